@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "lib_tar.h"
+
+/**
+ * Benchmarks the library on a given archive, starting every run with the archive out of the page cache
+ */
+
+static const char *mode_names[] = {"default", "sequential", "random", "oneshot", "direct"};
+static const int mode_flags[] = {TAR_ACCESS_DEFAULT, TAR_ACCESS_SEQUENTIAL, TAR_ACCESS_RANDOM, TAR_ACCESS_ONESHOT,
+                                 TAR_ACCESS_DEFAULT | TAR_OPEN_DIRECT};
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Drops the pages of a file from the page cache, so that the next run starts cold
+ */
+void drop_cache(int fd)
+{
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * @brief Computes the share of the pages of a file that are in the page cache
+ */
+double resident(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        return 0;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (st.st_size + page - 1) / page;
+    unsigned char *vec = malloc(pages);
+    size_t count = 0;
+    if (vec != NULL && mincore(map, st.st_size, vec) == 0)
+    {
+        for (size_t i = 0; i < pages; i++)
+        {
+            count += vec[i] & 1;
+        }
+    }
+    free(vec);
+    munmap(map, st.st_size);
+    return 100.0 * count / pages;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s tar_file\n", argv[0]);
+        return -1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1)
+    {
+        perror("open(tar_file)");
+        return -1;
+    }
+
+    printf("%-12s %12s %12s %10s\n", "mode", "open (ms)", "check (ms)", "cached");
+    for (int mode = 0; mode < sizeof(mode_flags) / sizeof(mode_flags[0]); mode++)
+    {
+        drop_cache(fd);
+        double start = now();
+        tar_archive_t *archive = tar_open(fd, mode_flags[mode]);
+        if (archive == NULL)
+        {
+            perror("tar_open(tar_file)");
+            return -1;
+        }
+        double opened = now();
+
+        drop_cache(fd);
+        double check_start = now();
+        int ret = tar_check_archive(archive);
+        double checked = now();
+        if (ret < 0)
+        {
+            printf("check_archive returned %d\n", ret);
+        }
+
+        printf("%-12s %12.3f %12.3f %9.1f%%\n", mode_names[mode], (opened - start) * 1e3, (checked - check_start) * 1e3,
+               resident(fd));
+        tar_close(archive);
+    }
+
+    tar_archive_t *archive = tar_open(fd, TAR_ACCESS_DEFAULT);
+    if (archive == NULL)
+    {
+        perror("tar_open(tar_file)");
+        return -1;
+    }
+    tar_index_stats_t stats;
+    tar_index_stats(archive, &stats);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("\nindex: %zu entries, %zu allocations, %zu bytes (%.1f per entry), %zu bytes of paths\n", stats.no_entries,
+           stats.no_allocs, stats.index_bytes, stats.no_entries ? (double)stats.index_bytes / stats.no_entries : 0.0,
+           stats.pool_bytes);
+    printf("peak RSS: %ld KiB\n", usage.ru_maxrss);
+
+    // Collect every path of the archive
+    char **paths = malloc(stats.no_entries * sizeof(char *));
+    size_t no_paths = 0;
+    static char names[64][PATH_MAX];
+    char *entries[64];
+    for (int i = 0; i < 64; i++)
+    {
+        entries[i] = names[i];
+    }
+    for (size_t dir = 0; dir <= no_paths && paths != NULL; dir++) // Walk the tree breadth first
+    {
+        tar_cursor_t cursor = TAR_CURSOR_INIT;
+        ssize_t left;
+        do
+        {
+            size_t no_entries = 64;
+            left = list_page(archive, dir == 0 ? "" : paths[dir - 1], &cursor, entries, &no_entries);
+            for (size_t i = 0; i < no_entries && no_paths < stats.no_entries; i++)
+            {
+                paths[no_paths++] = strdup(entries[i]);
+            }
+        } while (left > 0);
+    }
+
+    // Look up every path in the handle, with its hash table then with a minimal perfect hash
+    tar_archive_t *mph_archive = tar_open(fd, TAR_ACCESS_DEFAULT | TAR_OPEN_MPH);
+    if (mph_archive == NULL)
+    {
+        perror("tar_open(tar_file)");
+        return -1;
+    }
+    tar_index_stats_t mph_stats;
+    tar_index_stats(mph_archive, &mph_stats);
+    tar_archive_t *handles[] = {archive, mph_archive};
+    for (int k = 0; k < 2; k++)
+    {
+        double start = now();
+        size_t found = 0;
+        for (size_t i = 0; i < no_paths; i++)
+        {
+            found += tar_exists(handles[k], paths[i]) != 0;
+        }
+        double looked_up = now();
+        printf("handle (%s): %zu bytes of index, %zu/%zu found, %.3f us per lookup\n", k ? "mph" : "hash table",
+               k ? mph_stats.index_bytes : stats.index_bytes, found, no_paths,
+               no_paths ? (looked_up - start) * 1e6 / no_paths : 0.0);
+    }
+    tar_close(mph_archive);
+
+    // Look up paths that are not in the archive, without then with a Bloom filter
+    tar_archive_t *bloom_archive = tar_open(fd, TAR_ACCESS_DEFAULT | TAR_OPEN_BLOOM);
+    if (bloom_archive == NULL)
+    {
+        perror("tar_open(tar_file)");
+        return -1;
+    }
+    handles[1] = bloom_archive;
+    for (int k = 0; k < 2; k++)
+    {
+        char missing[600];
+        double start = now();
+        size_t found = 0;
+        for (size_t i = 0; i < no_paths; i++)
+        {
+            snprintf(missing, sizeof(missing), "%s.missing", paths[i]);
+            found += tar_exists(handles[k], missing) != 0;
+        }
+        double looked_up = now();
+        printf("misses (%s): %zu/%zu found, %.3f us per lookup\n", k ? "bloom" : "hash table", found, no_paths,
+               no_paths ? (looked_up - start) * 1e6 / no_paths : 0.0);
+    }
+    tar_close(bloom_archive);
+
+    // Look up every path in the compact index, with a binary search then with a minimal perfect hash
+    for (int k = 0; k < 2; k++)
+    {
+        tar_compact_t *compact = tar_compact_build(archive, k ? TAR_COMPACT_MPH : 0);
+        if (compact == NULL)
+        {
+            perror("tar_compact_build");
+            return -1;
+        }
+        double start = now();
+        tar_compact_entry_t entry;
+        size_t found = 0;
+        for (size_t i = 0; i < no_paths; i++)
+        {
+            found += tar_compact_lookup(compact, paths[i], &entry) != 0;
+        }
+        double looked_up = now();
+        printf("compact index (%s): %zu bytes (%.1f per entry, %.1f%% of the headers), %zu/%zu found, %.3f us per "
+               "lookup\n",
+               k ? "mph" : "binary search", tar_compact_size(compact),
+               stats.no_entries ? (double)tar_compact_size(compact) / stats.no_entries : 0.0,
+               stats.no_entries ? 100.0 * tar_compact_size(compact) / (512.0 * stats.no_entries) : 0.0, found,
+               no_paths, no_paths ? (looked_up - start) * 1e6 / no_paths : 0.0);
+        tar_compact_free(compact);
+    }
+
+    // Query the columnar copy of the index: every file, the large recent files under a prefix, the 10 largest files
+    tar_table_t *table = tar_table_build(archive);
+    uint32_t rows[10];
+    if (table == NULL)
+    {
+        perror("tar_table_build");
+        return -1;
+    }
+    tar_query_t queries[3] = {TAR_QUERY_INIT, TAR_QUERY_INIT, TAR_QUERY_INIT};
+    const char *query_names[3] = {"files", "large and recent", "top 10 by size"};
+    queries[0].types = TAR_QUERY_FILE;
+    queries[1].types = TAR_QUERY_FILE;
+    queries[1].min_size = 1 << 20;
+    queries[1].min_mtime = time(NULL) - 86400 * 365;
+    queries[1].prefix = no_paths > 0 ? paths[0] : NULL;
+    queries[2].types = TAR_QUERY_FILE;
+    queries[2].order = TAR_ORDER_SIZE;
+    queries[2].descending = 1;
+    for (int k = 0; k < 3; k++)
+    {
+        double start = now();
+        size_t found = tar_query(table, &queries[k], rows, 10);
+        double queried = now();
+        printf("query (%s): %zu/%zu rows, %.3f ms\n", query_names[k], found, tar_table_rows(table),
+               (queried - start) * 1e3);
+    }
+    tar_table_free(table);
+
+    for (size_t i = 0; i < no_paths; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+    tar_close(archive);
+
+    return 0;
+}
@@ -1,5 +1,32 @@
+#define _GNU_SOURCE // readahead()
+
 #include "lib_tar.h"
 
+/*
+ * Static tracepoints
+ *
+ * USDT probes of the "lib_tar" provider, for bpftrace or perf on live processes, see the scripts in probes/. With
+ * <sys/sdt.h> from SystemTap, a probe is a single nop and an ELF note describing where its arguments are, without it
+ * the probes and their arguments compile to nothing.
+ */
+
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TAR_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef TAR_HAVE_SDT
+#define TAR_PROBE2(name, a, b) DTRACE_PROBE2(lib_tar, name, a, b)
+#define TAR_PROBE3(name, a, b, c) DTRACE_PROBE3(lib_tar, name, a, b, c)
+#define TAR_PROBE4(name, a, b, c, d) DTRACE_PROBE4(lib_tar, name, a, b, c, d)
+#else
+#define TAR_PROBE2(name, a, b) ((void)0)
+#define TAR_PROBE3(name, a, b, c) ((void)0)
+#define TAR_PROBE4(name, a, b, c, d) ((void)0)
+#endif
+
 /**
  * @brief Verifies if we are at the end of the archive
  *
@@ -26,18 +53,21 @@ int check_end(int tar_fd)
     return 0;
 }
 
+uint64_t tar_number(const char *field, size_t len);
+
 /**
  * @brief Go to the next header
  *
  * @param header The current header
- * @return int The number of bytes to go to the next header
+ * @return off_t The number of bytes to go to the next header
  */
-int next_header(tar_header_t *header)
+off_t next_header(tar_header_t *header)
 {
-    int next = 0;
+    off_t next = 0;
+    uint64_t size = tar_number(header->size, sizeof(header->size)); // Octal, or base-256 for 8 GiB and more
 
-    next = TAR_INT(header->size) / 512;
-    if (TAR_INT(header->size) % 512 != 0)
+    next = size / 512;
+    if (size % 512 != 0)
     {
         next += 1; // If the size is not a multiple of 512, we need to add 1 to the next header position
     }
@@ -47,25 +77,229 @@ int next_header(tar_header_t *header)
 }
 
 /**
- * Checks whether the archive is valid.
+ * @brief Checks the magic value, the version value and the checksum of a header
  *
- * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
- *  - a correct checksum
+ * check_archive() keeps the strict rules: "ustar" and "00", and the bytes summed as signed chars. The handles are
+ * lenient, also accepting the "ustar  " magic and version of GNU tar, and the unsigned sum POSIX asks for, which
+ * headers with base-256 numbers need.
  *
- * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param buf A 512 bytes buffer containing the header
+ * @param lenient Whether to accept the GNU magic and version values and an unsigned checksum
+ * @return int 0 if the header is valid, -1 if the magic value is invalid, -2 if the version value is invalid,
+ *         -3 if the checksum is invalid
+ */
+int check_header(const char *buf, int lenient)
+{
+    const tar_header_t *header = (const tar_header_t *)buf;
+
+    // Check if the magic value is "ustar"
+    if (strncmp(header->magic, TMAGIC, TMAGLEN - 1) != 0)
+    {
+        return -1;
+    }
+    // Check if the version value is "00", GNU archives have "ustar  " and a null over the magic and the version
+    if (strncmp(header->version, TVERSION, TVERSLEN) != 0 && (!lenient || memcmp(header->magic, "ustar  ", 8) != 0))
+    {
+        return -2;
+    }
+
+    // Check if the checksum is correct, some writers summing the bytes as unsigned
+    int checksum = 0;
+    int unsigned_checksum = 0;
+    for (int i = 0; i < 512; i++)
+    {
+        if (i < 148 || i > 155) // The checksum field is between 148 and 155 bits
+        {
+            checksum += buf[i];
+            unsigned_checksum += (unsigned char)buf[i];
+        }
+        else
+        {
+            checksum += ' ';
+            unsigned_checksum += ' ';
+        }
+    }
+    if (TAR_INT(header->chksum) != checksum && (!lenient || TAR_INT(header->chksum) != unsigned_checksum))
+    {
+        return -3;
+    }
+
+    return 0;
+}
+
+/*
+ * Latency metrics
  *
- * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
- *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+ * Every public operation can record its latency in a histogram per operation, globally once enabled with
+ * tar_metrics_enable() and per handle with TAR_OPEN_METRICS. The histograms are log-linear like HDR histograms:
+ * TAR_HIST_SUB buckets per power of two, so a bucket is at most 1/TAR_HIST_SUB wide relative to its values, and
+ * recording is a few relaxed atomic additions.
  */
-int check_archive(int tar_fd)
+
+#define TAR_HIST_SUB_BITS 4                  // Bits of a value kept below its most significant bit
+#define TAR_HIST_SUB (1 << TAR_HIST_SUB_BITS) // Buckets per power of two
+#define TAR_HIST_MAX_EXP 40                  // Largest power of two of a value, about 18 minutes in nanoseconds
+#define TAR_HIST_BUCKETS ((TAR_HIST_MAX_EXP - TAR_HIST_SUB_BITS + 2) * TAR_HIST_SUB)
+
+typedef struct tar_histogram
 {
-    char buf[512]; // Buffer to read the header
-    int count = 0; // Number of non-null headers
-    long next = 0; // Next header position
+    uint64_t count;                     // Number of values recorded
+    uint64_t sum;                       // Sum of the values
+    uint64_t max;                       // Largest value
+    uint64_t buckets[TAR_HIST_BUCKETS]; // Number of values per bucket
+} tar_histogram_t;
+
+static tar_histogram_t metrics_global[TAR_OPS]; // Histograms of every operation of the process
+static int metrics_enabled;                     // Whether the global histograms record
+
+/**
+ * @brief Finds the bucket of a value
+ *
+ * @param value The value
+ * @return size_t The bucket
+ */
+size_t hist_bucket(uint64_t value)
+{
+    if (value < TAR_HIST_SUB)
+    {
+        return value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    if (exp > TAR_HIST_MAX_EXP)
+    {
+        return TAR_HIST_BUCKETS - 1;
+    }
+    int shift = exp - TAR_HIST_SUB_BITS;
+    return (size_t)(shift + 1) * TAR_HIST_SUB + ((value >> shift) & (TAR_HIST_SUB - 1));
+}
+
+/**
+ * @brief Gives the largest value of a bucket
+ *
+ * @param bucket The bucket
+ * @return uint64_t The largest value falling in that bucket
+ */
+uint64_t hist_bucket_max(size_t bucket)
+{
+    if (bucket < TAR_HIST_SUB)
+    {
+        return bucket;
+    }
+    int shift = bucket / TAR_HIST_SUB - 1;
+    uint64_t sub = bucket % TAR_HIST_SUB;
+    return ((TAR_HIST_SUB + sub + 1) << shift) - 1;
+}
+
+/**
+ * @brief Records a value in a histogram, possibly from several threads
+ *
+ * @param hist The histogram
+ * @param value The value
+ */
+void hist_record(tar_histogram_t *hist, uint64_t value)
+{
+    __atomic_fetch_add(&hist->buckets[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&hist->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Finds the value below which a given fraction of the values of a histogram are
+ *
+ * @param hist The histogram
+ * @param quantile The fraction, between 0 and 1
+ * @return uint64_t The value, as the largest value of its bucket, zero if the histogram is empty
+ */
+uint64_t hist_quantile(tar_histogram_t *hist, double quantile)
+{
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    if (count == 0)
+    {
+        return 0;
+    }
+    quantile = quantile < 0 ? 0 : quantile > 1 ? 1 : quantile;
+    uint64_t rank = (uint64_t)(quantile * count + 0.999999);
+    rank = rank == 0 ? 1 : rank;
+
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < TAR_HIST_BUCKETS; b++)
+    {
+        seen += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+        if (seen >= rank)
+        {
+            uint64_t value = hist_bucket_max(b);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+/**
+ * @brief Reads the monotonic clock
+ *
+ * @return uint64_t The time in nanoseconds
+ */
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Starts timing an operation
+ *
+ * @param hists The histograms of the handle, NULL if it has none
+ * @return uint64_t The start time, zero if nothing records the operation
+ */
+uint64_t metrics_begin(tar_histogram_t *hists)
+{
+    if (hists == NULL && !__atomic_load_n(&metrics_enabled, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    return metrics_now();
+}
+
+/**
+ * @brief Records the latency of an operation in the global histograms and in those of its handle
+ *
+ * @param hists The histograms of the handle, NULL if it has none
+ * @param op The operation, one of the TAR_OP_* values
+ * @param start The start time given by metrics_begin()
+ */
+void metrics_end(tar_histogram_t *hists, int op, uint64_t start)
+{
+    if (start == 0)
+    {
+        return;
+    }
+    uint64_t elapsed = metrics_now() - start;
+    if (__atomic_load_n(&metrics_enabled, __ATOMIC_RELAXED))
+    {
+        hist_record(&metrics_global[op], elapsed);
+    }
+    if (hists != NULL)
+    {
+        hist_record(&hists[op], elapsed);
+    }
+}
+
+/**
+ * @brief The body of check_archive(), without the latency metrics
+ */
+int check_archive_impl(int tar_fd)
+{
+    char buf[512];   // Buffer to read the header
+    int count = 0;   // Number of non-null headers
+    long next = 0;   // Next header position
+    long offset = 0; // Offset of the header, from the position of the file at the start
 
     int final = 0;
 
@@ -76,37 +310,26 @@ int check_archive(int tar_fd)
         // Parse the buffer as a tar header
         tar_header_t *header = (tar_header_t *)buf;
 
-        // Check if the magic value is "ustar"
-        if (strncmp(header->magic, TMAGIC, TMAGLEN - 1) != 0)
+        int ret = check_header(buf, 0);
+        if (ret < 0)
         {
-            return -1;
-        }
-        // Check if the version value is "00"
-        if (strncmp(header->version, TVERSION, TVERSLEN) != 0)
-        {
-            return -2;
-        }
-
-        // Check if the checksum is correct
-        int checksum = 0;
-        for (int i = 0; i < 512; i++)
-        {
-            if (i < 148 || i > 155) // The checksum field is between 148 and 155 bits
-            {
-                checksum += buf[i];
-            }
-            else
+            if (ret == -3)
             {
-                checksum += ' ';
+                TAR_PROBE2(checksum_fail, (long long)offset, header->name);
             }
-        }
-        if (TAR_INT(header->chksum) != checksum)
-        {
-            return -3;
+            return ret;
         }
 
         next = next_header(header);
+        // The map of a GNU sparse file goes on in extension blocks between its header and its payload
+        int extended = header->typeflag == GNUTYPE_SPARSE && buf[482];
+        while (extended && read(tar_fd, buf, 512) == 512)
+        {
+            extended = buf[504];
+            offset += 512;
+        }
         lseek(tar_fd, next, SEEK_CUR);
+        offset += 512 + next;
 
         final = check_end(tar_fd);
 
@@ -117,15 +340,32 @@ int check_archive(int tar_fd)
 }
 
 /**
- * Checks whether an entry exists in the archive.
+ * Checks whether the archive is valid.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * Each non-null header of a valid archive has:
+ *  - a magic value of "ustar" and a null,
+ *  - a version value of "00" and no null,
+ *  - a correct checksum
  *
- * @return zero if no entry at the given path exists in the archive,
- *         any other value otherwise.
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ *
+ * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
+ *         -1 if the archive contains a header with an invalid magic value,
+ *         -2 if the archive contains a header with an invalid version value,
+ *         -3 if the archive contains a header with an invalid checksum value
  */
-int exists(int tar_fd, char *path)
+int check_archive(int tar_fd)
+{
+    uint64_t start = metrics_begin(NULL);
+    int ret = check_archive_impl(tar_fd);
+    metrics_end(NULL, TAR_OP_CHECK, start);
+    return ret;
+}
+
+/**
+ * @brief The body of exists(), without the latency metrics
+ */
+int exists_impl(int tar_fd, char *path)
 {
     char buf[512]; // Buffer to read the header
     long next = 0; // Next header position
@@ -153,15 +393,26 @@ int exists(int tar_fd, char *path)
 }
 
 /**
- * Checks whether an entry exists in the archive and is a directory.
+ * Checks whether an entry exists in the archive.
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ * @return zero if no entry at the given path exists in the archive,
  *         any other value otherwise.
  */
-int is_dir(int tar_fd, char *path)
+int exists(int tar_fd, char *path)
+{
+    uint64_t start = metrics_begin(NULL);
+    int ret = exists_impl(tar_fd, path);
+    metrics_end(NULL, TAR_OP_EXISTS, start);
+    return ret;
+}
+
+/**
+ * @brief The body of is_dir(), without the latency metrics
+ */
+int is_dir_impl(int tar_fd, char *path)
 {
     char bufer[512];
 
@@ -193,15 +444,26 @@ int is_dir(int tar_fd, char *path)
 }
 
 /**
- * Checks whether an entry exists in the archive and is a file.
+ * Checks whether an entry exists in the archive and is a directory.
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
  *         any other value otherwise.
  */
-int is_file(int tar_fd, char *path)
+int is_dir(int tar_fd, char *path)
+{
+    uint64_t start = metrics_begin(NULL);
+    int ret = is_dir_impl(tar_fd, path);
+    metrics_end(NULL, TAR_OP_IS_DIR, start);
+    return ret;
+}
+
+/**
+ * @brief The body of is_file(), without the latency metrics
+ */
+int is_file_impl(int tar_fd, char *path)
 {
     char bufer[512];
 
@@ -232,14 +494,26 @@ int is_file(int tar_fd, char *path)
 }
 
 /**
- * Checks whether an entry exists in the archive and is a symlink.
+ * Checks whether an entry exists in the archive and is a file.
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive.
- * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
  *         any other value otherwise.
  */
-int is_symlink(int tar_fd, char *path)
+int is_file(int tar_fd, char *path)
+{
+    uint64_t start = metrics_begin(NULL);
+    int ret = is_file_impl(tar_fd, path);
+    metrics_end(NULL, TAR_OP_IS_FILE, start);
+    return ret;
+}
+
+/**
+ * @brief The body of is_symlink(), without the latency metrics
+ */
+int is_symlink_impl(int tar_fd, char *path)
 {
     char bufer[512];
 
@@ -272,28 +546,25 @@ int is_symlink(int tar_fd, char *path)
 }
 
 /**
- * Lists the entries at a given path in the archive.
- * list() does not recurse into the directories listed at the given path.
- *
- * Example:
- *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
- *   ├── a
- *   ├── b
- *   ├── c/
- *   │   └── d
- *   └── e/
+ * Checks whether an entry exists in the archive and is a symlink.
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
- * @param no_entries An in-out argument.
- *                   The caller set it to the number of entries in `entries`.
- *                   The callee set it to the number of entries listed.
- *
- * @return zero if no directory at the given path exists in the archive,
+ * @param path A path to an entry in the archive.
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
  *         any other value otherwise.
  */
-int list(int tar_fd, char *path, char **entries, size_t *no_entries) // -> doesn't work
+int is_symlink(int tar_fd, char *path)
+{
+    uint64_t start = metrics_begin(NULL);
+    int ret = is_symlink_impl(tar_fd, path);
+    metrics_end(NULL, TAR_OP_IS_SYMLINK, start);
+    return ret;
+}
+
+/**
+ * @brief The body of list(), without the latency metrics
+ */
+int list_impl(int tar_fd, char *path, char **entries, size_t *no_entries) // -> doesn't work
 {
     lseek(tar_fd, 0, SEEK_SET); // Go back to the beginning of the archive if we called list() before
 
@@ -322,7 +593,7 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) // -> doesn
             {
                 if (count == -1) // In case we didn't go in a directory before
                 {
-                    return list(tar_fd, header->linkname, entries, no_entries);
+                    return list_impl(tar_fd, header->linkname, entries, no_entries);
                 }
             }
 
@@ -379,6 +650,36 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) // -> doesn
     return *no_entries;
 }
 
+/**
+ * Lists the entries at a given path in the archive.
+ * list() does not recurse into the directories listed at the given path.
+ *
+ * Example:
+ *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
+ *   ├── a
+ *   ├── b
+ *   ├── c/
+ *   │   └── d
+ *   └── e/
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int list(int tar_fd, char *path, char **entries, size_t *no_entries)
+{
+    uint64_t start = metrics_begin(NULL);
+    int ret = list_impl(tar_fd, path, entries, no_entries);
+    metrics_end(NULL, TAR_OP_LIST, start);
+    return ret;
+}
+
 /**
  * @brief Reads a symlink at a given path in the archive. Same as read_file() but for symlinks.
  *
@@ -447,24 +748,9 @@ ssize_t read_symlink(int tar_fd, char *path, size_t offset, uint8_t *dest, size_
 }
 
 /**
- * Reads a file at a given path in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
- * @param dest A destination buffer to read the given file into.
- * @param len An in-out argument.
- *            The caller set it to the size of dest.
- *            The callee set it to the number of bytes written to dest.
- *
- * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
- *         -2 if the offset is outside the file total length,
- *         zero if the file was read in its entirety into the destination buffer,
- *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
- *         the end of the file.
- *
+ * @brief The body of read_file(), without the latency metrics
  */
-ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len)
+ssize_t read_file_impl(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len)
 {
     char buf[512];
     long next = 0;
@@ -516,3 +802,10505 @@ ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *
 
     return -1;
 }
+
+/**
+ * Reads a file at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ *
+ */
+ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    uint64_t start = metrics_begin(NULL);
+    ssize_t ret = read_file_impl(tar_fd, path, offset, dest, len);
+    metrics_end(NULL, TAR_OP_READ_FILE, start);
+    return ret;
+}
+
+/*
+ * CRC32C
+ *
+ * Content hashes are CRC32C (Castagnoli) checksums, computed with the SSE4.2 crc32 instruction when the processor
+ * has it, 8 bytes per instruction, and with a lookup table otherwise.
+ */
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Fills the lookup table of the software CRC32C
+ */
+void crc32c_init_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1; // Reversed Castagnoli polynomial
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+/**
+ * @brief Updates a CRC32C with a lookup table
+ *
+ * @param crc The CRC of the previous bytes, inverted
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return uint32_t The updated CRC, inverted
+ */
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init_table);
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+/**
+ * @brief Updates a CRC32C with the SSE4.2 crc32 instruction
+ *
+ * @param crc The CRC of the previous bytes, inverted
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return uint32_t The updated CRC, inverted
+ */
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t len)
+{
+    uint64_t crc64 = crc;
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+/**
+ * Computes the CRC32C (Castagnoli) of a buffer, the content hash of tar_content_hash().
+ *
+ * @param crc The CRC of the previous bytes, zero for the first bytes.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ *
+ * @return the CRC of the previous bytes followed by the given ones.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return ~crc32c_hw(~crc, data, len);
+    }
+#endif
+    return ~crc32c_sw(~crc, data, len);
+}
+
+/*
+ * Minimal perfect hash
+ *
+ * A BBHash style function mapping each of n known keys to a distinct rank in [0, n). Level l is a bit array of about
+ * 2 * n_l bits where n_l keys are hashed: the keys alone on their bit are placed at that level, the colliding ones go
+ * to the next level. The rank of a key is the number of bits set before its bit, counted with a prefix sum per
+ * 64 bits word. A lookup is one hash per level tried, most keys being placed on the first levels, and an unknown key
+ * may give any rank, so the caller must verify the key found.
+ */
+
+#define TAR_MPH_LEVELS 32  // Maximum number of levels, building fails if keys remain after them
+#define TAR_MPH_NONE UINT32_MAX // Value returned for a key that hits no level
+#define TAR_MPH_MAGIC "TARMPH1" // Magic value of the saved function of a handle, with its null
+
+int bound_cmp(const void *a, const void *b);
+
+typedef struct tar_mph
+{
+    uint32_t no_keys;                        // Number of keys
+    uint32_t no_levels;                      // Number of levels
+    uint64_t level_words[TAR_MPH_LEVELS];    // Number of 64 bits words of each level
+    uint64_t level_start[TAR_MPH_LEVELS];    // Position of the first word of each level
+    uint64_t no_words;                       // Number of words of every level
+    uint64_t *bits;                          // Bits of every level
+    uint32_t *ranks;                         // Number of bits set before each word
+    uint32_t *values;                        // Value of each rank
+} tar_mph_t;
+
+/**
+ * @brief Mixes the hash of a key with a level (splitmix64 finalizer)
+ *
+ * @param hash The hash of the key
+ * @param level The level
+ * @return uint64_t The hash for that level
+ */
+uint64_t mph_mix(uint64_t hash, uint64_t level)
+{
+    uint64_t x = hash ^ (level + 1) * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief Maps a hash to a bit of a level without a division
+ *
+ * @param hash The hash for that level
+ * @param bits The number of bits of the level
+ * @return uint64_t The bit
+ */
+uint64_t mph_bit(uint64_t hash, uint64_t bits)
+{
+    return (uint64_t)(((unsigned __int128)hash * bits) >> 64);
+}
+
+/**
+ * @brief Finds the rank of a key
+ *
+ * @param mph The function
+ * @param hash The hash of the key
+ * @return uint32_t The rank, TAR_MPH_NONE if the key is certainly unknown
+ */
+uint32_t mph_rank(tar_mph_t *mph, uint64_t hash)
+{
+    for (uint32_t level = 0; level < mph->no_levels; level++)
+    {
+        uint64_t bit = mph_bit(mph_mix(hash, level), mph->level_words[level] * 64);
+        uint64_t word = mph->level_start[level] + bit / 64;
+        uint64_t mask = 1ULL << (bit % 64);
+        if (mph->bits[word] & mask)
+        {
+            return mph->ranks[word] + __builtin_popcountll(mph->bits[word] & (mask - 1));
+        }
+    }
+    return TAR_MPH_NONE;
+}
+
+/**
+ * @brief Finds the value of a key
+ *
+ * @param mph The function
+ * @param hash The hash of the key
+ * @return uint32_t The value given to the key, any value for an unknown key, TAR_MPH_NONE if the key is certainly
+ *         unknown
+ */
+uint32_t mph_lookup(tar_mph_t *mph, uint64_t hash)
+{
+    uint32_t rank = mph_rank(mph, hash);
+    return rank < mph->no_keys ? mph->values[rank] : TAR_MPH_NONE;
+}
+
+/**
+ * @brief Lays out the arrays of a function after its header
+ *
+ * @param mph The function, with its counts set
+ * @return size_t The size of the function with its arrays
+ */
+size_t mph_layout(tar_mph_t *mph)
+{
+    mph->bits = (uint64_t *)(mph + 1);
+    mph->ranks = (uint32_t *)(mph->bits + mph->no_words);
+    mph->values = mph->ranks + mph->no_words;
+    return sizeof(tar_mph_t) + mph->no_words * (sizeof(uint64_t) + sizeof(uint32_t)) + mph->no_keys * sizeof(uint32_t);
+}
+
+/**
+ * @brief Describes the bytes of a function to save, its counts then its arrays, its pointers being set on loading
+ *
+ * @param mph The function, or NULL to save nothing
+ * @param header Receives the counts, 3 + TAR_MPH_LEVELS integers
+ * @param iov Receives the counts and the arrays, 2 buffers
+ */
+void mph_iov(tar_mph_t *mph, uint64_t *header, struct iovec *iov)
+{
+    memset(header, 0, (3 + TAR_MPH_LEVELS) * sizeof(uint64_t));
+    if (mph != NULL)
+    {
+        header[0] = mph->no_keys;
+        header[1] = mph->no_levels;
+        header[2] = mph->no_words;
+        memcpy(header + 3, mph->level_words, sizeof(mph->level_words));
+    }
+    iov[0].iov_base = header;
+    iov[0].iov_len = mph ? (3 + TAR_MPH_LEVELS) * sizeof(uint64_t) : 0;
+    iov[1].iov_base = mph ? (void *)mph->bits : NULL;
+    iov[1].iov_len = mph ? mph_layout(mph) - sizeof(tar_mph_t) : 0;
+}
+
+/**
+ * @brief Builds a minimal perfect hash function over distinct keys
+ *
+ * @param hashes The 64 bits hashes of the keys, which must be distinct
+ * @param values The value of each key
+ * @param no_keys The number of keys
+ * @return tar_mph_t* The function, in a single allocation, NULL if the memory could not be allocated (errno is
+ *         ENOMEM) or if the keys could not be placed, as when two of them have the same hash (errno is EEXIST)
+ */
+tar_mph_t *mph_build(const uint64_t *hashes, const uint32_t *values, size_t no_keys)
+{
+    tar_mph_t header = {0};
+    if (no_keys >= UINT32_MAX)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    header.no_keys = no_keys;
+
+    // Place the keys level by level, the remaining ones at the start of the array
+    uint64_t *left = malloc((no_keys ? no_keys : 1) * sizeof(uint64_t));
+    uint64_t *levels[TAR_MPH_LEVELS] = {NULL};
+    if (left == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(left, hashes, no_keys * sizeof(uint64_t));
+    size_t no_left = no_keys;
+
+    int failed = 0;
+    while (no_left > 0 && !failed)
+    {
+        if (header.no_levels == TAR_MPH_LEVELS)
+        {
+            failed = EEXIST;
+            break;
+        }
+
+        uint32_t level = header.no_levels++;
+        uint64_t words = (2 * no_left + 63) / 64;
+        uint64_t bits = words * 64;
+        uint64_t *hit = calloc(words, sizeof(uint64_t));
+        uint64_t *collision = calloc(words, sizeof(uint64_t));
+        if (hit == NULL || collision == NULL)
+        {
+            free(hit);
+            free(collision);
+            failed = ENOMEM;
+            break;
+        }
+
+        for (size_t i = 0; i < no_left; i++)
+        {
+            uint64_t bit = mph_bit(mph_mix(left[i], level), bits);
+            uint64_t mask = 1ULL << (bit % 64);
+            if (hit[bit / 64] & mask)
+            {
+                collision[bit / 64] |= mask;
+            }
+            hit[bit / 64] |= mask;
+        }
+
+        size_t no_next = 0;
+        for (size_t i = 0; i < no_left; i++)
+        {
+            uint64_t bit = mph_bit(mph_mix(left[i], level), bits);
+            if (collision[bit / 64] & (1ULL << (bit % 64)))
+            {
+                left[no_next++] = left[i];
+            }
+        }
+        for (uint64_t w = 0; w < words; w++)
+        {
+            hit[w] &= ~collision[w];
+        }
+        free(collision);
+
+        levels[level] = hit;
+        header.level_words[level] = words;
+        header.level_start[level] = header.no_words;
+        header.no_words += words;
+        if (no_next == no_left) // No key placed, which keys with the same hash never are
+        {
+            qsort(left, no_left, sizeof(uint64_t), bound_cmp);
+            for (size_t i = 1; i < no_left && !failed; i++)
+            {
+                failed = left[i] == left[i - 1] ? EEXIST : 0;
+            }
+        }
+        no_left = no_next;
+    }
+    free(left);
+
+    tar_mph_t *mph = NULL;
+    if (!failed)
+    {
+        size_t size = mph_layout(&header);
+        mph = malloc(size);
+        failed = mph == NULL ? ENOMEM : 0;
+    }
+    if (mph != NULL)
+    {
+        *mph = header;
+        mph_layout(mph);
+        uint32_t rank = 0;
+        for (uint32_t level = 0; level < mph->no_levels; level++)
+        {
+            memcpy(mph->bits + mph->level_start[level], levels[level], mph->level_words[level] * sizeof(uint64_t));
+        }
+        for (uint64_t w = 0; w < mph->no_words; w++)
+        {
+            mph->ranks[w] = rank;
+            rank += __builtin_popcountll(mph->bits[w]);
+        }
+        for (size_t i = 0; i < no_keys; i++)
+        {
+            mph->values[mph_rank(mph, hashes[i])] = values[i];
+        }
+    }
+
+    for (uint32_t level = 0; level < header.no_levels; level++)
+    {
+        free(levels[level]);
+    }
+    if (failed)
+    {
+        errno = failed;
+    }
+    return mph;
+}
+
+/*
+ * Bloom filter
+ *
+ * A blocked Bloom filter of the paths answering definite misses: each path sets TAR_BLOOM_PROBES bits of a single
+ * 512 bits block, so a check reads one cache line. Paths are added and checked without their trailing '/', so that
+ * "dir" and "dir/" are the same key. With TAR_BLOOM_BITS bits per path, about 1% of the unknown paths pass.
+ */
+
+#define TAR_BLOOM_BITS 10                // Bits of filter per path
+#define TAR_BLOOM_PROBES 6               // Bits set per path, of 9 bits each in the second hash
+#define TAR_BLOOM_BLOCK_WORDS 8          // 64 bits words per block, a cache line
+#define TAR_BLOOM_MAGIC "TARBLM1"        // Magic value of a saved filter, with its null
+
+struct tar_bloom
+{
+    uint64_t no_blocks; // Number of blocks
+    uint64_t no_keys;   // Number of paths added
+    uint64_t bits[];    // The blocks
+};
+
+/**
+ * @brief Computes the size of a filter
+ *
+ * @param no_blocks The number of blocks
+ * @return size_t The size of the filter with its blocks
+ */
+size_t bloom_size(uint64_t no_blocks)
+{
+    return sizeof(tar_bloom_t) + no_blocks * TAR_BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+}
+
+/**
+ * @brief Allocates an empty filter
+ *
+ * @param no_keys The number of paths that will be added
+ * @return tar_bloom_t* The filter, NULL if the memory could not be allocated
+ */
+tar_bloom_t *bloom_new(size_t no_keys)
+{
+    uint64_t block_bits = TAR_BLOOM_BLOCK_WORDS * 64;
+    uint64_t no_blocks = (no_keys * TAR_BLOOM_BITS + block_bits - 1) / block_bits;
+    no_blocks = no_blocks ? no_blocks : 1;
+    tar_bloom_t *bloom = calloc(1, bloom_size(no_blocks));
+    if (bloom != NULL)
+    {
+        bloom->no_blocks = no_blocks;
+    }
+    return bloom;
+}
+
+uint64_t tar_hash(const char *path, size_t len);
+
+/**
+ * @brief Hashes a path for a filter, without its trailing '/'
+ *
+ * @param path The path
+ * @param len The length of the path
+ * @return uint64_t The hash
+ */
+uint64_t bloom_hash(const char *path, size_t len)
+{
+    if (len > 0 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    return tar_hash(path, len);
+}
+
+/**
+ * @brief Adds a path to a filter, or checks whether it may be there
+ *
+ * @param bloom The filter
+ * @param hash The hash of the path given by bloom_hash()
+ * @param add 1 to add the path, 0 to only check it
+ * @return int 0 if the path is certainly not in the filter, 1 if it may be
+ */
+int bloom_probe(tar_bloom_t *bloom, uint64_t hash, int add)
+{
+    // FNV-1a spreads similar paths poorly over the high bits, mix the hash before choosing the block and the bits
+    uint64_t *block = bloom->bits + mph_bit(mph_mix(hash, TAR_MPH_LEVELS), bloom->no_blocks) * TAR_BLOOM_BLOCK_WORDS;
+    uint64_t probes = mph_mix(hash, TAR_MPH_LEVELS + 1);
+    int found = 1;
+    for (int k = 0; k < TAR_BLOOM_PROBES; k++, probes >>= 9)
+    {
+        uint64_t bit = probes & 511;
+        uint64_t mask = 1ULL << (bit % 64);
+        if (add)
+        {
+            block[bit / 64] |= mask;
+        }
+        else if (!(block[bit / 64] & mask))
+        {
+            found = 0;
+        }
+    }
+    return found;
+}
+
+/*
+ * Indexed archive handle
+ *
+ * tar_open() scans the archive once and records every entry in an array. Entry 0 is the root of the archive, every
+ * other entry knows its parent directory and every directory keeps the list of its children in archive order.
+ * Paths are found through an open addressing hash table storing entry indexes.
+ *
+ * An index with millions of entries must not cost millions of allocations: the paths are interned in a single
+ * string pool, the children of every directory share a single array, and entries refer to both with 32 bits
+ * offsets rather than pointers, so that these blocks can move when they grow. The whole index is a handful of blocks.
+ */
+
+#define TAR_ROOT 0            // Index of the root entry
+#define TAR_NO_ENTRY SIZE_MAX // Index returned when there is no entry
+#define TAR_EMPTY_SLOT 0      // Value of an empty hash table slot (the root is never stored in the table)
+#define TAR_MAX_HOPS 16       // Maximum number of symlinks followed when resolving a path
+#define TAR_PATH_MAX PATH_MAX // Longest path with its null, beyond the 256 bytes of a header with pax and GNU names
+#define TAR_NO_NAME 0         // Offset of the empty string at the start of the string pool
+#define TAR_READAHEAD (1 << 20) // Size of the window read ahead before a sequential scan
+#define TAR_WINDOW (1 << 20)    // Size of the buffer through which the headers are scanned
+#define TAR_DIRECT_ALIGN 4096   // Alignment of the offsets, lengths and buffers of O_DIRECT reads
+#define TAR_READ_GAP (64 << 10) // Default largest gap between two payloads read by a single preadv()
+#define TAR_NO_SPARSE 0         // Sparse map of an entry that is not sparse, the maps being numbered from 1
+#define TAR_PAX_MAX (16 << 20)  // Largest extended header parsed
+#define TAR_EXTRACT_CHUNK (1 << 20) // Size of the buffer through which files are extracted
+
+typedef struct tar_entry
+{
+    off_t header_offset;  // Offset of the header in the archive, -1 for directories without a header
+    uint64_t size;        // Size of the payload
+    uint32_t name;        // Offset in the string pool of the full path, the prefix and the name fields joined
+    uint32_t linkname;    // Offset in the string pool of the target of a link, TAR_NO_NAME otherwise
+    uint32_t parent;      // Index of the parent directory
+    uint32_t first_child; // Position of the first child of a directory in the children array
+    uint32_t no_children; // Number of children of a directory
+    uint32_t hash;        // CRC32C of the payload of a regular file, when the handle was opened with TAR_OPEN_HASH
+    uint32_t sparse;      // Position + 1 of the sparse map of a sparse file, TAR_NO_SPARSE otherwise
+    uint32_t pax;         // Blocks from the pax extended header of the entry to its header, zero if there is none
+    int64_t mtime;        // Modification time, in seconds since the epoch
+    uint32_t uid;         // Owner
+    uint32_t gid;         // Group
+    uint16_t mode;        // Permission bits
+    char typeflag;        // Type of the entry, GNUTYPE_SPARSE for every sparse file
+} tar_entry_t;
+
+typedef struct tar_sparse_region
+{
+    uint64_t offset; // Offset of the data in the file
+    uint64_t len;    // Length of the data
+    uint64_t stored; // Offset of the data in the stored payload
+} tar_sparse_region_t;
+
+typedef struct tar_sparse
+{
+    off_t data_offset;   // Offset of the stored payload in the archive, the data regions one after the other
+    uint32_t first;      // Position of the first region in the regions array
+    uint32_t no_regions; // Number of data regions, sorted by offset
+} tar_sparse_t;
+
+typedef struct tar_rollup
+{
+    uint64_t bytes;    // Total size of the files of the subtree
+    uint32_t no_files; // Number of files of the subtree
+    uint32_t largest;  // Largest file of the subtree, TAR_ROOT if there is none
+} tar_rollup_t;
+
+struct tar_archive
+{
+    int fd;                   // File descriptor of the archive, -1 when it is read through read_at
+    ssize_t (*read_at)(void *ctx, void *buf, size_t len, off_t offset); // Reads an archive that is not a file, or NULL
+    void *read_ctx;                                                      // Context of read_at
+    void (*read_free)(void *ctx);                                        // Frees read_ctx on tar_close(), or NULL
+    int access;               // Access mode, one of the TAR_ACCESS_* modes
+    int direct_fd;            // The archive opened with O_DIRECT, -1 when reading through the page cache
+    char *bounce;             // Aligned buffer of the unaligned O_DIRECT reads, allocated on first use, or NULL
+    pthread_mutex_t bounce_lock; // Taken while the bounce buffer is in use
+    size_t read_gap;          // Largest gap between two payloads read by a single preadv(), see tar_read_files()
+    int hashed;               // Whether the payloads were hashed while indexing
+    int delta;                // Whether the archive is a delta written by tar_create()
+    uint64_t generation;      // Changes made to the index by tar_delete(), tar_vacuum() and tar_update()
+    tar_entry_t *entries;     // Every entry of the archive, the root first
+    size_t no_entries;        // Number of entries, including the root
+    size_t cap_entries;       // Capacity of the entries array
+    char *pool;               // String pool holding every path and link target, null terminated
+    size_t pool_len;          // Number of bytes used in the pool
+    size_t pool_cap;          // Capacity of the pool
+    uint32_t *children;       // Children of every directory, those of a directory being contiguous
+    uint32_t *slots;          // Hash table of the paths, an entry index per slot
+    size_t no_slots;          // Number of slots, a power of two
+    tar_mph_t *mph;           // Minimal perfect hash of the paths replacing the hash table, NULL if there is none
+    tar_bloom_t *bloom;       // Filter of the paths checked before the index, NULL if there is none
+    tar_histogram_t *metrics; // Latency histograms of the operations, NULL without TAR_OPEN_METRICS
+    int flags;                // Flags the handle was opened with, given to the handles of nested archives
+    struct tar_nested *nested;   // Handles of the archives stored as files of the archive, opened on first use
+    size_t no_nested;            // Number of nested handles
+    pthread_mutex_t nested_lock; // Protects the nested handles
+    tar_sparse_t *sparse;         // Sparse maps of the sparse files
+    size_t no_sparse;             // Number of sparse maps
+    size_t cap_sparse;            // Capacity of the sparse maps array
+    tar_sparse_region_t *regions; // Data regions of every sparse map, those of a map being contiguous
+    size_t no_regions;            // Number of data regions
+    size_t cap_regions;           // Capacity of the data regions array
+    tar_rollup_t *rollups;        // Totals of the subtree of every entry, NULL without TAR_OPEN_USAGE
+    tar_size_histogram_t sizes;   // Histogram of the sizes of the files, with TAR_OPEN_USAGE
+    size_t no_allocs;         // Number of allocations made for the index
+    size_t index_bytes;       // Size of the memory blocks of the index
+    size_t no_skipped;        // Entries left out of the index, their path or link target being too long
+};
+
+/**
+ * @brief Reads exactly len bytes at a given offset of a file, unless the end of the file is reached
+ *
+ * @param fd The file to read from
+ * @param buf The destination buffer
+ * @param len The number of bytes to read
+ * @param offset The offset to read from
+ * @return ssize_t The number of bytes read, -1 on error
+ */
+ssize_t full_pread(int fd, void *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t ret = pread(fd, (char *)buf + done, len - done, offset + done);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) // End of the file
+        {
+            break;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+/**
+ * @brief Takes the bounce buffer of a handle, or allocates one when another thread is using it
+ *
+ * @param archive The archive, opened with TAR_OPEN_DIRECT
+ * @return char* A buffer of TAR_WINDOW bytes aligned for O_DIRECT, NULL if it could not be allocated (errno is set)
+ */
+char *bounce_take(tar_archive_t *archive)
+{
+    char *bounce = NULL;
+    if (pthread_mutex_trylock(&archive->bounce_lock) == 0)
+    {
+        if (archive->bounce == NULL && posix_memalign((void **)&archive->bounce, TAR_DIRECT_ALIGN, TAR_WINDOW) != 0)
+        {
+            archive->bounce = NULL;
+            pthread_mutex_unlock(&archive->bounce_lock);
+            errno = ENOMEM;
+            return NULL;
+        }
+        return archive->bounce;
+    }
+    if (posix_memalign((void **)&bounce, TAR_DIRECT_ALIGN, TAR_WINDOW) != 0)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return bounce;
+}
+
+/**
+ * @brief Gives back a buffer taken with bounce_take()
+ *
+ * @param archive The archive
+ * @param bounce The buffer, or NULL
+ */
+void bounce_release(tar_archive_t *archive, char *bounce)
+{
+    if (bounce == NULL)
+    {
+        return;
+    }
+    if (bounce == archive->bounce)
+    {
+        pthread_mutex_unlock(&archive->bounce_lock);
+    }
+    else
+    {
+        free(bounce);
+    }
+}
+
+/**
+ * @brief Reads a range of the archive with O_DIRECT
+ *
+ * O_DIRECT needs the offset, the length and the buffer to be aligned on the device blocks, while tar entries are
+ * only aligned on 512 bytes blocks. The aligned middle of the range is read straight into the destination when the
+ * destination allows it, the unaligned head and tail go through the aligned bounce buffer of the handle.
+ *
+ * @param archive The archive, opened with TAR_OPEN_DIRECT
+ * @param buf The destination buffer
+ * @param len The number of bytes to read
+ * @param offset The offset to read from
+ * @return ssize_t The number of bytes read, -1 on error
+ */
+ssize_t direct_pread(tar_archive_t *archive, void *buf, size_t len, off_t offset)
+{
+    char *bounce = NULL;
+    size_t done = 0;
+
+    while (done < len)
+    {
+        off_t pos = offset + done;
+        size_t left = len - done;
+        char *dest = (char *)buf + done;
+
+        // Aligned offset, aligned destination and at least a block to read: no copy needed
+        if (pos % TAR_DIRECT_ALIGN == 0 && (uintptr_t)dest % TAR_DIRECT_ALIGN == 0 && left >= TAR_DIRECT_ALIGN)
+        {
+            size_t chunk = left - left % TAR_DIRECT_ALIGN;
+            ssize_t ret = pread(archive->direct_fd, dest, chunk, pos);
+            if (ret < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (ret < 0)
+            {
+                bounce_release(archive, bounce);
+                return -1;
+            }
+            done += ret;
+            if ((size_t)ret < chunk) // End of the file
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (bounce == NULL && (bounce = bounce_take(archive)) == NULL)
+        {
+            return -1;
+        }
+
+        off_t start = pos - pos % TAR_DIRECT_ALIGN;
+        size_t skip = pos - start;
+        size_t chunk = skip + left;
+        if (chunk > TAR_WINDOW)
+        {
+            chunk = TAR_WINDOW;
+        }
+        chunk = (chunk + TAR_DIRECT_ALIGN - 1) / TAR_DIRECT_ALIGN * TAR_DIRECT_ALIGN;
+
+        ssize_t ret = pread(archive->direct_fd, bounce, chunk, start);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret < 0)
+        {
+            bounce_release(archive, bounce);
+            return -1;
+        }
+        if ((size_t)ret <= skip) // End of the file
+        {
+            break;
+        }
+
+        size_t copy = ret - skip;
+        if (copy > left)
+        {
+            copy = left;
+        }
+        memcpy(dest, bounce + skip, copy);
+        done += copy;
+        if ((size_t)ret < chunk) // The unaligned tail of the file
+        {
+            break;
+        }
+    }
+
+    bounce_release(archive, bounce);
+    return done;
+}
+
+/**
+ * @brief Reads exactly len bytes at a given offset of the archive, unless the end of the file is reached
+ *
+ * @param archive The archive to read from
+ * @param buf The destination buffer
+ * @param len The number of bytes to read
+ * @param offset The offset to read from
+ * @return ssize_t The number of bytes read, -1 on error
+ */
+ssize_t archive_pread(tar_archive_t *archive, void *buf, size_t len, off_t offset)
+{
+    if (archive->read_at != NULL)
+    {
+        return archive->read_at(archive->read_ctx, buf, len, offset);
+    }
+    if (archive->direct_fd >= 0)
+    {
+        return direct_pread(archive, buf, len, offset);
+    }
+    return full_pread(archive->fd, buf, len, offset);
+}
+
+/*
+ * Header windows
+ *
+ * Scans read the archive through a large aligned buffer rather than header by header. Payloads are skipped by moving
+ * to the next header: the window is only refilled, from the device block containing that header, when the header is
+ * not already in it.
+ */
+
+typedef struct tar_window
+{
+    tar_archive_t *archive; // The archive being scanned
+    char *buf;              // Aligned buffer of TAR_WINDOW bytes
+    off_t start;            // Offset of the buffer in the archive
+    size_t len;             // Number of valid bytes in the buffer
+} tar_window_t;
+
+/**
+ * @brief Allocates the buffer of a window
+ *
+ * @param window The window
+ * @param archive The archive to scan
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int window_init(tar_window_t *window, tar_archive_t *archive)
+{
+    window->archive = archive;
+    window->start = 0;
+    window->len = 0;
+    if (posix_memalign((void **)&window->buf, TAR_DIRECT_ALIGN, TAR_WINDOW) != 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Refills a window from the device block containing a given offset
+ *
+ * @param window The window
+ * @param offset The offset that must be in the window
+ * @return int 0 on success, -1 on error
+ */
+int window_fill(tar_window_t *window, off_t offset)
+{
+    window->start = offset - offset % TAR_DIRECT_ALIGN;
+    ssize_t ret;
+    if (window->archive->direct_fd >= 0)
+    {
+        // The buffer, the offset and the length are aligned, a short read only happens at the end of the file
+        do
+        {
+            ret = pread(window->archive->direct_fd, window->buf, TAR_WINDOW, window->start);
+        } while (ret < 0 && errno == EINTR);
+    }
+    else
+    {
+        ret = archive_pread(window->archive, window->buf, TAR_WINDOW, window->start);
+    }
+    if (ret < 0)
+    {
+        window->len = 0;
+        return -1;
+    }
+    window->len = ret;
+    TAR_PROBE2(cache_miss, (long long)window->start, (long long)ret);
+    return 0;
+}
+
+/**
+ * @brief Gets the header at a given offset of the archive
+ *
+ * @param window The window
+ * @param offset The offset of the header, a multiple of 512
+ * @param header Set to the header, which stays valid until the next call
+ * @return int 1 if a header was read, 0 at the end of the file, -1 on error
+ */
+int window_header(tar_window_t *window, off_t offset, const char **header)
+{
+    if (offset < window->start || offset + 512 > window->start + (off_t)window->len)
+    {
+        if (window_fill(window, offset) < 0)
+        {
+            return -1;
+        }
+        if (offset + 512 > window->start + (off_t)window->len) // Truncated archive
+        {
+            return 0;
+        }
+    }
+
+    *header = window->buf + (offset - window->start);
+    return 1;
+}
+
+/**
+ * @brief Gets the bytes at a given offset of the archive, at most up to the end of the window
+ *
+ * @param window The window
+ * @param offset The offset of the bytes
+ * @param len The number of bytes wanted
+ * @param data Set to the bytes, which stay valid until the next call
+ * @return ssize_t The number of bytes available, at most len, 0 at the end of the file, -1 on error
+ */
+ssize_t window_data(tar_window_t *window, off_t offset, size_t len, const char **data)
+{
+    if (offset < window->start || offset >= window->start + (off_t)window->len)
+    {
+        if (window_fill(window, offset) < 0)
+        {
+            return -1;
+        }
+        if (offset >= window->start + (off_t)window->len)
+        {
+            return 0;
+        }
+    }
+
+    size_t available = window->start + window->len - offset;
+    *data = window->buf + (offset - window->start);
+    return available < len ? available : len;
+}
+
+/**
+ * @brief Releases the buffer of a window
+ *
+ * @param window The window
+ */
+void window_free(tar_window_t *window)
+{
+    free(window->buf);
+    window->buf = NULL;
+}
+
+/**
+ * @brief Checks whether a block only contains zeros, i.e. is an end of archive marker
+ *
+ * @param block The 512 bytes block
+ * @return int 1 if the block is empty, 0 otherwise
+ */
+int block_empty(const char *block)
+{
+    for (int i = 0; i < 512; i++)
+    {
+        if (block[i] != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Hashes a path (FNV-1a)
+ *
+ * @param path The path to hash
+ * @param len The length of the path
+ * @return uint64_t The hash of the path
+ */
+uint64_t tar_hash(const char *path, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Joins the prefix and the name fields of a header
+ *
+ * @param header The header
+ * @param path A buffer of at least TAR_PATH_MAX bytes receiving the full path
+ */
+void header_path(const tar_header_t *header, char *path)
+{
+    size_t len = 0;
+    size_t prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+    if (prefix_len > 0)
+    {
+        memcpy(path, header->prefix, prefix_len);
+        len = prefix_len;
+        path[len++] = '/';
+    }
+    size_t name_len = strnlen(header->name, sizeof(header->name));
+    memcpy(path + len, header->name, name_len);
+    path[len + name_len] = '\0';
+}
+
+/**
+ * @brief Gets the path of an entry
+ *
+ * @param archive The archive
+ * @param index The index of the entry
+ * @return const char* The path, valid until the index changes
+ */
+const char *entry_name(tar_archive_t *archive, size_t index)
+{
+    return archive->pool + archive->entries[index].name;
+}
+
+/**
+ * @brief Makes room for more elements in a block of the index, doubling its capacity when it is full
+ *
+ * @param archive The archive, counting the allocations
+ * @param block The block, which may move
+ * @param cap An in-out argument, the capacity of the block in elements
+ * @param need The number of elements the block must be able to hold
+ * @param size The size of an element
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int index_reserve(tar_archive_t *archive, void **block, size_t *cap, size_t need, size_t size)
+{
+    if (need <= *cap)
+    {
+        return 0;
+    }
+
+    size_t new_cap = *cap ? *cap : 64;
+    while (new_cap < need)
+    {
+        new_cap *= 2;
+    }
+    void *grown = realloc(*block, new_cap * size);
+    if (grown == NULL)
+    {
+        return -1;
+    }
+    archive->no_allocs++;
+    archive->index_bytes += (new_cap - *cap) * size;
+    *block = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+/**
+ * @brief Interns a string in the string pool
+ *
+ * @param archive The archive
+ * @param str The string
+ * @param len The length of the string
+ * @return uint32_t The offset of the string in the pool, TAR_NO_NAME if the memory could not be allocated
+ */
+uint32_t pool_add(tar_archive_t *archive, const char *str, size_t len)
+{
+    if (archive->pool_len + len + 1 > UINT32_MAX ||
+        index_reserve(archive, (void **)&archive->pool, &archive->pool_cap, archive->pool_len + len + 1, 1) < 0)
+    {
+        return TAR_NO_NAME;
+    }
+
+    uint32_t offset = archive->pool_len;
+    memcpy(archive->pool + offset, str, len);
+    archive->pool[offset + len] = '\0';
+    archive->pool_len += len + 1;
+    return offset;
+}
+
+/**
+ * @brief Finds the slot of a path in the hash table
+ *
+ * @param archive The archive
+ * @param path The path to look for
+ * @param len The length of the path
+ * @return size_t The slot holding the path, or the empty slot where it would be inserted
+ */
+size_t index_slot(tar_archive_t *archive, const char *path, size_t len)
+{
+    size_t mask = archive->no_slots - 1;
+    size_t slot = tar_hash(path, len) & mask;
+    while (archive->slots[slot] != TAR_EMPTY_SLOT)
+    {
+        const char *name = entry_name(archive, archive->slots[slot]);
+        if (strncmp(name, path, len) == 0 && name[len] == '\0')
+        {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * @brief Doubles the size of the hash table
+ *
+ * @param archive The archive
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int index_grow(tar_archive_t *archive)
+{
+    uint32_t *old_slots = archive->slots;
+    size_t old_no_slots = archive->no_slots;
+
+    archive->no_slots = old_no_slots ? old_no_slots * 2 : 64;
+    archive->slots = calloc(archive->no_slots, sizeof(uint32_t));
+    if (archive->slots == NULL)
+    {
+        archive->slots = old_slots;
+        archive->no_slots = old_no_slots;
+        return -1;
+    }
+    archive->no_allocs++;
+    archive->index_bytes += (archive->no_slots - old_no_slots) * sizeof(uint32_t);
+
+    for (size_t i = 0; i < old_no_slots; i++)
+    {
+        if (old_slots[i] != TAR_EMPTY_SLOT)
+        {
+            const char *name = entry_name(archive, old_slots[i]);
+            archive->slots[index_slot(archive, name, strlen(name))] = old_slots[i];
+        }
+    }
+    free(old_slots);
+    return 0;
+}
+
+/**
+ * @brief Looks up an entry by its exact path
+ *
+ * @param archive The archive
+ * @param path The path to look for
+ * @param len The length of the path
+ * @return size_t The index of the entry, TAR_NO_ENTRY if there is none
+ */
+size_t index_find(tar_archive_t *archive, const char *path, size_t len)
+{
+    if (len == 0)
+    {
+        return TAR_NO_ENTRY;
+    }
+
+    size_t index;
+    if (archive->mph != NULL) // One probe, then the path of the entry found must be the path looked up
+    {
+        index = mph_lookup(archive->mph, tar_hash(path, len));
+        if (index == TAR_MPH_NONE || index == TAR_ROOT)
+        {
+            return TAR_NO_ENTRY;
+        }
+        const char *name = entry_name(archive, index);
+        return strncmp(name, path, len) == 0 && name[len] == '\0' ? index : TAR_NO_ENTRY;
+    }
+
+    index = archive->slots[index_slot(archive, path, len)];
+    return index == TAR_EMPTY_SLOT ? TAR_NO_ENTRY : index;
+}
+
+/**
+ * @brief Looks up an entry by its path, "dir" also matches "dir/" and "link/" also matches "link"
+ *
+ * @param archive The archive
+ * @param path The path to look for, "" or "/" for the root
+ * @return size_t The index of the entry, the root or TAR_NO_ENTRY if there is none
+ */
+size_t index_lookup(tar_archive_t *archive, const char *path)
+{
+    size_t len = strlen(path);
+    if (len == 0 || (len == 1 && path[0] == '/'))
+    {
+        return TAR_ROOT;
+    }
+    if (archive->bloom != NULL && !bloom_probe(archive->bloom, bloom_hash(path, len), 0))
+    {
+        return TAR_NO_ENTRY;
+    }
+
+    size_t index = index_find(archive, path, len);
+    if (index == TAR_NO_ENTRY && path[len - 1] != '/' && len + 1 < TAR_PATH_MAX)
+    {
+        char dir[TAR_PATH_MAX];
+        memcpy(dir, path, len);
+        dir[len] = '/';
+        index = index_find(archive, dir, len + 1);
+    }
+    else if (index == TAR_NO_ENTRY && path[len - 1] == '/')
+    {
+        index = index_find(archive, path, len - 1);
+    }
+    return index;
+}
+
+/**
+ * @brief Computes the length of the path of the parent directory of an entry
+ *
+ * @param name The path of the entry
+ * @return size_t The length of the parent path including its trailing '/', zero if the parent is the root
+ */
+size_t parent_len(const char *name)
+{
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '/') // Directories end with a '/'
+    {
+        len--;
+    }
+    while (len > 0 && name[len - 1] != '/')
+    {
+        len--;
+    }
+    return len;
+}
+
+size_t index_add(tar_archive_t *archive, const char *name, size_t name_len);
+
+/**
+ * @brief Finds the parent directory of an entry, adding the missing directories of its path
+ *
+ * @param archive The archive
+ * @param name The path of the entry
+ * @return size_t The index of the parent, TAR_NO_ENTRY if the memory could not be allocated
+ */
+size_t index_parent(tar_archive_t *archive, const char *name)
+{
+    size_t len = parent_len(name);
+    if (len == 0)
+    {
+        return TAR_ROOT;
+    }
+
+    size_t parent = index_find(archive, name, len);
+    if (parent == TAR_NO_ENTRY) // Archives are not required to contain a header for every directory
+    {
+        // The name may be in the pool, which moves when it grows. Not on the stack, as each missing directory of a
+        // long path is added by a call of its own
+        char *path = strndup(name, len);
+        if (path == NULL)
+        {
+            return TAR_NO_ENTRY;
+        }
+        parent = index_add(archive, path, len);
+        free(path);
+        if (parent != TAR_NO_ENTRY)
+        {
+            archive->entries[parent].typeflag = DIRTYPE;
+        }
+    }
+    return parent;
+}
+
+/**
+ * @brief Adds an entry to the index or returns the existing one with the same path
+ *
+ * @param archive The archive
+ * @param name The path of the entry
+ * @param name_len The length of the path
+ * @return size_t The index of the entry, TAR_NO_ENTRY if the memory could not be allocated
+ */
+size_t index_add(tar_archive_t *archive, const char *name, size_t name_len)
+{
+    size_t index = index_find(archive, name, name_len);
+    if (index != TAR_NO_ENTRY) // A later entry with the same path replaces the earlier one
+    {
+        return index;
+    }
+
+    if (archive->no_entries >= UINT32_MAX ||
+        (archive->no_entries * 2 >= archive->no_slots && index_grow(archive) < 0) ||
+        index_reserve(archive, (void **)&archive->entries, &archive->cap_entries, archive->no_entries + 1,
+                      sizeof(tar_entry_t)) < 0)
+    {
+        return TAR_NO_ENTRY;
+    }
+
+    uint32_t offset = pool_add(archive, name, name_len);
+    if (offset == TAR_NO_NAME)
+    {
+        return TAR_NO_ENTRY;
+    }
+
+    index = archive->no_entries++;
+    tar_entry_t *entry = &archive->entries[index];
+    memset(entry, 0, sizeof(tar_entry_t));
+    entry->name = offset;
+    entry->linkname = TAR_NO_NAME;
+    entry->header_offset = -1;
+    archive->slots[index_slot(archive, archive->pool + offset, name_len)] = index;
+
+    size_t parent = index_parent(archive, archive->pool + offset);
+    if (parent == TAR_NO_ENTRY)
+    {
+        return TAR_NO_ENTRY;
+    }
+    archive->entries[index].parent = parent; // index_parent() may have moved the entries
+    return index;
+}
+
+/**
+ * @brief Records the header found at a given offset in the index
+ *
+ * @param archive The archive
+ * @param header The header
+ * @param offset The offset of the header in the archive
+ * @param path The path of the entry given by an extended header, NULL to take the one of the header
+ * @param linkpath The target of the link given by an extended header, NULL to take the one of the header
+ * @return size_t The index of the entry, TAR_NO_ENTRY if the memory could not be allocated
+ */
+size_t index_header(tar_archive_t *archive, const tar_header_t *header, off_t offset, const char *path,
+                    const char *linkpath)
+{
+    char header_name[TAR_PATH_MAX];
+    if (path == NULL)
+    {
+        header_path(header, header_name);
+        path = header_name;
+    }
+
+    size_t index = index_add(archive, path, strlen(path));
+    if (index == TAR_NO_ENTRY)
+    {
+        return TAR_NO_ENTRY;
+    }
+
+    tar_entry_t *entry = &archive->entries[index];
+    entry->header_offset = offset;
+    entry->typeflag = header->typeflag;
+    entry->size = tar_number(header->size, sizeof(header->size));
+    entry->sparse = TAR_NO_SPARSE;
+    entry->mtime = tar_number(header->mtime, sizeof(header->mtime));
+    entry->uid = tar_number(header->uid, sizeof(header->uid));
+    entry->gid = tar_number(header->gid, sizeof(header->gid));
+    entry->mode = tar_number(header->mode, sizeof(header->mode)) & 07777;
+
+    entry->linkname = TAR_NO_NAME;
+    if (header->typeflag == SYMTYPE || header->typeflag == LNKTYPE)
+    {
+        uint32_t linkname = linkpath != NULL ? pool_add(archive, linkpath, strlen(linkpath))
+                                             : pool_add(archive, header->linkname,
+                                                        strnlen(header->linkname, sizeof(header->linkname)));
+        if (linkname == TAR_NO_NAME)
+        {
+            return TAR_NO_ENTRY;
+        }
+        archive->entries[index].linkname = linkname;
+    }
+    return index;
+}
+
+/**
+ * @brief Fills the children array once every entry is known, the children of each directory in archive order
+ *
+ * @param archive The archive
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int index_link_children(tar_archive_t *archive)
+{
+    free(archive->children);
+    archive->children = malloc((archive->no_entries ? archive->no_entries : 1) * sizeof(uint32_t));
+    if (archive->children == NULL)
+    {
+        return -1;
+    }
+    archive->no_allocs++;
+    archive->index_bytes += archive->no_entries * sizeof(uint32_t);
+
+    // Count the children, then give each directory its range of the array
+    for (size_t i = 0; i < archive->no_entries; i++)
+    {
+        archive->entries[i].no_children = 0;
+    }
+    for (size_t i = 1; i < archive->no_entries; i++)
+    {
+        archive->entries[archive->entries[i].parent].no_children++;
+    }
+    uint32_t first = 0;
+    for (size_t i = 0; i < archive->no_entries; i++)
+    {
+        archive->entries[i].first_child = first;
+        first += archive->entries[i].no_children;
+        archive->entries[i].no_children = 0;
+    }
+    for (size_t i = 1; i < archive->no_entries; i++)
+    {
+        tar_entry_t *parent = &archive->entries[archive->entries[i].parent];
+        archive->children[parent->first_child + parent->no_children++] = i;
+    }
+    return 0;
+}
+
+/*
+ * Sparse files
+ *
+ * A sparse file is stored as its data regions one after the other, with a map giving the offset and the length of
+ * each region in the file, the rest being holes. GNU tar writes the map in the header of a GNUTYPE_SPARSE member and
+ * in extension blocks after it, or, in the pax format, in the extended header of a regular member (versions 0.0 and
+ * 0.1) or as decimal lines at the start of its payload (version 1.0). Every sparse file is indexed as a
+ * GNUTYPE_SPARSE entry whose size is the size of the file, with its map in the regions array.
+ */
+
+typedef struct tar_pax
+{
+    char path[TAR_PATH_MAX];     // Path of the next entry, empty to use the one of its header
+    char linkpath[TAR_PATH_MAX]; // Target of the next entry if it is a link, empty to use the one of its header
+    int sparse_name;             // Whether the path comes from GNU.sparse.name, which wins over path
+    int sparse;                  // Whether the next entry is a sparse file
+    int major;                   // Version of its sparse format, 1 when the map starts the payload
+    uint64_t realsize;           // Size of the sparse file
+    uint64_t next_offset;        // Offset given by the last GNU.sparse.offset (version 0.0)
+    size_t first_region;         // Position of the regions given by the extended header in the regions array
+    off_t offset;                // Offset + 1 of the extended header, zero if there is none
+    int fields;                  // TAR_PAX_* bits of the numeric records given
+    uint64_t size;               // Size of the payload, which the header cannot hold from 8 GiB
+    int64_t mtime;               // Modification time, in seconds since the epoch
+    uint32_t uid;                // Owner
+    uint32_t gid;                // Group
+    int skip;                    // Whether the path or the link target of the next entry is too long for the index
+} tar_pax_t;
+
+#define TAR_PAX_SIZE 1  // The extended header gives the size of the payload
+#define TAR_PAX_MTIME 2 // It gives the modification time
+#define TAR_PAX_UID 4   // It gives the owner
+#define TAR_PAX_GID 8   // It gives the group
+
+/**
+ * @brief Checks whether the type of an entry is a file
+ *
+ * @param typeflag The type
+ * @return int 1 for a regular or a sparse file, 0 otherwise
+ */
+int type_is_file(char typeflag)
+{
+    return typeflag == REGTYPE || typeflag == AREGTYPE || typeflag == GNUTYPE_SPARSE;
+}
+
+/**
+ * @brief Parses a numeric field of a header, in octal or in the base-256 encoding of GNU tar for large values
+ *
+ * @param field The field
+ * @param len The length of the field
+ * @return uint64_t The value
+ */
+uint64_t tar_number(const char *field, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char *)field;
+    uint64_t value = 0;
+    if (len > 0 && (bytes[0] & 0x80)) // Base-256, big endian, after the marker bit
+    {
+        value = bytes[0] & 0x3f;
+        for (size_t i = 1; i < len; i++)
+        {
+            value = value << 8 | bytes[i];
+        }
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < len && field[i] == ' ')
+    {
+        i++;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    {
+        value = value << 3 | (field[i] - '0');
+    }
+    return value;
+}
+
+/**
+ * @brief Appends a data region to the regions array
+ *
+ * @param archive The archive
+ * @param offset The offset of the data in the file
+ * @param len The length of the data, a region of length zero only marking the size of the file is not kept
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int sparse_add_region(tar_archive_t *archive, uint64_t offset, uint64_t len)
+{
+    if (len == 0)
+    {
+        return 0;
+    }
+    if (archive->no_regions >= UINT32_MAX ||
+        index_reserve(archive, (void **)&archive->regions, &archive->cap_regions, archive->no_regions + 1,
+                      sizeof(tar_sparse_region_t)) < 0)
+    {
+        return -1;
+    }
+    tar_sparse_region_t *region = &archive->regions[archive->no_regions++];
+    region->offset = offset;
+    region->len = len;
+    region->stored = 0;
+    return 0;
+}
+
+/**
+ * @brief Turns an entry into a sparse file, with the regions appended since a given position
+ *
+ * @param archive The archive
+ * @param index The index of the entry
+ * @param first The position of its first region in the regions array
+ * @param data_offset The offset of the stored regions in the archive
+ * @param realsize The size of the file
+ * @param stored_size The size of the stored regions
+ * @return int 0 on success, -1 if the map is invalid or the memory could not be allocated (errno is set)
+ */
+int sparse_finish(tar_archive_t *archive, size_t index, size_t first, off_t data_offset, uint64_t realsize,
+                  uint64_t stored_size)
+{
+    // The regions must be sorted, apart and inside the file, and the stored payload must hold them
+    uint64_t stored = 0;
+    for (size_t r = first; r < archive->no_regions; r++)
+    {
+        tar_sparse_region_t *region = &archive->regions[r];
+        if ((r > first && region->offset < region[-1].offset + region[-1].len) || region->offset > realsize ||
+            region->len > realsize - region->offset)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        region->stored = stored;
+        stored += region->len;
+    }
+    if (stored > stored_size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (archive->no_sparse >= UINT32_MAX - 1 ||
+        index_reserve(archive, (void **)&archive->sparse, &archive->cap_sparse, archive->no_sparse + 1,
+                      sizeof(tar_sparse_t)) < 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    tar_sparse_t *sparse = &archive->sparse[archive->no_sparse++];
+    sparse->data_offset = data_offset;
+    sparse->first = first;
+    sparse->no_regions = archive->no_regions - first;
+
+    tar_entry_t *entry = &archive->entries[index];
+    entry->sparse = archive->no_sparse; // Position + 1
+    entry->typeflag = GNUTYPE_SPARSE;
+    entry->size = realsize;
+    return 0;
+}
+
+/**
+ * @brief Reads the map of a GNUTYPE_SPARSE member, from its header and its extension blocks
+ *
+ * @param archive The archive
+ * @param window The window of the scan
+ * @param offset The offset of the header
+ * @param index The index of the entry
+ * @param next The offset of the next header, moved past the extension blocks
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int sparse_gnu(tar_archive_t *archive, tar_window_t *window, off_t offset, size_t index, off_t *next)
+{
+    const char *buf;
+    if (window_header(window, offset, &buf) <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t realsize = tar_number(buf + 483, 12);
+    uint64_t stored_size = tar_number(buf + 124, 12);
+    size_t first = archive->no_regions;
+
+    // 4 regions of 2 fields of 12 bytes in the header, then 21 per extension block while the extended flag is set
+    const char *regions = buf + 386;
+    int no_regions = 4;
+    char extended = buf[482];
+    off_t pos = offset + 512;
+    for (;;)
+    {
+        for (int i = 0; i < no_regions && regions[24 * i] != '\0'; i++)
+        {
+            if (sparse_add_region(archive, tar_number(regions + 24 * i, 12), tar_number(regions + 24 * i + 12, 12)) <
+                0)
+            {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        if (!extended)
+        {
+            break;
+        }
+        if (window_header(window, pos, &buf) <= 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        regions = buf;
+        no_regions = 21;
+        extended = buf[504];
+        pos += 512;
+    }
+
+    *next += pos - (offset + 512);
+    return sparse_finish(archive, index, first, pos, realsize, stored_size);
+}
+
+/**
+ * @brief Reads a decimal number ending with a line feed from the archive
+ *
+ * @param window The window of the scan
+ * @param pos The offset of the number, moved past its line feed
+ * @param end The offset the number must end before
+ * @param value Receives the number
+ * @return int 0 on success, -1 if the number is malformed or cannot be read
+ */
+int window_decimal(tar_window_t *window, off_t *pos, off_t end, uint64_t *value)
+{
+    *value = 0;
+    for (int digits = 0; *pos < end; digits++)
+    {
+        const char *data;
+        if (window_data(window, *pos, 1, &data) <= 0)
+        {
+            return -1;
+        }
+        (*pos)++;
+        if (*data == '\n')
+        {
+            return digits > 0 ? 0 : -1;
+        }
+        if (!isdigit((unsigned char)*data) || digits == 19)
+        {
+            return -1;
+        }
+        *value = *value * 10 + (*data - '0');
+    }
+    return -1;
+}
+
+/**
+ * @brief Reads the map starting the payload of a pax sparse member (version 1.0)
+ *
+ * @param archive The archive
+ * @param window The window of the scan
+ * @param offset The offset of the header
+ * @param index The index of the entry
+ * @param pax The extended header of the member
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int sparse_pax_map(tar_archive_t *archive, tar_window_t *window, off_t offset, size_t index, tar_pax_t *pax)
+{
+    uint64_t size = archive->entries[index].size; // Still the size of the payload
+    off_t pos = offset + 512;
+    off_t end = pos + size;
+    uint64_t no_regions;
+    if (window_decimal(window, &pos, end, &no_regions) < 0 || no_regions > size / 4) // At least "0\n0\n" each
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (uint64_t i = 0; i < no_regions; i++)
+    {
+        uint64_t region_offset, region_len;
+        if (window_decimal(window, &pos, end, &region_offset) < 0 || window_decimal(window, &pos, end, &region_len) < 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        if (sparse_add_region(archive, region_offset, region_len) < 0)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    // The map is padded to a whole block
+    uint64_t map_len = (pos - (offset + 512) + 511) / 512 * 512;
+    if (map_len > size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return sparse_finish(archive, index, pax->first_region, offset + 512 + map_len, pax->realsize, size - map_len);
+}
+
+/**
+ * @brief Parses the records of a pax extended header applying to the next entry
+ *
+ * The path, the link target, the size, the modification time, the owner, the group and the sparse maps are kept, the
+ * other records are ignored. A path or a link target too long for the index marks the next entry to be left out.
+ *
+ * @param archive The archive
+ * @param window The window of the scan
+ * @param data The offset of the records
+ * @param size The size of the records
+ * @param pax Receives what applies to the next entry
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int pax_parse(tar_archive_t *archive, tar_window_t *window, off_t data, uint64_t size, tar_pax_t *pax)
+{
+    if (size > TAR_PAX_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The buffer grows with the bytes actually read, so that the size of a header cannot make it larger than the file
+    char *records = NULL;
+    for (uint64_t done = 0; done < size;)
+    {
+        const char *chunk;
+        ssize_t len = window_data(window, data + done, size - done, &chunk);
+        char *grown = len <= 0 ? NULL : realloc(records, done + len + 1);
+        if (grown == NULL)
+        {
+            free(records);
+            errno = len < 0 ? errno : len == 0 ? EINVAL : ENOMEM;
+            return -1;
+        }
+        records = grown;
+        memcpy(records + done, chunk, len);
+        done += len;
+    }
+    if (records == NULL)
+    {
+        return 0; // No records
+    }
+    records[size] = '\0';
+
+    // Each record is "<length> <key>=<value>\n", the length counting the whole record
+    int ret = 0;
+    for (char *record = records; record < records + size && ret == 0;)
+    {
+        char *key;
+        unsigned long long len = strtoull(record, &key, 10);
+        if (key == record || *key != ' ' || len == 0 || len > (unsigned long long)(records + size - record) ||
+            record[len - 1] != '\n')
+        {
+            ret = -1;
+            break;
+        }
+        record[len - 1] = '\0';
+        key++;
+        char *value = strchr(key, '=');
+        if (value == NULL)
+        {
+            ret = -1;
+            break;
+        }
+        *value++ = '\0';
+
+        int is_sparse_name = strcmp(key, "GNU.sparse.name") == 0;
+        int is_path = is_sparse_name || strcmp(key, "path") == 0;
+        if ((is_path || strcmp(key, "linkpath") == 0) && strlen(value) >= TAR_PATH_MAX)
+        {
+            pax->skip = 1; // Left out rather than indexed under the cut name of its header
+        }
+        else if (is_path && (is_sparse_name || !pax->sparse_name))
+        {
+            strcpy(pax->path, value);
+            pax->sparse_name |= is_sparse_name;
+        }
+        else if (strcmp(key, "linkpath") == 0)
+        {
+            strcpy(pax->linkpath, value);
+        }
+        else if (strcmp(key, "size") == 0)
+        {
+            pax->size = strtoull(value, NULL, 10);
+            pax->fields |= TAR_PAX_SIZE;
+        }
+        else if (strcmp(key, "mtime") == 0) // Seconds, the fraction after the '.' is dropped
+        {
+            pax->mtime = strtoll(value, NULL, 10);
+            pax->fields |= TAR_PAX_MTIME;
+        }
+        else if (strcmp(key, "uid") == 0)
+        {
+            pax->uid = strtoul(value, NULL, 10);
+            pax->fields |= TAR_PAX_UID;
+        }
+        else if (strcmp(key, "gid") == 0)
+        {
+            pax->gid = strtoul(value, NULL, 10);
+            pax->fields |= TAR_PAX_GID;
+        }
+        else if (strncmp(key, "GNU.sparse.", 11) == 0)
+        {
+            const char *field = key + 11;
+            pax->sparse = 1;
+            if (strcmp(field, "major") == 0)
+            {
+                pax->major = atoi(value);
+            }
+            else if (strcmp(field, "realsize") == 0 || strcmp(field, "size") == 0)
+            {
+                pax->realsize = strtoull(value, NULL, 10);
+            }
+            else if (strcmp(field, "offset") == 0) // Version 0.0, a record per field of each region
+            {
+                pax->next_offset = strtoull(value, NULL, 10);
+            }
+            else if (strcmp(field, "numbytes") == 0)
+            {
+                ret = sparse_add_region(archive, pax->next_offset, strtoull(value, NULL, 10));
+            }
+            else if (strcmp(field, "map") == 0) // Version 0.1, "offset,length,offset,length..."
+            {
+                for (char *number = value; *number != '\0' && ret == 0;)
+                {
+                    char *comma;
+                    uint64_t region_offset = strtoull(number, &comma, 10);
+                    if (*comma != ',')
+                    {
+                        ret = -1;
+                        break;
+                    }
+                    uint64_t region_len = strtoull(comma + 1, &number, 10);
+                    ret = sparse_add_region(archive, region_offset, region_len);
+                    number += *number == ',';
+                }
+            }
+        }
+        record += len;
+    }
+
+    free(records);
+    if (ret < 0)
+    {
+        errno = EINVAL;
+    }
+    return ret;
+}
+
+/**
+ * @brief Applies the numeric records of an extended header to its entry, over the fields of the ustar header
+ *
+ * @param pax The records of the extended header
+ * @param entry The entry
+ */
+void pax_apply(const tar_pax_t *pax, tar_entry_t *entry)
+{
+    if (pax->fields & TAR_PAX_SIZE)
+    {
+        entry->size = pax->size;
+    }
+    if (pax->fields & TAR_PAX_MTIME)
+    {
+        entry->mtime = pax->mtime;
+    }
+    if (pax->fields & TAR_PAX_UID)
+    {
+        entry->uid = pax->uid;
+    }
+    if (pax->fields & TAR_PAX_GID)
+    {
+        entry->gid = pax->gid;
+    }
+}
+
+/**
+ * @brief Reads the name held by the payload of a GNU long name or long link member, applying to the next entry
+ *
+ * @param window The window of the scan
+ * @param data The offset of the payload
+ * @param size The size of the payload, the name and a null
+ * @param name Receives the name, TAR_PATH_MAX bytes, empty if it does not fit
+ * @return int 0 on success, 1 if the name does not fit, -1 on error (errno is set)
+ */
+int gnu_long_name(tar_window_t *window, off_t data, uint64_t size, char *name)
+{
+    size_t len = size < TAR_PATH_MAX ? size : TAR_PATH_MAX;
+    for (size_t done = 0; done < len;)
+    {
+        const char *chunk;
+        ssize_t ret = window_data(window, data + done, len - done, &chunk);
+        if (ret <= 0)
+        {
+            errno = ret < 0 ? errno : EINVAL;
+            return -1;
+        }
+        memcpy(name + done, chunk, ret);
+        done += ret;
+    }
+    if (strnlen(name, len) == TAR_PATH_MAX)
+    {
+        name[0] = '\0';
+        return 1;
+    }
+    name[len < TAR_PATH_MAX ? len : TAR_PATH_MAX - 1] = '\0'; // Without a null, the whole payload is the name
+    return 0;
+}
+
+int pax_dead(tar_window_t *window, off_t data, uint64_t size);
+int pax_delta(tar_window_t *window, off_t data, uint64_t size);
+int index_rollup(tar_archive_t *archive);
+void rollup_resize(tar_archive_t *archive, size_t index, uint64_t old_size);
+
+/**
+ * @brief Scans the archive and fills its index
+ *
+ * @param archive The archive
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int index_build(tar_archive_t *archive)
+{
+    tar_window_t window;
+    if (window_init(&window, archive) < 0)
+    {
+        return -1;
+    }
+
+    off_t offset = 0;
+    const char *buf;
+    int ret;
+    tar_pax_t pax = {.major = 0};
+    pax.first_region = archive->no_regions;
+    while ((ret = window_header(&window, offset, &buf)) > 0) // Stop at a truncated archive without an end marker
+    {
+        if (block_empty(buf)) // End of archive
+        {
+            TAR_PROBE2(end_of_archive, (long long)offset, archive->no_entries - 1);
+            break;
+        }
+
+        int valid = check_header(buf, 1);
+        if (valid < 0)
+        {
+            if (valid == -3)
+            {
+                TAR_PROBE2(checksum_fail, (long long)offset, ((const tar_header_t *)buf)->name);
+            }
+            window_free(&window);
+            errno = EINVAL;
+            return -1;
+        }
+
+        const tar_header_t *header = (const tar_header_t *)buf;
+        off_t next = offset + 512 + next_header((tar_header_t *)header);
+        if (header->typeflag == XHDTYPE) // Extended header of the next entry or dead member, not an entry itself
+        {
+            uint64_t size = tar_number(header->size, sizeof(header->size));
+            if (!pax_dead(&window, offset + 512, size))
+            {
+                if (pax_parse(archive, &window, offset + 512, size, &pax) < 0)
+                {
+                    window_free(&window);
+                    return -1;
+                }
+                pax.offset = offset + 1;
+            }
+            offset = next;
+            continue;
+        }
+        if (header->typeflag == GNUTYPE_LONGNAME || header->typeflag == GNUTYPE_LONGLINK) // Of the next entry
+        {
+            uint64_t size = tar_number(header->size, sizeof(header->size));
+            int long_name = gnu_long_name(&window, offset + 512, size,
+                                          header->typeflag == GNUTYPE_LONGNAME ? pax.path : pax.linkpath);
+            if (long_name < 0)
+            {
+                window_free(&window);
+                return -1;
+            }
+            pax.skip |= long_name;
+            offset = next;
+            continue;
+        }
+        if (header->typeflag == XGLTYPE) // Attributes of every next entry, only the mark of a delta is used
+        {
+            archive->delta |= pax_delta(&window, offset + 512, tar_number(header->size, sizeof(header->size)));
+            offset = next;
+            continue;
+        }
+
+        char typeflag = header->typeflag;
+        if (pax.fields & TAR_PAX_SIZE) // The size field of the header is wrong from 8 GiB in ustar archives
+        {
+            next = offset + 512 + (off_t)((pax.size + 511) / 512 * 512);
+        }
+        if (pax.skip) // Left out rather than indexed under the cut name of its header, its members being skipped
+        {
+            int extended = typeflag == GNUTYPE_SPARSE && buf[482];
+            for (off_t pos = offset + 512; extended && window_header(&window, pos, &buf) > 0; pos += 512)
+            {
+                extended = buf[504]; // Extension blocks of a sparse map
+                next += 512;
+            }
+            archive->no_regions = pax.first_region;
+            archive->no_skipped++;
+            memset(&pax, 0, sizeof(pax));
+            pax.first_region = archive->no_regions;
+            offset = next;
+            continue;
+        }
+        size_t index = index_header(archive, header, offset, pax.path[0] != '\0' ? pax.path : NULL,
+                                    pax.linkpath[0] != '\0' ? pax.linkpath : NULL);
+        if (index == TAR_NO_ENTRY)
+        {
+            window_free(&window);
+            errno = ENOMEM;
+            return -1;
+        }
+        pax_apply(&pax, &archive->entries[index]);
+        archive->entries[index].pax = pax.offset > 0 ? (offset - (pax.offset - 1)) / 512 : 0;
+
+        // The header may leave the window while the sparse map is read
+        int sparse = 0;
+        if (typeflag == GNUTYPE_SPARSE)
+        {
+            sparse = sparse_gnu(archive, &window, offset, index, &next);
+        }
+        else if (pax.sparse && pax.major == 1)
+        {
+            sparse = sparse_pax_map(archive, &window, offset, index, &pax);
+        }
+        else if (pax.sparse)
+        {
+            sparse = sparse_finish(archive, index, pax.first_region, offset + 512, pax.realsize,
+                                   archive->entries[index].size);
+        }
+        if (sparse < 0)
+        {
+            window_free(&window);
+            return -1;
+        }
+        memset(&pax, 0, sizeof(pax));
+        pax.first_region = archive->no_regions;
+        TAR_PROBE4(header, (long long)offset, archive->entries[index].typeflag, archive->entries[index].size,
+                   entry_name(archive, index));
+
+        tar_entry_t *entry = &archive->entries[index];
+        if (archive->hashed && (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE))
+        {
+            // Hash the payload as it goes through the window, on the way to the next header
+            entry->hash = 0;
+            for (off_t pos = offset + 512; pos < offset + 512 + (off_t)entry->size;)
+            {
+                const char *data;
+                ssize_t len = window_data(&window, pos, offset + 512 + entry->size - pos, &data);
+                if (len <= 0)
+                {
+                    window_free(&window);
+                    errno = len < 0 ? errno : EINVAL;
+                    return -1;
+                }
+                entry->hash = crc32c(entry->hash, data, len);
+                pos += len;
+            }
+        }
+
+        offset = next;
+    }
+
+    window_free(&window);
+    if (ret < 0)
+    {
+        return -1;
+    }
+    if (index_link_children(archive) < 0 || index_rollup(archive) < 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+int read_all(int fd, void *buf, size_t len);
+tar_mph_t *mph_read(int fd, size_t no_entries, size_t no_values);
+
+/**
+ * @brief Reads the minimal perfect hash of the index saved by tar_mph_save()
+ *
+ * @param archive The archive, indexed
+ * @param fd The file, at the position of the function
+ * @return tar_mph_t* The function, NULL if it could not be read or does not map every path to its entry
+ */
+tar_mph_t *index_read_mph(tar_archive_t *archive, int fd)
+{
+    char magic[sizeof(TAR_MPH_MAGIC)];
+    if (read_all(fd, magic, sizeof(magic)) < 0 || memcmp(magic, TAR_MPH_MAGIC, sizeof(magic)) != 0)
+    {
+        return NULL;
+    }
+    tar_mph_t *mph = mph_read(fd, archive->no_entries - 1, archive->no_entries);
+
+    // The function of another index, as once the archive changed, maps some of the paths elsewhere
+    for (size_t i = 1; mph != NULL && i < archive->no_entries; i++)
+    {
+        const char *name = entry_name(archive, i);
+        if (mph_lookup(mph, tar_hash(name, strlen(name))) != i)
+        {
+            free(mph);
+            mph = NULL;
+        }
+    }
+    return mph;
+}
+
+/**
+ * @brief Replaces the hash table of the paths by a minimal perfect hash, once the index is complete
+ *
+ * If the function cannot be built, the hash table is kept. The hash table is needed to index the archive anyway,
+ * replacing the entries of paths found again, so a saved function only spares its build.
+ *
+ * @param archive The archive
+ * @param mph_fd A file holding the function saved by tar_mph_save(), or -1 to build it; the function is built if
+ *               the file does not hold the function of the index
+ */
+void index_build_mph(tar_archive_t *archive, int mph_fd)
+{
+    size_t no_keys = archive->no_entries - 1; // The root is not a key
+    archive->mph = mph_fd >= 0 ? index_read_mph(archive, mph_fd) : NULL;
+    uint64_t *hashes = archive->mph == NULL ? malloc((no_keys ? no_keys : 1) * sizeof(uint64_t)) : NULL;
+    uint32_t *values = archive->mph == NULL ? malloc((no_keys ? no_keys : 1) * sizeof(uint32_t)) : NULL;
+    if (hashes != NULL && values != NULL)
+    {
+        for (size_t i = 0; i < no_keys; i++)
+        {
+            const char *name = entry_name(archive, i + 1);
+            hashes[i] = tar_hash(name, strlen(name));
+            values[i] = i + 1;
+        }
+        archive->mph = mph_build(hashes, values, no_keys);
+    }
+    free(hashes);
+    free(values);
+
+    if (archive->mph != NULL)
+    {
+        archive->no_allocs++;
+        archive->index_bytes += mph_layout(archive->mph);
+        archive->index_bytes -= archive->no_slots * sizeof(uint32_t);
+        free(archive->slots);
+        archive->slots = NULL;
+        archive->no_slots = 0;
+    }
+}
+
+/**
+ * @brief Fills a filter with the paths of an index
+ *
+ * @param archive The archive
+ * @return tar_bloom_t* The filter, NULL if the memory could not be allocated
+ */
+tar_bloom_t *index_build_bloom(tar_archive_t *archive)
+{
+    tar_bloom_t *bloom = bloom_new(archive->no_entries - 1);
+    for (size_t i = 1; bloom != NULL && i < archive->no_entries; i++) // The root is not a key
+    {
+        const char *name = entry_name(archive, i);
+        bloom_probe(bloom, bloom_hash(name, strlen(name)), 1);
+        bloom->no_keys++;
+    }
+    return bloom;
+}
+
+/**
+ * @brief Tells the kernel how the whole archive is going to be read, according to the access mode
+ *
+ * @param archive The archive
+ */
+void advise_mode(tar_archive_t *archive)
+{
+    if (archive->fd < 0) // Read through read_at, without a file to give the hints on
+    {
+        return;
+    }
+    switch (archive->access)
+    {
+    case TAR_ACCESS_SEQUENTIAL:
+    case TAR_ACCESS_ONESHOT:
+        posix_fadvise(archive->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        break;
+    case TAR_ACCESS_RANDOM:
+        posix_fadvise(archive->fd, 0, 0, POSIX_FADV_RANDOM);
+        break;
+    default:
+        posix_fadvise(archive->fd, 0, 0, POSIX_FADV_NORMAL);
+        break;
+    }
+}
+
+/**
+ * @brief Gives the hints before a scan of the archive from its start
+ *
+ * @param archive The archive
+ */
+void advise_scan_begin(tar_archive_t *archive)
+{
+    advise_mode(archive);
+    if (archive->fd >= 0 && (archive->access == TAR_ACCESS_SEQUENTIAL || archive->access == TAR_ACCESS_ONESHOT))
+    {
+        readahead(archive->fd, 0, TAR_READAHEAD); // Start reading before the first header is needed
+    }
+}
+
+/**
+ * @brief Gives the hints after a scan of the archive, dropping its pages in one-shot mode
+ *
+ * @param archive The archive
+ */
+void advise_scan_end(tar_archive_t *archive)
+{
+    if (archive->fd >= 0 && archive->access == TAR_ACCESS_ONESHOT)
+    {
+        posix_fadvise(archive->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+/**
+ * @brief Gives the hints before reading a range of the archive
+ *
+ * @param archive The archive
+ * @param offset The start of the range
+ * @param len The length of the range
+ */
+void advise_read_begin(tar_archive_t *archive, off_t offset, size_t len)
+{
+    if (archive->fd < 0)
+    {
+        return;
+    }
+    if (archive->access == TAR_ACCESS_SEQUENTIAL || archive->access == TAR_ACCESS_ONESHOT)
+    {
+        readahead(archive->fd, offset, len);
+    }
+    else if (archive->access == TAR_ACCESS_RANDOM && len > TAR_READAHEAD)
+    {
+        // Large point reads still benefit from I/O in advance
+        posix_fadvise(archive->fd, offset, len, POSIX_FADV_WILLNEED);
+    }
+}
+
+/**
+ * @brief Gives the hints after reading a range of the archive, dropping its pages in one-shot mode
+ *
+ * @param archive The archive
+ * @param offset The start of the range
+ * @param len The length of the range
+ */
+void advise_read_end(tar_archive_t *archive, off_t offset, size_t len)
+{
+    if (archive->fd >= 0 && archive->access == TAR_ACCESS_ONESHOT)
+    {
+        posix_fadvise(archive->fd, offset, len, POSIX_FADV_DONTNEED);
+    }
+}
+
+/**
+ * @brief Opens a handle by indexing an archive read from a file or through a function
+ *
+ * @param tar_fd The file of the archive, -1 if it is read through read_at
+ * @param flags The flags of tar_open(), TAR_OPEN_DIRECT being ignored with read_at
+ * @param read_at Reads len bytes of the archive at an offset, fewer only at its end, returning the number of bytes
+ *                read or -1 on error (errno is set); NULL to read the file
+ * @param read_ctx The context of read_at, owned by the handle even if it cannot be opened
+ * @param read_free Frees read_ctx when the handle is closed, or NULL
+ * @param mph_fd A file holding the minimal perfect hash of TAR_OPEN_MPH saved by tar_mph_save(), or -1
+ * @return tar_archive_t* The handle, NULL on error (errno is set)
+ */
+tar_archive_t *archive_open(int tar_fd, int flags, ssize_t (*read_at)(void *ctx, void *buf, size_t len, off_t offset),
+                            void *read_ctx, void (*read_free)(void *ctx), int mph_fd)
+{
+    tar_archive_t *archive = calloc(1, sizeof(tar_archive_t));
+    if (archive == NULL)
+    {
+        if (read_free != NULL)
+        {
+            read_free(read_ctx);
+        }
+        errno = ENOMEM;
+        return NULL;
+    }
+    archive->fd = tar_fd;
+    archive->read_at = read_at;
+    archive->read_ctx = read_ctx;
+    archive->read_free = read_free;
+    archive->access = flags & TAR_ACCESS_MASK;
+    archive->direct_fd = -1;
+    archive->read_gap = TAR_READ_GAP;
+    archive->hashed = (flags & TAR_OPEN_HASH) != 0;
+    archive->flags = flags;
+    pthread_mutex_init(&archive->nested_lock, NULL);
+    pthread_mutex_init(&archive->bounce_lock, NULL);
+    if (flags & TAR_OPEN_METRICS)
+    {
+        archive->metrics = calloc(TAR_OPS, sizeof(tar_histogram_t));
+        if (archive->metrics == NULL)
+        {
+            tar_close(archive);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    if ((flags & TAR_OPEN_DIRECT) && read_at == NULL)
+    {
+        // Open a second file description, so that O_DIRECT does not change the reads of the caller on tar_fd
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", tar_fd);
+        archive->direct_fd = open(proc_path, O_RDONLY | O_DIRECT);
+    }
+
+    // The root is the first entry, it is not stored in the hash table. Its name is the empty string starting the pool
+    if (index_reserve(archive, (void **)&archive->entries, &archive->cap_entries, 1, sizeof(tar_entry_t)) < 0 ||
+        index_grow(archive) < 0 || index_reserve(archive, (void **)&archive->pool, &archive->pool_cap, 1, 1) < 0)
+    {
+        tar_close(archive);
+        errno = ENOMEM;
+        return NULL;
+    }
+    archive->no_entries = 1;
+    memset(&archive->entries[TAR_ROOT], 0, sizeof(tar_entry_t));
+    archive->entries[TAR_ROOT].name = TAR_NO_NAME;
+    archive->entries[TAR_ROOT].linkname = TAR_NO_NAME;
+    archive->entries[TAR_ROOT].typeflag = DIRTYPE;
+    archive->entries[TAR_ROOT].header_offset = -1;
+    archive->pool[0] = '\0';
+    archive->pool_len = 1;
+
+    advise_scan_begin(archive);
+    int ret = index_build(archive);
+    advise_scan_end(archive);
+    if (ret == 0 && (flags & TAR_OPEN_MPH))
+    {
+        index_build_mph(archive, mph_fd);
+    }
+    if (ret == 0 && (flags & TAR_OPEN_BLOOM))
+    {
+        archive->bloom = index_build_bloom(archive);
+        if (archive->bloom == NULL)
+        {
+            errno = ENOMEM;
+            ret = -1;
+        }
+        else
+        {
+            archive->no_allocs++;
+            archive->index_bytes += bloom_size(archive->bloom->no_blocks);
+        }
+    }
+    if (ret < 0)
+    {
+        int err = errno;
+        tar_close(archive);
+        errno = err;
+        return NULL;
+    }
+
+    return archive;
+}
+
+/**
+ * Opens an archive handle by indexing the archive.
+ *
+ * The paths given to the functions taking the handle may go through archives stored as files of the archive, as in
+ * "layers/3.tar!/etc/passwd", see tar_nested().
+ *
+ * The path, link target, size, modification time, owner and group given by a pax extended header or a GNU long
+ * name member replace the fields of the header of their entry. An entry whose path or link target is PATH_MAX bytes
+ * or more is left out of the index rather than indexed under the cut name of its header, see tar_index_stats().
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file. The handle reads it with pread() and does
+ *               not take ownership of it, the caller must keep it open until tar_close().
+ * @param flags One of the TAR_ACCESS_* modes, see tar_set_access(), optionally combined with TAR_OPEN_* flags.
+ *
+ * @return a new handle, or NULL if the archive could not be read or indexed (errno is set).
+ */
+tar_archive_t *tar_open(int tar_fd, int flags)
+{
+    return archive_open(tar_fd, flags, NULL, NULL, NULL, -1);
+}
+
+/**
+ * Opens an archive handle like tar_open() with TAR_OPEN_MPH, loading the minimal perfect hash of the paths saved by
+ * tar_mph_save() instead of building it.
+ *
+ * The saved function is only a cache of its build: the archive is still scanned and indexed with the hash table of
+ * tar_open(), which the function replaces once checked against the index, so the open costs the same time and peak
+ * memory as with TAR_OPEN_MPH, less the build of the function. A function that does not map every path to its entry,
+ * as once the archive changed, or that cannot be read is ignored and a new one built.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file, see tar_open().
+ * @param flags The flags of tar_open(), TAR_OPEN_MPH being implied.
+ * @param mph_fd A file descriptor open for reading, at the position where the function was written, or -1 to build
+ *               the function.
+ *
+ * @return a new handle, or NULL if the archive could not be read or indexed (errno is set).
+ */
+tar_archive_t *tar_open_mph(int tar_fd, int flags, int mph_fd)
+{
+    return archive_open(tar_fd, flags | TAR_OPEN_MPH, NULL, NULL, NULL, mph_fd);
+}
+
+int writev_all(int fd, struct iovec *iov, int count);
+
+/**
+ * Saves the minimal perfect hash of the paths of a handle, to be loaded by tar_open_mph() instead of building it.
+ *
+ * @param archive A handle returned by tar_open() or tar_open_mph() with TAR_OPEN_MPH.
+ * @param fd A file descriptor open for writing, at the position where the function is written.
+ *
+ * @return zero on success, -1 on error (errno is set, EINVAL if the handle has no minimal perfect hash).
+ */
+int tar_mph_save(tar_archive_t *archive, int fd)
+{
+    if (archive->mph == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t header[3 + TAR_MPH_LEVELS];
+    struct iovec iov[3] = {{TAR_MPH_MAGIC, sizeof(TAR_MPH_MAGIC)}};
+    mph_iov(archive->mph, header, iov + 1);
+    return writev_all(fd, iov, 3);
+}
+
+void nested_drop(tar_archive_t *archive, size_t index);
+
+/**
+ * Releases an archive handle and its index. The file descriptor is left open.
+ *
+ * @param archive A handle returned by tar_open(), or NULL.
+ */
+void tar_close(tar_archive_t *archive)
+{
+    if (archive == NULL)
+    {
+        return;
+    }
+
+    free(archive->entries);
+    free(archive->pool);
+    free(archive->children);
+    free(archive->slots);
+    free(archive->mph);
+    free(archive->bloom);
+    free(archive->metrics);
+    free(archive->sparse);
+    free(archive->regions);
+    free(archive->rollups);
+    nested_drop(archive, TAR_NO_ENTRY);
+    pthread_mutex_destroy(&archive->nested_lock);
+    pthread_mutex_destroy(&archive->bounce_lock);
+    free(archive->bounce);
+    if (archive->direct_fd >= 0)
+    {
+        close(archive->direct_fd);
+    }
+    if (archive->read_free != NULL)
+    {
+        archive->read_free(archive->read_ctx);
+    }
+    free(archive);
+}
+
+/**
+ * Gets the memory usage of the index of a handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param stats Receives the statistics.
+ */
+void tar_index_stats(tar_archive_t *archive, tar_index_stats_t *stats)
+{
+    stats->no_entries = archive->no_entries - 1; // Without the root
+    stats->no_allocs = archive->no_allocs;
+    stats->index_bytes = archive->index_bytes;
+    stats->pool_bytes = archive->pool_len;
+    stats->no_skipped = archive->no_skipped;
+}
+
+/**
+ * @brief Computes the path targeted by a symlink
+ *
+ * A link target is relative to the directory containing the link, or to the root of the archive if it starts
+ * with a '/'.
+ *
+ * @param archive The archive
+ * @param index The index of the symlink
+ * @param target A buffer of 2 * TAR_PATH_MAX bytes receiving the path
+ */
+void link_target(tar_archive_t *archive, size_t index, char *target)
+{
+    const char *name = entry_name(archive, index);
+    const char *linkname = archive->pool + archive->entries[index].linkname;
+    if (linkname[0] == '/')
+    {
+        snprintf(target, 2 * TAR_PATH_MAX, "%s", linkname + 1);
+    }
+    else
+    {
+        size_t len = parent_len(name);
+        snprintf(target, 2 * TAR_PATH_MAX, "%.*s%s", (int)len, name, linkname);
+    }
+}
+
+/**
+ * @brief Follows the symlinks starting at a given entry
+ *
+ * @param archive The archive
+ * @param index The index of the entry
+ * @return size_t The index of the first entry that is not a symlink, TAR_NO_ENTRY if a link is dangling or if
+ *         there are too many levels of links
+ */
+size_t index_resolve(tar_archive_t *archive, size_t index)
+{
+    for (int hops = 0; index != TAR_NO_ENTRY && archive->entries[index].typeflag == SYMTYPE; hops++)
+    {
+        if (hops == TAR_MAX_HOPS)
+        {
+            return TAR_NO_ENTRY;
+        }
+
+        char target[2 * TAR_PATH_MAX];
+        link_target(archive, index, target);
+        TAR_PROBE3(symlink, entry_name(archive, index), target, hops);
+        index = index_lookup(archive, target);
+    }
+    return index;
+}
+
+/*
+ * Nested archives
+ *
+ * A file of an archive holding an archive is opened as a handle of its own, reading through a view of the file in the
+ * outer archive, so that reading it costs the reads of the outer archive and nothing more. The handles are opened with
+ * the flags of the outer one on first use and kept until it is closed. Paths go through them with "!/", as in
+ * "layers/3.tar!/etc/passwd".
+ */
+
+typedef struct tar_nested
+{
+    size_t index;           // Entry of the file holding the archive
+    tar_archive_t *archive; // Handle on the archive, NULL if the file does not hold one
+} tar_nested_t;
+
+typedef struct tar_view
+{
+    tar_archive_t *outer; // Archive holding the file
+    size_t index;         // Entry of the file
+} tar_view_t;
+
+ssize_t entry_pread(tar_archive_t *archive, size_t index, void *buf, size_t len, uint64_t pos);
+
+/**
+ * @brief Reads a nested archive from the file holding it, see archive_open()
+ */
+ssize_t view_read(void *ctx, void *buf, size_t len, off_t offset)
+{
+    tar_view_t *view = ctx;
+    uint64_t size = view->outer->entries[view->index].size;
+    if ((uint64_t)offset >= size)
+    {
+        return 0;
+    }
+    return entry_pread(view->outer, view->index, buf, size - offset < len ? size - offset : len, offset);
+}
+
+/**
+ * @brief Closes the handles of nested archives
+ *
+ * @param archive The outer archive
+ * @param index The entry of the file holding the nested archive to close, TAR_NO_ENTRY to close all of them
+ */
+void nested_drop(tar_archive_t *archive, size_t index)
+{
+    pthread_mutex_lock(&archive->nested_lock);
+    size_t kept = 0;
+    for (size_t i = 0; i < archive->no_nested; i++)
+    {
+        if (index == TAR_NO_ENTRY || archive->nested[i].index == index)
+        {
+            tar_close(archive->nested[i].archive);
+        }
+        else
+        {
+            archive->nested[kept++] = archive->nested[i];
+        }
+    }
+    archive->no_nested = kept;
+    if (kept == 0)
+    {
+        free(archive->nested);
+        archive->nested = NULL;
+    }
+    pthread_mutex_unlock(&archive->nested_lock);
+}
+
+/**
+ * @brief Gets the handle of the archive held by a file, opening it on first use
+ *
+ * A file found not to hold an archive is remembered as such, while an open failing for want of memory or on a read
+ * error is tried again on the next use.
+ *
+ * @param archive The outer archive
+ * @param index The entry of the file
+ * @return tar_archive_t* The handle, NULL if the file does not hold an archive (errno is set)
+ */
+tar_archive_t *nested_get(tar_archive_t *archive, size_t index)
+{
+    pthread_mutex_lock(&archive->nested_lock);
+    for (size_t i = 0; i < archive->no_nested; i++)
+    {
+        if (archive->nested[i].index == index)
+        {
+            tar_archive_t *nested = archive->nested[i].archive;
+            pthread_mutex_unlock(&archive->nested_lock);
+            errno = nested == NULL ? EINVAL : errno;
+            return nested;
+        }
+    }
+
+    // Opened under the lock, so that concurrent first uses index the archive once
+    tar_view_t *view = malloc(sizeof(tar_view_t));
+    if (view == NULL)
+    {
+        pthread_mutex_unlock(&archive->nested_lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+    view->outer = archive;
+    view->index = index;
+    tar_archive_t *nested = archive_open(-1, archive->flags, view_read, view, free, -1); // Frees the view on error
+    int err = errno;
+
+    // An invalid header is the only failure the next use would get again
+    if (nested != NULL || err == EINVAL)
+    {
+        tar_nested_t *grown = realloc(archive->nested, (archive->no_nested + 1) * sizeof(tar_nested_t));
+        if (grown == NULL)
+        {
+            tar_close(nested);
+            nested = NULL;
+            err = ENOMEM;
+        }
+        else
+        {
+            archive->nested = grown;
+            archive->nested[archive->no_nested++] = (tar_nested_t){.index = index, .archive = nested};
+        }
+    }
+    pthread_mutex_unlock(&archive->nested_lock);
+    errno = err;
+    return nested;
+}
+
+/**
+ * @brief Finds the archive holding a path that goes through nested archives
+ *
+ * A "!/" only separates a nested archive when the path before it is a file holding an archive and the rest of the path
+ * is found in it, so that other paths containing it, as "a!/b" next to a plain file "a", are still found.
+ *
+ * @param archive The archive
+ * @param path An in-out argument, the path, then the path in the archive returned
+ * @return tar_archive_t* The innermost archive, the archive itself for a path not going through a nested one, NULL
+ *         if the memory to open a nested archive could not be allocated (errno is set)
+ */
+tar_archive_t *archive_route(tar_archive_t *archive, char **path)
+{
+    for (char *bang = strstr(*path, "!/"); bang != NULL; bang = strstr(bang + 1, "!/"))
+    {
+        char member[TAR_PATH_MAX];
+        size_t len = bang - *path;
+        if (len >= TAR_PATH_MAX)
+        {
+            break;
+        }
+        memcpy(member, *path, len);
+        member[len] = '\0';
+        size_t index = index_resolve(archive, index_lookup(archive, member));
+        if (index == TAR_NO_ENTRY || index == TAR_ROOT || !type_is_file(archive->entries[index].typeflag))
+        {
+            continue;
+        }
+
+        // Depth-first, the path being shorter at each level
+        char *rest = bang + 2;
+        tar_archive_t *nested = nested_get(archive, index);
+        nested = nested == NULL ? NULL : archive_route(nested, &rest);
+        if (nested == NULL && errno == ENOMEM)
+        {
+            return NULL;
+        }
+        if (nested != NULL && index_lookup(nested, rest) != TAR_NO_ENTRY)
+        {
+            *path = rest;
+            return nested;
+        }
+    }
+    return archive; // Or the path is looked up as it is
+}
+
+/**
+ * Gets the handle of an archive stored as a file of the archive of a handle.
+ *
+ * The nested handle is opened with the flags of the outer one on first use, and kept by it: it must not be closed,
+ * and stays valid until the outer handle is closed, or changed by tar_delete() or by tar_update() of the file. Its
+ * reads are reads of the file in the outer archive, without copying it.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to a file of the archive holding an archive, which may itself be in nested archives, as in
+ *             "bundle.tar!/layers/3.tar". If the entry is a symlink, it is resolved to its linked-to entry.
+ *
+ * @return the nested handle, or NULL if no file at the given path exists or it does not hold an archive (errno is
+ *         set).
+ */
+tar_archive_t *tar_nested(tar_archive_t *archive, char *path)
+{
+    archive = archive_route(archive, &path);
+    size_t index = archive == NULL ? TAR_NO_ENTRY : index_resolve(archive, index_lookup(archive, path));
+    if (index == TAR_NO_ENTRY || index == TAR_ROOT || !type_is_file(archive->entries[index].typeflag))
+    {
+        errno = archive == NULL ? errno : ENOENT;
+        return NULL;
+    }
+    return nested_get(archive, index);
+}
+
+/**
+ * @brief The body of tar_exists(), without the latency metrics
+ */
+int tar_exists_impl(tar_archive_t *archive, char *path)
+{
+    archive = archive_route(archive, &path);
+    if (archive == NULL)
+    {
+        return 0;
+    }
+    size_t index = index_lookup(archive, path);
+    return index != TAR_NO_ENTRY && index != TAR_ROOT;
+}
+
+/**
+ * Checks whether an entry exists in the archive of a handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_exists(tar_archive_t *archive, char *path)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    int ret = tar_exists_impl(archive, path);
+    metrics_end(archive->metrics, TAR_OP_EXISTS, start);
+    return ret;
+}
+
+/**
+ * @brief The body of tar_is_dir(), without the latency metrics
+ */
+int tar_is_dir_impl(tar_archive_t *archive, char *path)
+{
+    archive = archive_route(archive, &path);
+    if (archive == NULL)
+    {
+        return 0;
+    }
+    size_t index = index_lookup(archive, path);
+    return index != TAR_NO_ENTRY && index != TAR_ROOT && archive->entries[index].typeflag == DIRTYPE;
+}
+
+/**
+ * Checks whether an entry exists in the archive of a handle and is a directory.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int tar_is_dir(tar_archive_t *archive, char *path)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    int ret = tar_is_dir_impl(archive, path);
+    metrics_end(archive->metrics, TAR_OP_IS_DIR, start);
+    return ret;
+}
+
+/**
+ * @brief The body of tar_is_file(), without the latency metrics
+ */
+int tar_is_file_impl(tar_archive_t *archive, char *path)
+{
+    archive = archive_route(archive, &path);
+    if (archive == NULL)
+    {
+        return 0;
+    }
+    size_t index = index_lookup(archive, path);
+    return index != TAR_NO_ENTRY && index != TAR_ROOT && type_is_file(archive->entries[index].typeflag);
+}
+
+/**
+ * Checks whether an entry exists in the archive of a handle and is a file.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int tar_is_file(tar_archive_t *archive, char *path)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    int ret = tar_is_file_impl(archive, path);
+    metrics_end(archive->metrics, TAR_OP_IS_FILE, start);
+    return ret;
+}
+
+/**
+ * @brief The body of tar_is_symlink(), without the latency metrics
+ */
+int tar_is_symlink_impl(tar_archive_t *archive, char *path)
+{
+    archive = archive_route(archive, &path);
+    if (archive == NULL)
+    {
+        return 0;
+    }
+    size_t index = index_lookup(archive, path);
+    return index != TAR_NO_ENTRY && index != TAR_ROOT && archive->entries[index].typeflag == SYMTYPE;
+}
+
+/**
+ * Checks whether an entry exists in the archive of a handle and is a symlink.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int tar_is_symlink(tar_archive_t *archive, char *path)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    int ret = tar_is_symlink_impl(archive, path);
+    metrics_end(archive->metrics, TAR_OP_IS_SYMLINK, start);
+    return ret;
+}
+
+void entry_stat(tar_archive_t *archive, size_t index, tar_stat_t *st);
+off_t entry_offset(tar_archive_t *archive, size_t index, uint64_t pos);
+
+/**
+ * @brief The body of tar_stat() and tar_lstat(), without the latency metrics
+ *
+ * @param archive The archive
+ * @param path The path of the entry
+ * @param st Receives the metadata
+ * @param follow Whether a symlink is resolved to its linked-to entry
+ * @return int 0 on success, -1 if there is no such entry
+ */
+int tar_stat_impl(tar_archive_t *archive, char *path, tar_stat_t *st, int follow)
+{
+    archive = archive_route(archive, &path);
+    if (archive == NULL)
+    {
+        return -1;
+    }
+    size_t index = index_lookup(archive, path);
+    if (follow)
+    {
+        index = index_resolve(archive, index);
+    }
+    if (index == TAR_NO_ENTRY || index == TAR_ROOT)
+    {
+        return -1;
+    }
+    entry_stat(archive, index, st);
+
+    // Offsets in the archive of the handle, through the files holding the nested archives
+    while (archive->read_at == view_read)
+    {
+        tar_view_t *view = archive->read_ctx;
+        st->header_offset = st->header_offset < 0 ? -1 : entry_offset(view->outer, view->index, st->header_offset);
+        st->payload_offset = st->payload_offset < 0 ? -1 : entry_offset(view->outer, view->index, st->payload_offset);
+        archive = view->outer;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decodes the metadata of an entry of the index
+ *
+ * @param archive The archive
+ * @param index The entry, not the root
+ * @param st Receives the metadata
+ */
+void entry_stat(tar_archive_t *archive, size_t index, tar_stat_t *st)
+{
+    tar_entry_t *entry = &archive->entries[index];
+    st->type = entry->typeflag == AREGTYPE ? REGTYPE : entry->typeflag;
+    st->size = entry->size;
+    st->mode = entry->mode;
+    st->uid = entry->uid;
+    st->gid = entry->gid;
+    st->mtime = entry->mtime;
+    st->linkname = entry->linkname != TAR_NO_NAME ? archive->pool + entry->linkname : NULL;
+    st->header_offset = entry->header_offset;
+    st->payload_offset = entry->header_offset < 0 ? -1 : entry->header_offset + 512;
+    if (entry->sparse != TAR_NO_SPARSE)
+    {
+        st->payload_offset = archive->sparse[entry->sparse - 1].data_offset;
+    }
+    st->hash = archive->hashed ? entry->hash : 0;
+}
+
+/**
+ * Gets the metadata of an entry of the archive of a handle, with a single lookup in its index.
+ *
+ * The offsets are in the archive of the handle, for an entry of a nested archive too, and -1 when they fall in a hole
+ * of a sparse file holding a nested archive.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param st Receives the metadata of the entry.
+ *
+ * @return zero on success, -1 if no entry at the given path exists in the archive or a symlink is dangling.
+ */
+int tar_stat(tar_archive_t *archive, char *path, tar_stat_t *st)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    int ret = tar_stat_impl(archive, path, st, 1);
+    metrics_end(archive->metrics, TAR_OP_STAT, start);
+    return ret;
+}
+
+/**
+ * Gets the metadata of an entry of the archive of a handle like tar_stat(), a symlink being the entry itself.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ * @param st Receives the metadata of the entry.
+ *
+ * @return zero on success, -1 if no entry at the given path exists in the archive.
+ */
+int tar_lstat(tar_archive_t *archive, char *path, tar_stat_t *st)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    int ret = tar_stat_impl(archive, path, st, 0);
+    metrics_end(archive->metrics, TAR_OP_STAT, start);
+    return ret;
+}
+
+/**
+ * @brief The body of list_page(), without the latency metrics
+ */
+ssize_t list_page_impl(tar_archive_t *archive, char *path, tar_cursor_t *cursor, char **entries, size_t *no_entries)
+{
+    archive = archive_route(archive, &path); // On every call, the cursor being in the nested archive
+    if (archive == NULL)
+    {
+        *no_entries = 0;
+        return -1;
+    }
+    if (cursor->dir == 0) // First page, find the directory
+    {
+        size_t index = index_resolve(archive, index_lookup(archive, path));
+        if (index == TAR_NO_ENTRY || archive->entries[index].typeflag != DIRTYPE)
+        {
+            *no_entries = 0;
+            return -1;
+        }
+        cursor->dir = index + 1;
+        cursor->next = 0;
+        cursor->generation = archive->generation;
+    }
+    if (cursor->generation != archive->generation) // The entries were renumbered or changed since the first page
+    {
+        *no_entries = 0;
+        errno = ESTALE;
+        return -1;
+    }
+    if (cursor->dir > archive->no_entries || archive->entries[cursor->dir - 1].typeflag != DIRTYPE)
+    {
+        *no_entries = 0;
+        return -1;
+    }
+
+    tar_entry_t *dir = &archive->entries[cursor->dir - 1];
+    cursor->next = cursor->next < dir->no_children ? cursor->next : dir->no_children;
+    size_t count = 0;
+    while (count < *no_entries && cursor->next < dir->no_children)
+    {
+        const char *name = entry_name(archive, archive->children[dir->first_child + cursor->next]);
+        memcpy(entries[count], name, strlen(name) + 1);
+        count++;
+        cursor->next++;
+    }
+
+    *no_entries = count;
+    return dir->no_children - cursor->next;
+}
+
+/**
+ * Lists one page of the entries at a given path in the archive.
+ * Like list(), list_page() does not recurse into the directories listed at the given path.
+ *
+ * Entries are returned in archive order, which is stable across calls. Each page costs O(page size) as the children
+ * of every directory are kept in the index of the handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to a directory in the archive, "" for the root. If the entry is a symlink, it is resolved to its
+ *             linked-to entry. The path is only looked up on the first call with a given cursor.
+ * @param cursor An in-out argument, initialised with TAR_CURSOR_INIT to start listing from the first entry.
+ *               The callee advances it past the entries listed.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`, i.e. the page size.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return -1 if no directory at the given path exists in the archive, or if the handle was changed since the first
+ *         page (errno is set to ESTALE),
+ *         zero if the listing is complete,
+ *         a positive value otherwise, representing the number of entries left to be listed.
+ */
+ssize_t list_page(tar_archive_t *archive, char *path, tar_cursor_t *cursor, char **entries, size_t *no_entries)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    ssize_t ret = list_page_impl(archive, path, cursor, entries, no_entries);
+    metrics_end(archive->metrics, TAR_OP_LIST, start);
+    return ret;
+}
+
+/**
+ * Sets the access mode of a handle.
+ *
+ * The mode selects the posix_fadvise() and readahead() hints given around the scans and the reads of the handle:
+ *  - TAR_ACCESS_SEQUENTIAL asks for sequential readahead,
+ *  - TAR_ACCESS_RANDOM disables readahead for point reads,
+ *  - TAR_ACCESS_ONESHOT reads sequentially and drops the pages of the archive from the page cache once read, so that
+ *    a single pass does not evict the hot pages of other files.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param mode One of the TAR_ACCESS_* modes.
+ *
+ * @return zero on success, -1 if the mode is invalid.
+ */
+int tar_set_access(tar_archive_t *archive, int mode)
+{
+    if (mode < 0 || mode > TAR_ACCESS_MASK)
+    {
+        return -1;
+    }
+    archive->access = mode;
+    advise_mode(archive);
+    return 0;
+}
+
+/**
+ * @brief Checks whether the archive is valid like check_archive(), scanning it through a window with pread()
+ *
+ * @param archive The archive
+ * @return int the same values as check_archive(), -1 if it could not be read or ends before its end blocks (errno
+ *         is EIO then)
+ */
+int window_check_archive(tar_archive_t *archive)
+{
+    tar_window_t window;
+    if (window_init(&window, archive) < 0)
+    {
+        return -1;
+    }
+
+    int count = 0;
+    off_t offset = 0;
+    const char *buf;
+    int ret;
+    while ((ret = window_header(&window, offset, &buf)) > 0 && !block_empty(buf))
+    {
+        ret = check_header(buf, 1);
+        if (ret < 0)
+        {
+            if (ret == -3)
+            {
+                TAR_PROBE2(checksum_fail, (long long)offset, ((const tar_header_t *)buf)->name);
+            }
+            window_free(&window);
+            return ret;
+        }
+
+        count++;
+        off_t next = offset + 512 + next_header((tar_header_t *)buf);
+        int extended = ((tar_header_t *)buf)->typeflag == GNUTYPE_SPARSE && buf[482];
+        while (extended && (ret = window_header(&window, offset + 512, &buf)) > 0) // Extension blocks of a sparse map
+        {
+            extended = buf[504];
+            offset += 512;
+            next += 512;
+        }
+        if (ret < 0)
+        {
+            break;
+        }
+        offset = next;
+    }
+
+    window_free(&window);
+    if (ret == 0) // Truncated before the end blocks, an I/O error rather than an invalid header
+    {
+        errno = EIO;
+        return -1;
+    }
+    return ret < 0 ? -1 : count; // A read error is not the end of the archive
+}
+
+/**
+ * @brief The body of tar_check_archive(), without the latency metrics
+ */
+int tar_check_archive_impl(tar_archive_t *archive)
+{
+    advise_scan_begin(archive);
+    int ret = window_check_archive(archive);
+    advise_scan_end(archive);
+    return ret;
+}
+
+/**
+ * Checks whether the archive of a handle is valid, like check_archive(), using the access mode of the handle.
+ * The archive is read with pread(), leaving the offset of the file descriptor of the handle as it is.  The headers
+ * are checked as tar_open() reads them, also accepting the "ustar  " magic and version of GNU tar and a checksum
+ * summing the bytes as unsigned.
+ *
+ * @param archive A handle returned by tar_open().
+ *
+ * @return the same values as check_archive(), -1 also if the archive could not be read or is truncated before its
+ *         end blocks (errno is set then, EIO for a truncated archive).
+ */
+int tar_check_archive(tar_archive_t *archive)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    int ret = tar_check_archive_impl(archive);
+    metrics_end(archive->metrics, TAR_OP_CHECK, start);
+    return ret;
+}
+
+/**
+ * @brief Finds the first data region of a sparse file ending after an offset
+ *
+ * @param regions The regions of the file, sorted by offset
+ * @param no_regions The number of regions
+ * @param pos The offset in the file
+ * @return size_t The position of the region, no_regions if there is none
+ */
+size_t sparse_region_find(const tar_sparse_region_t *regions, size_t no_regions, uint64_t pos)
+{
+    size_t low = 0;
+    size_t high = no_regions;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (regions[mid].offset + regions[mid].len <= pos)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Gets the offset in the archive of a byte of the content of a file
+ *
+ * @param archive The archive
+ * @param index The index of the file
+ * @param pos The offset of the byte in the file
+ * @return off_t The offset of the byte in the archive, -1 if it is in a hole of a sparse file
+ */
+off_t entry_offset(tar_archive_t *archive, size_t index, uint64_t pos)
+{
+    tar_entry_t *entry = &archive->entries[index];
+    if (entry->sparse == TAR_NO_SPARSE)
+    {
+        return entry->header_offset + 512 + pos;
+    }
+
+    tar_sparse_t *sparse = &archive->sparse[entry->sparse - 1];
+    tar_sparse_region_t *regions = archive->regions + sparse->first;
+    size_t r = sparse_region_find(regions, sparse->no_regions, pos);
+    if (r == sparse->no_regions || regions[r].offset > pos)
+    {
+        return -1;
+    }
+    return sparse->data_offset + regions[r].stored + (pos - regions[r].offset);
+}
+
+/**
+ * @brief Gets the bytes of the archive holding a range of the content of a file, the data regions of a sparse file
+ *        being stored one after the other
+ *
+ * @param archive The archive
+ * @param index The index of the file
+ * @param pos The offset of the range in the file
+ * @param len The length of the range, within the file
+ * @param len_stored Receives the number of bytes of the archive, zero if the range is a hole of a sparse file
+ * @return off_t The offset of the bytes in the archive
+ */
+off_t entry_stored(tar_archive_t *archive, size_t index, uint64_t pos, size_t len, size_t *len_stored)
+{
+    tar_entry_t *entry = &archive->entries[index];
+    if (entry->sparse == TAR_NO_SPARSE)
+    {
+        *len_stored = len;
+        return entry->header_offset + 512 + pos;
+    }
+
+    tar_sparse_t *sparse = &archive->sparse[entry->sparse - 1];
+    tar_sparse_region_t *regions = archive->regions + sparse->first;
+    size_t first = sparse_region_find(regions, sparse->no_regions, pos);
+    size_t last = len > 0 ? sparse_region_find(regions, sparse->no_regions, pos + len - 1) : first;
+    if (last == sparse->no_regions || regions[last].offset >= pos + len) // Ending in a hole
+    {
+        last--;
+    }
+    if (first == sparse->no_regions || regions[first].offset >= pos + len)
+    {
+        *len_stored = 0;
+        return sparse->data_offset;
+    }
+
+    uint64_t start = regions[first].stored + (pos > regions[first].offset ? pos - regions[first].offset : 0);
+    uint64_t end = regions[last].stored + (pos + len < regions[last].offset + regions[last].len
+                                               ? pos + len - regions[last].offset
+                                               : regions[last].len);
+    *len_stored = end - start;
+    return sparse->data_offset + start;
+}
+
+/**
+ * @brief Reads bytes of the content of a file, synthesizing the holes of a sparse file without any I/O
+ *
+ * @param archive The archive
+ * @param index The index of the file
+ * @param buf The destination buffer
+ * @param len The number of bytes to read
+ * @param pos The offset in the file of the first byte, len bytes from it must be in the file
+ * @return ssize_t The number of bytes read, less than len if the archive is truncated, -1 on error
+ */
+ssize_t entry_pread(tar_archive_t *archive, size_t index, void *buf, size_t len, uint64_t pos)
+{
+    tar_entry_t *entry = &archive->entries[index];
+    if (entry->sparse == TAR_NO_SPARSE)
+    {
+        return archive_pread(archive, buf, len, entry->header_offset + 512 + pos);
+    }
+
+    tar_sparse_t *sparse = &archive->sparse[entry->sparse - 1];
+    tar_sparse_region_t *regions = archive->regions + sparse->first;
+    memset(buf, 0, len);
+
+    // Copy the data of every region overlapping the range
+    size_t first = sparse_region_find(regions, sparse->no_regions, pos);
+    for (size_t r = first; r < sparse->no_regions && regions[r].offset < pos + len; r++)
+    {
+        uint64_t start = regions[r].offset > pos ? regions[r].offset : pos;
+        uint64_t end = regions[r].offset + regions[r].len < pos + len ? regions[r].offset + regions[r].len : pos + len;
+        ssize_t ret = archive_pread(archive, (uint8_t *)buf + (start - pos), end - start,
+                                    sparse->data_offset + regions[r].stored + (start - regions[r].offset));
+        if (ret < 0)
+        {
+            return -1;
+        }
+        if ((uint64_t)ret < end - start)
+        {
+            return start - pos + ret;
+        }
+    }
+    return len;
+}
+
+/**
+ * @brief Reads the payload of an entry of the index, see tar_read_file()
+ *
+ * @param archive The archive
+ * @param index The index of the entry, symlinks already resolved
+ * @param offset An offset in the file from which to start reading from
+ * @param dest A destination buffer to read the given file into
+ * @param len An in-out argument, the size of dest then the number of bytes written to dest
+ * @return ssize_t the same values as tar_read_file()
+ */
+ssize_t entry_read(tar_archive_t *archive, size_t index, size_t offset, uint8_t *dest, size_t *len)
+{
+    tar_entry_t *entry = &archive->entries[index];
+    if (!type_is_file(entry->typeflag)) // If the entry is not a file, we need to return -1
+    {
+        return -1;
+    }
+    if (offset > entry->size) // If the offset is outside the file total length, we need to return -2
+    {
+        return -2;
+    }
+
+    if (entry->size - offset < *len)
+    {
+        *len = entry->size - offset;
+    }
+
+    size_t len_stored;
+    off_t start = entry_stored(archive, index, offset, *len, &len_stored); // Holes are not read
+    TAR_PROBE3(payload_read, (long long)start, len_stored, entry_name(archive, index));
+    advise_read_begin(archive, start, len_stored);
+    ssize_t ret = entry_pread(archive, index, dest, *len, offset);
+    TAR_PROBE2(payload_read_done, (long long)start, (long long)ret);
+    advise_read_end(archive, start, len_stored);
+    if (ret < 0 || (size_t)ret < *len)
+    {
+        *len = ret < 0 ? 0 : ret;
+        return -3;
+    }
+
+    return (entry->size - offset) - *len;
+}
+
+/**
+ * @brief The body of tar_read_file(), without the latency metrics
+ */
+ssize_t tar_read_file_impl(tar_archive_t *archive, char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    archive = archive_route(archive, &path);
+    if (archive == NULL)
+    {
+        return -1;
+    }
+    size_t index = index_resolve(archive, index_lookup(archive, path));
+    if (index == TAR_NO_ENTRY)
+    {
+        return -1;
+    }
+    return entry_read(archive, index, offset, dest, len);
+}
+
+/**
+ * Reads a file at a given path in the archive of a handle, like read_file(), without scanning the archive.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its
+ *             linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return the same values as read_file(), or -3 if the archive could not be read.
+ */
+ssize_t tar_read_file(tar_archive_t *archive, char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    ssize_t ret = tar_read_file_impl(archive, path, offset, dest, len);
+    metrics_end(archive->metrics, TAR_OP_READ_FILE, start);
+    return ret;
+}
+
+/**
+ * @brief The body of tar_sparse_map(), without the latency metrics
+ */
+ssize_t tar_sparse_map_impl(tar_archive_t *archive, char *path, tar_region_t *regions, size_t no_regions)
+{
+    archive = archive_route(archive, &path);
+    if (archive == NULL)
+    {
+        return -1;
+    }
+    size_t index = index_resolve(archive, index_lookup(archive, path));
+    if (index == TAR_NO_ENTRY || !type_is_file(archive->entries[index].typeflag))
+    {
+        return -1;
+    }
+
+    tar_entry_t *entry = &archive->entries[index];
+    if (entry->sparse == TAR_NO_SPARSE)
+    {
+        if (entry->size > 0 && no_regions > 0)
+        {
+            regions[0].offset = 0;
+            regions[0].len = entry->size;
+        }
+        return entry->size > 0;
+    }
+
+    tar_sparse_t *sparse = &archive->sparse[entry->sparse - 1];
+    for (size_t r = 0; r < sparse->no_regions && r < no_regions; r++)
+    {
+        regions[r].offset = archive->regions[sparse->first + r].offset;
+        regions[r].len = archive->regions[sparse->first + r].len;
+    }
+    return sparse->no_regions;
+}
+
+/**
+ * Gets the data regions of a file of the archive of a handle, the rest of the file being holes that read as zeros.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param regions An array receiving the data regions, sorted by offset.
+ * @param no_regions The size of the array, the regions after it are counted but not stored.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         the number of data regions otherwise, one for a non-empty file that is not sparse.
+ */
+ssize_t tar_sparse_map(tar_archive_t *archive, char *path, tar_region_t *regions, size_t no_regions)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    ssize_t ret = tar_sparse_map_impl(archive, path, regions, no_regions);
+    metrics_end(archive->metrics, TAR_OP_SPARSE_MAP, start);
+    return ret;
+}
+
+/**
+ * @brief The body of tar_extract_file(), without the latency metrics
+ */
+int tar_extract_file_impl(tar_archive_t *archive, char *path, int out_fd)
+{
+    archive = archive_route(archive, &path);
+    if (archive == NULL)
+    {
+        return -1;
+    }
+    size_t index = index_resolve(archive, index_lookup(archive, path));
+    if (index == TAR_NO_ENTRY || !type_is_file(archive->entries[index].typeflag))
+    {
+        return -1;
+    }
+
+    tar_entry_t *entry = &archive->entries[index];
+    tar_sparse_region_t whole = {0, entry->size, 0};
+    tar_sparse_region_t *regions = &whole;
+    size_t no_regions = entry->size > 0;
+    if (entry->sparse != TAR_NO_SPARSE)
+    {
+        regions = archive->regions + archive->sparse[entry->sparse - 1].first;
+        no_regions = archive->sparse[entry->sparse - 1].no_regions;
+    }
+
+    uint8_t *buf = malloc(TAR_EXTRACT_CHUNK);
+    if (buf == NULL || ftruncate(out_fd, 0) < 0)
+    {
+        free(buf);
+        return -3;
+    }
+
+    // The holes are left unwritten, the final size is set once the data is in place
+    for (size_t r = 0; r < no_regions; r++)
+    {
+        for (uint64_t done = 0; done < regions[r].len;)
+        {
+            size_t len = regions[r].len - done < TAR_EXTRACT_CHUNK ? regions[r].len - done : TAR_EXTRACT_CHUNK;
+            ssize_t ret = entry_pread(archive, index, buf, len, regions[r].offset + done);
+            if (ret < 0 || (size_t)ret < len)
+            {
+                free(buf);
+                errno = ret < 0 ? errno : EIO;
+                return -3;
+            }
+            for (size_t written = 0; written < len;)
+            {
+                ret = pwrite(out_fd, buf + written, len - written, regions[r].offset + done + written);
+                if (ret < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (ret <= 0)
+                {
+                    free(buf);
+                    errno = ret < 0 ? errno : EIO;
+                    return -3;
+                }
+                written += ret;
+            }
+            done += len;
+        }
+    }
+    free(buf);
+
+    return ftruncate(out_fd, entry->size) < 0 ? -3 : 0;
+}
+
+/**
+ * Extracts a file of the archive of a handle into a file, writing only its data regions so that the holes of a
+ * sparse file stay holes in the extracted file.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param out_fd A file descriptor open for writing on a regular file, which is truncated first.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -3 if the archive could not be read or the file could not be written (errno is set).
+ */
+int tar_extract_file(tar_archive_t *archive, char *path, int out_fd)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    int ret = tar_extract_file_impl(archive, path, out_fd);
+    metrics_end(archive->metrics, TAR_OP_EXTRACT, start);
+    return ret;
+}
+
+typedef struct tar_read_request
+{
+    size_t path;  // Position of the request in the arrays of the caller
+    off_t start;  // Offset of the payload in the archive
+    size_t len;   // Number of bytes to read
+    size_t size;  // Size of the file
+} tar_read_request_t;
+
+/**
+ * @brief Orders read requests by offset in the archive, for qsort()
+ */
+int read_request_cmp(const void *a, const void *b)
+{
+    off_t start_a = ((const tar_read_request_t *)a)->start;
+    off_t start_b = ((const tar_read_request_t *)b)->start;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+/**
+ * @brief Reads a run of requests sorted by offset with a single preadv(), the gaps between them going to a scratch
+ *        buffer
+ *
+ * @param archive The archive
+ * @param run The requests of the run
+ * @param no_run The number of requests, at most IOV_MAX / 2
+ * @param bufs The destination buffers of the caller
+ * @param scratch A buffer of archive->read_gap bytes receiving the gaps
+ * @param iov An array of 2 * no_run iovecs
+ * @return int 0 if every request was read, -1 otherwise
+ */
+int read_run(tar_archive_t *archive, tar_read_request_t *run, size_t no_run, uint8_t **bufs, uint8_t *scratch,
+             struct iovec *iov)
+{
+    int no_iov = 0;
+    size_t total = 0;
+    for (size_t i = 0; i < no_run; i++)
+    {
+        if (i > 0 && run[i].start > run[i - 1].start + (off_t)run[i - 1].len)
+        {
+            iov[no_iov].iov_base = scratch;
+            iov[no_iov].iov_len = run[i].start - (run[i - 1].start + run[i - 1].len);
+            total += iov[no_iov++].iov_len;
+        }
+        iov[no_iov].iov_base = bufs[run[i].path];
+        iov[no_iov].iov_len = run[i].len;
+        total += iov[no_iov++].iov_len;
+    }
+
+    TAR_PROBE3(payload_readv, (long long)run[0].start, total, no_run);
+    advise_read_begin(archive, run[0].start, total);
+    ssize_t ret;
+    do
+    {
+        ret = preadv(archive->fd, iov, no_iov, run[0].start);
+    } while (ret < 0 && errno == EINTR);
+    advise_read_end(archive, run[0].start, total);
+
+    return ret >= 0 && (size_t)ret == total ? 0 : -1;
+}
+
+/**
+ * @brief The body of tar_read_files(), without the latency metrics
+ */
+ssize_t tar_read_files_impl(tar_archive_t *archive, char **paths, uint8_t **bufs, size_t *lens, ssize_t *results,
+                            size_t no_paths)
+{
+    tar_read_request_t *requests = malloc((no_paths ? no_paths : 1) * sizeof(tar_read_request_t));
+    uint8_t *scratch = malloc(archive->read_gap ? archive->read_gap : 1);
+    if (requests == NULL || scratch == NULL)
+    {
+        free(requests);
+        free(scratch);
+        return -1;
+    }
+
+    // Resolve every path
+    size_t no_requests = 0;
+    for (size_t i = 0; i < no_paths; i++)
+    {
+        char *path = paths[i];
+        tar_archive_t *nested = archive_route(archive, &path);
+        if (nested != archive) // Read from the nested archive, outside of the runs of this one
+        {
+            results[i] = nested == NULL ? -1 : tar_read_file_impl(nested, path, 0, bufs[i], &lens[i]);
+            lens[i] = nested == NULL ? 0 : lens[i];
+            continue;
+        }
+        size_t index = index_resolve(archive, index_lookup(archive, path));
+        if (index != TAR_NO_ENTRY && archive->entries[index].typeflag == GNUTYPE_SPARSE)
+        {
+            results[i] = entry_read(archive, index, 0, bufs[i], &lens[i]); // Holes are not in a single run
+            continue;
+        }
+        if (index == TAR_NO_ENTRY ||
+            !(archive->entries[index].typeflag == REGTYPE || archive->entries[index].typeflag == AREGTYPE))
+        {
+            results[i] = -1;
+            lens[i] = 0;
+            continue;
+        }
+
+        tar_entry_t *entry = &archive->entries[index];
+        tar_read_request_t *request = &requests[no_requests++];
+        request->path = i;
+        request->start = entry->header_offset + 512;
+        request->size = entry->size;
+        request->len = entry->size < lens[i] ? entry->size : lens[i];
+    }
+    qsort(requests, no_requests, sizeof(tar_read_request_t), read_request_cmp);
+
+    // A run of n payloads takes up to 2 * n - 1 buffers, the gaps going to the scratch buffer
+    size_t no_iov = 2 * no_requests < IOV_MAX ? 2 * no_requests : IOV_MAX;
+    struct iovec *iov = malloc((no_iov ? no_iov : 1) * sizeof(struct iovec));
+    if (iov == NULL)
+    {
+        free(requests);
+        free(scratch);
+        return -1;
+    }
+
+    // Read runs of nearby payloads
+    size_t done = 0;
+    while (done < no_requests)
+    {
+        size_t no_run = 1;
+        off_t end = requests[done].start + requests[done].len;
+        while (done + no_run < no_requests && no_run < IOV_MAX / 2)
+        {
+            tar_read_request_t *next = &requests[done + no_run];
+            if (next->start < end || next->start - end > (off_t)archive->read_gap) // Overlapping or too far
+            {
+                break;
+            }
+            end = next->start + next->len;
+            no_run++;
+        }
+
+        tar_read_request_t *run = &requests[done];
+        if (archive->direct_fd >= 0 || archive->read_at != NULL ||
+            read_run(archive, run, no_run, bufs, scratch, iov) < 0)
+        {
+            // O_DIRECT cannot scatter to unaligned buffers, read_at has no preadv(), and a failed run is retried
+            // request by request
+            for (size_t i = 0; i < no_run; i++)
+            {
+                ssize_t ret = archive_pread(archive, bufs[run[i].path], run[i].len, run[i].start);
+                if (ret < 0 || (size_t)ret < run[i].len)
+                {
+                    run[i].len = ret < 0 ? 0 : ret;
+                    run[i].size = SIZE_MAX; // Marks the failure
+                }
+            }
+        }
+
+        for (size_t i = 0; i < no_run; i++)
+        {
+            lens[run[i].path] = run[i].len;
+            results[run[i].path] = run[i].size == SIZE_MAX ? -3 : (ssize_t)(run[i].size - run[i].len);
+        }
+        done += no_run;
+    }
+
+    ssize_t count = 0;
+    for (size_t i = 0; i < no_paths; i++)
+    {
+        count += results[i] >= 0;
+    }
+
+    free(requests);
+    free(scratch);
+    free(iov);
+    return count;
+}
+
+/**
+ * Reads several files of the archive of a handle, from their start.
+ *
+ * The payloads are read in the order of their offsets in the archive. Payloads separated by at most the gap
+ * threshold of the handle (see tar_set_read_gap()) are read by a single preadv(), scattering them to the buffers of
+ * the caller, so that many small files cost a few sequential reads instead of one random read each.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param paths The paths of the files to read. Symlinks are resolved to their linked-to entries.
+ * @param bufs The destination buffers, one per path.
+ * @param lens An in-out array, the sizes of the buffers then the number of bytes written to each buffer.
+ * @param results An array receiving, for each path, the value tar_read_file() would have returned.
+ * @param no_paths The number of paths.
+ *
+ * @return the number of files read successfully, i.e. with a result of zero or a positive value,
+ *         -1 if the memory could not be allocated.
+ */
+ssize_t tar_read_files(tar_archive_t *archive, char **paths, uint8_t **bufs, size_t *lens, ssize_t *results,
+                       size_t no_paths)
+{
+    uint64_t start = metrics_begin(archive->metrics);
+    ssize_t ret = tar_read_files_impl(archive, paths, bufs, lens, results, no_paths);
+    metrics_end(archive->metrics, TAR_OP_READ_FILES, start);
+    return ret;
+}
+
+/**
+ * Sets the gap threshold of tar_read_files() for a handle, 64 KiB by default.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param gap The largest number of bytes between two payloads for them to be read by a single request. As payloads
+ *            are separated by at least a header, a gap below 512 disables merging.
+ */
+void tar_set_read_gap(tar_archive_t *archive, size_t gap)
+{
+    archive->read_gap = gap;
+}
+
+/**
+ * Gets the content hash of a file of the archive of a handle, without reading the file.
+ *
+ * @param archive A handle returned by tar_open() with TAR_OPEN_HASH.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param hash Set to the CRC32C of the content of the file.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the handle was not opened with TAR_OPEN_HASH.
+ */
+int tar_content_hash(tar_archive_t *archive, char *path, uint32_t *hash)
+{
+    archive = archive_route(archive, &path);
+    if (archive == NULL)
+    {
+        return -1;
+    }
+    size_t index = index_resolve(archive, index_lookup(archive, path));
+    if (index == TAR_NO_ENTRY ||
+        !(archive->entries[index].typeflag == REGTYPE || archive->entries[index].typeflag == AREGTYPE))
+    {
+        return -1;
+    }
+    if (!archive->hashed)
+    {
+        return -2;
+    }
+    *hash = archive->entries[index].hash;
+    return 0;
+}
+
+/*
+ * Union catalog
+ *
+ * A catalog indexes every shard with tar_open() and merges the indexes in a single hash table mapping each path to
+ * the shard and the entry holding it. A path is found with one probe of that table whatever the number of shards.
+ */
+
+typedef struct tar_catalog_slot
+{
+    uint32_t shard; // Index of the shard
+    uint32_t entry; // Index of the entry in the shard, TAR_EMPTY_SLOT for an empty slot
+} tar_catalog_slot_t;
+
+struct tar_catalog
+{
+    tar_archive_t **shards;    // The shards, in the order they were given
+    int *fds;                  // File descriptors of the shards, owned by the catalog
+    size_t no_shards;          // Number of shards
+    tar_catalog_slot_t *slots; // Hash table of the paths of every shard
+    size_t no_slots;           // Number of slots, a power of two
+    size_t no_paths;           // Number of paths in the table
+    uint32_t **visible;        // For every entry of every shard, the number of its children visible from the shard
+};
+
+/**
+ * @brief Gets the path of the entry referenced by a slot
+ *
+ * @param catalog The catalog
+ * @param slot The slot, not empty
+ * @return const char* The path
+ */
+const char *catalog_name(tar_catalog_t *catalog, tar_catalog_slot_t slot)
+{
+    return entry_name(catalog->shards[slot.shard], slot.entry);
+}
+
+/**
+ * @brief Finds the slot of a path in the hash table of a catalog
+ *
+ * @param catalog The catalog
+ * @param path The path to look for
+ * @param len The length of the path
+ * @return size_t The slot holding the path, or the empty slot where it would be inserted
+ */
+size_t catalog_slot(tar_catalog_t *catalog, const char *path, size_t len)
+{
+    size_t mask = catalog->no_slots - 1;
+    size_t slot = tar_hash(path, len) & mask;
+    while (catalog->slots[slot].entry != TAR_EMPTY_SLOT)
+    {
+        const char *name = catalog_name(catalog, catalog->slots[slot]);
+        if (strncmp(name, path, len) == 0 && name[len] == '\0')
+        {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * @brief Looks up a path in a catalog, "dir" also matches "dir/" and "link/" also matches "link"
+ *
+ * @param catalog The catalog
+ * @param path The path to look for, "" or "/" for the root, found in the first shard
+ * @param found Set to the shard and the entry holding the path
+ * @return int 1 if the path was found, 0 otherwise
+ */
+int catalog_lookup(tar_catalog_t *catalog, const char *path, tar_catalog_slot_t *found)
+{
+    size_t len = strlen(path);
+    if (len == 0 || (len == 1 && path[0] == '/'))
+    {
+        *found = (tar_catalog_slot_t){.shard = 0, .entry = TAR_ROOT};
+        return catalog->no_shards > 0;
+    }
+    if (len + 1 >= TAR_PATH_MAX)
+    {
+        return 0;
+    }
+
+    *found = catalog->slots[catalog_slot(catalog, path, len)];
+    if (found->entry == TAR_EMPTY_SLOT && path[len - 1] != '/')
+    {
+        char dir[TAR_PATH_MAX];
+        memcpy(dir, path, len);
+        dir[len] = '/';
+        *found = catalog->slots[catalog_slot(catalog, dir, len + 1)];
+    }
+    else if (found->entry == TAR_EMPTY_SLOT && len > 1)
+    {
+        *found = catalog->slots[catalog_slot(catalog, path, len - 1)];
+    }
+    return found->entry != TAR_EMPTY_SLOT;
+}
+
+/**
+ * @brief Follows the symlinks starting at a given entry, across the shards
+ *
+ * @param catalog The catalog
+ * @param found An in-out argument, the entry to start from then the first entry that is not a symlink
+ * @return int 1 on success, 0 if a link is dangling or if there are too many levels of links
+ */
+int catalog_resolve(tar_catalog_t *catalog, tar_catalog_slot_t *found)
+{
+    for (int hops = 0; catalog->shards[found->shard]->entries[found->entry].typeflag == SYMTYPE; hops++)
+    {
+        char target[2 * TAR_PATH_MAX];
+        link_target(catalog->shards[found->shard], found->entry, target);
+        if (hops == TAR_MAX_HOPS || !catalog_lookup(catalog, target, found))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Adds every entry of a shard to the hash table of a catalog
+ *
+ * @param catalog The catalog
+ * @param shard The index of the shard
+ * @param shadow Whether the entries of the shard replace the entries of the previous shards with the same path
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int catalog_merge(tar_catalog_t *catalog, uint32_t shard, int shadow)
+{
+    tar_archive_t *archive = catalog->shards[shard];
+    for (size_t i = 1; i < archive->no_entries; i++) // Skip the root
+    {
+        if ((catalog->no_paths + 1) * 2 > catalog->no_slots)
+        {
+            size_t old_no_slots = catalog->no_slots;
+            tar_catalog_slot_t *old_slots = catalog->slots;
+            catalog->no_slots = old_no_slots ? old_no_slots * 2 : 1024;
+            catalog->slots = calloc(catalog->no_slots, sizeof(tar_catalog_slot_t));
+            if (catalog->slots == NULL)
+            {
+                catalog->slots = old_slots;
+                catalog->no_slots = old_no_slots;
+                return -1;
+            }
+            for (size_t j = 0; j < old_no_slots; j++)
+            {
+                if (old_slots[j].entry != TAR_EMPTY_SLOT)
+                {
+                    const char *name = catalog_name(catalog, old_slots[j]);
+                    catalog->slots[catalog_slot(catalog, name, strlen(name))] = old_slots[j];
+                }
+            }
+            free(old_slots);
+        }
+
+        const char *name = entry_name(archive, i);
+        tar_catalog_slot_t *slot = &catalog->slots[catalog_slot(catalog, name, strlen(name))];
+        if (slot->entry == TAR_EMPTY_SLOT)
+        {
+            catalog->no_paths++;
+        }
+        else if (!shadow) // The first shard holding a path wins
+        {
+            continue;
+        }
+        slot->shard = shard;
+        slot->entry = i;
+    }
+    return 0;
+}
+
+/**
+ * @brief Counts the children every directory of every shard contributes to the listings of a catalog
+ *
+ * @param catalog The catalog, every shard merged
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int catalog_count_visible(tar_catalog_t *catalog)
+{
+    catalog->visible = calloc(catalog->no_shards ? catalog->no_shards : 1, sizeof(uint32_t *));
+    if (catalog->visible == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < catalog->no_shards; i++)
+    {
+        catalog->visible[i] = calloc(catalog->shards[i]->no_entries, sizeof(uint32_t));
+        if (catalog->visible[i] == NULL)
+        {
+            return -1;
+        }
+    }
+    for (size_t j = 0; j < catalog->no_slots; j++)
+    {
+        tar_catalog_slot_t slot = catalog->slots[j];
+        if (slot.entry != TAR_EMPTY_SLOT)
+        {
+            catalog->visible[slot.shard][catalog->shards[slot.shard]->entries[slot.entry].parent]++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Opens a catalog over several archives.
+ *
+ * @param paths The paths of the archive files, from the lowest to the highest layer.
+ * @param no_paths The number of paths.
+ * @param flags The flags given to tar_open() for each archive, optionally combined with TAR_CATALOG_SHADOW.
+ *
+ * @return a new catalog, or NULL if an archive could not be opened or indexed (errno is set).
+ */
+tar_catalog_t *tar_catalog_open(char **paths, size_t no_paths, int flags)
+{
+    tar_catalog_t *catalog = calloc(1, sizeof(tar_catalog_t));
+    if (catalog == NULL)
+    {
+        return NULL;
+    }
+    catalog->shards = calloc(no_paths ? no_paths : 1, sizeof(tar_archive_t *));
+    catalog->fds = malloc((no_paths ? no_paths : 1) * sizeof(int));
+    catalog->no_slots = 1024; // Allocated even if no shard has an entry, lookups always probe the table
+    catalog->slots = calloc(catalog->no_slots, sizeof(tar_catalog_slot_t));
+    if (catalog->shards == NULL || catalog->fds == NULL || catalog->slots == NULL || no_paths > UINT32_MAX)
+    {
+        tar_catalog_close(catalog);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < no_paths; i++)
+    {
+        int fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+        tar_archive_t *archive = fd < 0 ? NULL : tar_open(fd, flags & ~TAR_CATALOG_SHADOW);
+        if (archive == NULL)
+        {
+            int err = errno;
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            tar_catalog_close(catalog);
+            errno = err;
+            return NULL;
+        }
+
+        catalog->fds[i] = fd;
+        catalog->shards[i] = archive;
+        catalog->no_shards++;
+        if (catalog_merge(catalog, i, flags & TAR_CATALOG_SHADOW) < 0)
+        {
+            tar_catalog_close(catalog);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    if (catalog_count_visible(catalog) < 0)
+    {
+        tar_catalog_close(catalog);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return catalog;
+}
+
+/**
+ * Opens a catalog over the archives matching a glob pattern, in the lexicographic order of their paths.
+ *
+ * @param pattern A glob(3) pattern, e.g. "shards/data-*.tar".
+ * @param flags See tar_catalog_open().
+ *
+ * @return a new catalog, or NULL if no archive matches or an archive could not be opened (errno is set).
+ */
+tar_catalog_t *tar_catalog_open_glob(const char *pattern, int flags)
+{
+    glob_t matches;
+    if (glob(pattern, 0, NULL, &matches) != 0)
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    tar_catalog_t *catalog = tar_catalog_open(matches.gl_pathv, matches.gl_pathc, flags);
+    int err = errno;
+    globfree(&matches);
+    errno = err;
+    return catalog;
+}
+
+/**
+ * Opens a catalog over the archives listed in a manifest file.
+ *
+ * @param manifest The path of a text file listing an archive path per line, from the lowest to the highest layer.
+ *                 Empty lines and lines starting with '#' are ignored.
+ * @param flags See tar_catalog_open().
+ *
+ * @return a new catalog, or NULL if the manifest or an archive could not be read (errno is set).
+ */
+tar_catalog_t *tar_catalog_open_manifest(const char *manifest, int flags)
+{
+    FILE *file = fopen(manifest, "r");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    char **paths = NULL;
+    size_t no_paths = 0;
+    size_t cap_paths = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    int failed = 0;
+    while (!failed && (line_len = getline(&line, &line_cap, file)) >= 0)
+    {
+        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+        {
+            line[--line_len] = '\0';
+        }
+        if (line_len == 0 || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (no_paths == cap_paths)
+        {
+            cap_paths = cap_paths ? cap_paths * 2 : 16;
+            char **grown = realloc(paths, cap_paths * sizeof(char *));
+            if (grown == NULL)
+            {
+                failed = 1;
+                break;
+            }
+            paths = grown;
+        }
+        paths[no_paths] = strdup(line);
+        failed = paths[no_paths] == NULL;
+        no_paths += !failed;
+    }
+    free(line);
+    fclose(file);
+
+    tar_catalog_t *catalog = NULL;
+    if (!failed)
+    {
+        catalog = tar_catalog_open(paths, no_paths, flags);
+    }
+    int err = failed ? ENOMEM : errno;
+
+    for (size_t i = 0; i < no_paths; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+    errno = err;
+    return catalog;
+}
+
+/**
+ * Releases a catalog, its archive handles and their file descriptors.
+ *
+ * @param catalog A catalog returned by one of the tar_catalog_open*() functions, or NULL.
+ */
+void tar_catalog_close(tar_catalog_t *catalog)
+{
+    if (catalog == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < catalog->no_shards; i++)
+    {
+        tar_close(catalog->shards[i]);
+        close(catalog->fds[i]);
+        if (catalog->visible != NULL)
+        {
+            free(catalog->visible[i]);
+        }
+    }
+    free(catalog->visible);
+    free(catalog->shards);
+    free(catalog->fds);
+    free(catalog->slots);
+    free(catalog);
+}
+
+/**
+ * Checks whether an entry exists in any archive of a catalog.
+ *
+ * @param catalog A catalog.
+ * @param path A path to an entry.
+ *
+ * @return zero if no entry at the given path exists in the catalog,
+ *         any other value otherwise.
+ */
+int catalog_exists(tar_catalog_t *catalog, char *path)
+{
+    tar_catalog_slot_t found;
+    return catalog_lookup(catalog, path, &found);
+}
+
+/**
+ * Checks whether an entry exists in a catalog and is a directory.
+ *
+ * @param catalog A catalog.
+ * @param path A path to an entry.
+ *
+ * @return zero if no entry at the given path exists in the catalog or the visible entry is not a directory,
+ *         any other value otherwise.
+ */
+int catalog_is_dir(tar_catalog_t *catalog, char *path)
+{
+    tar_catalog_slot_t found;
+    return catalog_lookup(catalog, path, &found) &&
+           catalog->shards[found.shard]->entries[found.entry].typeflag == DIRTYPE;
+}
+
+/**
+ * Checks whether an entry exists in a catalog and is a file.
+ *
+ * @param catalog A catalog.
+ * @param path A path to an entry.
+ *
+ * @return zero if no entry at the given path exists in the catalog or the visible entry is not a file,
+ *         any other value otherwise.
+ */
+int catalog_is_file(tar_catalog_t *catalog, char *path)
+{
+    tar_catalog_slot_t found;
+    if (!catalog_lookup(catalog, path, &found))
+    {
+        return 0;
+    }
+    return type_is_file(catalog->shards[found.shard]->entries[found.entry].typeflag);
+}
+
+/**
+ * Checks whether an entry exists in a catalog and is a symlink.
+ *
+ * @param catalog A catalog.
+ * @param path A path to an entry.
+ *
+ * @return zero if no entry at the given path exists in the catalog or the visible entry is not a symlink,
+ *         any other value otherwise.
+ */
+int catalog_is_symlink(tar_catalog_t *catalog, char *path)
+{
+    tar_catalog_slot_t found;
+    return catalog_lookup(catalog, path, &found) &&
+           catalog->shards[found.shard]->entries[found.entry].typeflag == SYMTYPE;
+}
+
+/**
+ * Lists one page of the entries at a given path in a catalog, see list_page().
+ *
+ * The listing is the union of the directory in every archive, each path being listed once, from the archive where
+ * it is visible. Entries are listed shard by shard, in archive order.
+ *
+ * @param catalog A catalog.
+ * @param path A path to a directory, "" for the root. If the entry is a symlink, it is resolved to its linked-to
+ *             entry. Unlike list_page(), the path must be given again on each call.
+ * @param cursor An in-out argument, initialised with TAR_CURSOR_INIT.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument, the page size then the number of entries listed.
+ *
+ * @return -1 if no directory at the given path exists in the catalog,
+ *         zero if the listing is complete,
+ *         a positive value otherwise, representing the number of entries left to be listed.
+ */
+ssize_t catalog_list_page(tar_catalog_t *catalog, char *path, tar_cursor_t *cursor, char **entries, size_t *no_entries)
+{
+    char dir_path[2 * TAR_PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    if (path[0] != '\0') // Resolve the path once for every shard
+    {
+        tar_catalog_slot_t found;
+        if (!catalog_lookup(catalog, path, &found) || !catalog_resolve(catalog, &found) ||
+            catalog->shards[found.shard]->entries[found.entry].typeflag != DIRTYPE)
+        {
+            *no_entries = 0;
+            return -1;
+        }
+        snprintf(dir_path, sizeof(dir_path), "%s", catalog_name(catalog, found));
+    }
+
+    size_t count = 0;
+    size_t total = 0; // Number of entries of the listing, from every shard
+    for (size_t i = 0; i < catalog->no_shards; i++)
+    {
+        size_t dir = index_lookup(catalog->shards[i], dir_path);
+        if (dir != TAR_NO_ENTRY && catalog->shards[i]->entries[dir].typeflag == DIRTYPE)
+        {
+            total += catalog->visible[i][dir];
+        }
+    }
+    // cursor->dir is the shard being listed plus one
+    for (cursor->dir = cursor->dir ? cursor->dir : 1; cursor->dir <= catalog->no_shards; cursor->dir++)
+    {
+        tar_archive_t *archive = catalog->shards[cursor->dir - 1];
+        size_t dir = index_lookup(archive, dir_path);
+        if (dir != TAR_NO_ENTRY && archive->entries[dir].typeflag == DIRTYPE)
+        {
+            tar_entry_t *entry = &archive->entries[dir];
+            for (; cursor->next < entry->no_children && count < *no_entries; cursor->next++)
+            {
+                const char *name = entry_name(archive, archive->children[entry->first_child + cursor->next]);
+                tar_catalog_slot_t found = catalog->slots[catalog_slot(catalog, name, strlen(name))];
+                if (found.shard == cursor->dir - 1) // Skip the paths visible from another shard
+                {
+                    memcpy(entries[count], name, strlen(name) + 1);
+                    count++;
+                }
+            }
+            if (count == *no_entries)
+            {
+                break;
+            }
+        }
+        cursor->next = 0;
+    }
+
+    cursor->listed += count;
+    *no_entries = count;
+    return cursor->listed < total ? total - cursor->listed : 0;
+}
+
+/**
+ * Reads a file at a given path in a catalog, see tar_read_file().
+ *
+ * @param catalog A catalog.
+ * @param path A path to a file. If the entry is a symlink, it is resolved to its linked-to entry, in any archive.
+ * @param offset An offset in the file from which to start reading from.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument, the size of dest then the number of bytes written to dest.
+ *
+ * @return the same values as tar_read_file().
+ */
+ssize_t catalog_read_file(tar_catalog_t *catalog, char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    tar_catalog_slot_t found;
+    if (!catalog_lookup(catalog, path, &found) || !catalog_resolve(catalog, &found))
+    {
+        return -1;
+    }
+    return entry_read(catalog->shards[found.shard], found.entry, offset, dest, len);
+}
+
+/*
+ * Sample iterator
+ *
+ * Consecutive regular files sharing a key, their path without the extension of their base name, form a sample, e.g.
+ * "000123.jpg", "000123.json" and "000123.cls". The files are taken in the order of their headers in the archive,
+ * not in the order of the index, whose directories and rewritten members are out of sequence. The payloads of a
+ * sample are read into its arena by a pread() per run of payloads at most the read gap of the handle apart, the
+ * headers in between included, so that a member rewritten far later in the archive is read on its own. A sparse
+ * file is also read on its own, through entry_pread() which fills its holes with zeros. A background thread reads up
+ * to `prefetch` samples ahead of the consumer.
+ */
+
+struct tar_samples
+{
+    tar_archive_t *archive; // The archive being iterated
+    uint64_t generation;    // Generation of the index of the archive when the iteration started
+    uint32_t *files;        // Regular files of the index, by offset of their header
+    size_t no_files;        // Number of regular files
+    size_t next;            // Position of the next file to group
+    int error;              // errno of the first error of the producer, 0 if none
+    int done;               // Set when the producer reached the end of the archive or an error
+    int stop;               // Set by tar_samples_close() to stop the producer
+    tar_sample_t **ring;    // Samples read ahead, in order
+    size_t cap_ring;        // Capacity of the ring, the prefetch depth
+    size_t head;            // Position of the oldest sample of the ring
+    size_t count;           // Number of samples in the ring
+    pthread_t thread;       // The producer, when prefetching
+    pthread_mutex_t lock;   // Protects the ring and the flags
+    pthread_cond_t changed; // Signaled when a sample is added or removed, or when a flag changes
+};
+
+/**
+ * @brief Computes the length of the key of a path, i.e. the path up to the first '.' of its base name
+ *
+ * @param name The path
+ * @return size_t The length of the key
+ */
+size_t sample_key_len(const char *name)
+{
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    const char *dot = strchr(base, '.');
+    return dot ? (size_t)(dot - name) : strlen(name);
+}
+
+/**
+ * @brief Orders entries by the offset of their header
+ */
+int sample_cmp(const void *a, const void *b, void *arg)
+{
+    tar_entry_t *entries = arg;
+    off_t offset_a = entries[*(const uint32_t *)a].header_offset;
+    off_t offset_b = entries[*(const uint32_t *)b].header_offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+/**
+ * @brief Checks whether a payload is read with the previous one of its sample
+ *
+ * The stored data of a sparse file is not its content, so a sparse file is read on its own through entry_pread().
+ *
+ * @param archive The archive
+ * @param prev The previous member, NULL for the first one
+ * @param entry The member
+ * @return int Whether it is
+ */
+int sample_joined(tar_archive_t *archive, const tar_entry_t *prev, const tar_entry_t *entry)
+{
+    if (prev == NULL || prev->sparse != TAR_NO_SPARSE || entry->sparse != TAR_NO_SPARSE)
+    {
+        return 0;
+    }
+    off_t prev_end = prev->header_offset + 512 + prev->size;
+    off_t start = entry->header_offset + 512;
+    return start >= prev_end && (uint64_t)(start - prev_end) <= archive->read_gap;
+}
+
+/**
+ * @brief Computes the bytes read between the payload of the previous member of a sample and the one of a member
+ *
+ * @param archive The archive
+ * @param prev The previous member, NULL for the first one
+ * @param entry The member
+ * @return size_t The length of the gap, zero if the payloads are not read together
+ */
+size_t sample_gap(tar_archive_t *archive, const tar_entry_t *prev, const tar_entry_t *entry)
+{
+    return sample_joined(archive, prev, entry) ? entry->header_offset + 512 - (prev->header_offset + 512 + prev->size)
+                                               : 0;
+}
+
+/**
+ * @brief Groups the next files of the archive into a sample and reads their payloads
+ *
+ * @param samples The iterator
+ * @param sample Set to the new sample
+ * @return int 1 if a sample was read, 0 at the end of the archive, -1 on error (errno is set)
+ */
+int sample_read(tar_samples_t *samples, tar_sample_t **sample)
+{
+    tar_archive_t *archive = samples->archive;
+    tar_entry_t *entries = archive->entries;
+    uint32_t *files = samples->files;
+    size_t first = samples->next;
+    if (first == samples->no_files)
+    {
+        return 0;
+    }
+    if (samples->generation != archive->generation) // The files are entry indexes from before a deletion
+    {
+        errno = ESTALE;
+        return -1;
+    }
+
+    // Extend the group while the key is the same
+    const char *key = entry_name(archive, files[first]);
+    size_t key_len = sample_key_len(key);
+    size_t end = first + 1;
+    while (end < samples->no_files)
+    {
+        const char *name = entry_name(archive, files[end]);
+        if (sample_key_len(name) != key_len || strncmp(name, key, key_len) != 0)
+        {
+            break;
+        }
+        end++;
+    }
+    samples->next = end;
+    size_t no_members = end - first;
+
+    // The sample, its members and its key in a single allocation
+    tar_sample_t *new = malloc(sizeof(tar_sample_t) + no_members * sizeof(tar_sample_member_t) + key_len + 1);
+    if (new == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    new->members = (tar_sample_member_t *)(new + 1);
+    new->key = (char *)(new->members + no_members);
+    memcpy(new->key, key, key_len);
+    new->key[key_len] = '\0';
+    new->no_members = no_members;
+
+    // The payloads and the gaps within their runs
+    new->size = 0;
+    for (size_t i = first; i < end; i++)
+    {
+        tar_entry_t *entry = &entries[files[i]];
+        new->size += sample_gap(archive, i > first ? &entries[files[i - 1]] : NULL, entry) + entry->size;
+    }
+    new->arena = malloc(new->size ? new->size : 1);
+    if (new->arena == NULL)
+    {
+        free(new);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t pos = 0;
+    for (size_t i = first, run = first; i < end; i++)
+    {
+        tar_entry_t *entry = &entries[files[i]];
+        pos += sample_gap(archive, i > first ? &entries[files[i - 1]] : NULL, entry);
+        tar_sample_member_t *member = &new->members[i - first];
+        member->name = entry_name(archive, files[i]);
+        member->ext = member->name[key_len] == '.' ? member->name + key_len + 1 : "";
+        member->data = new->arena + pos;
+        member->size = entry->size;
+        pos += entry->size;
+
+        // The run ends with the last member or before a member too far or sparse
+        if (i + 1 < end && sample_joined(archive, entry, &entries[files[i + 1]]))
+        {
+            continue;
+        }
+        off_t run_start = entries[files[run]].header_offset + 512;
+        size_t run_len = entry->header_offset + 512 + entry->size - run_start;
+        uint8_t *dest = (uint8_t *)new->members[run - first].data;
+        ssize_t ret;
+        if (entry->sparse != TAR_NO_SPARSE) // Alone in its run, its holes zero-filled
+        {
+            ret = entry_pread(archive, files[i], dest, entry->size, 0);
+        }
+        else
+        {
+            advise_read_begin(archive, run_start, run_len);
+            ret = archive_pread(archive, dest, run_len, run_start);
+            advise_read_end(archive, run_start, run_len);
+        }
+        if (ret < 0 || (size_t)ret < run_len)
+        {
+            tar_sample_free(new);
+            errno = ret < 0 ? errno : EIO;
+            return -1;
+        }
+        run = i + 1;
+    }
+
+    *sample = new;
+    return 1;
+}
+
+/**
+ * @brief Body of the prefetching thread, filling the ring until the end of the archive
+ *
+ * @param arg The iterator
+ * @return void* NULL
+ */
+void *samples_producer(void *arg)
+{
+    tar_samples_t *samples = arg;
+
+    pthread_mutex_lock(&samples->lock);
+    while (!samples->stop)
+    {
+        if (samples->count == samples->cap_ring) // The ring is full, wait for the consumer
+        {
+            pthread_cond_wait(&samples->changed, &samples->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&samples->lock);
+
+        tar_sample_t *sample = NULL;
+        int ret = sample_read(samples, &sample);
+        int err = errno;
+
+        pthread_mutex_lock(&samples->lock);
+        if (ret <= 0)
+        {
+            samples->error = ret < 0 ? err : 0;
+            samples->done = 1;
+            pthread_cond_broadcast(&samples->changed);
+            break;
+        }
+        samples->ring[(samples->head + samples->count) % samples->cap_ring] = sample;
+        samples->count++;
+        pthread_cond_broadcast(&samples->changed);
+    }
+    pthread_mutex_unlock(&samples->lock);
+
+    return NULL;
+}
+
+/**
+ * Starts iterating over the samples of an archive.
+ *
+ * @param archive A handle returned by tar_open(). It must stay open until tar_samples_close().
+ * @param prefetch The number of samples read ahead by a background thread, zero to read each sample on demand.
+ *
+ * @return a new iterator, or NULL on error (errno is set).
+ */
+tar_samples_t *tar_samples_open(tar_archive_t *archive, size_t prefetch)
+{
+    tar_samples_t *samples = calloc(1, sizeof(tar_samples_t));
+    if (samples == NULL)
+    {
+        return NULL;
+    }
+    samples->archive = archive;
+    samples->generation = archive->generation;
+    samples->cap_ring = prefetch;
+    samples->files = malloc((archive->no_entries ? archive->no_entries : 1) * sizeof(uint32_t));
+    if (samples->files == NULL)
+    {
+        free(samples);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i = TAR_ROOT + 1; i < archive->no_entries; i++)
+    {
+        tar_entry_t *entry = &archive->entries[i];
+        if (type_is_file(entry->typeflag) && entry->header_offset >= 0) // Sparse files included
+        {
+            samples->files[samples->no_files++] = i;
+        }
+    }
+    qsort_r(samples->files, samples->no_files, sizeof(uint32_t), sample_cmp, archive->entries);
+    if (prefetch == 0)
+    {
+        return samples;
+    }
+
+    samples->ring = calloc(prefetch, sizeof(tar_sample_t *));
+    if (samples->ring == NULL)
+    {
+        free(samples->files);
+        free(samples);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&samples->lock, NULL);
+    pthread_cond_init(&samples->changed, NULL);
+
+    int ret = pthread_create(&samples->thread, NULL, samples_producer, samples);
+    if (ret != 0)
+    {
+        pthread_mutex_destroy(&samples->lock);
+        pthread_cond_destroy(&samples->changed);
+        free(samples->ring);
+        free(samples->files);
+        free(samples);
+        errno = ret;
+        return NULL;
+    }
+    return samples;
+}
+
+/**
+ * Gets the next sample of an archive.
+ *
+ * The payloads of the members of a sample are read into the arena of the sample, with a single read for payloads at
+ * most the read gap of the handle apart (see tar_set_read_gap()).
+ *
+ * @param samples An iterator returned by tar_samples_open().
+ * @param sample Set to the next sample, to be released with tar_sample_free().
+ *
+ * @return 1 if a sample was returned, zero at the end of the archive, -1 on error (errno is set, ESTALE if
+ *         tar_delete(), tar_vacuum() or tar_update() changed the handle since tar_samples_open()).
+ */
+int tar_samples_next(tar_samples_t *samples, tar_sample_t **sample)
+{
+    if (samples->cap_ring == 0)
+    {
+        return sample_read(samples, sample);
+    }
+
+    pthread_mutex_lock(&samples->lock);
+    while (samples->count == 0 && !samples->done)
+    {
+        pthread_cond_wait(&samples->changed, &samples->lock);
+    }
+
+    int ret;
+    if (samples->count > 0)
+    {
+        *sample = samples->ring[samples->head];
+        samples->head = (samples->head + 1) % samples->cap_ring;
+        samples->count--;
+        pthread_cond_broadcast(&samples->changed);
+        ret = 1;
+    }
+    else if (samples->error)
+    {
+        ret = -1;
+        errno = samples->error;
+    }
+    else
+    {
+        ret = 0;
+    }
+    pthread_mutex_unlock(&samples->lock);
+    return ret;
+}
+
+/**
+ * Releases a sample and its arena.
+ *
+ * @param sample A sample returned by tar_samples_next(), or NULL.
+ */
+void tar_sample_free(tar_sample_t *sample)
+{
+    if (sample == NULL)
+    {
+        return;
+    }
+    free(sample->arena);
+    free(sample);
+}
+
+/**
+ * Stops an iterator, waits for its prefetching thread and releases the samples it read ahead.
+ *
+ * @param samples An iterator returned by tar_samples_open(), or NULL.
+ */
+void tar_samples_close(tar_samples_t *samples)
+{
+    if (samples == NULL)
+    {
+        return;
+    }
+
+    if (samples->cap_ring > 0)
+    {
+        pthread_mutex_lock(&samples->lock);
+        samples->stop = 1;
+        pthread_cond_broadcast(&samples->changed);
+        pthread_mutex_unlock(&samples->lock);
+        pthread_join(samples->thread, NULL);
+
+        for (size_t i = 0; i < samples->count; i++)
+        {
+            tar_sample_free(samples->ring[(samples->head + i) % samples->cap_ring]);
+        }
+        pthread_mutex_destroy(&samples->lock);
+        pthread_cond_destroy(&samples->changed);
+        free(samples->ring);
+    }
+    free(samples->files);
+    free(samples);
+}
+
+/*
+ * Thread pool
+ *
+ * Runs a number of independent tasks on worker threads, each worker taking the next task not started yet.
+ */
+
+typedef struct tar_pool
+{
+    size_t no_tasks;                              // Number of tasks
+    size_t next;                                  // Next task to start, taken atomically
+    void (*task)(size_t i, void *ctx, void *buf); // Runs the task i with the buffer of its worker
+    void *ctx;                                    // Context given to every task
+    size_t buf_len;                               // Size of the buffer of each worker, zero for none
+} tar_pool_t;
+
+/**
+ * @brief Body of a worker thread, running tasks until there are none left
+ *
+ * The buffer of the worker is allocated once and given to each of its tasks, NULL if it could not be.
+ *
+ * @param arg The pool
+ * @return void* NULL
+ */
+void *pool_worker(void *arg)
+{
+    tar_pool_t *pool = arg;
+    void *buf = pool->buf_len > 0 ? malloc(pool->buf_len) : NULL;
+    size_t i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->no_tasks)
+    {
+        pool->task(i, pool->ctx, buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Runs tasks on a number of threads and waits for all of them
+ *
+ * Tasks are started in order, so tasks sorted by offset read the archive mostly forward.
+ *
+ * @param no_tasks The number of tasks
+ * @param no_threads The number of threads, zero for one per online processor
+ * @param task Runs the task i with the buffer of its worker, NULL if it could not be allocated
+ * @param ctx Context given to every task
+ * @param buf_len The size of the buffer of each worker, zero for none
+ */
+void pool_run(size_t no_tasks, int no_threads, void (*task)(size_t i, void *ctx, void *buf), void *ctx,
+              size_t buf_len)
+{
+    tar_pool_t pool = {no_tasks, 0, task, ctx, buf_len};
+
+    if (no_threads <= 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        no_threads = online > 0 ? online : 1;
+    }
+    if ((size_t)no_threads > no_tasks)
+    {
+        no_threads = no_tasks ? no_tasks : 1;
+    }
+
+    pthread_t *threads = malloc(no_threads * sizeof(pthread_t));
+    int started = 0;
+    while (threads != NULL && started < no_threads - 1 &&
+           pthread_create(&threads[started], NULL, pool_worker, &pool) == 0)
+    {
+        started++;
+    }
+    pool_worker(&pool); // The calling thread works too, and alone if no thread could be started
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+/*
+ * SHA-256
+ */
+
+typedef struct tar_sha256
+{
+    uint32_t state[8];  // Intermediate hash
+    uint64_t len;       // Number of bytes hashed
+    uint8_t block[64];  // Pending bytes
+    size_t no_block;    // Number of pending bytes
+} tar_sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * @brief Starts a SHA-256
+ *
+ * @param sha The hash state
+ */
+void sha256_init(tar_sha256_t *sha)
+{
+    static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(sha->state, init, sizeof(init));
+    sha->len = 0;
+    sha->no_block = 0;
+}
+
+/**
+ * @brief Hashes a 64 bytes block
+ *
+ * @param state The intermediate hash
+ * @param block The block
+ */
+void sha256_block(uint32_t *state, const uint8_t *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 |
+               block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/**
+ * @brief Hashes bytes
+ *
+ * @param sha The hash state
+ * @param data The bytes
+ * @param len The number of bytes
+ */
+void sha256_update(tar_sha256_t *sha, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    sha->len += len;
+    if (sha->no_block > 0)
+    {
+        size_t copy = 64 - sha->no_block < len ? 64 - sha->no_block : len;
+        memcpy(sha->block + sha->no_block, bytes, copy);
+        sha->no_block += copy;
+        bytes += copy;
+        len -= copy;
+        if (sha->no_block < 64)
+        {
+            return;
+        }
+        sha256_block(sha->state, sha->block);
+        sha->no_block = 0;
+    }
+    for (; len >= 64; bytes += 64, len -= 64)
+    {
+        sha256_block(sha->state, bytes);
+    }
+    memcpy(sha->block, bytes, len);
+    sha->no_block = len;
+}
+
+/**
+ * @brief Ends a SHA-256
+ *
+ * @param sha The hash state
+ * @param digest Receives the 32 bytes of the hash
+ */
+void sha256_final(tar_sha256_t *sha, uint8_t *digest)
+{
+    uint64_t bits = sha->len * 8;
+    uint8_t pad[72] = {0x80};
+    size_t no_pad = (sha->no_block < 56 ? 56 : 120) - sha->no_block;
+    for (int i = 0; i < 8; i++)
+    {
+        pad[no_pad + i] = bits >> (56 - 8 * i);
+    }
+    sha256_update(sha, pad, no_pad + 8);
+    for (int i = 0; i < 8; i++)
+    {
+        digest[4 * i] = sha->state[i] >> 24;
+        digest[4 * i + 1] = sha->state[i] >> 16;
+        digest[4 * i + 2] = sha->state[i] >> 8;
+        digest[4 * i + 3] = sha->state[i];
+    }
+}
+
+/*
+ * Manifest verification
+ *
+ * The manifest lists a digest per path, in the format of sha256sum. Every file of the manifest is a task of the
+ * thread pool; tasks are sorted by offset and each one reads its payload in large chunks.
+ */
+
+#define TAR_VERIFY_CHUNK (1 << 20) // Size of the reads of the payloads
+#define TAR_DIGEST_MAX 32          // Size of the largest digest, a SHA-256
+
+typedef struct tar_verify_task
+{
+    char *path;                      // Path read from the manifest
+    size_t index;                    // Entry of the path, TAR_NO_ENTRY if it is missing
+    uint8_t digest[TAR_DIGEST_MAX];  // Expected digest
+} tar_verify_task_t;
+
+typedef struct tar_verify
+{
+    tar_archive_t *archive;     // The archive being verified
+    int algorithm;              // One of the TAR_DIGEST_* algorithms
+    int flags;                  // TAR_VERIFY_* flags
+    tar_verify_task_t *tasks;   // The files of the manifest
+    tar_verify_cb_t callback;   // Called for every failure, may be NULL
+    void *ctx;                  // Context of the callback
+    tar_verify_report_t report; // Counts of the results
+    int failed;                 // Set at the first failure
+    pthread_mutex_t lock;       // Protects the report and the callback
+} tar_verify_t;
+
+/**
+ * @brief Computes the digest of the payload of an entry
+ *
+ * @param archive The archive
+ * @param index The entry, a regular file
+ * @param algorithm One of the TAR_DIGEST_* algorithms
+ * @param buf A buffer of TAR_VERIFY_CHUNK bytes
+ * @param digest Receives the digest
+ * @param stop Checked between chunks, the hash is abandoned when it becomes non-zero, may be NULL
+ * @return int 0 on success, -1 if the payload could not be read, 1 if stopped
+ */
+int entry_digest(tar_archive_t *archive, size_t index, int algorithm, uint8_t *buf, uint8_t *digest, int *stop)
+{
+    tar_entry_t *entry = &archive->entries[index];
+    tar_sha256_t sha;
+    uint32_t crc = 0;
+    sha256_init(&sha);
+
+    off_t start = entry->header_offset + 512;
+    int ret = 0;
+    advise_read_begin(archive, start, entry->size);
+    for (size_t done = 0; done < entry->size && ret == 0;)
+    {
+        if (stop != NULL && __atomic_load_n(stop, __ATOMIC_RELAXED))
+        {
+            ret = 1;
+            break;
+        }
+
+        size_t len = entry->size - done < TAR_VERIFY_CHUNK ? entry->size - done : TAR_VERIFY_CHUNK;
+        ssize_t got = entry_pread(archive, index, buf, len, done);
+        if (got < 0 || (size_t)got < len)
+        {
+            ret = -1;
+            break;
+        }
+        if (algorithm == TAR_DIGEST_SHA256)
+        {
+            sha256_update(&sha, buf, len);
+        }
+        else
+        {
+            crc = crc32c(crc, buf, len);
+        }
+        done += len;
+    }
+    advise_read_end(archive, start, entry->size); // Whether the hash was finished or not
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    if (algorithm == TAR_DIGEST_SHA256)
+    {
+        sha256_final(&sha, digest);
+    }
+    else
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            digest[i] = crc >> (24 - 8 * i);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Records the result of a path
+ *
+ * @param verify The verification
+ * @param path The path
+ * @param status One of the TAR_VERIFY_* statuses
+ */
+void verify_result(tar_verify_t *verify, const char *path, int status)
+{
+    pthread_mutex_lock(&verify->lock);
+    switch (status)
+    {
+    case TAR_VERIFY_OK:
+        verify->report.no_ok++;
+        break;
+    case TAR_VERIFY_MISMATCH:
+        verify->report.no_mismatched++;
+        break;
+    case TAR_VERIFY_MISSING:
+        verify->report.no_missing++;
+        break;
+    case TAR_VERIFY_EXTRA:
+        verify->report.no_extra++;
+        break;
+    default:
+        verify->report.no_errors++;
+        break;
+    }
+    if (status != TAR_VERIFY_OK)
+    {
+        if (verify->flags & TAR_VERIFY_STOP)
+        {
+            __atomic_store_n(&verify->failed, 1, __ATOMIC_RELAXED);
+        }
+        if (verify->callback != NULL)
+        {
+            verify->callback(path, status, verify->ctx);
+        }
+    }
+    pthread_mutex_unlock(&verify->lock);
+}
+
+/**
+ * @brief Verifies the file of a task, run by the thread pool
+ *
+ * @param i The task
+ * @param ctx The verification
+ * @param buf The buffer of the worker, of TAR_VERIFY_CHUNK bytes, NULL if it could not be allocated
+ */
+void verify_task(size_t i, void *ctx, void *buf)
+{
+    tar_verify_t *verify = ctx;
+    tar_verify_task_t *task = &verify->tasks[i];
+    if (__atomic_load_n(&verify->failed, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    size_t index = task->index;
+    if (index == TAR_NO_ENTRY)
+    {
+        verify_result(verify, task->path, TAR_VERIFY_MISSING);
+        return;
+    }
+    if (!type_is_file(verify->archive->entries[index].typeflag))
+    {
+        verify_result(verify, task->path, TAR_VERIFY_MISMATCH); // Not a file anymore
+        return;
+    }
+
+    uint8_t digest[TAR_DIGEST_MAX];
+    int ret = buf == NULL ? -1 : entry_digest(verify->archive, index, verify->algorithm, buf, digest, &verify->failed);
+    if (ret > 0) // Stopped by another failure
+    {
+        return;
+    }
+
+    size_t digest_len = verify->algorithm == TAR_DIGEST_SHA256 ? 32 : 4;
+    if (ret < 0)
+    {
+        verify_result(verify, task->path, TAR_VERIFY_ERROR);
+    }
+    else
+    {
+        verify_result(verify, task->path,
+                      memcmp(digest, task->digest, digest_len) == 0 ? TAR_VERIFY_OK : TAR_VERIFY_MISMATCH);
+    }
+}
+
+/**
+ * @brief Orders tasks by the offset of their entry, missing entries first
+ */
+int verify_task_cmp(const void *a, const void *b, void *arg)
+{
+    tar_archive_t *archive = arg;
+    size_t index_a = ((const tar_verify_task_t *)a)->index;
+    size_t index_b = ((const tar_verify_task_t *)b)->index;
+    off_t start_a = index_a == TAR_NO_ENTRY ? -1 : archive->entries[index_a].header_offset;
+    off_t start_b = index_b == TAR_NO_ENTRY ? -1 : archive->entries[index_b].header_offset;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+/**
+ * @brief Parses a line of a manifest, "<hex digest> <path>" as written by sha256sum
+ *
+ * @param line The line, without its end of line
+ * @param digest_len The expected length of the digest, in bytes
+ * @param task Receives the digest and the path, which points into the line
+ * @return int 0 on success, -1 if the line is malformed
+ */
+int manifest_parse(char *line, size_t digest_len, tar_verify_task_t *task)
+{
+    for (size_t i = 0; i < digest_len; i++)
+    {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)line[2 * i]) || !isxdigit((unsigned char)line[2 * i + 1]) ||
+            sscanf(line + 2 * i, "%2x", &byte) != 1)
+        {
+            return -1;
+        }
+        task->digest[i] = byte;
+    }
+
+    char *path = line + 2 * digest_len;
+    if (*path != ' ' && *path != '\t')
+    {
+        return -1;
+    }
+    while (*path == ' ' || *path == '\t')
+    {
+        path++;
+    }
+    if (*path == '*') // Binary mode marker of sha256sum
+    {
+        path++;
+    }
+    if (strncmp(path, "./", 2) == 0)
+    {
+        path += 2;
+    }
+    if (*path == '\0')
+    {
+        return -1;
+    }
+    task->path = path;
+    return 0;
+}
+
+/**
+ * Verifies the content of the files of the archive of a handle against a manifest of digests.
+ *
+ * The files are hashed in parallel, each worker reading its files in large chunks.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param manifest The path of a manifest, a line per file with the hexadecimal digest of the file, whitespace and
+ *                 the path of the file, as written by sha256sum. Empty lines and lines starting with '#' are ignored.
+ * @param algorithm TAR_DIGEST_SHA256 or TAR_DIGEST_CRC32C, the algorithm of the digests of the manifest.
+ * @param no_threads The number of threads hashing the files, zero for one per online processor.
+ * @param flags Zero or TAR_VERIFY_STOP to stop at the first failure.
+ * @param callback Called with the path and the status of every failure, from the worker threads but never
+ *                 concurrently, or NULL.
+ * @param ctx The context given to the callback.
+ * @param report Receives the counts of the results, or NULL.
+ *
+ * @return zero if every file of the manifest matches and the archive has no other file,
+ *         1 if there was a failure,
+ *         -1 if the manifest could not be read or is malformed (errno is set).
+ */
+int tar_verify(tar_archive_t *archive, const char *manifest, int algorithm, int no_threads, int flags,
+               tar_verify_cb_t callback, void *ctx, tar_verify_report_t *report)
+{
+    FILE *file = fopen(manifest, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    tar_verify_t verify = {archive, algorithm, flags, NULL, callback, ctx, {0}, 0};
+    size_t digest_len = algorithm == TAR_DIGEST_SHA256 ? 32 : 4;
+    char **lines = NULL;
+    size_t no_tasks = 0;
+    size_t cap_tasks = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    int err = 0;
+    while (!err && (line_len = getline(&line, &line_cap, file)) >= 0)
+    {
+        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+        {
+            line[--line_len] = '\0';
+        }
+        if (line_len == 0 || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (no_tasks == cap_tasks)
+        {
+            cap_tasks = cap_tasks ? cap_tasks * 2 : 64;
+            tar_verify_task_t *tasks = realloc(verify.tasks, cap_tasks * sizeof(tar_verify_task_t));
+            char **grown = realloc(lines, cap_tasks * sizeof(char *));
+            verify.tasks = tasks ? tasks : verify.tasks;
+            lines = grown ? grown : lines;
+            if (tasks == NULL || grown == NULL)
+            {
+                err = ENOMEM;
+                break;
+            }
+        }
+        lines[no_tasks] = line; // The task keeps the line, its path points into it
+        if (manifest_parse(line, digest_len, &verify.tasks[no_tasks]) < 0)
+        {
+            err = EINVAL;
+            break;
+        }
+        no_tasks++;
+        line = NULL;
+        line_cap = 0;
+    }
+    free(line);
+    fclose(file);
+
+    // Mark the files of the archive listed by the manifest, the others are extra
+    uint8_t *listed = err ? NULL : calloc(archive->no_entries, 1);
+    if (!err && listed == NULL)
+    {
+        err = ENOMEM;
+    }
+
+    if (!err)
+    {
+        pthread_mutex_init(&verify.lock, NULL);
+        for (size_t i = 0; i < no_tasks; i++)
+        {
+            verify.tasks[i].index = index_resolve(archive, index_lookup(archive, verify.tasks[i].path));
+            if (verify.tasks[i].index != TAR_NO_ENTRY)
+            {
+                listed[verify.tasks[i].index] = 1;
+            }
+        }
+        qsort_r(verify.tasks, no_tasks, sizeof(tar_verify_task_t), verify_task_cmp, archive);
+
+        pool_run(no_tasks, no_threads, verify_task, &verify, TAR_VERIFY_CHUNK);
+
+        for (size_t i = 1; i < archive->no_entries && !verify.failed; i++)
+        {
+            tar_entry_t *entry = &archive->entries[i];
+            if (!listed[i] && type_is_file(entry->typeflag))
+            {
+                verify_result(&verify, entry_name(archive, i), TAR_VERIFY_EXTRA);
+            }
+        }
+        pthread_mutex_destroy(&verify.lock);
+    }
+
+    free(listed);
+    for (size_t i = 0; i < no_tasks; i++)
+    {
+        free(lines[i]);
+    }
+    free(lines);
+    free(verify.tasks);
+
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+    if (report != NULL)
+    {
+        *report = verify.report;
+    }
+    tar_verify_report_t *r = &verify.report;
+    return r->no_mismatched || r->no_missing || r->no_extra || r->no_errors ? 1 : 0;
+}
+
+/*
+ * Archive diff
+ *
+ * The entries of the new archive are matched by path with those of the old one through its index. Types, sizes, link
+ * targets and header metadata are compared from the two indexes alone, so only the files of the same size whose
+ * modification time changed have their payloads read. Those are cut in segments of TAR_DIFF_SEGMENT bytes, the tasks
+ * of the thread pool, sorted by offset in the new archive; a task stops at its first differing chunk and is skipped
+ * once another segment of the same file differs.
+ */
+
+#define TAR_DIFF_SEGMENT (64 << 20) // Largest range of a payload compared by a single task
+
+typedef struct tar_diff_task
+{
+    size_t index;    // Entry of the new archive
+    uint64_t offset; // Start of the range compared, in the file
+    uint64_t len;    // Length of the range
+} tar_diff_task_t;
+
+typedef struct tar_diff
+{
+    tar_archive_t *old_archive; // The archive compared against
+    tar_archive_t *new_archive; // The archive whose changes are reported
+    size_t *matches;            // Entry of the old archive of the path of every entry of the new one, or TAR_NO_ENTRY
+    int *changes;               // TAR_DIFF_* changes of every entry of the new archive
+    tar_diff_task_t *tasks;     // The ranges of payloads to compare
+} tar_diff_t;
+
+/**
+ * @brief Compares two entries of the same path from their indexes
+ *
+ * @param diff The diff
+ * @param old_index The entry of the old archive
+ * @param new_index The entry of the new archive
+ * @param flags The TAR_DIFF_* flags of tar_diff()
+ * @param compare Set to 1 if the payloads must be read to know whether the content changed, 0 otherwise
+ * @return int The TAR_DIFF_* changes found
+ */
+int diff_entries(tar_diff_t *diff, size_t old_index, size_t new_index, int flags, int *compare)
+{
+    tar_entry_t *old_entry = &diff->old_archive->entries[old_index];
+    tar_entry_t *new_entry = &diff->new_archive->entries[new_index];
+    int is_file = type_is_file(new_entry->typeflag);
+    *compare = 0;
+    if (is_file != type_is_file(old_entry->typeflag) || (!is_file && old_entry->typeflag != new_entry->typeflag))
+    {
+        return TAR_DIFF_TYPE;
+    }
+
+    int changes = 0;
+    if (old_entry->header_offset >= 0 && new_entry->header_offset >= 0 && // Directories without a header have none
+        (old_entry->mode != new_entry->mode || old_entry->uid != new_entry->uid || old_entry->gid != new_entry->gid ||
+         old_entry->mtime != new_entry->mtime))
+    {
+        changes |= TAR_DIFF_METADATA;
+    }
+
+    if (old_entry->linkname != TAR_NO_NAME || new_entry->linkname != TAR_NO_NAME)
+    {
+        const char *old_target =
+            old_entry->linkname == TAR_NO_NAME ? "" : diff->old_archive->pool + old_entry->linkname;
+        const char *new_target =
+            new_entry->linkname == TAR_NO_NAME ? "" : diff->new_archive->pool + new_entry->linkname;
+        if (strcmp(old_target, new_target) != 0)
+        {
+            changes |= TAR_DIFF_CONTENT;
+        }
+    }
+    else if (is_file && old_entry->size != new_entry->size)
+    {
+        changes |= TAR_DIFF_CONTENT;
+    }
+    else if (is_file && new_entry->size > 0)
+    {
+        // The CRCs of the indexes tell a change apart without reading, but equal ones do not prove the content equal
+        int hashed = diff->old_archive->hashed && diff->new_archive->hashed &&
+                     old_entry->typeflag != GNUTYPE_SPARSE && new_entry->typeflag != GNUTYPE_SPARSE;
+        if (hashed && old_entry->hash != new_entry->hash)
+        {
+            changes |= TAR_DIFF_CONTENT;
+        }
+        else if (old_entry->mtime != new_entry->mtime || (flags & TAR_DIFF_FULL))
+        {
+            *compare = 1;
+        }
+    }
+    return changes;
+}
+
+/**
+ * @brief Compares a range of the payloads of a file in both archives, run by the thread pool
+ *
+ * @param i The task
+ * @param ctx The diff
+ * @param scratch The buffer of the worker, of 2 * TAR_VERIFY_CHUNK bytes, NULL if it could not be allocated
+ */
+void diff_task(size_t i, void *ctx, void *scratch)
+{
+    tar_diff_t *diff = ctx;
+    uint8_t *buf = scratch;
+    tar_diff_task_t *task = &diff->tasks[i];
+    int *changes = &diff->changes[task->index];
+    if (__atomic_load_n(changes, __ATOMIC_RELAXED) & (TAR_DIFF_CONTENT | TAR_DIFF_ERROR))
+    {
+        return; // Another segment of the file already differs
+    }
+
+    size_t old_index = diff->matches[task->index];
+    off_t old_start = diff->old_archive->entries[old_index].header_offset + 512 + task->offset;
+    off_t new_start = diff->new_archive->entries[task->index].header_offset + 512 + task->offset;
+    advise_read_begin(diff->old_archive, old_start, task->len);
+    advise_read_begin(diff->new_archive, new_start, task->len);
+
+    int found = buf == NULL ? TAR_DIFF_ERROR : 0;
+    for (uint64_t done = 0; !found && done < task->len;)
+    {
+        if (__atomic_load_n(changes, __ATOMIC_RELAXED) & (TAR_DIFF_CONTENT | TAR_DIFF_ERROR))
+        {
+            break;
+        }
+
+        size_t len = task->len - done < TAR_VERIFY_CHUNK ? task->len - done : TAR_VERIFY_CHUNK;
+        ssize_t old_ret = entry_pread(diff->old_archive, old_index, buf, len, task->offset + done);
+        ssize_t new_ret = entry_pread(diff->new_archive, task->index, buf + TAR_VERIFY_CHUNK, len, task->offset + done);
+        if (old_ret < 0 || new_ret < 0 || (size_t)old_ret < len || (size_t)new_ret < len)
+        {
+            found = TAR_DIFF_ERROR;
+        }
+        else if (memcmp(buf, buf + TAR_VERIFY_CHUNK, len) != 0)
+        {
+            found = TAR_DIFF_CONTENT;
+        }
+        done += len;
+    }
+
+    advise_read_end(diff->old_archive, old_start, task->len);
+    advise_read_end(diff->new_archive, new_start, task->len);
+    if (found)
+    {
+        __atomic_fetch_or(changes, found, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Orders tasks by the offset of their range in the new archive
+ */
+int diff_task_cmp(const void *a, const void *b, void *arg)
+{
+    tar_archive_t *archive = arg;
+    const tar_diff_task_t *task_a = a;
+    const tar_diff_task_t *task_b = b;
+    off_t start_a = archive->entries[task_a->index].header_offset + task_a->offset;
+    off_t start_b = archive->entries[task_b->index].header_offset + task_b->offset;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+/**
+ * @brief Counts the changes of a path in a report and gives them to the callback
+ *
+ * @param report The report
+ * @param path The path
+ * @param changes The TAR_DIFF_* changes of the path
+ * @param callback Called with the path and its changes, may be NULL
+ * @param ctx The context of the callback
+ */
+void diff_result(tar_diff_report_t *report, const char *path, int changes, tar_diff_cb_t callback, void *ctx)
+{
+    report->no_added += (changes & TAR_DIFF_ADDED) != 0;
+    report->no_removed += (changes & TAR_DIFF_REMOVED) != 0;
+    report->no_type_changed += (changes & TAR_DIFF_TYPE) != 0;
+    report->no_metadata_changed += (changes & TAR_DIFF_METADATA) != 0;
+    report->no_content_changed += (changes & TAR_DIFF_CONTENT) != 0;
+    report->no_errors += (changes & TAR_DIFF_ERROR) != 0;
+    if (callback != NULL)
+    {
+        callback(path, changes, ctx);
+    }
+}
+
+/**
+ * Compares the archives of two handles.
+ *
+ * The paths, types, sizes, link targets and metadata of the entries are compared from the indexes; the payloads of
+ * the files are read only when their size is the same but their modification time differs, in parallel and in
+ * large chunks, up to the first difference. When both handles were opened with TAR_OPEN_HASH, files whose CRC
+ * differs are known to have changed without reading them.
+ *
+ * @param old_archive A handle returned by tar_open(), the archive compared against.
+ * @param new_archive A handle returned by tar_open(), the archive whose changes are reported.
+ * @param no_threads The number of threads comparing the payloads, zero for one per online processor.
+ * @param flags Zero or TAR_DIFF_FULL to also compare the payloads of the files whose modification time is the same.
+ * @param callback Called with the path and the TAR_DIFF_* changes of every entry that changed, once the comparison is
+ *                 over: the entries of the new archive in archive order, then the removed entries of the old one.
+ *                 May be NULL.
+ * @param ctx The context given to the callback.
+ * @param report Receives the counts of the changes, or NULL.
+ *
+ * @return zero if the archives hold the same entries,
+ *         1 if an entry changed or could not be compared,
+ *         -1 if the memory could not be allocated (errno is set).
+ */
+int tar_diff(tar_archive_t *old_archive, tar_archive_t *new_archive, int no_threads, int flags,
+             tar_diff_cb_t callback, void *ctx, tar_diff_report_t *report)
+{
+    tar_diff_t diff = {old_archive, new_archive, NULL, NULL, NULL};
+    tar_diff_report_t counts = {0};
+    uint8_t *matched = calloc(old_archive->no_entries, 1);
+    diff.matches = malloc(new_archive->no_entries * sizeof(size_t));
+    diff.changes = calloc(new_archive->no_entries, sizeof(int));
+    size_t no_tasks = 0;
+    size_t cap_tasks = 0;
+    int err = matched == NULL || diff.matches == NULL || diff.changes == NULL;
+
+    for (size_t i = 1; !err && i < new_archive->no_entries; i++)
+    {
+        size_t match = index_lookup(old_archive, entry_name(new_archive, i));
+        diff.matches[i] = match;
+        if (match == TAR_NO_ENTRY || match == TAR_ROOT)
+        {
+            diff.changes[i] = TAR_DIFF_ADDED;
+            continue;
+        }
+        matched[match] = 1;
+
+        int compare;
+        diff.changes[i] = diff_entries(&diff, match, i, flags, &compare);
+        if (!compare)
+        {
+            continue;
+        }
+        counts.no_compared++;
+        uint64_t size = new_archive->entries[i].size;
+        for (uint64_t offset = 0; offset < size; offset += TAR_DIFF_SEGMENT)
+        {
+            if (no_tasks == cap_tasks)
+            {
+                cap_tasks = cap_tasks ? cap_tasks * 2 : 64;
+                tar_diff_task_t *tasks = realloc(diff.tasks, cap_tasks * sizeof(tar_diff_task_t));
+                if (tasks == NULL)
+                {
+                    err = 1;
+                    break;
+                }
+                diff.tasks = tasks;
+            }
+            uint64_t len = size - offset < TAR_DIFF_SEGMENT ? size - offset : TAR_DIFF_SEGMENT;
+            diff.tasks[no_tasks++] = (tar_diff_task_t){i, offset, len};
+        }
+    }
+
+    if (!err)
+    {
+        qsort_r(diff.tasks, no_tasks, sizeof(tar_diff_task_t), diff_task_cmp, new_archive);
+        pool_run(no_tasks, no_threads, diff_task, &diff, 2 * TAR_VERIFY_CHUNK);
+
+        for (size_t i = 1; i < new_archive->no_entries; i++)
+        {
+            if (diff.changes[i])
+            {
+                diff_result(&counts, entry_name(new_archive, i), diff.changes[i], callback, ctx);
+            }
+        }
+        for (size_t i = 1; i < old_archive->no_entries; i++)
+        {
+            if (!matched[i])
+            {
+                diff_result(&counts, entry_name(old_archive, i), TAR_DIFF_REMOVED, callback, ctx);
+            }
+        }
+    }
+
+    free(matched);
+    free(diff.matches);
+    free(diff.changes);
+    free(diff.tasks);
+
+    if (err)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (report != NULL)
+    {
+        *report = counts;
+    }
+    tar_diff_report_t *r = &counts;
+    return r->no_added || r->no_removed || r->no_type_changed || r->no_metadata_changed || r->no_content_changed ||
+                   r->no_errors
+               ? 1
+               : 0;
+}
+
+/*
+ * Archive creation
+ *
+ * The source directory is walked by a pool of threads sharing a queue of directories: a worker reads a directory, stats
+ * its entries with statx() and queues the subdirectories it found. The entries are then sorted by path, so that the
+ * archive does not depend on the order of the walk, and written as ustar members, with a pax extended header for the
+ * paths and link targets that do not fit their fields. The files are read by reader threads into a ring of buffers,
+ * each part of the content of the files having a sequence number in path order and a slot of the ring, while the
+ * calling thread writes the entries, taking the parts in sequence. A reader fills a slot once the writer is done with
+ * the part it held, so the readers stay at most a ring ahead of the writer. Against the index of a previous archive, an
+ * entry whose type, size, metadata and link target are the same in that index is left out, without reading the previous
+ * archive, and the paths of the previous archive that disappeared or changed type are written to a deletion manifest.
+ * Such a delta starts with a pax global header holding a comment, which the index records, so that a delta is always
+ * taken against a full archive: a delta taken against another one would miss the changes of the deltas before it.
+ */
+
+#define TAR_CREATE_CHUNK (1 << 20)               // Size of the buffer through which the archive is written
+#define TAR_PAX_RECORDS (2 * TAR_PATH_MAX + 64) // Room for the path and link target records of an extended header
+#define TAR_RING_PART (256 << 10)               // Largest part of a file read into a slot of the ring
+#define TAR_RING_SLOTS 64                        // Slots of the ring, the parts read ahead of the writer
+#define TAR_RING_BATCH 64                        // Most small files read as a single part, a bit each in a mask
+#define TAR_DELTA_NAME "PaxHeaders/delta"         // Name in the global header marking a delta
+#define TAR_DELTA_COMMENT "delta of tar_create()" // Comment of the global header marking a delta
+
+typedef struct tar_source
+{
+    char *path;     // Path relative to the source directory, with a trailing '/' for a directory
+    char *linkname; // Target of a symbolic link, NULL otherwise
+    uint64_t size;  // Size of a regular file, 0 otherwise
+    int64_t mtime;  // Modification time
+    uint32_t uid;   // Owner
+    uint32_t gid;   // Group
+    mode_t mode;    // Type and permission bits
+    size_t base;    // Entry of the same path in the previous archive, TAR_NO_ENTRY if there is none
+    int write;      // Whether the entry goes in the archive
+} tar_source_t;
+
+typedef struct tar_walk
+{
+    int root_fd;           // The source directory
+    char **dirs;           // Directories left to read, relative to the source directory
+    size_t no_dirs;        // Number of directories left to read
+    size_t cap_dirs;       // Capacity of the dirs array
+    int busy;              // Number of workers reading a directory
+    tar_source_t *sources; // Entries found
+    size_t no_sources;     // Number of entries found
+    size_t cap_sources;    // Capacity of the sources array
+    int err;               // First error, 0 if there was none
+    pthread_mutex_t lock;  // Protects the walk
+    pthread_cond_t cond;   // Signaled when directories are queued and when the last busy worker is done
+} tar_walk_t;
+
+typedef struct tar_writer
+{
+    int fd;           // The file written
+    uint8_t *buf;     // Bytes not written yet, TAR_CREATE_CHUNK bytes
+    size_t len;       // Number of bytes in the buffer
+    uint64_t written; // Number of bytes written to the file
+} tar_writer_t;
+
+/**
+ * @brief Frees the strings of entries of the source directory
+ *
+ * @param sources The entries
+ * @param no_sources The number of entries
+ */
+void sources_free(tar_source_t *sources, size_t no_sources)
+{
+    for (size_t i = 0; i < no_sources; i++)
+    {
+        free(sources[i].path);
+        free(sources[i].linkname);
+    }
+}
+
+/**
+ * @brief Gets the metadata of an entry of a directory, asking statx() for the fields of a header only
+ *
+ * Without statx(), in older kernels and some sandboxes, the entry is stated with fstatat().
+ *
+ * @param dir_fd The directory
+ * @param name The name of the entry
+ * @param st Receives the type, permissions, owner, group, size and modification time of the entry
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int source_stat(int dir_fd, const char *name, struct stat *st)
+{
+    struct statx stx;
+    unsigned int mask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_MTIME | STATX_SIZE;
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC, mask, &stx) < 0)
+    {
+        return errno == ENOSYS || errno == EPERM ? fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW) : -1;
+    }
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = stx.stx_mode;
+    st->st_uid = stx.stx_uid;
+    st->st_gid = stx.stx_gid;
+    st->st_size = stx.stx_size;
+    st->st_mtime = stx.stx_mtime.tv_sec;
+    return 0;
+}
+
+/**
+ * @brief Opens a regular file of the source directory for reading
+ *
+ * The file may have been replaced since the walk, so it is opened without blocking, as a FIFO would block until a
+ * writer opens it, and only kept if it is still a regular file.
+ *
+ * @param root_fd The source directory
+ * @param path The path of the file, relative to the source directory
+ * @return int The file descriptor, -1 on error (errno is set, ENOENT if it is no longer a regular file)
+ */
+int source_open(int root_fd, const char *path)
+{
+    int fd = openat(root_fd, path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    struct stat st;
+    int err = fd < 0 || fstat(fd, &st) < 0 ? errno : !S_ISREG(st.st_mode) ? ENOENT : 0;
+    if (err)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Reads a directory of the source directory
+ *
+ * Regular files, directories and symbolic links are kept, other types of files are ignored, and so are entries that
+ * disappear while the directory is read.
+ *
+ * @param root_fd The source directory
+ * @param dir The directory, relative to the source directory with a trailing '/', empty for the source directory
+ * @param found Receives the entries of the directory, to free with sources_free() and free()
+ * @param no_found Receives the number of entries
+ * @return int 0 on success, an errno value on error
+ */
+int walk_dir(int root_fd, const char *dir, tar_source_t **found, size_t *no_found)
+{
+    *found = NULL;
+    *no_found = 0;
+    int fd = openat(root_fd, dir[0] != '\0' ? dir : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return errno == ENOENT ? 0 : errno;
+    }
+    DIR *stream = fdopendir(fd);
+    if (stream == NULL)
+    {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+
+    size_t dir_len = strlen(dir);
+    size_t cap_found = 0;
+    int err = 0;
+    struct dirent *dirent;
+    while (!err && (errno = 0, dirent = readdir(stream)) != NULL)
+    {
+        const char *name = dirent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        {
+            continue;
+        }
+
+        if (dirent->d_type != DT_UNKNOWN && dirent->d_type != DT_REG && dirent->d_type != DT_DIR &&
+            dirent->d_type != DT_LNK) // Not stated at all
+        {
+            continue;
+        }
+        struct stat st;
+        if (source_stat(fd, name, &st) < 0)
+        {
+            err = errno == ENOENT ? 0 : errno;
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode))
+        {
+            continue;
+        }
+
+        // Paths beyond the 256 bytes of a header go in a pax path record, up to PATH_MAX, which the files could
+        // no longer be opened by nor the index hold
+        size_t name_len = strlen(name);
+        if (dir_len + name_len + 2 > TAR_PATH_MAX)
+        {
+            err = ENAMETOOLONG;
+            break;
+        }
+        if (*no_found == cap_found)
+        {
+            cap_found = cap_found ? cap_found * 2 : 64;
+            tar_source_t *grown = realloc(*found, cap_found * sizeof(tar_source_t));
+            if (grown == NULL)
+            {
+                err = ENOMEM;
+                break;
+            }
+            *found = grown;
+        }
+
+        tar_source_t *source = &(*found)[*no_found];
+        memset(source, 0, sizeof(tar_source_t));
+        source->path = malloc(dir_len + name_len + 2);
+        if (source->path == NULL)
+        {
+            err = ENOMEM;
+            break;
+        }
+        (*no_found)++;
+        sprintf(source->path, "%s%s%s", dir, name, S_ISDIR(st.st_mode) ? "/" : "");
+        source->size = S_ISREG(st.st_mode) ? st.st_size : 0;
+        source->mtime = st.st_mtime;
+        source->uid = st.st_uid;
+        source->gid = st.st_gid;
+        source->mode = st.st_mode;
+        source->base = TAR_NO_ENTRY;
+        if (S_ISLNK(st.st_mode))
+        {
+            char target[TAR_PATH_MAX];
+            ssize_t len = readlinkat(fd, name, target, sizeof(target));
+            if (len < 0 || len == sizeof(target))
+            {
+                err = len < 0 ? errno : ENAMETOOLONG;
+                break;
+            }
+            source->linkname = strndup(target, len);
+            err = source->linkname == NULL ? ENOMEM : 0;
+        }
+    }
+    if (!err && dirent == NULL && errno != 0)
+    {
+        err = errno;
+    }
+    closedir(stream);
+
+    if (err)
+    {
+        sources_free(*found, *no_found);
+        free(*found);
+        *found = NULL;
+        *no_found = 0;
+    }
+    return err;
+}
+
+/**
+ * @brief Adds the entries of a directory to the walk and queues its subdirectories, with the lock held
+ *
+ * @param walk The walk
+ * @param found The entries, whose strings are taken by the walk
+ * @param no_found The number of entries
+ * @return int 0 on success, ENOMEM if the memory could not be allocated
+ */
+int walk_add(tar_walk_t *walk, tar_source_t *found, size_t no_found)
+{
+    size_t no_subdirs = 0;
+    for (size_t i = 0; i < no_found; i++)
+    {
+        no_subdirs += S_ISDIR(found[i].mode) != 0;
+    }
+    if (walk->no_sources + no_found > walk->cap_sources)
+    {
+        size_t cap = walk->cap_sources ? walk->cap_sources : 1024;
+        while (cap < walk->no_sources + no_found)
+        {
+            cap *= 2;
+        }
+        tar_source_t *grown = realloc(walk->sources, cap * sizeof(tar_source_t));
+        if (grown == NULL)
+        {
+            return ENOMEM;
+        }
+        walk->sources = grown;
+        walk->cap_sources = cap;
+    }
+    if (walk->no_dirs + no_subdirs > walk->cap_dirs)
+    {
+        size_t cap = walk->cap_dirs ? walk->cap_dirs : 64;
+        while (cap < walk->no_dirs + no_subdirs)
+        {
+            cap *= 2;
+        }
+        char **grown = realloc(walk->dirs, cap * sizeof(char *));
+        if (grown == NULL)
+        {
+            return ENOMEM;
+        }
+        walk->dirs = grown;
+        walk->cap_dirs = cap;
+    }
+
+    for (size_t i = 0; i < no_found; i++)
+    {
+        if (S_ISDIR(found[i].mode))
+        {
+            char *dir = strdup(found[i].path);
+            if (dir == NULL)
+            {
+                return ENOMEM;
+            }
+            walk->dirs[walk->no_dirs++] = dir;
+        }
+    }
+    memcpy(walk->sources + walk->no_sources, found, no_found * sizeof(tar_source_t));
+    walk->no_sources += no_found;
+    return 0;
+}
+
+/**
+ * @brief Reads the queued directories until none is left and no worker is busy, run by every thread of the walk
+ *
+ * @param arg The walk
+ * @return void* NULL
+ */
+void *walk_worker(void *arg)
+{
+    tar_walk_t *walk = arg;
+    pthread_mutex_lock(&walk->lock);
+    for (;;)
+    {
+        while (walk->no_dirs == 0 && walk->busy > 0 && walk->err == 0)
+        {
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        }
+        if (walk->no_dirs == 0 || walk->err != 0)
+        {
+            break;
+        }
+        char *dir = walk->dirs[--walk->no_dirs];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        tar_source_t *found;
+        size_t no_found;
+        int err = walk_dir(walk->root_fd, dir, &found, &no_found);
+        free(dir);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->busy--;
+        if (!err && (err = walk_add(walk, found, no_found)) != 0)
+        {
+            sources_free(found, no_found);
+        }
+        free(found);
+        if (err && walk->err == 0)
+        {
+            walk->err = err;
+        }
+        pthread_cond_broadcast(&walk->cond);
+    }
+    pthread_cond_broadcast(&walk->cond); // Wake the idle workers up, the walk is over
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+/**
+ * @brief Orders entries of the source directory by path
+ */
+int source_cmp(const void *a, const void *b)
+{
+    return strcmp(((const tar_source_t *)a)->path, ((const tar_source_t *)b)->path);
+}
+
+/**
+ * @brief Walks the source directory in parallel
+ *
+ * @param root_fd The source directory
+ * @param no_threads The number of threads, zero for one per online processor
+ * @param sources Receives the entries found, sorted by path, to free with sources_free() and free()
+ * @param no_sources Receives the number of entries
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int walk_tree(int root_fd, int no_threads, tar_source_t **sources, size_t *no_sources)
+{
+    tar_walk_t walk = {root_fd, NULL, 0, 0, 0, NULL, 0, 0, 0};
+    walk.dirs = malloc(sizeof(char *));
+    char *root = strdup("");
+    if (walk.dirs == NULL || root == NULL)
+    {
+        free(walk.dirs);
+        free(root);
+        errno = ENOMEM;
+        return -1;
+    }
+    walk.dirs[walk.no_dirs++] = root;
+    walk.cap_dirs = 1;
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+
+    if (no_threads <= 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        no_threads = online > 0 ? online : 1;
+    }
+    pthread_t *threads = malloc(no_threads * sizeof(pthread_t));
+    int started = 0;
+    while (threads != NULL && started < no_threads - 1 &&
+           pthread_create(&threads[started], NULL, walk_worker, &walk) == 0)
+    {
+        started++;
+    }
+    walk_worker(&walk); // The calling thread works too, and alone if no thread could be started
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_cond_destroy(&walk.cond);
+    pthread_mutex_destroy(&walk.lock);
+    for (size_t i = 0; i < walk.no_dirs; i++) // Left by an error
+    {
+        free(walk.dirs[i]);
+    }
+    free(walk.dirs);
+
+    if (walk.err)
+    {
+        sources_free(walk.sources, walk.no_sources);
+        free(walk.sources);
+        errno = walk.err;
+        return -1;
+    }
+    qsort(walk.sources, walk.no_sources, sizeof(tar_source_t), source_cmp);
+    *sources = walk.sources;
+    *no_sources = walk.no_sources;
+    return 0;
+}
+
+/**
+ * @brief Checks from the index of the previous archive whether an entry of the source directory changed
+ *
+ * @param base The previous archive
+ * @param source The entry, whose base is set
+ * @return int 1 if the entry is new or changed, 0 if its type, metadata, size and link target are the same
+ */
+int source_changed(tar_archive_t *base, const tar_source_t *source)
+{
+    if (source->base == TAR_NO_ENTRY)
+    {
+        return 1;
+    }
+    tar_entry_t *entry = &base->entries[source->base];
+    int same_type = S_ISDIR(source->mode)   ? entry->typeflag == DIRTYPE
+                    : S_ISLNK(source->mode) ? entry->typeflag == SYMTYPE
+                                            : type_is_file(entry->typeflag);
+    if (!same_type || entry->header_offset < 0 || entry->mode != (source->mode & 07777) || entry->uid != source->uid ||
+        entry->gid != source->gid || entry->mtime != source->mtime)
+    {
+        return 1;
+    }
+    if (S_ISLNK(source->mode))
+    {
+        return entry->linkname == TAR_NO_NAME || strcmp(base->pool + entry->linkname, source->linkname) != 0;
+    }
+    return entry->size != source->size;
+}
+
+typedef struct tar_create_hash
+{
+    tar_archive_t *base;   // The previous archive
+    int root_fd;           // The source directory
+    tar_source_t *sources; // Entries of the source directory
+    size_t *files;         // Positions of the files to hash in the sources array
+} tar_create_hash_t;
+
+/**
+ * @brief Hashes a file of the source directory and compares it with the CRC of the previous archive, run by the
+ *        thread pool
+ *
+ * @param i The task
+ * @param ctx The hashing
+ * @param buf The buffer of the worker, of TAR_CREATE_CHUNK bytes, NULL if it could not be allocated
+ */
+void create_hash_task(size_t i, void *ctx, void *buf)
+{
+    tar_create_hash_t *hashing = ctx;
+    tar_source_t *source = &hashing->sources[hashing->files[i]];
+    tar_entry_t *entry = &hashing->base->entries[source->base];
+    source->write = 1; // Unless the content is shown to be the same
+    if (entry->typeflag == GNUTYPE_SPARSE) // Not hashed while indexing
+    {
+        return;
+    }
+
+    int fd = buf == NULL ? -1 : source_open(hashing->root_fd, source->path);
+    uint32_t crc = 0;
+    uint64_t done = 0;
+    ssize_t ret = 1;
+    while (fd >= 0 && done <= source->size && (ret = read(fd, buf, TAR_CREATE_CHUNK)) != 0)
+    {
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        crc = crc32c(crc, buf, ret);
+        done += ret;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (ret == 0 && done == source->size && crc == entry->hash)
+    {
+        source->write = 0;
+    }
+}
+
+/**
+ * @brief Writes a whole buffer to a file
+ *
+ * @param fd The file
+ * @param buf The buffer
+ * @param len The number of bytes to write
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int write_all(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t ret = write(fd, (const char *)buf + done, len - done);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes whole buffers to a file, in as few calls as the file takes
+ *
+ * @param fd The file
+ * @param iov The buffers, advanced past the bytes written
+ * @param count The number of buffers
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int writev_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        if (iov->iov_len == 0)
+        {
+            iov++;
+            count--;
+            continue;
+        }
+        ssize_t ret = writev(fd, iov, count);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        for (; count > 0 && (size_t)ret >= iov->iov_len; iov++, count--) // Skip the buffers written in full
+        {
+            ret -= iov->iov_len;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the buffered bytes of a writer to its file
+ *
+ * @param writer The writer
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int writer_flush(tar_writer_t *writer)
+{
+    if (write_all(writer->fd, writer->buf, writer->len) < 0)
+    {
+        return -1;
+    }
+    writer->written += writer->len;
+    writer->len = 0;
+    return 0;
+}
+
+/**
+ * @brief Appends bytes to a writer, or zeros
+ *
+ * @param writer The writer
+ * @param data The bytes, NULL for zeros
+ * @param len The number of bytes
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int writer_put(tar_writer_t *writer, const void *data, size_t len)
+{
+    for (size_t done = 0; done < len;)
+    {
+        if (writer->len == TAR_CREATE_CHUNK && writer_flush(writer) < 0)
+        {
+            return -1;
+        }
+        size_t part = len - done < TAR_CREATE_CHUNK - writer->len ? len - done : TAR_CREATE_CHUNK - writer->len;
+        if (data != NULL)
+        {
+            memcpy(writer->buf + writer->len, (const char *)data + done, part);
+        }
+        else
+        {
+            memset(writer->buf + writer->len, 0, part);
+        }
+        writer->len += part;
+        done += part;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a number in a numeric field of a header, in octal, or in base-256 if it does not fit
+ *
+ * @param field The field
+ * @param len The length of the field
+ * @param value The value
+ */
+void header_number(char *field, size_t len, uint64_t value)
+{
+    if (value < 1ULL << (3 * (len - 1)))
+    {
+        field[len - 1] = '\0';
+        for (size_t i = len - 1; i > 0; i--) // Zero-padded, the digits from the last one, see TAR_INT()
+        {
+            field[i - 1] = '0' + (value & 7);
+            value >>= 3;
+        }
+        return;
+    }
+    for (size_t i = len - 1; i > 0; i--) // Big endian, after the marker bit, see tar_number()
+    {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+/**
+ * @brief Computes the checksum of a header once its other fields are set
+ *
+ * @param header The header
+ */
+void header_checksum(tar_header_t *header)
+{
+    unsigned int checksum = 0;
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    for (size_t i = 0; i < sizeof(tar_header_t); i++)
+    {
+        checksum += ((const unsigned char *)header)[i];
+    }
+    snprintf(header->chksum, sizeof(header->chksum) - 1, "%06o", checksum); // Six digits, a null and a space
+}
+
+/**
+ * @brief Fills a ustar header
+ *
+ * @param header The header, zeroed
+ * @param path The path, stored in the name and prefix fields if it fits them
+ * @param linkname The target of a link, or NULL
+ * @param typeflag The type of the entry
+ * @param source The metadata of the entry
+ * @return int 1 if the path or the target does not fit the header and needs an extended header, 0 otherwise
+ */
+int header_fill(tar_header_t *header, const char *path, const char *linkname, char typeflag,
+                const tar_source_t *source)
+{
+    int extended = 0;
+    size_t len = strlen(path);
+    if (len <= sizeof(header->name))
+    {
+        memcpy(header->name, path, len);
+    }
+    else
+    {
+        // Split at a '/' leaving at most 155 bytes before it and between 1 and 100 bytes after it
+        size_t split = 0;
+        for (size_t i = len - sizeof(header->name) - 1; i <= sizeof(header->prefix) && i + 1 < len; i++)
+        {
+            if (path[i] == '/' && i > 0)
+            {
+                split = i;
+                break;
+            }
+        }
+        if (split > 0)
+        {
+            memcpy(header->prefix, path, split);
+            memcpy(header->name, path + split + 1, len - split - 1);
+        }
+        else
+        {
+            memcpy(header->name, path, sizeof(header->name)); // Truncated, for readers without pax support
+            extended = 1;
+        }
+    }
+    if (linkname != NULL)
+    {
+        size_t link_len = strlen(linkname);
+        memcpy(header->linkname, linkname, link_len < sizeof(header->linkname) ? link_len : sizeof(header->linkname));
+        extended |= link_len > sizeof(header->linkname);
+    }
+
+    header_number(header->mode, sizeof(header->mode), source->mode & 07777);
+    header_number(header->uid, sizeof(header->uid), source->uid);
+    header_number(header->gid, sizeof(header->gid), source->gid);
+    int has_payload = typeflag == REGTYPE || typeflag == XHDTYPE || typeflag == XGLTYPE;
+    header_number(header->size, sizeof(header->size), has_payload ? source->size : 0);
+    header_number(header->mtime, sizeof(header->mtime), source->mtime > 0 ? source->mtime : 0);
+    header->typeflag = typeflag;
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+    header_checksum(header);
+    return extended;
+}
+
+/**
+ * @brief Appends a record to the records of a pax extended header
+ *
+ * @param records The records, at least TAR_PAX_RECORDS bytes
+ * @param len The length of the records, updated
+ * @param key The key
+ * @param value The value
+ */
+void pax_record(char *records, size_t *len, const char *key, const char *value)
+{
+    // "<length> <key>=<value>\n", the length counting its own digits
+    size_t record_len = strlen(key) + strlen(value) + 3;
+    size_t digits = 1;
+    for (size_t power = 10; record_len + digits >= power; power *= 10)
+    {
+        digits++;
+    }
+    *len += sprintf(records + *len, "%zu %s=%s\n", record_len + digits, key, value);
+}
+
+/**
+ * @brief Writes the global header marking a delta, at the start of the archive
+ *
+ * @param writer The writer
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int create_delta_header(tar_writer_t *writer)
+{
+    char records[TAR_PAX_RECORDS];
+    size_t len = 0;
+    pax_record(records, &len, "comment", TAR_DELTA_COMMENT); // Ignored by other readers
+    tar_source_t source = {.mode = 0644, .size = len};
+    tar_header_t header;
+    memset(&header, 0, sizeof(header));
+    header_fill(&header, TAR_DELTA_NAME, NULL, XGLTYPE, &source);
+    if (writer_put(writer, &header, sizeof(header)) < 0 || writer_put(writer, records, len) < 0 ||
+        writer_put(writer, NULL, (512 - len % 512) % 512) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks whether a global header is the one marking a delta
+ *
+ * @param window The window of the scan
+ * @param data The offset of the records
+ * @param size The size of the records
+ * @return int 1 if it marks a delta, 0 otherwise
+ */
+int pax_delta(tar_window_t *window, off_t data, uint64_t size)
+{
+    char records[TAR_PAX_RECORDS];
+    size_t len = 0;
+    pax_record(records, &len, "comment", TAR_DELTA_COMMENT);
+    const char *found;
+    return size == len && window_data(window, data, len, &found) == (ssize_t)len && memcmp(found, records, len) == 0;
+}
+
+/**
+ * @brief Writes the headers of an entry, preceded by a pax extended header when it needs one
+ *
+ * @param writer The writer
+ * @param source The entry
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int create_headers(tar_writer_t *writer, const tar_source_t *source)
+{
+    char typeflag = S_ISDIR(source->mode) ? DIRTYPE : S_ISLNK(source->mode) ? SYMTYPE : REGTYPE;
+    tar_header_t header;
+    memset(&header, 0, sizeof(header));
+    if (header_fill(&header, source->path, source->linkname, typeflag, source))
+    {
+        char records[TAR_PAX_RECORDS];
+        size_t len = 0;
+        pax_record(records, &len, "path", source->path);
+        if (source->linkname != NULL)
+        {
+            pax_record(records, &len, "linkpath", source->linkname);
+        }
+
+        // Named after the entry, in a PaxHeaders directory like GNU tar does
+        char name[TAR_PATH_MAX];
+        const char *base = strrchr(source->path, '/');
+        base = base != NULL && base[1] != '\0' ? base + 1 : source->path;
+        snprintf(name, sizeof(header.name) + 1, "PaxHeaders/%s", base);
+
+        tar_source_t pax = *source;
+        pax.mode = 0644;
+        pax.size = len;
+        tar_header_t pax_header;
+        memset(&pax_header, 0, sizeof(pax_header));
+        header_fill(&pax_header, name, NULL, XHDTYPE, &pax);
+        if (writer_put(writer, &pax_header, sizeof(pax_header)) < 0 || writer_put(writer, records, len) < 0 ||
+            writer_put(writer, NULL, (512 - len % 512) % 512) < 0)
+        {
+            return -1;
+        }
+    }
+    return writer_put(writer, &header, sizeof(header));
+}
+
+/**
+ * @brief Writes an entry of the source directory, its headers and the content of a file
+ *
+ * If the file shrinks while it is read, its payload is padded with zeros to the size in its header, and only that
+ * size is read if it grows.
+ *
+ * @param writer The writer
+ * @param root_fd The source directory
+ * @param source The entry
+ * @return int 1 if the entry was written, 0 if it disappeared, -1 on error (errno is set)
+ */
+int create_entry(tar_writer_t *writer, int root_fd, const tar_source_t *source)
+{
+    int fd = -1;
+    if (S_ISREG(source->mode))
+    {
+        fd = source_open(root_fd, source->path);
+        if (fd < 0)
+        {
+            return errno == ENOENT ? 0 : -1;
+        }
+    }
+
+    int ret = create_headers(writer, source);
+    for (uint64_t done = 0; ret == 0 && done < source->size;)
+    {
+        if (writer->len == TAR_CREATE_CHUNK && (ret = writer_flush(writer)) < 0)
+        {
+            break;
+        }
+        size_t room = TAR_CREATE_CHUNK - writer->len;
+        size_t want = source->size - done < room ? source->size - done : room;
+        ssize_t len = read(fd, writer->buf + writer->len, want); // Straight into the buffer of the writer
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len < 0)
+        {
+            ret = -1;
+            break;
+        }
+        if (len == 0) // The file shrank
+        {
+            memset(writer->buf + writer->len, 0, want);
+            len = want;
+        }
+        writer->len += len;
+        done += len;
+    }
+    if (ret == 0)
+    {
+        ret = writer_put(writer, NULL, (512 - source->size % 512) % 512);
+    }
+
+    if (fd >= 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    return ret < 0 ? -1 : 1;
+}
+
+typedef struct tar_ring_slot
+{
+    uint8_t *data;     // TAR_RING_PART bytes
+    size_t len;        // Number of bytes of the part
+    uint64_t vanished; // Bit k set if the file k of its job vanished before it was opened
+    int err;           // 0, or the errno of a file of the job that could not be read
+    uint64_t seq;      // Sequence number + 1 of the part held, 0 before the first one
+} tar_ring_slot_t;
+
+typedef struct tar_ring
+{
+    int root_fd;                           // The source directory
+    tar_source_t *sources;                 // Entries of the source directory
+    size_t *files;                         // Positions of the files to read in the sources array, in path order
+    size_t no_files;                       // Number of files to read
+    size_t *job_file;                      // First file of each job, then no_files
+    uint64_t *job_seq;                     // Sequence number of the first part of each job, then the total
+    size_t no_jobs;                        // Number of jobs
+    size_t next;                           // Next job to read, taken atomically
+    uint64_t consumed;                     // Number of parts written by the writer
+    int abort;                             // Set by the writer on an error, stopping the readers
+    size_t job;                            // Job of the file being written, only used by the writer
+    uint64_t seq;                          // Part being written, only used by the writer
+    size_t pos;                            // Position in that part, only used by the writer
+    tar_ring_slot_t slots[TAR_RING_SLOTS]; // Part seq is held by slot seq % TAR_RING_SLOTS
+    pthread_mutex_t lock;                  // Protects consumed, abort and the sequence numbers of the slots
+    pthread_cond_t filled;                 // Signaled when a slot is filled
+    pthread_cond_t freed;                  // Signaled when a slot is written, or on abort
+} tar_ring_t;
+
+/**
+ * @brief Gets the number of parts of the ring a job is read in, a job of empty files taking one to tell if they
+ *        vanished
+ *
+ * @param bytes The total size of the files of the job
+ * @return uint64_t The number of parts
+ */
+uint64_t ring_parts(uint64_t bytes)
+{
+    return bytes == 0 ? 1 : (bytes + TAR_RING_PART - 1) / TAR_RING_PART;
+}
+
+/**
+ * @brief Waits until the slot of a part is no longer needed by the writer, in a reader
+ *
+ * @param ring The ring
+ * @param seq The part
+ * @return tar_ring_slot_t* The slot, which belongs to the reader until it is published, NULL on abort
+ */
+tar_ring_slot_t *ring_acquire(tar_ring_t *ring, uint64_t seq)
+{
+    pthread_mutex_lock(&ring->lock);
+    while (seq >= ring->consumed + TAR_RING_SLOTS && !ring->abort)
+    {
+        pthread_cond_wait(&ring->freed, &ring->lock);
+    }
+    int abort = ring->abort;
+    pthread_mutex_unlock(&ring->lock);
+    return abort ? NULL : &ring->slots[seq % TAR_RING_SLOTS];
+}
+
+/**
+ * @brief Hands a filled slot over to the writer
+ *
+ * @param ring The ring
+ * @param slot The slot
+ * @param seq The part it holds
+ */
+void ring_publish(tar_ring_t *ring, tar_ring_slot_t *slot, uint64_t seq)
+{
+    pthread_mutex_lock(&ring->lock);
+    slot->seq = seq + 1;
+    pthread_cond_broadcast(&ring->filled);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/**
+ * @brief Reads the jobs in turn into the slots of the ring, each part once the writer is done with its slot, run by
+ *        every reader thread
+ *
+ * A job is read by a single reader, as the contents of its files one after the other split in parts, up to
+ * TAR_RING_SLOTS parts ahead of the writer. A file that shrinks is padded with zeros to its size, like
+ * create_entry() does, and so is a file that vanished, to keep the place of the next ones.
+ *
+ * @param arg The ring
+ * @return void* NULL
+ */
+void *ring_reader(void *arg)
+{
+    tar_ring_t *ring = arg;
+    size_t j;
+    while ((j = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED)) < ring->no_jobs)
+    {
+        uint64_t seq = ring->job_seq[j];
+        tar_ring_slot_t *slot = ring_acquire(ring, seq);
+        if (slot == NULL)
+        {
+            return NULL;
+        }
+        slot->len = 0;
+        slot->vanished = 0;
+        slot->err = 0;
+        for (size_t k = 0; k < ring->job_file[j + 1] - ring->job_file[j]; k++)
+        {
+            const tar_source_t *source = &ring->sources[ring->files[ring->job_file[j] + k]];
+            int fd = source_open(ring->root_fd, source->path);
+            int err = fd < 0 && errno != ENOENT ? errno : 0;
+            slot->vanished |= (uint64_t)(fd < 0 && errno == ENOENT) << k;
+            for (uint64_t left = source->size; left > 0;)
+            {
+                if (slot->len == TAR_RING_PART) // Only for a large file, alone in its job
+                {
+                    uint64_t vanished = slot->vanished;
+                    ring_publish(ring, slot, seq++);
+                    if ((slot = ring_acquire(ring, seq)) == NULL)
+                    {
+                        if (fd >= 0)
+                        {
+                            close(fd);
+                        }
+                        return NULL;
+                    }
+                    slot->len = 0;
+                    slot->vanished = vanished;
+                    slot->err = err;
+                }
+                size_t want = left < TAR_RING_PART - slot->len ? left : TAR_RING_PART - slot->len;
+                size_t len = 0;
+                while (fd >= 0 && !err && len < want)
+                {
+                    ssize_t ret = read(fd, slot->data + slot->len + len, want - len);
+                    if (ret < 0 && errno != EINTR)
+                    {
+                        err = errno;
+                    }
+                    if (ret == 0) // The file shrank
+                    {
+                        break;
+                    }
+                    len += ret > 0 ? ret : 0;
+                }
+                memset(slot->data + slot->len + len, 0, want - len);
+                slot->len += want;
+                left -= want;
+            }
+            slot->err = slot->err ? slot->err : err;
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+        ring_publish(ring, slot, seq);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Waits until a part is read, in the writer
+ *
+ * @param ring The ring
+ * @param seq The part
+ * @return tar_ring_slot_t* The slot holding the part
+ */
+tar_ring_slot_t *ring_wait(tar_ring_t *ring, uint64_t seq)
+{
+    tar_ring_slot_t *slot = &ring->slots[seq % TAR_RING_SLOTS];
+    pthread_mutex_lock(&ring->lock);
+    while (slot->seq != seq + 1)
+    {
+        pthread_cond_wait(&ring->filled, &ring->lock);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return slot;
+}
+
+/**
+ * @brief Gives the slot of a part back to the readers, once the writer is done with it
+ *
+ * @param ring The ring
+ * @param seq The part
+ */
+void ring_release(tar_ring_t *ring, uint64_t seq)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->consumed = seq + 1;
+    pthread_cond_broadcast(&ring->freed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/**
+ * @brief Writes a file of the source directory from the parts read into the ring, in the thread of the writer
+ *
+ * @param ring The ring
+ * @param writer The writer
+ * @param i The position of the file in the files of the ring, each file being written in turn
+ * @return int 1 if the file was written, 0 if it vanished, -1 on error (errno is set)
+ */
+int ring_write(tar_ring_t *ring, tar_writer_t *writer, size_t i)
+{
+    const tar_source_t *source = &ring->sources[ring->files[i]];
+    if (i == ring->job_file[ring->job + 1])
+    {
+        ring->job++;
+    }
+    if (i == ring->job_file[ring->job])
+    {
+        ring->seq = ring->job_seq[ring->job];
+        ring->pos = 0;
+    }
+
+    tar_ring_slot_t *slot = ring_wait(ring, ring->seq);
+    int vanished = (slot->vanished >> (i - ring->job_file[ring->job])) & 1;
+    if (slot->err != 0)
+    {
+        errno = slot->err;
+        return -1;
+    }
+    if (!vanished && create_headers(writer, source) < 0)
+    {
+        return -1;
+    }
+    for (uint64_t left = source->size; left > 0;)
+    {
+        if (ring->pos == slot->len)
+        {
+            ring_release(ring, ring->seq++);
+            ring->pos = 0;
+            slot = ring_wait(ring, ring->seq);
+            if (slot->err != 0)
+            {
+                errno = slot->err;
+                return -1;
+            }
+        }
+        size_t len = left < slot->len - ring->pos ? left : slot->len - ring->pos;
+        if (!vanished && writer_put(writer, slot->data + ring->pos, len) < 0)
+        {
+            return -1;
+        }
+        ring->pos += len;
+        left -= len;
+    }
+    if (i + 1 == ring->job_file[ring->job + 1]) // The last file of its job
+    {
+        ring_release(ring, ring->seq);
+    }
+    if (!vanished && writer_put(writer, NULL, (512 - source->size % 512) % 512) < 0)
+    {
+        return -1;
+    }
+    return !vanished;
+}
+
+/**
+ * @brief Sets up the ring for the files to write and starts its readers
+ *
+ * The files are grouped in jobs, taken by the readers in order: a file larger than a part alone, or consecutive
+ * smaller files filling at most one part, so that millions of small files do not cost a hand-over each.
+ *
+ * @param ring The ring, zeroed
+ * @param root_fd The source directory
+ * @param sources The entries of the source directory, sorted by path
+ * @param no_sources The number of entries
+ * @param base The previous archive, or NULL if every entry is written
+ * @param no_threads The number of readers, zero for one per online processor
+ * @param threads Receives the readers, to give to ring_stop()
+ * @return int The number of readers started, 0 if there are none to read the files, in which case the ring is not
+ *             set up
+ */
+int ring_start(tar_ring_t *ring, int root_fd, tar_source_t *sources, size_t no_sources, tar_archive_t *base,
+               int no_threads, pthread_t **threads)
+{
+    *threads = NULL;
+    ring->root_fd = root_fd;
+    ring->sources = sources;
+    ring->files = malloc((no_sources ? no_sources : 1) * sizeof(size_t));
+    ring->job_file = malloc((no_sources + 1) * sizeof(size_t));
+    ring->job_seq = malloc((no_sources + 1) * sizeof(uint64_t));
+    uint8_t *data = malloc((size_t)TAR_RING_SLOTS * TAR_RING_PART);
+    if (ring->files == NULL || ring->job_file == NULL || ring->job_seq == NULL || data == NULL)
+    {
+        free(ring->files);
+        free(ring->job_file);
+        free(ring->job_seq);
+        free(data);
+        return 0;
+    }
+
+    size_t job_files = 0;   // Files of the job being grouped
+    uint64_t job_bytes = 0; // Their total size
+    ring->job_seq[0] = 0;
+    for (size_t i = 0; i < no_sources; i++)
+    {
+        if (!S_ISREG(sources[i].mode) || (base != NULL && !sources[i].write))
+        {
+            continue;
+        }
+        uint64_t size = sources[i].size;
+        if (job_files > 0 && (job_bytes + size > TAR_RING_PART || job_files == TAR_RING_BATCH))
+        {
+            ring->job_seq[ring->no_jobs + 1] = ring->job_seq[ring->no_jobs] + ring_parts(job_bytes);
+            ring->no_jobs++;
+            job_files = 0;
+            job_bytes = 0;
+        }
+        if (job_files == 0)
+        {
+            ring->job_file[ring->no_jobs] = ring->no_files;
+        }
+        ring->files[ring->no_files++] = i;
+        job_files++;
+        job_bytes += size;
+    }
+    if (job_files > 0)
+    {
+        ring->job_seq[ring->no_jobs + 1] = ring->job_seq[ring->no_jobs] + ring_parts(job_bytes);
+        ring->no_jobs++;
+    }
+    ring->job_file[ring->no_jobs] = ring->no_files;
+
+    for (int i = 0; i < TAR_RING_SLOTS; i++)
+    {
+        ring->slots[i].data = data + (size_t)i * TAR_RING_PART;
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->filled, NULL);
+    pthread_cond_init(&ring->freed, NULL);
+
+    if (no_threads <= 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        no_threads = online > 0 ? online : 1;
+    }
+    *threads = malloc(no_threads * sizeof(pthread_t));
+    int started = 0;
+    while (*threads != NULL && started < no_threads &&
+           pthread_create(&(*threads)[started], NULL, ring_reader, ring) == 0)
+    {
+        started++;
+    }
+    if (started == 0)
+    {
+        free(*threads);
+        *threads = NULL;
+        pthread_cond_destroy(&ring->freed);
+        pthread_cond_destroy(&ring->filled);
+        pthread_mutex_destroy(&ring->lock);
+        free(ring->files);
+        free(ring->job_file);
+        free(ring->job_seq);
+        free(data);
+    }
+    return started;
+}
+
+/**
+ * @brief Stops the readers of the ring, once every file is written or after an error, and frees the ring
+ *
+ * @param ring The ring
+ * @param threads The readers
+ * @param no_threads The number of readers
+ */
+void ring_stop(tar_ring_t *ring, pthread_t *threads, int no_threads)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->abort = 1; // Only readers waiting for the writer after an error are left
+    pthread_cond_broadcast(&ring->freed);
+    pthread_mutex_unlock(&ring->lock);
+    for (int i = 0; i < no_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_cond_destroy(&ring->freed);
+    pthread_cond_destroy(&ring->filled);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->slots[0].data);
+    free(ring->files);
+    free(ring->job_file);
+    free(ring->job_seq);
+}
+
+/**
+ * Creates an archive of a directory, or the delta of a directory against a previous archive.
+ *
+ * The directory is walked in parallel and its regular files, directories and symbolic links are written in the
+ * order of their paths, relative to the directory, so that the archive does not depend on the order of the walk. The
+ * files are read by as many threads into a bounded ring of buffers, ahead of a single writer emitting the entries in
+ * that order, and the archive is the same byte for byte whatever the number of threads.
+ * Against a previous archive, only the entries that are new or whose type, size, modification time, permissions,
+ * owner, group or link target changed are written, which is decided from the index of the previous archive without
+ * reading it, and the paths of the previous archive that are gone or changed type are written to a deletion
+ * manifest. A delta holds every change since a full archive, so the previous archive must be a full archive and
+ * not another delta, which a delta marks with a pax global header. A directory is restored by extracting the full
+ * archive, then removing the paths of the manifest of the latest delta and extracting that delta alone.
+ *
+ * @param dir The path of the source directory.
+ * @param out_fd The file the archive is written to.
+ * @param base A handle returned by tar_open() on the previous full archive, or NULL to write every entry.
+ * @param manifest_fd The file the deletion manifest is written to, a path per line, or -1.
+ * @param no_threads The number of threads walking the directory and reading the files, zero for one per online
+ *                   processor.
+ * @param flags Zero or TAR_CREATE_HASH to also leave out the files whose CRC32C is the same as in the previous
+ *              archive despite a different modification time, the previous archive having been opened with
+ *              TAR_OPEN_HASH.
+ * @param report Receives the counts of the entries, or NULL.
+ *
+ * @return zero on success,
+ *         -1 on error (errno is set, EINVAL if the previous archive is a delta, ENAMETOOLONG if a path of the
+ *         directory is PATH_MAX bytes or more).
+ */
+int tar_create(const char *dir, int out_fd, tar_archive_t *base, int manifest_fd, int no_threads, int flags,
+               tar_create_report_t *report)
+{
+    if ((flags & TAR_CREATE_HASH) && (base == NULL || !base->hashed))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (base != NULL && base->delta) // The changes since the full archive would be lost
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    int root_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0)
+    {
+        return -1;
+    }
+
+    tar_source_t *sources;
+    size_t no_sources;
+    if (walk_tree(root_fd, no_threads, &sources, &no_sources) < 0)
+    {
+        int err = errno;
+        close(root_fd);
+        errno = err;
+        return -1;
+    }
+
+    tar_create_report_t counts = {0};
+    counts.no_entries = no_sources;
+    tar_writer_t writer = {out_fd, malloc(TAR_CREATE_CHUNK), 0, 0};
+    uint8_t *deleted = base == NULL ? NULL : malloc(base->no_entries);
+    size_t *files = malloc((no_sources ? no_sources : 1) * sizeof(size_t));
+    int err = writer.buf == NULL || files == NULL || (base != NULL && deleted == NULL) ? ENOMEM : 0;
+    if (!err && base != NULL && create_delta_header(&writer) < 0)
+    {
+        err = errno;
+    }
+
+    // Decide what to write from the index of the previous archive, hashing only the files whose mtime changed
+    size_t no_files = 0;
+    if (!err && base != NULL)
+    {
+        memset(deleted, 1, base->no_entries);
+        for (size_t i = 0; i < no_sources; i++)
+        {
+            tar_source_t *source = &sources[i];
+            source->base = index_lookup(base, source->path);
+            source->write = source_changed(base, source);
+            if (source->base == TAR_NO_ENTRY)
+            {
+                continue;
+            }
+            tar_entry_t *entry = &base->entries[source->base];
+            int same_type = S_ISDIR(source->mode)   ? entry->typeflag == DIRTYPE
+                            : S_ISLNK(source->mode) ? entry->typeflag == SYMTYPE
+                                                    : type_is_file(entry->typeflag);
+            deleted[source->base] = !same_type; // Replaced by an entry of another type
+            if ((flags & TAR_CREATE_HASH) && source->write && same_type && S_ISREG(source->mode) &&
+                entry->header_offset >= 0 && entry->size == source->size && entry->mtime != source->mtime &&
+                entry->mode == (source->mode & 07777) && entry->uid == source->uid && entry->gid == source->gid)
+            {
+                files[no_files++] = i;
+            }
+        }
+        tar_create_hash_t hashing = {base, root_fd, sources, files};
+        pool_run(no_files, no_threads, create_hash_task, &hashing, TAR_CREATE_CHUNK);
+        counts.no_hashed = no_files;
+    }
+
+    // Readers fill the ring with the files in path order while this thread writes the entries, reading the files
+    // itself only if no reader could be started
+    tar_ring_t ring = {0};
+    pthread_t *readers = NULL;
+    int no_readers = err ? 0 : ring_start(&ring, root_fd, sources, no_sources, base, no_threads, &readers);
+    size_t file = 0;
+    for (size_t i = 0; !err && i < no_sources; i++)
+    {
+        if (base != NULL && !sources[i].write)
+        {
+            counts.no_unchanged++;
+            continue;
+        }
+        int ret = no_readers > 0 && S_ISREG(sources[i].mode) ? ring_write(&ring, &writer, file++)
+                                                              : create_entry(&writer, root_fd, &sources[i]);
+        if (ret < 0)
+        {
+            err = errno;
+        }
+        else if (ret == 0)
+        {
+            counts.no_vanished++;
+        }
+        else
+        {
+            counts.no_written++;
+        }
+    }
+    if (!err && (writer_put(&writer, NULL, 1024) < 0 || writer_flush(&writer) < 0)) // The end of archive marker
+    {
+        err = errno;
+    }
+    if (no_readers > 0)
+    {
+        ring_stop(&ring, readers, no_readers);
+    }
+    counts.bytes = writer.written;
+
+    // The deletion manifest
+    if (!err && base != NULL && manifest_fd >= 0)
+    {
+        tar_writer_t manifest = {manifest_fd, writer.buf, 0, 0};
+        for (size_t i = 1; !err && i < base->no_entries; i++)
+        {
+            if (deleted[i])
+            {
+                const char *path = entry_name(base, i);
+                if (writer_put(&manifest, path, strlen(path)) < 0 || writer_put(&manifest, "\n", 1) < 0)
+                {
+                    err = errno;
+                }
+                counts.no_deleted++;
+            }
+        }
+        if (!err && writer_flush(&manifest) < 0)
+        {
+            err = errno;
+        }
+    }
+    else if (!err && base != NULL)
+    {
+        for (size_t i = 1; i < base->no_entries; i++)
+        {
+            counts.no_deleted += deleted[i];
+        }
+    }
+
+    free(writer.buf);
+    free(deleted);
+    free(files);
+    sources_free(sources, no_sources);
+    free(sources);
+    close(root_fd);
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+    if (report != NULL)
+    {
+        *report = counts;
+    }
+    return 0;
+}
+
+/*
+ * Compact index
+ *
+ * A read-only copy of an index for archives with many millions of entries. Entries are sorted by path and cut in
+ * blocks of TAR_COMPACT_BLOCK entries:
+ *  - the paths of a block are front coded: the first one is stored in full, each next one as the length of the
+ *    prefix it shares with the previous one followed by the rest of the path,
+ *  - the metadata is stored as structure of arrays: a type byte per entry, the content hash of every entry when the
+ *    handle was opened with TAR_OPEN_HASH, and streams of variable length integers for the offsets, the sizes and
+ *    the link targets,
+ *  - every stream keeps the position of the start of each block (restart points), so a lookup is a binary search on
+ *    the first paths of the blocks followed by the decoding of a single block.
+ */
+
+#define TAR_COMPACT_BLOCK 16         // Number of entries per block
+#define TAR_COMPACT_MAGIC "TARIDX1" // Magic value of a saved compact index, with its null
+
+enum
+{
+    COMPACT_NAMES,   // Front coded paths
+    COMPACT_OFFSETS, // Offset of the header / 512 + 1 per entry, 0 for directories without a header
+    COMPACT_SIZES,   // Size of the payload per entry
+    COMPACT_LINKS,   // Length and bytes of the link target per entry, length 0 if there is none
+    COMPACT_STREAMS  // Number of streams
+};
+
+struct tar_compact
+{
+    size_t no_entries;                   // Number of entries
+    size_t no_blocks;                    // Number of blocks
+    uint8_t *types;                      // Type of each entry
+    uint32_t *hashes;                    // CRC32C of the content of each entry, or NULL if the handle was not hashed
+    uint8_t *streams[COMPACT_STREAMS];   // Variable length encoded streams
+    size_t stream_len[COMPACT_STREAMS];  // Length of each stream
+    uint32_t *restarts[COMPACT_STREAMS]; // Start of each block in each stream
+    void *memory;                        // Single block holding everything above
+    size_t memory_len;                   // Size of the block
+    tar_mph_t *mph;                      // Minimal perfect hash from the paths to their positions, or NULL
+    tar_bloom_t *bloom;                  // Filter of the paths checked before the lookup, or NULL
+};
+
+enum
+{
+    COMPACT_HAS_MPH = 1,   // A saved compact index is followed by its minimal perfect hash
+    COMPACT_HAS_BLOOM = 2, // A saved compact index is followed by its filter, after the minimal perfect hash
+    COMPACT_HAS_HASHES = 4 // A saved compact index holds the content hash of its entries, after the restart points
+};
+
+tar_bloom_t *bloom_read(int fd);
+
+/**
+ * @brief Writes a variable length integer, 7 bits per byte, the high bit set on every byte but the last
+ *
+ * @param out The destination, NULL to only compute the length
+ * @param value The integer
+ * @return size_t The number of bytes of the encoding
+ */
+size_t varint_put(uint8_t *out, uint64_t value)
+{
+    size_t len = 0;
+    do
+    {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        if (out != NULL)
+        {
+            out[len] = byte | (value ? 0x80 : 0);
+        }
+        len++;
+    } while (value);
+    return len;
+}
+
+/**
+ * @brief Reads a variable length integer
+ *
+ * @param in An in-out argument, the position of the integer then the position after it, set to NULL if the integer
+ *           does not end before the end of its stream, and left NULL by the next calls
+ * @param end The end of the stream
+ * @return uint64_t The integer, 0 if it does not end before the end of its stream
+ */
+uint64_t varint_get(const uint8_t **in, const uint8_t *end)
+{
+    uint64_t value = 0;
+    const uint8_t *pos = *in;
+    for (int shift = 0; pos != NULL && pos < end && shift < 64; shift += 7)
+    {
+        value |= (uint64_t)(*pos & 0x7f) << shift;
+        if (!(*pos++ & 0x80))
+        {
+            *in = pos;
+            return value;
+        }
+    }
+    *in = NULL;
+    return 0;
+}
+
+/**
+ * @brief Orders entries by path, for qsort_r()
+ */
+int compact_cmp(const void *a, const void *b, void *arg)
+{
+    tar_archive_t *archive = arg;
+    return strcmp(entry_name(archive, *(const uint32_t *)a), entry_name(archive, *(const uint32_t *)b));
+}
+
+/**
+ * @brief Encodes the fields of an entry in the streams, or only computes their lengths
+ *
+ * @param archive The archive
+ * @param order The entries sorted by path
+ * @param i The position of the entry in the order
+ * @param compact The compact index, whose streams are written if they are allocated
+ * @param pos An in-out array, the position in each stream
+ */
+void compact_encode(tar_archive_t *archive, uint32_t *order, size_t i, tar_compact_t *compact, size_t *pos)
+{
+    tar_entry_t *entry = &archive->entries[order[i]];
+    const char *name = entry_name(archive, order[i]);
+    size_t name_len = strlen(name);
+    uint8_t **out = compact->streams;
+
+    if (i % TAR_COMPACT_BLOCK == 0)
+    {
+        for (int k = 0; k < COMPACT_STREAMS; k++)
+        {
+            if (compact->restarts[k] != NULL)
+            {
+                compact->restarts[k][i / TAR_COMPACT_BLOCK] = pos[k];
+            }
+        }
+    }
+
+    size_t shared = 0;
+    if (i % TAR_COMPACT_BLOCK != 0) // The first path of a block is stored in full
+    {
+        const char *prev = entry_name(archive, order[i - 1]);
+        while (shared < name_len && prev[shared] == name[shared])
+        {
+            shared++;
+        }
+    }
+    pos[COMPACT_NAMES] += varint_put(out[COMPACT_NAMES] ? out[COMPACT_NAMES] + pos[COMPACT_NAMES] : NULL, shared);
+    pos[COMPACT_NAMES] += varint_put(out[COMPACT_NAMES] ? out[COMPACT_NAMES] + pos[COMPACT_NAMES] : NULL,
+                                     name_len - shared);
+    if (out[COMPACT_NAMES] != NULL)
+    {
+        memcpy(out[COMPACT_NAMES] + pos[COMPACT_NAMES], name + shared, name_len - shared);
+    }
+    pos[COMPACT_NAMES] += name_len - shared;
+
+    uint64_t offset = entry->header_offset < 0 ? 0 : entry->header_offset / 512 + 1;
+    pos[COMPACT_OFFSETS] +=
+        varint_put(out[COMPACT_OFFSETS] ? out[COMPACT_OFFSETS] + pos[COMPACT_OFFSETS] : NULL, offset);
+    pos[COMPACT_SIZES] += varint_put(out[COMPACT_SIZES] ? out[COMPACT_SIZES] + pos[COMPACT_SIZES] : NULL, entry->size);
+
+    const char *linkname = archive->pool + entry->linkname;
+    size_t link_len = strlen(linkname);
+    pos[COMPACT_LINKS] += varint_put(out[COMPACT_LINKS] ? out[COMPACT_LINKS] + pos[COMPACT_LINKS] : NULL, link_len);
+    if (out[COMPACT_LINKS] != NULL)
+    {
+        memcpy(out[COMPACT_LINKS] + pos[COMPACT_LINKS], linkname, link_len);
+    }
+    pos[COMPACT_LINKS] += link_len;
+
+    if (compact->types != NULL)
+    {
+        compact->types[i] = entry->typeflag;
+    }
+    if (compact->hashes != NULL)
+    {
+        compact->hashes[i] = entry->hash;
+    }
+}
+
+/**
+ * @brief Lays out the arrays of a compact index in its memory block
+ *
+ * @param compact The compact index, with its counts and stream lengths set
+ * @param memory The block, NULL to only compute its size
+ * @param hashed Whether the block holds the content hashes of the entries
+ * @return size_t The size of the block
+ */
+size_t compact_layout(tar_compact_t *compact, uint8_t *memory, int hashed)
+{
+    size_t len = 0;
+    for (int k = 0; k < COMPACT_STREAMS; k++)
+    {
+        if (memory != NULL)
+        {
+            compact->restarts[k] = (uint32_t *)(memory + len);
+        }
+        len += compact->no_blocks * sizeof(uint32_t);
+    }
+    if (hashed) // Aligned, right after the restart points
+    {
+        if (memory != NULL)
+        {
+            compact->hashes = (uint32_t *)(memory + len);
+        }
+        len += compact->no_entries * sizeof(uint32_t);
+    }
+    for (int k = 0; k < COMPACT_STREAMS; k++)
+    {
+        if (memory != NULL)
+        {
+            compact->streams[k] = memory + len;
+        }
+        len += compact->stream_len[k];
+    }
+    if (memory != NULL)
+    {
+        compact->types = memory + len;
+    }
+    len += compact->no_entries;
+    return len;
+}
+
+/**
+ * Builds a compact, read-only copy of the index of a handle.
+ * The content hashes of the entries are kept, for 4 more bytes per entry, when the handle was opened with
+ * TAR_OPEN_HASH.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param flags Zero or TAR_COMPACT_MPH to add a minimal perfect hash of the paths, making a lookup a single probe
+ *              instead of a binary search, for about 5 more bytes per entry, optionally combined with
+ *              TAR_COMPACT_BLOOM to add a filter answering most lookups of unknown paths, for 1.25 more bytes per
+ *              entry. Should two paths have the same 64 bits hash, lookups stay binary searches.
+ *
+ * @return a new compact index, or NULL if the memory could not be allocated.
+ */
+tar_compact_t *tar_compact_build(tar_archive_t *archive, int flags)
+{
+    tar_compact_t *compact = calloc(1, sizeof(tar_compact_t));
+    uint32_t *order = malloc(archive->no_entries * sizeof(uint32_t));
+    if (compact == NULL || order == NULL || archive->pool_len > UINT32_MAX)
+    {
+        free(compact);
+        free(order);
+        return NULL;
+    }
+
+    // Every entry but the root, sorted by path
+    compact->no_entries = archive->no_entries - 1;
+    compact->no_blocks = (compact->no_entries + TAR_COMPACT_BLOCK - 1) / TAR_COMPACT_BLOCK;
+    for (size_t i = 0; i < compact->no_entries; i++)
+    {
+        order[i] = i + 1;
+    }
+    qsort_r(order, compact->no_entries, sizeof(uint32_t), compact_cmp, archive);
+
+    // A first pass computes the length of the streams, a second one writes them
+    size_t pos[COMPACT_STREAMS] = {0};
+    for (size_t i = 0; i < compact->no_entries; i++)
+    {
+        compact_encode(archive, order, i, compact, pos);
+    }
+    memcpy(compact->stream_len, pos, sizeof(pos));
+
+    compact->memory_len = compact_layout(compact, NULL, archive->hashed);
+    compact->memory = malloc(compact->memory_len ? compact->memory_len : 1);
+    if (compact->memory == NULL)
+    {
+        free(compact);
+        free(order);
+        return NULL;
+    }
+    compact_layout(compact, compact->memory, archive->hashed);
+
+    memset(pos, 0, sizeof(pos));
+    for (size_t i = 0; i < compact->no_entries; i++)
+    {
+        compact_encode(archive, order, i, compact, pos);
+    }
+
+    if (flags & TAR_COMPACT_MPH)
+    {
+        uint64_t *hashes = malloc((compact->no_entries ? compact->no_entries : 1) * sizeof(uint64_t));
+        uint32_t *values = malloc((compact->no_entries ? compact->no_entries : 1) * sizeof(uint32_t));
+        int err = hashes == NULL || values == NULL ? ENOMEM : 0;
+        if (!err)
+        {
+            for (size_t i = 0; i < compact->no_entries; i++)
+            {
+                const char *name = entry_name(archive, order[i]);
+                hashes[i] = tar_hash(name, strlen(name));
+                values[i] = i;
+            }
+            compact->mph = mph_build(hashes, values, compact->no_entries);
+            err = compact->mph == NULL && errno != EEXIST ? errno : 0; // Paths with the same hash use binary searches
+        }
+        free(hashes);
+        free(values);
+        if (err)
+        {
+            free(order);
+            tar_compact_free(compact);
+            return NULL;
+        }
+    }
+    if (flags & TAR_COMPACT_BLOOM)
+    {
+        compact->bloom = index_build_bloom(archive);
+        if (compact->bloom == NULL)
+        {
+            free(order);
+            tar_compact_free(compact);
+            return NULL;
+        }
+    }
+
+    free(order);
+    return compact;
+}
+
+/**
+ * @brief Gets the bounds of a block of a stream of a compact index
+ *
+ * @param compact The compact index
+ * @param k The stream
+ * @param block The block
+ * @param end Set to the end of the stream
+ * @return const uint8_t* The start of the block
+ */
+const uint8_t *compact_stream(tar_compact_t *compact, int k, size_t block, const uint8_t **end)
+{
+    *end = compact->streams[k] + compact->stream_len[k];
+    return compact->streams[k] + compact->restarts[k][block];
+}
+
+/**
+ * @brief Decodes the next path of a block from the previous one
+ *
+ * @param in An in-out argument, the position of the path in the stream of the paths then the position after it
+ * @param end The end of the stream
+ * @param name An in-out argument, the previous path then the path, TAR_PATH_MAX bytes
+ * @param len An in-out argument, the length of the previous path, 0 for the first path of a block, then of the path
+ * @return int 0 on success, -1 if the index is corrupted
+ */
+int compact_next_name(const uint8_t **in, const uint8_t *end, char *name, size_t *len)
+{
+    uint64_t shared = varint_get(in, end);
+    uint64_t suffix = varint_get(in, end);
+    if (*in == NULL || shared > *len || suffix > (uint64_t)(end - *in) || shared + suffix >= TAR_PATH_MAX)
+    {
+        return -1;
+    }
+    memcpy(name + shared, *in, suffix);
+    name[shared + suffix] = '\0';
+    *in += suffix;
+    *len = shared + suffix;
+    return 0;
+}
+
+/**
+ * @brief Decodes the path of the entries of a block, stopping at a given path
+ *
+ * @param compact The compact index
+ * @param block The block
+ * @param path The path to look for, or NULL to decode the first path only
+ * @param name Receives the last path decoded, TAR_PATH_MAX bytes
+ * @return size_t The position of the path in the block, TAR_COMPACT_BLOCK if it is not in the block
+ */
+size_t compact_block_find(tar_compact_t *compact, size_t block, const char *path, char *name)
+{
+    const uint8_t *end;
+    const uint8_t *in = compact_stream(compact, COMPACT_NAMES, block, &end);
+    size_t count = compact->no_entries - block * TAR_COMPACT_BLOCK;
+    count = count < TAR_COMPACT_BLOCK ? count : TAR_COMPACT_BLOCK;
+
+    size_t len = 0;
+    name[0] = '\0';
+    for (size_t i = 0; i < count; i++)
+    {
+        if (compact_next_name(&in, end, name, &len) < 0) // Corrupted index
+        {
+            return TAR_COMPACT_BLOCK;
+        }
+
+        if (path == NULL)
+        {
+            return 0;
+        }
+        int cmp = strcmp(name, path);
+        if (cmp == 0)
+        {
+            return i;
+        }
+        if (cmp > 0) // Paths are sorted, it is not further
+        {
+            break;
+        }
+    }
+    return TAR_COMPACT_BLOCK;
+}
+
+/**
+ * @brief Decodes the path at a given position of a compact index
+ *
+ * @param compact The compact index
+ * @param i The position
+ * @param name Receives the path, TAR_PATH_MAX bytes
+ * @return int 0 on success, -1 if the index is corrupted
+ */
+int compact_name(tar_compact_t *compact, size_t i, char *name)
+{
+    size_t block = i / TAR_COMPACT_BLOCK;
+    const uint8_t *end;
+    const uint8_t *in = compact_stream(compact, COMPACT_NAMES, block, &end);
+    size_t len = 0;
+    for (size_t k = block * TAR_COMPACT_BLOCK; k <= i; k++)
+    {
+        if (compact_next_name(&in, end, name, &len) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Looks up the exact path of an entry in a compact index
+ *
+ * @param compact The compact index
+ * @param path The path
+ * @return size_t The position of the entry in the sorted order, TAR_NO_ENTRY if it is not there
+ */
+size_t compact_find(tar_compact_t *compact, const char *path)
+{
+    if (compact->no_blocks == 0)
+    {
+        return TAR_NO_ENTRY;
+    }
+
+    char name[TAR_PATH_MAX];
+    if (compact->mph != NULL) // One probe, then the path found must be the path looked up
+    {
+        uint32_t i = mph_lookup(compact->mph, tar_hash(path, strlen(path)));
+        if (i == TAR_MPH_NONE || i >= compact->no_entries || compact_name(compact, i, name) < 0)
+        {
+            return TAR_NO_ENTRY;
+        }
+        return strcmp(name, path) == 0 ? i : TAR_NO_ENTRY;
+    }
+
+    // Find the last block whose first path is not greater than the path
+    size_t low = 0;
+    size_t high = compact->no_blocks;
+    while (high - low > 1)
+    {
+        size_t mid = (low + high) / 2;
+        compact_block_find(compact, mid, NULL, name);
+        if (strcmp(name, path) <= 0)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    size_t i = compact_block_find(compact, low, path, name);
+    return i == TAR_COMPACT_BLOCK ? TAR_NO_ENTRY : low * TAR_COMPACT_BLOCK + i;
+}
+
+/**
+ * Looks up an entry in a compact index. Like the handle functions, "dir" also matches "dir/".
+ *
+ * @param compact A compact index.
+ * @param path A path to an entry in the archive.
+ * @param entry Receives the metadata of the entry.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_compact_lookup(tar_compact_t *compact, const char *path, tar_compact_entry_t *entry)
+{
+    size_t len = strlen(path);
+    if (len == 0 || len + 1 >= TAR_PATH_MAX)
+    {
+        return 0;
+    }
+    if (compact->bloom != NULL && !bloom_probe(compact->bloom, bloom_hash(path, len), 0))
+    {
+        return 0;
+    }
+
+    size_t i = compact_find(compact, path);
+    if (i == TAR_NO_ENTRY)
+    {
+        char other[TAR_PATH_MAX];
+        memcpy(other, path, len + 1);
+        if (path[len - 1] == '/')
+        {
+            other[len - 1] = '\0';
+        }
+        else
+        {
+            other[len] = '/';
+            other[len + 1] = '\0';
+        }
+        i = compact_find(compact, other);
+        if (i == TAR_NO_ENTRY)
+        {
+            return 0;
+        }
+    }
+
+    // Decode the metadata streams up to the entry in its block
+    size_t block = i / TAR_COMPACT_BLOCK;
+    const uint8_t *offsets_end;
+    const uint8_t *sizes_end;
+    const uint8_t *links_end;
+    const uint8_t *offsets = compact_stream(compact, COMPACT_OFFSETS, block, &offsets_end);
+    const uint8_t *sizes = compact_stream(compact, COMPACT_SIZES, block, &sizes_end);
+    const uint8_t *links = compact_stream(compact, COMPACT_LINKS, block, &links_end);
+    uint64_t offset = 0;
+    uint64_t link_len = 0;
+    for (size_t k = block * TAR_COMPACT_BLOCK; k <= i; k++)
+    {
+        offset = varint_get(&offsets, offsets_end);
+        entry->size = varint_get(&sizes, sizes_end);
+        link_len = varint_get(&links, links_end);
+        if (offsets == NULL || sizes == NULL || links == NULL || link_len > (uint64_t)(links_end - links))
+        {
+            return 0; // Corrupted index
+        }
+        if (k < i)
+        {
+            links += link_len;
+        }
+    }
+
+    entry->typeflag = compact->types[i];
+    entry->hash = compact->hashes != NULL ? compact->hashes[i] : 0;
+    entry->header_offset = offset == 0 ? -1 : (off_t)(offset - 1) * 512;
+    link_len = link_len < sizeof(entry->linkname) - 1 ? link_len : sizeof(entry->linkname) - 1;
+    memcpy(entry->linkname, links, link_len);
+    entry->linkname[link_len] = '\0';
+    return 1;
+}
+
+/**
+ * Gets the memory used by a compact index.
+ *
+ * @param compact A compact index.
+ *
+ * @return the number of bytes of the compact index.
+ */
+size_t tar_compact_size(tar_compact_t *compact)
+{
+    return sizeof(tar_compact_t) + compact->memory_len + (compact->mph ? mph_layout(compact->mph) : 0) +
+           (compact->bloom ? bloom_size(compact->bloom->no_blocks) : 0);
+}
+
+/**
+ * Saves a compact index to a file, to be loaded again with tar_compact_load() instead of scanning the archive.
+ *
+ * @param compact A compact index.
+ * @param fd A file descriptor open for writing, at the position where the index is written.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_compact_save(tar_compact_t *compact, int fd)
+{
+    uint64_t header[3 + COMPACT_STREAMS] = {compact->no_entries, compact->no_blocks};
+    for (int k = 0; k < COMPACT_STREAMS; k++)
+    {
+        header[2 + k] = compact->stream_len[k];
+    }
+    header[2 + COMPACT_STREAMS] = (compact->mph ? COMPACT_HAS_MPH : 0) | (compact->bloom ? COMPACT_HAS_BLOOM : 0) |
+                                  (compact->hashes ? COMPACT_HAS_HASHES : 0);
+
+    // The minimal perfect hash follows the arrays
+    uint64_t mph_header[3 + TAR_MPH_LEVELS];
+    struct iovec iov[6] = {{TAR_COMPACT_MAGIC, sizeof(TAR_COMPACT_MAGIC)},
+                           {header, sizeof(header)},
+                           {compact->memory, compact->memory_len},
+                           {NULL, 0},
+                           {NULL, 0},
+                           {compact->bloom, compact->bloom ? bloom_size(compact->bloom->no_blocks) : 0}};
+    mph_iov(compact->mph, mph_header, iov + 3);
+    return writev_all(fd, iov, 6);
+}
+
+/**
+ * @brief Reads exactly len bytes from a file
+ *
+ * @param fd The file
+ * @param buf The destination buffer
+ * @param len The number of bytes to read
+ * @return int 0 on success, -1 on error or if the file is too short (errno is set)
+ */
+int read_all(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t ret = read(fd, (char *)buf + done, len - done);
+        if (ret <= 0)
+        {
+            if (ret < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            errno = ret < 0 ? errno : EINVAL;
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads a minimal perfect hash saved in a compact index or for a handle, checking that every lookup stays in
+ *        its arrays
+ *
+ * @param fd The file, at the position of the function
+ * @param no_entries The number of keys of the function
+ * @param no_values The bound of the values of the function
+ * @return tar_mph_t* The function, NULL if it could not be read or is invalid (errno is set)
+ */
+tar_mph_t *mph_read(int fd, size_t no_entries, size_t no_values)
+{
+    uint64_t header[3 + TAR_MPH_LEVELS];
+    if (read_all(fd, header, sizeof(header)) < 0)
+    {
+        return NULL;
+    }
+    tar_mph_t counts = {.no_keys = header[0], .no_levels = header[1], .no_words = header[2]};
+    if (header[0] != no_entries || header[1] > TAR_MPH_LEVELS || (header[1] == 0) != (no_entries == 0) ||
+        header[2] > (uint64_t)TAR_MPH_LEVELS * (no_entries / 32 + 1)) // At most 2 bits per key left on each level
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    uint64_t no_words = 0;
+    for (uint32_t level = 0; level < TAR_MPH_LEVELS; level++)
+    {
+        counts.level_words[level] = header[3 + level];
+        counts.level_start[level] = no_words;
+        no_words += header[3 + level];
+        if ((level < counts.no_levels) != (header[3 + level] != 0) || header[3 + level] > counts.no_words)
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    if (no_words != counts.no_words)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t size = mph_layout(&counts);
+    tar_mph_t *mph = malloc(size);
+    if (mph == NULL)
+    {
+        return NULL;
+    }
+    *mph = counts;
+    mph_layout(mph);
+    if (read_all(fd, mph->bits, size - sizeof(tar_mph_t)) < 0)
+    {
+        free(mph);
+        return NULL;
+    }
+
+    // The ranks must be the prefix sums of the bits, up to one per key, and the values positions of entries
+    uint64_t rank = 0;
+    for (uint64_t w = 0; w < mph->no_words && rank <= mph->no_keys; w++)
+    {
+        rank = mph->ranks[w] == rank ? rank + __builtin_popcountll(mph->bits[w]) : UINT64_MAX;
+    }
+    for (uint32_t i = 0; i < mph->no_keys && rank == mph->no_keys; i++)
+    {
+        rank = mph->values[i] < no_values ? rank : UINT64_MAX;
+    }
+    if (rank != mph->no_keys)
+    {
+        free(mph);
+        errno = EINVAL;
+        return NULL;
+    }
+    return mph;
+}
+
+/**
+ * Loads a compact index saved by tar_compact_save().
+ *
+ * @param fd A file descriptor open for reading, at the position where the index was written.
+ *
+ * @return a new compact index, or NULL if it could not be read or is invalid (errno is set).
+ */
+tar_compact_t *tar_compact_load(int fd)
+{
+    char magic[sizeof(TAR_COMPACT_MAGIC)];
+    uint64_t header[3 + COMPACT_STREAMS];
+    if (read_all(fd, magic, sizeof(magic)) < 0 || memcmp(magic, TAR_COMPACT_MAGIC, sizeof(magic)) != 0 ||
+        read_all(fd, header, sizeof(header)) < 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // The counts must fit the file, and the positions of the entries and in the streams 32 bits
+    struct stat st;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    uint64_t left = pos >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size - pos : UINT64_MAX;
+    for (int k = 0; k < 2 + COMPACT_STREAMS; k++)
+    {
+        if (header[k] > UINT32_MAX || header[k] > left)
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    tar_compact_t *compact = calloc(1, sizeof(tar_compact_t));
+    if (compact == NULL)
+    {
+        return NULL;
+    }
+    compact->no_entries = header[0];
+    compact->no_blocks = header[1];
+    for (int k = 0; k < COMPACT_STREAMS; k++)
+    {
+        compact->stream_len[k] = header[2 + k];
+    }
+    if (compact->no_blocks != (compact->no_entries + TAR_COMPACT_BLOCK - 1) / TAR_COMPACT_BLOCK)
+    {
+        free(compact);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (header[2 + COMPACT_STREAMS] & ~(uint64_t)(COMPACT_HAS_MPH | COMPACT_HAS_BLOOM | COMPACT_HAS_HASHES))
+    {
+        free(compact);
+        errno = EINVAL;
+        return NULL;
+    }
+    int hashed = (header[2 + COMPACT_STREAMS] & COMPACT_HAS_HASHES) != 0;
+    compact->memory_len = compact_layout(compact, NULL, hashed);
+    if (compact->memory_len > left)
+    {
+        free(compact);
+        errno = EINVAL;
+        return NULL;
+    }
+    compact->memory = malloc(compact->memory_len ? compact->memory_len : 1);
+    if (compact->memory == NULL)
+    {
+        free(compact);
+        return NULL;
+    }
+    if (read_all(fd, compact->memory, compact->memory_len) < 0)
+    {
+        tar_compact_free(compact);
+        return NULL;
+    }
+    compact_layout(compact, compact->memory, hashed);
+
+    if (header[2 + COMPACT_STREAMS] & COMPACT_HAS_MPH) // A minimal perfect hash follows
+    {
+        compact->mph = mph_read(fd, compact->no_entries, compact->no_entries);
+        if (compact->mph == NULL)
+        {
+            tar_compact_free(compact);
+            return NULL;
+        }
+    }
+
+    if (header[2 + COMPACT_STREAMS] & COMPACT_HAS_BLOOM)
+    {
+        compact->bloom = bloom_read(fd);
+        if (compact->bloom == NULL)
+        {
+            tar_compact_free(compact);
+            return NULL;
+        }
+    }
+
+    // Restart points outside their stream would make lookups read out of bounds
+    for (int k = 0; k < COMPACT_STREAMS; k++)
+    {
+        for (size_t b = 0; b < compact->no_blocks; b++)
+        {
+            if (compact->restarts[k][b] > compact->stream_len[k])
+            {
+                tar_compact_free(compact);
+                errno = EINVAL;
+                return NULL;
+            }
+        }
+    }
+    return compact;
+}
+
+/**
+ * Releases a compact index.
+ *
+ * @param compact A compact index, or NULL.
+ */
+void tar_compact_free(tar_compact_t *compact)
+{
+    if (compact == NULL)
+    {
+        return;
+    }
+    free(compact->memory);
+    free(compact->mph);
+    free(compact->bloom);
+    free(compact);
+}
+
+/*
+ * Standalone Bloom filter
+ *
+ * The filter of a handle can be saved on its own, next to the archive, so that a process can answer the lookups of
+ * unknown paths with a few bytes per entry and without indexing or even opening the archive.
+ * There is no handle without a full index: the low memory mode is the compact index, which checks the filter added
+ * by TAR_COMPACT_BLOOM before its blocks, and the filter loaded alone stands in for a handle that is not opened.
+ */
+
+/**
+ * @brief Reads a filter saved after its magic value or in a compact index
+ *
+ * @param fd The file, at the position of the filter
+ * @return tar_bloom_t* The filter, NULL if it could not be read or is invalid (errno is set)
+ */
+tar_bloom_t *bloom_read(int fd)
+{
+    tar_bloom_t header;
+    if (read_all(fd, &header, sizeof(header)) < 0)
+    {
+        return NULL;
+    }
+    if (header.no_blocks == 0 || header.no_blocks > (SIZE_MAX - sizeof(header)) / (TAR_BLOOM_BLOCK_WORDS * 8))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    tar_bloom_t *bloom = malloc(bloom_size(header.no_blocks));
+    if (bloom == NULL)
+    {
+        return NULL;
+    }
+    *bloom = header;
+    if (read_all(fd, bloom->bits, bloom_size(header.no_blocks) - sizeof(header)) < 0)
+    {
+        free(bloom);
+        return NULL;
+    }
+    return bloom;
+}
+
+/**
+ * Builds the filter of the paths of a handle.
+ *
+ * @param archive A handle returned by tar_open().
+ *
+ * @return a new filter, or NULL if the memory could not be allocated.
+ */
+tar_bloom_t *tar_bloom_build(tar_archive_t *archive)
+{
+    return index_build_bloom(archive);
+}
+
+/**
+ * Checks whether a path may be in the archive of a filter. Like the handle functions, "dir" also matches "dir/".
+ *
+ * @param bloom A filter.
+ * @param path A path.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value if one may exist.
+ */
+int tar_bloom_check(tar_bloom_t *bloom, const char *path)
+{
+    size_t len = strlen(path);
+    if (len == 0 || (len == 1 && path[0] == '/')) // The root is always there
+    {
+        return 1;
+    }
+    return bloom_probe(bloom, bloom_hash(path, len), 0);
+}
+
+/**
+ * Gets the memory used by a filter.
+ *
+ * @param bloom A filter.
+ *
+ * @return the number of bytes of the filter.
+ */
+size_t tar_bloom_size(tar_bloom_t *bloom)
+{
+    return bloom_size(bloom->no_blocks);
+}
+
+/**
+ * Saves a filter to a file, to be loaded again with tar_bloom_load().
+ *
+ * @param bloom A filter.
+ * @param fd A file descriptor open for writing, at the position where the filter is written.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_bloom_save(tar_bloom_t *bloom, int fd)
+{
+    struct iovec iov[2] = {{TAR_BLOOM_MAGIC, sizeof(TAR_BLOOM_MAGIC)}, {bloom, bloom_size(bloom->no_blocks)}};
+    return writev_all(fd, iov, 2);
+}
+
+/**
+ * Loads a filter saved by tar_bloom_save().
+ *
+ * @param fd A file descriptor open for reading, at the position where the filter was written.
+ *
+ * @return a new filter, or NULL if it could not be read or is invalid (errno is set).
+ */
+tar_bloom_t *tar_bloom_load(int fd)
+{
+    char magic[sizeof(TAR_BLOOM_MAGIC)];
+    if (read_all(fd, magic, sizeof(magic)) < 0 || memcmp(magic, TAR_BLOOM_MAGIC, sizeof(magic)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return bloom_read(fd);
+}
+
+/**
+ * Releases a filter.
+ *
+ * @param bloom A filter, or NULL.
+ */
+void tar_bloom_free(tar_bloom_t *bloom)
+{
+    free(bloom);
+}
+
+/*
+ * Latency metrics export
+ */
+
+static const char *metrics_op_names[TAR_OPS] = {"check_archive", "exists",       "is_dir",     "is_file",
+                                                "is_symlink",    "list",         "read_file",  "read_files",
+                                                "stat",          "sparse_map",   "extract_file"};
+
+/**
+ * @brief Finds the histograms of a handle, or the global ones
+ *
+ * @param archive The handle, NULL for the global histograms
+ * @return tar_histogram_t* The histograms, NULL if the handle has none
+ */
+tar_histogram_t *metrics_of(tar_archive_t *archive)
+{
+    return archive == NULL ? metrics_global : archive->metrics;
+}
+
+/**
+ * Enables or disables the global latency histograms, which record the operations of every handle and of the
+ * functions taking a file descriptor. They are disabled by default.
+ *
+ * @param enabled Zero to disable them, any other value to enable them.
+ */
+void tar_metrics_enable(int enabled)
+{
+    __atomic_store_n(&metrics_enabled, enabled != 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Clears latency histograms. Operations running meanwhile may be partly lost.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the global histograms.
+ */
+void tar_metrics_reset(tar_archive_t *archive)
+{
+    tar_histogram_t *hists = metrics_of(archive);
+    if (hists != NULL)
+    {
+        memset(hists, 0, TAR_OPS * sizeof(tar_histogram_t));
+    }
+}
+
+/**
+ * Counts the operations recorded in a latency histogram.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the global histograms.
+ * @param op One of the TAR_OP_* operations.
+ *
+ * @return the number of operations recorded, zero if the handle was not opened with TAR_OPEN_METRICS.
+ */
+uint64_t tar_metrics_count(tar_archive_t *archive, int op)
+{
+    tar_histogram_t *hists = metrics_of(archive);
+    if (hists == NULL || op < 0 || op >= TAR_OPS)
+    {
+        return 0;
+    }
+    return __atomic_load_n(&hists[op].count, __ATOMIC_RELAXED);
+}
+
+/**
+ * Gets a quantile of the latency of an operation, e.g. 0.99 for the p99.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the global histograms.
+ * @param op One of the TAR_OP_* operations.
+ * @param quantile The fraction of the operations at most as slow as the result, between 0 and 1.
+ *
+ * @return the latency in nanoseconds, within 1/16 of the exact value, zero if no operation was recorded.
+ */
+uint64_t tar_metrics_quantile(tar_archive_t *archive, int op, double quantile)
+{
+    tar_histogram_t *hists = metrics_of(archive);
+    if (hists == NULL || op < 0 || op >= TAR_OPS)
+    {
+        return 0;
+    }
+    return hist_quantile(&hists[op], quantile);
+}
+
+/**
+ * Writes latency histograms in the Prometheus text exposition format, as one summary with the p50, p90, p99 and
+ * p999 of every operation.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the global histograms.
+ * @param label The value of an "archive" label added to every sample, or NULL for none.
+ * @param out The stream to write to.
+ *
+ * @return zero on success, -1 if the handle has no histograms or on a write error.
+ */
+int tar_metrics_dump(tar_archive_t *archive, const char *label, FILE *out)
+{
+    static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+    static const double quantile_values[] = {0.5, 0.9, 0.99, 0.999};
+    tar_histogram_t *hists = metrics_of(archive);
+    if (hists == NULL)
+    {
+        return -1;
+    }
+
+    // Label values escape backslashes, double quotes and line feeds
+    char labels[TAR_PATH_MAX + 16] = "";
+    if (label != NULL)
+    {
+        size_t len = snprintf(labels, sizeof(labels), "archive=\"");
+        for (const char *c = label; *c != '\0' && len + 6 < sizeof(labels); c++)
+        {
+            if (*c == '\\' || *c == '"' || *c == '\n')
+            {
+                labels[len++] = '\\';
+            }
+            labels[len++] = *c == '\n' ? 'n' : *c;
+        }
+        memcpy(labels + len, "\",", 3);
+    }
+
+    fprintf(out, "# HELP tar_operation_duration_seconds Latency of the archive operations.\n");
+    fprintf(out, "# TYPE tar_operation_duration_seconds summary\n");
+    for (int op = 0; op < TAR_OPS; op++)
+    {
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+        {
+            fprintf(out, "tar_operation_duration_seconds{%sop=\"%s\",quantile=\"%s\"} %.9f\n", labels,
+                    metrics_op_names[op], quantiles[q], hist_quantile(&hists[op], quantile_values[q]) * 1e-9);
+        }
+        fprintf(out, "tar_operation_duration_seconds_sum{%sop=\"%s\"} %.9f\n", labels, metrics_op_names[op],
+                __atomic_load_n(&hists[op].sum, __ATOMIC_RELAXED) * 1e-9);
+        fprintf(out, "tar_operation_duration_seconds_count{%sop=\"%s\"} %llu\n", labels, metrics_op_names[op],
+                (unsigned long long)__atomic_load_n(&hists[op].count, __ATOMIC_RELAXED));
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+ * Chunk store
+ *
+ * A directory holding the content of many archives once. Archives are cut in chunks with FastCDC: a gear hash rolls
+ * over the bytes and a chunk ends where the top bits of the hash are zero, with more bits tested before the average
+ * size than after it so that sizes cluster around the average. The hash is scalar, a byte at a time: each step
+ * depends on the previous hash, so cutting is bound to a chain of a few cycles per byte and is not vectorized. The
+ * payload of every file starts a chunk, so a file shared by archives gives the same chunks whatever headers precede
+ * it. Chunks are named by their SHA-256 and stored once:
+ *  - "chunks" holds the chunks one after the other and is only ever appended to,
+ *  - "index" lists the SHA-256, the offset and the length of every chunk, loaded in a hash table on open,
+ *  - "recipes/<name>" lists the chunks of an archive in order, the archive being their concatenation.
+ * An archive of the store is read through a handle mapping its offsets to chunks, so the files shared by many
+ * archives are read from the same place of the store and stay in the page cache.
+ */
+
+#define TAR_CDC_MIN (16 << 10)     // Smallest chunk, no cut point is looked for before it
+#define TAR_CDC_AVG (64 << 10)     // Average chunk
+#define TAR_CDC_MAX (256 << 10)    // Largest chunk
+#define TAR_CDC_BITS 16            // log2(TAR_CDC_AVG)
+#define TAR_STORE_BUFFER (8 << 20) // Size of the buffer through which archives are ingested and extracted
+#define TAR_STORE_MAGIC "TARSTO1"  // Magic value of the index of a store, with its null
+#define TAR_RECIPE_MAGIC "TARRCP1" // Magic value of a recipe, with its null
+#define TAR_STORE_NONE UINT32_MAX  // Empty slot of the hash table of the chunks
+
+// Cut masks over the top bits of the hash: two more bits before the average size, two fewer after it
+#define TAR_CDC_MASK_S (~0ULL << (64 - TAR_CDC_BITS - 2))
+#define TAR_CDC_MASK_L (~0ULL << (64 - TAR_CDC_BITS + 2))
+
+typedef struct tar_chunk
+{
+    uint8_t digest[32]; // SHA-256 of the chunk
+    uint64_t offset;    // Offset of the chunk in the chunks file
+    uint64_t len;       // Length of the chunk
+} tar_chunk_t;
+
+struct tar_store
+{
+    int dir_fd;          // The directory of the store
+    int chunks_fd;       // The chunks file, opened for appending
+    int index_fd;        // The index file, opened for appending
+    uint64_t index_len;  // Number of bytes of the index file loaded
+    uint64_t chunks_len; // Size of the chunks file while an ingest holds the lock
+    tar_chunk_t *chunks; // Every chunk, in the order of the index
+    size_t no_chunks;    // Number of chunks
+    size_t cap_chunks;   // Capacity of the chunks array
+    uint32_t *slots;     // Hash table of the digests, a chunk per slot
+    size_t no_slots;     // Number of slots, a power of two
+    uint64_t gear[256];  // Value of every byte for the gear hash
+};
+
+typedef struct tar_recipe
+{
+    int chunks_fd;     // The chunks file of the store
+    uint64_t *offsets; // Offset in the chunks file of every chunk of the archive
+    uint64_t *starts;  // Offset in the archive of every chunk, followed by the size of the archive
+    size_t no_chunks;  // Number of chunks
+} tar_recipe_t;
+
+/**
+ * @brief Finds the end of the next chunk with FastCDC, rolling the gear hash a byte at a time
+ *
+ * @param gear The value of every byte
+ * @param data The bytes from the start of the chunk
+ * @param len The number of bytes, at most TAR_CDC_MAX, fewer only at the end of a payload
+ * @return size_t The length of the chunk
+ */
+size_t cdc_cut(const uint64_t *gear, const uint8_t *data, size_t len)
+{
+    if (len <= TAR_CDC_MIN)
+    {
+        return len;
+    }
+    size_t normal = len < TAR_CDC_AVG ? len : TAR_CDC_AVG;
+    uint64_t hash = 0;
+    size_t i = TAR_CDC_MIN;
+    for (; i < normal; i++)
+    {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & TAR_CDC_MASK_S))
+        {
+            return i + 1;
+        }
+    }
+    for (; i < len; i++)
+    {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & TAR_CDC_MASK_L))
+        {
+            return i + 1;
+        }
+    }
+    return len;
+}
+
+/**
+ * @brief Finds the slot of a digest in the hash table of a store
+ *
+ * @param store The store
+ * @param digest The SHA-256
+ * @return size_t The slot holding the chunk of the digest, or the empty slot where it would go
+ */
+size_t store_slot(tar_store_t *store, const uint8_t *digest)
+{
+    uint64_t key;
+    memcpy(&key, digest, sizeof(key)); // A SHA-256 is already uniform
+    size_t slot = key & (store->no_slots - 1);
+    while (store->slots[slot] != TAR_STORE_NONE &&
+           memcmp(store->chunks[store->slots[slot]].digest, digest, sizeof(store->chunks->digest)) != 0)
+    {
+        slot = (slot + 1) & (store->no_slots - 1);
+    }
+    return slot;
+}
+
+/**
+ * @brief Fills the hash table of a store again with its chunks
+ *
+ * @param store The store
+ */
+void store_rehash(tar_store_t *store)
+{
+    memset(store->slots, 0xff, store->no_slots * sizeof(uint32_t)); // TAR_STORE_NONE
+    for (size_t i = 0; i < store->no_chunks; i++)
+    {
+        store->slots[store_slot(store, store->chunks[i].digest)] = i;
+    }
+}
+
+/**
+ * @brief Doubles the hash table of a store, rehashing every chunk
+ *
+ * @param store The store
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int store_grow(tar_store_t *store)
+{
+    size_t no_slots = store->no_slots ? store->no_slots * 2 : 1024;
+    uint32_t *slots = malloc(no_slots * sizeof(uint32_t));
+    if (slots == NULL)
+    {
+        return -1;
+    }
+    free(store->slots);
+    store->slots = slots;
+    store->no_slots = no_slots;
+    store_rehash(store);
+    return 0;
+}
+
+/**
+ * @brief Adds a chunk to the table of a store, without writing it
+ *
+ * @param store The store
+ * @param chunk The chunk
+ * @return size_t The id of the chunk, TAR_NO_ENTRY if the memory could not be allocated
+ */
+size_t store_insert(tar_store_t *store, const tar_chunk_t *chunk)
+{
+    if (store->no_chunks >= TAR_STORE_NONE)
+    {
+        return TAR_NO_ENTRY;
+    }
+    if ((store->no_chunks + 1) * 2 > store->no_slots && store_grow(store) < 0)
+    {
+        return TAR_NO_ENTRY;
+    }
+    if (store->no_chunks == store->cap_chunks)
+    {
+        size_t cap = store->cap_chunks ? store->cap_chunks * 2 : 1024;
+        tar_chunk_t *chunks = realloc(store->chunks, cap * sizeof(tar_chunk_t));
+        if (chunks == NULL)
+        {
+            return TAR_NO_ENTRY;
+        }
+        store->chunks = chunks;
+        store->cap_chunks = cap;
+    }
+    size_t id = store->no_chunks++;
+    store->chunks[id] = *chunk;
+    store->slots[store_slot(store, chunk->digest)] = id;
+    return id;
+}
+
+/**
+ * @brief Loads the records appended to the index of a store since it was last loaded
+ *
+ * Records of chunks beyond the end of the chunks file, left by an interrupted ingest, are ignored.
+ *
+ * @param store The store
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int store_sync(tar_store_t *store)
+{
+    struct stat index_st;
+    struct stat chunks_st;
+    if (fstat(store->index_fd, &index_st) < 0 || fstat(store->chunks_fd, &chunks_st) < 0)
+    {
+        return -1;
+    }
+    if ((uint64_t)index_st.st_size < store->index_len + sizeof(tar_chunk_t))
+    {
+        return 0;
+    }
+
+    size_t no_records = (index_st.st_size - store->index_len) / sizeof(tar_chunk_t);
+    tar_chunk_t *records = malloc(no_records * sizeof(tar_chunk_t));
+    if (records == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (full_pread(store->index_fd, records, no_records * sizeof(tar_chunk_t), store->index_len) !=
+        (ssize_t)(no_records * sizeof(tar_chunk_t)))
+    {
+        free(records);
+        errno = EIO;
+        return -1;
+    }
+    for (size_t i = 0; i < no_records; i++)
+    {
+        if (records[i].offset + records[i].len > (uint64_t)chunks_st.st_size)
+        {
+            break;
+        }
+        if (store_insert(store, &records[i]) == TAR_NO_ENTRY) // The ids of the chunks are their positions
+        {
+            free(records);
+            errno = ENOMEM;
+            return -1;
+        }
+        store->index_len += sizeof(tar_chunk_t);
+    }
+    free(records);
+    return 0;
+}
+
+/**
+ * Opens a chunk store.
+ *
+ * @param dir The directory of the store.
+ * @param flags Zero or TAR_STORE_CREATE to create the store if it does not exist.
+ *
+ * @return a new store, or NULL on error (errno is set).
+ */
+tar_store_t *tar_store_open(const char *dir, int flags)
+{
+    int create = (flags & TAR_STORE_CREATE) != 0;
+    if (create && mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        return NULL;
+    }
+
+    tar_store_t *store = calloc(1, sizeof(tar_store_t));
+    if (store == NULL)
+    {
+        return NULL;
+    }
+    store->chunks_fd = -1;
+    store->index_fd = -1;
+    store->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store->dir_fd < 0 || (create && mkdirat(store->dir_fd, "recipes", 0755) < 0 && errno != EEXIST))
+    {
+        tar_store_close(store);
+        return NULL;
+    }
+    int open_flags = O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT : 0);
+    store->chunks_fd = openat(store->dir_fd, "chunks", open_flags, 0644);
+    store->index_fd = openat(store->dir_fd, "index", open_flags, 0644);
+    if (store->chunks_fd < 0 || store->index_fd < 0)
+    {
+        tar_store_close(store);
+        return NULL;
+    }
+
+    // Processes creating the store at the same time must not both find it empty and write the magic value
+    if (create && flock(store->index_fd, LOCK_EX) < 0)
+    {
+        tar_store_close(store);
+        return NULL;
+    }
+    char magic[sizeof(TAR_STORE_MAGIC)];
+    ssize_t len = full_pread(store->index_fd, magic, sizeof(magic), 0);
+    int err = 0;
+    if (len == 0 && create)
+    {
+        err = write_all(store->index_fd, TAR_STORE_MAGIC, sizeof(magic)) < 0 ? errno : 0;
+    }
+    else if (len != sizeof(magic) || memcmp(magic, TAR_STORE_MAGIC, sizeof(magic)) != 0)
+    {
+        err = len < 0 ? errno : EINVAL;
+    }
+    if (create)
+    {
+        flock(store->index_fd, LOCK_UN);
+    }
+    if (err)
+    {
+        tar_store_close(store);
+        errno = err;
+        return NULL;
+    }
+    store->index_len = sizeof(magic);
+
+    for (int i = 0; i < 256; i++)
+    {
+        store->gear[i] = mph_mix(i, TAR_MPH_LEVELS + 2); // Fixed forever, the chunks of a store depend on it
+    }
+    if (store_grow(store) < 0 || store_sync(store) < 0)
+    {
+        err = errno;
+        tar_store_close(store);
+        errno = err ? err : ENOMEM;
+        return NULL;
+    }
+    return store;
+}
+
+/**
+ * Closes a chunk store. Handles returned by tar_store_archive() must be closed first.
+ *
+ * @param store A store returned by tar_store_open(), or NULL.
+ */
+void tar_store_close(tar_store_t *store)
+{
+    if (store == NULL)
+    {
+        return;
+    }
+    int err = errno;
+    if (store->dir_fd >= 0)
+    {
+        close(store->dir_fd);
+    }
+    if (store->chunks_fd >= 0)
+    {
+        close(store->chunks_fd);
+    }
+    if (store->index_fd >= 0)
+    {
+        close(store->index_fd);
+    }
+    free(store->chunks);
+    free(store->slots);
+    free(store);
+    errno = err;
+}
+
+/**
+ * @brief Checks whether a name can name an archive of a store, a single path component
+ */
+int store_name_valid(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 0 && len < NAME_MAX - 8 && name[0] != '.' && strchr(name, '/') == NULL;
+}
+
+/**
+ * @brief Orders offsets
+ */
+int bound_cmp(const void *a, const void *b)
+{
+    uint64_t bound_a = *(const uint64_t *)a;
+    uint64_t bound_b = *(const uint64_t *)b;
+    return (bound_a > bound_b) - (bound_a < bound_b);
+}
+
+/**
+ * @brief Collects the offsets where chunks must be cut, the starts and the ends of the payloads of regular files
+ *
+ * @param tar_fd The archive
+ * @param size The size of the archive
+ * @param bounds Receives the sorted offsets, 0 and the size included, to free
+ * @param no_bounds Receives the number of offsets
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int store_bounds(int tar_fd, uint64_t size, uint64_t **bounds, size_t *no_bounds)
+{
+    tar_archive_t *archive = tar_open(tar_fd, TAR_ACCESS_SEQUENTIAL);
+    if (archive == NULL)
+    {
+        return -1;
+    }
+    *bounds = malloc((2 * archive->no_entries + 2) * sizeof(uint64_t));
+    if (*bounds == NULL)
+    {
+        tar_close(archive);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t n = 0;
+    (*bounds)[n++] = 0;
+    (*bounds)[n++] = size;
+    for (size_t i = 1; i < archive->no_entries; i++)
+    {
+        tar_entry_t *entry = &archive->entries[i];
+        uint64_t start = entry->header_offset + 512;
+        if (entry->header_offset >= 0 && (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE) &&
+            entry->size > 0 && start + entry->size <= size)
+        {
+            (*bounds)[n++] = start;
+            (*bounds)[n++] = start + entry->size;
+        }
+    }
+    tar_close(archive);
+
+    qsort(*bounds, n, sizeof(uint64_t), bound_cmp);
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (unique == 0 || (*bounds)[i] != (*bounds)[unique - 1])
+        {
+            (*bounds)[unique++] = (*bounds)[i];
+        }
+    }
+    *no_bounds = unique;
+    return 0;
+}
+
+/**
+ * @brief Stores a chunk unless the store already has it
+ *
+ * @param store The store, locked
+ * @param data The chunk
+ * @param len The length of the chunk
+ * @param report Counts the chunk
+ * @return size_t The id of the chunk, TAR_NO_ENTRY on error (errno is set)
+ */
+size_t store_put(tar_store_t *store, const uint8_t *data, size_t len, tar_store_report_t *report)
+{
+    tar_chunk_t chunk;
+    tar_sha256_t sha;
+    sha256_init(&sha);
+    sha256_update(&sha, data, len);
+    sha256_final(&sha, chunk.digest);
+    report->no_chunks++;
+
+    uint32_t id = store->slots[store_slot(store, chunk.digest)];
+    if (id != TAR_STORE_NONE)
+    {
+        return id;
+    }
+
+    if (write_all(store->chunks_fd, data, len) < 0)
+    {
+        return TAR_NO_ENTRY;
+    }
+    chunk.offset = store->chunks_len;
+    chunk.len = len;
+    store->chunks_len += len;
+    size_t new_id = store_insert(store, &chunk);
+    if (new_id == TAR_NO_ENTRY)
+    {
+        errno = ENOMEM;
+        return TAR_NO_ENTRY;
+    }
+    report->no_new_chunks++;
+    report->new_bytes += len;
+    return new_id;
+}
+
+/**
+ * Adds an archive to a chunk store, storing the chunks the store does not have yet.
+ *
+ * Ingests are serialized by a lock on the store, and may run while archives of the store are being read.
+ *
+ * @param store A store returned by tar_store_open().
+ * @param name The name of the archive in the store, a path component not starting with '.'. An archive of the same
+ *             name is replaced.
+ * @param tar_fd A file descriptor of the archive, read with pread().
+ * @param report Receives the counts of the chunks, or NULL.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_store_ingest(tar_store_t *store, const char *name, int tar_fd, tar_store_report_t *report)
+{
+    struct stat st;
+    if (!store_name_valid(name))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fstat(tar_fd, &st) < 0)
+    {
+        return -1;
+    }
+
+    uint64_t *bounds;
+    size_t no_bounds;
+    if (store_bounds(tar_fd, st.st_size, &bounds, &no_bounds) < 0)
+    {
+        return -1;
+    }
+
+    tar_store_report_t counts = {st.st_size, 0, 0, 0};
+    uint8_t *buf = malloc(TAR_STORE_BUFFER);
+    uint32_t *ids = NULL;
+    size_t no_ids = 0;
+    size_t cap_ids = 0;
+    int err = buf == NULL ? ENOMEM : 0;
+    int locked = !err && flock(store->index_fd, LOCK_EX) == 0;
+    if (!err && !locked)
+    {
+        err = errno;
+    }
+    // Load the chunks added by other processes since the store was opened, and drop a record torn by a crash
+    struct stat chunks_st;
+    if (!err && (store_sync(store) < 0 || ftruncate(store->index_fd, store->index_len) < 0 ||
+                 fstat(store->chunks_fd, &chunks_st) < 0))
+    {
+        err = errno;
+    }
+    store->chunks_len = err ? 0 : chunks_st.st_size;
+    uint64_t first_offset = store->chunks_len;
+    size_t first_new = store->no_chunks;
+
+    // Cut every range between two bounds in chunks, the buffer always holding a whole chunk from pos
+    uint64_t buf_start = 0;
+    size_t buf_len = 0;
+    for (size_t b = 0; !err && b + 1 < no_bounds; b++)
+    {
+        for (uint64_t pos = bounds[b]; !err && pos < bounds[b + 1];)
+        {
+            size_t want = bounds[b + 1] - pos < TAR_CDC_MAX ? bounds[b + 1] - pos : TAR_CDC_MAX;
+            if (pos + want > buf_start + buf_len)
+            {
+                size_t keep = buf_start + buf_len - pos;
+                memmove(buf, buf + (pos - buf_start), keep);
+                buf_start = pos;
+                ssize_t ret = full_pread(tar_fd, buf + keep, TAR_STORE_BUFFER - keep, buf_start + keep);
+                buf_len = ret < 0 ? keep : keep + ret;
+                if (buf_len < want) // The archive shrank
+                {
+                    err = ret < 0 ? errno : EIO;
+                    break;
+                }
+            }
+
+            size_t len = cdc_cut(store->gear, buf + (pos - buf_start), want);
+            size_t id = store_put(store, buf + (pos - buf_start), len, &counts);
+            if (id == TAR_NO_ENTRY)
+            {
+                err = errno;
+                break;
+            }
+            if (no_ids == cap_ids)
+            {
+                cap_ids = cap_ids ? cap_ids * 2 : 1024;
+                uint32_t *grown = realloc(ids, cap_ids * sizeof(uint32_t));
+                if (grown == NULL)
+                {
+                    err = ENOMEM;
+                    break;
+                }
+                ids = grown;
+            }
+            ids[no_ids++] = id;
+            pos += len;
+        }
+    }
+
+    // The chunks reach the disk before the index records naming them, and those before the recipe using them
+    size_t records_len = (store->no_chunks - first_new) * sizeof(tar_chunk_t);
+    if (!err && (fdatasync(store->chunks_fd) < 0 ||
+                 write_all(store->index_fd, store->chunks + first_new, records_len) < 0 ||
+                 fdatasync(store->index_fd) < 0))
+    {
+        err = errno;
+    }
+    if (!err)
+    {
+        store->index_len += records_len;
+    }
+
+    char tmp[NAME_MAX + 1];
+    char path[NAME_MAX + 1];
+    snprintf(tmp, sizeof(tmp), "recipes/.%s.tmp", name);
+    snprintf(path, sizeof(path), "recipes/%s", name);
+    int fd = err ? -1 : openat(store->dir_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (!err && fd < 0)
+    {
+        err = errno;
+    }
+    if (!err)
+    {
+        uint64_t header[2] = {no_ids, st.st_size};
+        if (write_all(fd, TAR_RECIPE_MAGIC, sizeof(TAR_RECIPE_MAGIC)) < 0 ||
+            write_all(fd, header, sizeof(header)) < 0 || write_all(fd, ids, no_ids * sizeof(uint32_t)) < 0 ||
+            fsync(fd) < 0 || renameat(store->dir_fd, tmp, store->dir_fd, path) < 0)
+        {
+            err = errno;
+            unlinkat(store->dir_fd, tmp, 0);
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (!err)
+    {
+        fsync(store->dir_fd);
+    }
+    else if (locked)
+    {
+        // The ids of the chunks are their positions in the index, so chunks without a record must not be reused
+        store->no_chunks = first_new;
+        store_rehash(store);
+        // Should this fail too, the next ingest truncates the index again and only loads the records of whole chunks
+        ftruncate(store->chunks_fd, first_offset);
+        ftruncate(store->index_fd, store->index_len);
+    }
+
+    if (locked)
+    {
+        flock(store->index_fd, LOCK_UN);
+    }
+    free(buf);
+    free(ids);
+    free(bounds);
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+    if (report != NULL)
+    {
+        *report = counts;
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees a recipe
+ *
+ * @param ctx The recipe
+ */
+void recipe_free(void *ctx)
+{
+    tar_recipe_t *recipe = ctx;
+    if (recipe != NULL)
+    {
+        free(recipe->offsets);
+        free(recipe->starts);
+        free(recipe);
+    }
+}
+
+/**
+ * @brief Loads the recipe of an archive of a store
+ *
+ * @param store The store
+ * @param name The name of the archive
+ * @return tar_recipe_t* The recipe, NULL on error (errno is set)
+ */
+tar_recipe_t *recipe_load(tar_store_t *store, const char *name)
+{
+    char path[NAME_MAX + 1];
+    if (!store_name_valid(name))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "recipes/%s", name);
+    int fd = openat(store->dir_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    char magic[sizeof(TAR_RECIPE_MAGIC)];
+    uint64_t header[2];
+    tar_recipe_t *recipe = calloc(1, sizeof(tar_recipe_t));
+    uint32_t *ids = NULL;
+    int err = recipe == NULL ? ENOMEM : 0;
+    if (!err && (read_all(fd, magic, sizeof(magic)) < 0 || memcmp(magic, TAR_RECIPE_MAGIC, sizeof(magic)) != 0 ||
+                 read_all(fd, header, sizeof(header)) < 0 || header[0] > SIZE_MAX / sizeof(uint64_t) - 1))
+    {
+        err = EINVAL;
+    }
+    if (!err)
+    {
+        recipe->chunks_fd = store->chunks_fd;
+        recipe->no_chunks = header[0];
+        ids = malloc(recipe->no_chunks * sizeof(uint32_t) + 1);
+        recipe->offsets = malloc(recipe->no_chunks * sizeof(uint64_t) + 1);
+        recipe->starts = malloc((recipe->no_chunks + 1) * sizeof(uint64_t));
+        err = ids == NULL || recipe->offsets == NULL || recipe->starts == NULL ? ENOMEM : 0;
+    }
+    if (!err && read_all(fd, ids, recipe->no_chunks * sizeof(uint32_t)) < 0)
+    {
+        err = EINVAL;
+    }
+    close(fd);
+
+    // A recipe written by another process may use chunks added since the store was opened
+    if (!err && recipe->no_chunks > 0 && store_sync(store) < 0)
+    {
+        err = errno;
+    }
+    uint64_t start = 0;
+    for (size_t i = 0; !err && i < recipe->no_chunks; i++)
+    {
+        if (ids[i] >= store->no_chunks)
+        {
+            err = EINVAL;
+            break;
+        }
+        recipe->offsets[i] = store->chunks[ids[i]].offset;
+        recipe->starts[i] = start;
+        start += store->chunks[ids[i]].len;
+    }
+    if (!err && start != header[1])
+    {
+        err = EINVAL;
+    }
+    free(ids);
+    if (err)
+    {
+        recipe_free(recipe);
+        errno = err;
+        return NULL;
+    }
+    recipe->starts[recipe->no_chunks] = start;
+    return recipe;
+}
+
+/**
+ * @brief Reads bytes of an archive of a store, the read_at function of its handles
+ *
+ * @param ctx The recipe of the archive
+ * @param buf The destination buffer
+ * @param len The number of bytes to read
+ * @param offset The offset in the archive
+ * @return ssize_t The number of bytes read, fewer than len only at the end of the archive, -1 on error
+ */
+ssize_t recipe_read(void *ctx, void *buf, size_t len, off_t offset)
+{
+    tar_recipe_t *recipe = ctx;
+    uint64_t size = recipe->starts[recipe->no_chunks];
+    if (offset < 0 || (uint64_t)offset >= size)
+    {
+        return 0;
+    }
+    if (len > size - offset)
+    {
+        len = size - offset;
+    }
+
+    // The last chunk starting at or before the offset
+    size_t lo = 0;
+    size_t hi = recipe->no_chunks;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (recipe->starts[mid] <= (uint64_t)offset)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    size_t done = 0;
+    for (size_t k = lo; done < len; k++)
+    {
+        uint64_t skip = offset + done - recipe->starts[k];
+        uint64_t left = recipe->starts[k + 1] - recipe->starts[k] - skip;
+        size_t part = len - done < left ? len - done : left;
+        ssize_t ret = full_pread(recipe->chunks_fd, (uint8_t *)buf + done, part, recipe->offsets[k] + skip);
+        if (ret < 0 || (size_t)ret < part)
+        {
+            errno = ret < 0 ? errno : EIO;
+            return -1;
+        }
+        done += part;
+    }
+    return done;
+}
+
+/**
+ * Opens a handle on an archive of a chunk store, its reads being served from the chunks of the store.
+ *
+ * The handle supports every function taking a handle, and must be closed before the store.
+ *
+ * @param store A store returned by tar_store_open().
+ * @param name The name given to tar_store_ingest().
+ * @param flags The flags of tar_open(), TAR_OPEN_DIRECT being ignored.
+ *
+ * @return a new handle, or NULL on error (errno is set).
+ */
+tar_archive_t *tar_store_archive(tar_store_t *store, const char *name, int flags)
+{
+    tar_recipe_t *recipe = recipe_load(store, name);
+    if (recipe == NULL)
+    {
+        return NULL;
+    }
+    return archive_open(-1, flags, recipe_read, recipe, recipe_free, -1);
+}
+
+/**
+ * Writes an archive of a chunk store, byte for byte as it was ingested.
+ *
+ * @param store A store returned by tar_store_open().
+ * @param name The name given to tar_store_ingest().
+ * @param out_fd The file the archive is written to.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_store_extract(tar_store_t *store, const char *name, int out_fd)
+{
+    tar_recipe_t *recipe = recipe_load(store, name);
+    uint8_t *buf = recipe == NULL ? NULL : malloc(TAR_STORE_BUFFER);
+    int ret = buf == NULL ? -1 : 0;
+    if (recipe != NULL && buf == NULL)
+    {
+        errno = ENOMEM;
+    }
+
+    uint64_t size = recipe == NULL ? 0 : recipe->starts[recipe->no_chunks];
+    for (uint64_t done = 0; ret == 0 && done < size;)
+    {
+        ssize_t len = recipe_read(recipe, buf, TAR_STORE_BUFFER, done);
+        if (len <= 0 || write_all(out_fd, buf, len) < 0)
+        {
+            errno = len == 0 ? EIO : errno;
+            ret = -1;
+            break;
+        }
+        done += len;
+    }
+
+    int err = errno;
+    free(buf);
+    recipe_free(recipe);
+    errno = err;
+    return ret;
+}
+
+/*
+ * In-place deletion
+ *
+ * Deleting entries turns their members into dead members: pax extended headers whose only record is a comment
+ * spanning the whole member, the old bytes being its value, so that every reader skips them. Only a header and both
+ * ends of the record are written. On filesystems supporting FALLOC_FL_COLLAPSE_RANGE, the blocks of the file lying
+ * entirely in a run of deleted members are then removed from the file, dead members covering the partial blocks at
+ * both ends. Elsewhere, or with TAR_DELETE_MARK, the space stays in the file until tar_vacuum() moves the live members
+ * over the dead ones in a single pass. The index of the handle follows both without scanning the archive again.
+ */
+
+#define TAR_DEAD_KEY "comment"             // Key of the record of a dead member
+#define TAR_DEAD_NAME "PaxHeaders/deleted" // Name in the header of a dead member
+#define TAR_DEAD_MAX (64 << 20)            // Largest records of a dead member, as other readers load them in memory
+#define TAR_MOVE_CHUNK (1 << 30)           // Largest copy of tar_vacuum()
+
+typedef struct tar_range
+{
+    off_t start;   // Offset of the first byte
+    off_t end;     // Offset after the last byte
+    int deleted;   // Whether a member being deleted is in the range, not only dead members
+    off_t removed; // Bytes of the range removed from the file
+    off_t shift;   // Bytes removed from the file up to the end of the range, this one included
+} tar_range_t;
+
+typedef struct tar_member
+{
+    off_t start;             // Offset of its first header, its extended headers included
+    off_t end;               // Offset after its padded payload
+    int dead;                // Whether it is a dead member
+    char path[TAR_PATH_MAX]; // Path of the entry, empty for a dead member or an entry left out of the index
+} tar_member_t;
+
+/**
+ * @brief Checks whether an extended header is a dead member
+ *
+ * @param window The window of the scan
+ * @param data The offset of the records
+ * @param size The size of the records
+ * @return int 1 if there are no records or a single comment, 0 otherwise
+ */
+int pax_dead(tar_window_t *window, off_t data, uint64_t size)
+{
+    if (size == 0)
+    {
+        return 1;
+    }
+    char prefix[32];
+    int len = snprintf(prefix, sizeof(prefix), "%llu " TAR_DEAD_KEY "=", (unsigned long long)size);
+    const char *records;
+    return (uint64_t)len < size && window_data(window, data, len, &records) == len &&
+           memcmp(records, prefix, len) == 0;
+}
+
+/**
+ * @brief Reads the next member of the archive, with the extended headers before it
+ *
+ * @param archive The archive
+ * @param window The window of the scan
+ * @param offset The offset of the member, moved to the next one
+ * @param member Receives the member
+ * @return int 1 if a member was read, 0 at the end of the archive, -1 on error (errno is set)
+ */
+int member_next(tar_archive_t *archive, tar_window_t *window, off_t *offset, tar_member_t *member)
+{
+    tar_pax_t pax = {.major = 0};
+    size_t no_regions = archive->no_regions; // The sparse maps are parsed, then dropped
+    member->start = *offset;
+    member->dead = 0;
+    member->path[0] = '\0';
+
+    const char *buf;
+    int ret;
+    int found = 0;
+    while (!found && (ret = window_header(window, *offset, &buf)) > 0 && !block_empty(buf))
+    {
+        if (check_header(buf, 1) < 0)
+        {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+        const tar_header_t *header = (const tar_header_t *)buf;
+        char typeflag = header->typeflag;
+        uint64_t size = tar_number(header->size, sizeof(header->size));
+        off_t next = *offset + 512 + next_header((tar_header_t *)header);
+        if (typeflag == GNUTYPE_LONGNAME || typeflag == GNUTYPE_LONGLINK)
+        {
+            char name[TAR_PATH_MAX];
+            int long_name = gnu_long_name(window, *offset + 512, size, typeflag == GNUTYPE_LONGNAME ? pax.path : name);
+            if (long_name < 0)
+            {
+                ret = -1;
+                break;
+            }
+            pax.skip |= long_name && typeflag == GNUTYPE_LONGNAME;
+        }
+        else if (typeflag != XHDTYPE)
+        {
+            if (pax.fields & TAR_PAX_SIZE)
+            {
+                next = *offset + 512 + (off_t)((pax.size + 511) / 512 * 512);
+            }
+            if (pax.path[0] != '\0')
+            {
+                strcpy(member->path, pax.path);
+            }
+            else if (!pax.skip) // Not under the cut name of its header, as the index left it out
+            {
+                header_path(header, member->path);
+            }
+            int extended = typeflag == GNUTYPE_SPARSE && buf[482];
+            for (off_t pos = *offset + 512; extended && window_header(window, pos, &buf) > 0; pos += 512)
+            {
+                extended = buf[504]; // Extension blocks of a sparse map
+                next += 512;
+            }
+            found = 1;
+        }
+        else if (pax_dead(window, *offset + 512, size))
+        {
+            found = *offset == member->start; // Dead members are members of their own
+            member->dead = found;
+        }
+        else if (pax_parse(archive, window, *offset + 512, size, &pax) < 0)
+        {
+            ret = -1;
+            break;
+        }
+        member->end = next;
+        *offset = next;
+    }
+
+    archive->no_regions = no_regions;
+    return ret < 0 ? -1 : found;
+}
+
+/**
+ * @brief Writes a whole buffer at a given offset of a file
+ *
+ * @param fd The file
+ * @param buf The buffer
+ * @param len The number of bytes to write
+ * @param offset The offset to write at
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int full_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t ret = pwrite(fd, (const char *)buf + done, len - done, offset + done);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Turns a range of the archive into dead members, as many as TAR_DEAD_MAX requires
+ *
+ * The ends of the records are written before the headers, and the header at the start of the range last.
+ *
+ * @param fd The archive
+ * @param start The offset of the range, a multiple of 512
+ * @param end The offset after the range, a multiple of 512
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int dead_write(int fd, off_t start, off_t end)
+{
+    off_t stride = TAR_DEAD_MAX + 512;
+    for (off_t member = start + (end - start - 1) / stride * stride; member >= start; member -= stride)
+    {
+        off_t member_end = end - member > stride ? member + stride : end;
+        uint64_t size = member_end - member - 512;
+        if (size > 0)
+        {
+            // "<size> comment=<old bytes>\n", the length of the record counting its own digits
+            char prefix[32];
+            int len = snprintf(prefix, sizeof(prefix), "%llu " TAR_DEAD_KEY "=", (unsigned long long)size);
+            if (full_pwrite(fd, prefix, len, member + 512) < 0 || full_pwrite(fd, "\n", 1, member_end - 1) < 0)
+            {
+                return -1;
+            }
+        }
+
+        tar_source_t dead = {.mode = 0644, .size = size};
+        tar_header_t header;
+        memset(&header, 0, sizeof(header));
+        header_fill(&header, TAR_DEAD_NAME, NULL, XHDTYPE, &dead);
+        if (full_pwrite(fd, &header, sizeof(header), member) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Appends a member to the ranges, merging it with the last range when they are adjacent
+ *
+ * @param ranges The ranges, which may move
+ * @param no_ranges An in-out argument, the number of ranges
+ * @param cap_ranges An in-out argument, the capacity of the ranges array
+ * @param member The member
+ * @param deleted Whether the member is being deleted
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int range_add(tar_range_t **ranges, size_t *no_ranges, size_t *cap_ranges, const tar_member_t *member, int deleted)
+{
+    if (*no_ranges > 0 && (*ranges)[*no_ranges - 1].end == member->start)
+    {
+        (*ranges)[*no_ranges - 1].end = member->end;
+        (*ranges)[*no_ranges - 1].deleted |= deleted;
+        return 0;
+    }
+    if (*no_ranges == *cap_ranges)
+    {
+        size_t cap = *cap_ranges ? *cap_ranges * 2 : 64;
+        tar_range_t *grown = realloc(*ranges, cap * sizeof(tar_range_t));
+        if (grown == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        *ranges = grown;
+        *cap_ranges = cap;
+    }
+    (*ranges)[(*no_ranges)++] = (tar_range_t){.start = member->start, .end = member->end, .deleted = deleted};
+    return 0;
+}
+
+/**
+ * @brief Gets the bytes removed from the file before an offset
+ *
+ * @param ranges The ranges, sorted, with their shifts
+ * @param no_ranges The number of ranges
+ * @param offset An offset outside of the ranges
+ * @return off_t The bytes removed before the offset
+ */
+off_t range_shift(const tar_range_t *ranges, size_t no_ranges, off_t offset)
+{
+    size_t low = 0;
+    size_t high = no_ranges; // The ranges before low end before the offset, those from high after it
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (ranges[mid].end <= offset)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low > 0 ? ranges[low - 1].shift : 0;
+}
+
+/**
+ * @brief Fills the hash table of the paths again after the entries moved, and the perfect hash if there was one
+ *
+ * @param archive The archive
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int index_rehash(tar_archive_t *archive)
+{
+    int had_mph = archive->mph != NULL;
+    if (had_mph)
+    {
+        archive->index_bytes -= mph_layout(archive->mph);
+        free(archive->mph);
+        archive->mph = NULL;
+    }
+    else
+    {
+        memset(archive->slots, 0, archive->no_slots * sizeof(uint32_t));
+    }
+    while (archive->no_entries * 2 >= archive->no_slots)
+    {
+        if (index_grow(archive) < 0)
+        {
+            return -1;
+        }
+    }
+
+    for (size_t i = 1; i < archive->no_entries; i++) // The root is not in the table
+    {
+        const char *name = entry_name(archive, i);
+        archive->slots[index_slot(archive, name, strlen(name))] = i;
+    }
+    if (had_mph)
+    {
+        index_build_mph(archive, -1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Removes entries from the index and moves the others by the bytes removed before them in the archive
+ *
+ * The filter of the paths, if any, is left as it is, a superset of the paths.
+ *
+ * @param archive The archive
+ * @param removed Whether each entry is removed, or NULL to keep every entry
+ * @param ranges The ranges of the archive, sorted, with their shifts
+ * @param no_ranges The number of ranges
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int index_compact(tar_archive_t *archive, const uint8_t *removed, const tar_range_t *ranges, size_t no_ranges)
+{
+    archive->generation++; // The entries move, the tables built before are stale
+    uint32_t *moved = malloc(archive->no_entries * sizeof(uint32_t)); // New index of every entry kept
+    if (moved == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t old_no_entries = archive->no_entries;
+    size_t no_entries = 0;
+    for (size_t i = 0; i < archive->no_entries; i++)
+    {
+        if (removed == NULL || !removed[i])
+        {
+            moved[i] = no_entries;
+            archive->entries[no_entries++] = archive->entries[i];
+        }
+    }
+    archive->no_entries = no_entries;
+
+    for (size_t i = 0; i < no_entries; i++)
+    {
+        tar_entry_t *entry = &archive->entries[i];
+        entry->parent = moved[entry->parent]; // The parent of an entry kept is kept
+        if (entry->header_offset >= 0)
+        {
+            entry->header_offset -= range_shift(ranges, no_ranges, entry->header_offset);
+        }
+    }
+    for (size_t i = 0; i < archive->no_sparse; i++)
+    {
+        archive->sparse[i].data_offset -= range_shift(ranges, no_ranges, archive->sparse[i].data_offset);
+    }
+    free(moved);
+
+    nested_drop(archive, TAR_NO_ENTRY); // Their views refer to entries by index
+    archive->index_bytes -= old_no_entries * sizeof(uint32_t); // The children array is allocated again
+    if (index_rehash(archive) < 0 || index_link_children(archive) < 0 || index_rollup(archive) < 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the entries to remove from the index, the subtrees of the paths and the directories they empty
+ *
+ * @param archive The archive
+ * @param paths The paths to delete
+ * @param no_paths The number of paths
+ * @return uint8_t* Whether each entry is removed, NULL on error (errno is set)
+ */
+uint8_t *delete_entries(tar_archive_t *archive, char **paths, size_t no_paths)
+{
+    uint8_t *removed = calloc(archive->no_entries, 1);
+    if (removed == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i = 0; i < no_paths; i++)
+    {
+        size_t index = index_lookup(archive, paths[i]);
+        if (index == TAR_NO_ENTRY || index == TAR_ROOT)
+        {
+            free(removed);
+            errno = index == TAR_ROOT ? EINVAL : ENOENT;
+            return NULL;
+        }
+        removed[index] = 1;
+    }
+
+    for (size_t i = 1; i < archive->no_entries; i++) // Everything under a directory deleted
+    {
+        for (size_t parent = archive->entries[i].parent; parent != TAR_ROOT && !removed[i];
+             parent = archive->entries[parent].parent)
+        {
+            removed[i] = removed[parent];
+        }
+    }
+
+    // Directories without a header exist only through their children
+    for (int changed = 1; changed;)
+    {
+        changed = 0;
+        for (size_t i = 1; i < archive->no_entries; i++)
+        {
+            tar_entry_t *entry = &archive->entries[i];
+            if (removed[i] || entry->header_offset >= 0 || entry->no_children == 0)
+            {
+                continue;
+            }
+            uint32_t child = 0;
+            while (child < entry->no_children && removed[archive->children[entry->first_child + child]])
+            {
+                child++;
+            }
+            if (child == entry->no_children)
+            {
+                removed[i] = 1;
+                changed = 1;
+            }
+        }
+    }
+    return removed;
+}
+
+/**
+ * Deletes entries from an archive in place.
+ *
+ * Every member of the paths is turned into a dead member, the older members of the same paths included, and the
+ * blocks of the file in runs of dead members are removed with FALLOC_FL_COLLAPSE_RANGE where the filesystem supports
+ * it. The archive stays readable by any tar reader. The index of the handle is updated, and must not be used by other
+ * threads meanwhile. Hard links to the files deleted are not followed. The entries being renumbered, the list cursors,
+ * the sample iterators and the tables of the handle become stale: they then fail with ESTALE.
+ *
+ * @param archive A handle on an archive opened with O_RDWR, not a handle of a chunk store.
+ * @param paths The paths of the entries, directories being deleted with everything under them.
+ * @param no_paths The number of paths.
+ * @param flags Zero or TAR_DELETE_MARK to only mark the members as dead.
+ * @param report Receives the counts of the deletion, or NULL.
+ *
+ * @return zero on success, -1 on error (errno is set), ENOENT if a path is not in the archive, in which case nothing
+ *         is deleted. After other errors the archive is valid, but the handle must be opened again.
+ */
+int tar_delete(tar_archive_t *archive, char **paths, size_t no_paths, int flags, tar_delete_report_t *report)
+{
+    tar_delete_report_t counts = {.no_entries = 0};
+    if (archive->read_at != NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    uint8_t *removed = delete_entries(archive, paths, no_paths);
+    tar_window_t window;
+    if (removed == NULL || window_init(&window, archive) < 0)
+    {
+        free(removed);
+        return -1;
+    }
+    for (size_t i = 0; i < archive->no_entries; i++)
+    {
+        counts.no_entries += removed[i];
+    }
+
+    // The members being deleted, with the dead members next to them
+    tar_range_t *ranges = NULL;
+    size_t no_ranges = 0;
+    size_t cap_ranges = 0;
+    off_t offset = 0;
+    tar_member_t member;
+    int ret;
+    while ((ret = member_next(archive, &window, &offset, &member)) > 0)
+    {
+        size_t index = member.dead ? TAR_NO_ENTRY : index_find(archive, member.path, strlen(member.path));
+        int deleted = index != TAR_NO_ENTRY && removed[index];
+        counts.no_members += deleted;
+        if ((deleted || member.dead) && range_add(&ranges, &no_ranges, &cap_ranges, &member, deleted) < 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    window_free(&window);
+    size_t kept = 0;
+    for (size_t i = 0; i < no_ranges; i++)
+    {
+        if (ranges[i].deleted)
+        {
+            ranges[kept++] = ranges[i];
+        }
+    }
+    no_ranges = kept;
+
+    struct stat st;
+    if (ret == 0 && fstat(archive->fd, &st) < 0)
+    {
+        ret = -1;
+    }
+    off_t block = ret == 0 && st.st_blksize >= 512 && st.st_blksize % 512 == 0 ? st.st_blksize : 4096;
+    int collapse = !(flags & TAR_DELETE_MARK);
+
+    // Every range dead first, with a member starting at each end of the blocks to collapse
+    for (size_t i = 0; i < no_ranges && ret == 0; i++)
+    {
+        off_t first = (ranges[i].start + block - 1) / block * block;
+        off_t last = ranges[i].end / block * block;
+        if (collapse && last > first)
+        {
+            ret = (last < ranges[i].end ? dead_write(archive->fd, last, ranges[i].end) : 0) < 0 ||
+                          dead_write(archive->fd, first, last) < 0 ||
+                          (first > ranges[i].start ? dead_write(archive->fd, ranges[i].start, first) : 0) < 0
+                      ? -1
+                      : 0;
+        }
+        else
+        {
+            ret = dead_write(archive->fd, ranges[i].start, ranges[i].end);
+        }
+    }
+    if (ret == 0 && no_ranges > 0 && fdatasync(archive->fd) < 0)
+    {
+        ret = -1;
+    }
+
+    // From the last range, so that the offsets of the others do not move
+    for (size_t i = no_ranges; i-- > 0 && ret == 0;)
+    {
+        off_t first = (ranges[i].start + block - 1) / block * block;
+        off_t last = ranges[i].end / block * block;
+        if (collapse && last > first)
+        {
+            if (fallocate(archive->fd, FALLOC_FL_COLLAPSE_RANGE, first, last - first) == 0)
+            {
+                ranges[i].removed = last - first;
+            }
+            else if (errno == EOPNOTSUPP || errno == EINVAL || errno == ENOSYS)
+            {
+                collapse = 0; // The ranges stay dead
+            }
+            else
+            {
+                ret = -1;
+            }
+        }
+        counts.collapsed += ranges[i].removed;
+        counts.marked += ranges[i].end - ranges[i].start - ranges[i].removed;
+    }
+
+    off_t shift = 0;
+    for (size_t i = 0; i < no_ranges; i++)
+    {
+        shift += ranges[i].removed;
+        ranges[i].shift = shift;
+    }
+    if (ret == 0)
+    {
+        ret = index_compact(archive, removed, ranges, no_ranges);
+    }
+
+    int err = errno;
+    free(ranges);
+    free(removed);
+    if (report != NULL)
+    {
+        *report = counts;
+    }
+    errno = err;
+    return ret;
+}
+
+/**
+ * @brief Moves bytes of a file to a lower offset
+ *
+ * @param fd The file
+ * @param from The offset of the bytes
+ * @param to The offset they are moved to, lower
+ * @param len The number of bytes
+ * @param copy An in-out argument, whether copy_file_range() is used, cleared when the filesystem does not support it
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int move_down(int fd, off_t from, off_t to, off_t len, int *copy)
+{
+    char *buf = NULL;
+    int ret = 0;
+    while (len > 0 && ret == 0)
+    {
+        // A copy must not overlap its destination
+        size_t chunk = len < from - to ? len : from - to;
+        chunk = chunk < TAR_MOVE_CHUNK ? chunk : TAR_MOVE_CHUNK;
+        ssize_t done = -1;
+        if (*copy)
+        {
+            loff_t in = from;
+            loff_t out = to;
+            done = copy_file_range(fd, &in, fd, &out, chunk, 0);
+            if (done < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                *copy = 0;
+            }
+        }
+        if (!*copy)
+        {
+            chunk = chunk < TAR_EXTRACT_CHUNK ? chunk : TAR_EXTRACT_CHUNK;
+            if (buf == NULL && (buf = malloc(TAR_EXTRACT_CHUNK)) == NULL)
+            {
+                errno = ENOMEM;
+                ret = -1;
+                break;
+            }
+            done = full_pread(fd, buf, chunk, from);
+            if (done > 0 && full_pwrite(fd, buf, done, to) < 0)
+            {
+                done = -1;
+            }
+        }
+        if (done <= 0)
+        {
+            errno = done == 0 ? EIO : errno; // The file shrank
+            ret = -1;
+            break;
+        }
+        from += done;
+        to += done;
+        len -= done;
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * Removes the dead members of an archive, left by tar_delete(), from the file.
+ *
+ * The members after each run of dead members are moved over it in a single pass with copy_file_range(), then the
+ * file is truncated, and the index of the handle is updated. The archive is damaged if the process stops during the
+ * moves. Like after tar_delete(), the list cursors, the sample iterators and the tables of the handle become stale.
+ *
+ * @param archive A handle on an archive opened with O_RDWR, not a handle of a chunk store.
+ *
+ * @return the number of bytes removed from the file, -1 on error (errno is set).
+ */
+int64_t tar_vacuum(tar_archive_t *archive)
+{
+    tar_window_t window;
+    if (archive->read_at != NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (window_init(&window, archive) < 0)
+    {
+        return -1;
+    }
+
+    tar_range_t *ranges = NULL;
+    size_t no_ranges = 0;
+    size_t cap_ranges = 0;
+    off_t offset = 0;
+    tar_member_t member;
+    int ret;
+    while ((ret = member_next(archive, &window, &offset, &member)) > 0)
+    {
+        if (member.dead && range_add(&ranges, &no_ranges, &cap_ranges, &member, 1) < 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    window_free(&window);
+
+    struct stat st = {.st_size = 0};
+    if (ret == 0 && no_ranges > 0 && fstat(archive->fd, &st) < 0)
+    {
+        ret = -1;
+    }
+
+    // Everything after each range moves down by the bytes of the ranges up to it, the end of the archive included
+    off_t shift = 0;
+    int copy = 1;
+    for (size_t i = 0; i < no_ranges && ret == 0; i++)
+    {
+        ranges[i].removed = ranges[i].end - ranges[i].start;
+        shift += ranges[i].removed;
+        ranges[i].shift = shift;
+        off_t next = i + 1 < no_ranges ? ranges[i + 1].start : st.st_size;
+        ret = move_down(archive->fd, ranges[i].end, ranges[i].end - shift, next - ranges[i].end, &copy);
+    }
+    if (ret == 0 && no_ranges > 0 &&
+        (ftruncate(archive->fd, st.st_size - shift) < 0 || index_compact(archive, NULL, ranges, no_ranges) < 0))
+    {
+        ret = -1;
+    }
+
+    int err = errno;
+    free(ranges);
+    errno = err;
+    return ret < 0 ? -1 : shift;
+}
+
+/*
+ * In-place updates
+ *
+ * The metadata of an entry and the content of a regular file are changed by rewriting its header and its payload where
+ * they are, as long as the payload keeps its number of blocks. The numeric records of the pax extended header before
+ * the entry win over its header for other readers, so they are rewritten too, padded with leading zeros to keep their
+ * length.
+ */
+
+/**
+ * @brief Reads the pax extended header of an entry, recorded by index_build()
+ *
+ * @param archive The archive
+ * @param entry The entry
+ * @param buf Receives the extended header followed by its records, to be freed, NULL if there is none
+ * @param records_len Receives the length of the records, zero if there is none
+ * @return int 0 on success, -1 on error (errno is set)
+ */
+int pax_read(tar_archive_t *archive, const tar_entry_t *entry, char **buf, size_t *records_len)
+{
+    *buf = NULL;
+    *records_len = 0;
+    if (entry->pax == 0)
+    {
+        return 0;
+    }
+
+    size_t len = (size_t)entry->pax * 512;
+    char *pax = malloc(len);
+    if (pax == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t ret = full_pread(archive->fd, pax, len, entry->header_offset - len);
+    tar_header_t *header = (tar_header_t *)pax;
+    if (ret != (ssize_t)len || header->typeflag != XHDTYPE || check_header(pax, 1) != 0 ||
+        512 + next_header(header) > (off_t)len) // The archive changed under the index
+    {
+        errno = ret < 0 ? errno : EIO;
+        free(pax);
+        return -1;
+    }
+    *buf = pax;
+    *records_len = tar_number(header->size, sizeof(header->size));
+    return 0;
+}
+
+/**
+ * @brief Rewrites the value of the records of a numeric key in place, padded with leading zeros
+ *
+ * @param records The records
+ * @param len The length of the records
+ * @param key The key
+ * @param value The new value
+ * @return int 0 on success, -1 if the value does not fit a record or the records are malformed
+ */
+int pax_rewrite(char *records, size_t len, const char *key, uint64_t value)
+{
+    size_t key_len = strlen(key);
+    for (char *record = records; record < records + len;)
+    {
+        char *space;
+        unsigned long long record_len = strtoull(record, &space, 10);
+        if (space == record || *space != ' ' || record_len == 0 ||
+            record_len > (unsigned long long)(records + len - record))
+        {
+            return -1;
+        }
+        char *value_start = space + 1 + key_len + 1;
+        if (value_start < record + record_len && strncmp(space + 1, key, key_len) == 0 && space[1 + key_len] == '=')
+        {
+            char digits[32];
+            int width = record + record_len - 1 - value_start; // Up to the line feed ending the record
+            if (width <= 0 || width >= (int)sizeof(digits) ||
+                snprintf(digits, sizeof(digits), "%0*llu", width, (unsigned long long)value) != width)
+            {
+                return -1;
+            }
+            memcpy(value_start, digits, width);
+        }
+        record += record_len;
+    }
+    return 0;
+}
+
+/**
+ * Changes the metadata of an entry, or the content of a regular file, in place.
+ *
+ * Only the header of the entry, its payload and the extended header before it are written, the payload last but for
+ * the header. The index of the handle is updated, and must not be used by other threads meanwhile.
+ *
+ * @param archive A handle on an archive opened with O_RDWR, not a handle of a chunk store.
+ * @param path The path of the entry, a symbolic link being changed itself.
+ * @param update The fields to change and their new values.
+ *
+ * @return zero on success, -1 on error (errno is set): ENOENT if the entry has no header in the archive, EINVAL if
+ *         the new content does not take as many blocks as the old one or the entry is not a regular file, EOVERFLOW
+ *         if a record of its extended header is too short for a new value.
+ */
+int tar_update(tar_archive_t *archive, const char *path, const tar_update_t *update)
+{
+    if (archive->read_at != NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t index = index_lookup(archive, path);
+    if (index == TAR_NO_ENTRY || archive->entries[index].header_offset < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    tar_entry_t *entry = &archive->entries[index];
+    int content = (update->fields & TAR_UPDATE_CONTENT) != 0;
+    if (content && ((entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE) ||
+                    (update->size + 511) / 512 != (entry->size + 511) / 512))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    off_t offset = entry->header_offset;
+    tar_header_t header;
+    char *pax;
+    size_t records_len;
+    ssize_t ret = full_pread(archive->fd, &header, sizeof(header), offset);
+    if (ret != sizeof(header))
+    {
+        errno = ret < 0 ? errno : EIO;
+        return -1;
+    }
+    if (pax_read(archive, entry, &pax, &records_len) < 0)
+    {
+        return -1;
+    }
+
+    uint64_t mtime = update->mtime > 0 ? update->mtime : 0;
+    if (update->fields & TAR_UPDATE_MODE)
+    {
+        header_number(header.mode, sizeof(header.mode), update->mode & 07777);
+    }
+    if (update->fields & TAR_UPDATE_MTIME)
+    {
+        header_number(header.mtime, sizeof(header.mtime), mtime);
+    }
+    if (update->fields & TAR_UPDATE_UID)
+    {
+        header_number(header.uid, sizeof(header.uid), update->uid);
+    }
+    if (update->fields & TAR_UPDATE_GID)
+    {
+        header_number(header.gid, sizeof(header.gid), update->gid);
+    }
+    if (content)
+    {
+        header_number(header.size, sizeof(header.size), update->size);
+    }
+    header_checksum(&header);
+
+    char *records = pax != NULL ? pax + 512 : NULL;
+    if (pax != NULL &&
+        (((update->fields & TAR_UPDATE_MTIME) && pax_rewrite(records, records_len, "mtime", mtime) < 0) ||
+         ((update->fields & TAR_UPDATE_UID) && pax_rewrite(records, records_len, "uid", update->uid) < 0) ||
+         ((update->fields & TAR_UPDATE_GID) && pax_rewrite(records, records_len, "gid", update->gid) < 0) ||
+         (content && pax_rewrite(records, records_len, "size", update->size) < 0)))
+    {
+        free(pax);
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    // The payload and its padding, the records, then the header
+    static const char zeros[512];
+    ret = 0;
+    if (content && (full_pwrite(archive->fd, update->data, update->size, offset + 512) < 0 ||
+                    full_pwrite(archive->fd, zeros, (512 - update->size % 512) % 512, offset + 512 + update->size) < 0))
+    {
+        ret = -1;
+    }
+    if (ret == 0 && pax != NULL &&
+        full_pwrite(archive->fd, records, records_len, offset - (off_t)entry->pax * 512 + 512) < 0)
+    {
+        ret = -1;
+    }
+    if (ret == 0 && full_pwrite(archive->fd, &header, sizeof(header), offset) < 0)
+    {
+        ret = -1;
+    }
+    int err = errno;
+    free(pax);
+    errno = err;
+    if (ret < 0)
+    {
+        return -1;
+    }
+
+    archive->generation++;
+    entry->mode = update->fields & TAR_UPDATE_MODE ? update->mode & 07777 : entry->mode;
+    entry->mtime = update->fields & TAR_UPDATE_MTIME ? (int64_t)mtime : entry->mtime;
+    entry->uid = update->fields & TAR_UPDATE_UID ? update->uid : entry->uid;
+    entry->gid = update->fields & TAR_UPDATE_GID ? update->gid : entry->gid;
+    if (content)
+    {
+        nested_drop(archive, index);
+        uint64_t old_size = entry->size;
+        entry->size = update->size;
+        entry->hash = archive->hashed ? crc32c(0, update->data, update->size) : entry->hash;
+        rollup_resize(archive, index, old_size);
+    }
+    return 0;
+}
+
+/*
+ * Query engine
+ *
+ * A table is a structure-of-arrays copy of the metadata of the index, a column per predicate, whose rows are the
+ * entries sorted by path so that the entries under a path prefix are a range of rows found by two binary searches. A
+ * query scans the columns of that range 64 rows at a time, each predicate giving a mask of the rows it matches, with
+ * AVX2 compares when the CPU has them. The matching rows are kept in path order as they come, or in a bounded heap
+ * for the first N in another order.
+ */
+
+#define TAR_TABLE_BLOCK 64 // Rows per mask of a scan, the columns being padded to a multiple of it
+
+struct tar_table
+{
+    tar_archive_t *archive; // Handle the table was built from
+    uint64_t generation;    // Generation of the index of the handle when the table was built
+    size_t no_rows;         // Number of rows, every entry but the root
+    uint64_t *sizes;        // Size of each row
+    int64_t *mtimes;        // Modification time of each row
+    uint32_t *uids;         // Owner of each row
+    uint32_t *modes;        // Permission bits of each row, as wide as the owners to be compared the same way
+    uint32_t *entries;      // Entry of each row in the index
+    uint8_t *types;         // TAR_QUERY_* type of each row, zero in the padding so that it never matches
+    void *memory;           // Single block holding the columns
+};
+
+/**
+ * @brief Gets the TAR_QUERY_* type of an entry
+ *
+ * @param typeflag The type flag of the entry
+ * @return uint8_t The type, a single bit
+ */
+uint8_t table_type(char typeflag)
+{
+    switch (typeflag)
+    {
+    case REGTYPE:
+    case AREGTYPE:
+    case GNUTYPE_SPARSE:
+        return TAR_QUERY_FILE;
+    case DIRTYPE:
+        return TAR_QUERY_DIR;
+    case SYMTYPE:
+        return TAR_QUERY_SYMLINK;
+    case LNKTYPE:
+        return TAR_QUERY_HARDLINK;
+    default:
+        return TAR_QUERY_OTHER;
+    }
+}
+
+/**
+ * Builds a columnar copy of the metadata of the index of a handle.
+ *
+ * @param archive A handle returned by tar_open().
+ *
+ * @return a new table, or NULL if the memory could not be allocated.
+ */
+tar_table_t *tar_table_build(tar_archive_t *archive)
+{
+    tar_table_t *table = calloc(1, sizeof(tar_table_t));
+    if (table == NULL || archive->no_entries - 1 > UINT32_MAX)
+    {
+        free(table);
+        errno = ENOMEM;
+        return NULL;
+    }
+    table->archive = archive;
+    table->generation = archive->generation;
+    table->no_rows = archive->no_entries - 1;
+
+    // The widest columns first, each one starting on a cache line as the padded length is a multiple of 64
+    size_t padded = (table->no_rows + TAR_TABLE_BLOCK - 1) / TAR_TABLE_BLOCK * TAR_TABLE_BLOCK;
+    size_t row_len = sizeof(uint64_t) + sizeof(int64_t) + 3 * sizeof(uint32_t) + sizeof(uint8_t);
+    if (posix_memalign(&table->memory, 64, padded ? padded * row_len : 64) != 0)
+    {
+        free(table);
+        errno = ENOMEM;
+        return NULL;
+    }
+    table->sizes = table->memory;
+    table->mtimes = (int64_t *)(table->sizes + padded);
+    table->uids = (uint32_t *)(table->mtimes + padded);
+    table->modes = table->uids + padded;
+    table->entries = table->modes + padded;
+    table->types = (uint8_t *)(table->entries + padded);
+
+    for (size_t i = 0; i < table->no_rows; i++)
+    {
+        table->entries[i] = i + 1;
+    }
+    qsort_r(table->entries, table->no_rows, sizeof(uint32_t), compact_cmp, archive);
+    for (size_t i = 0; i < padded; i++)
+    {
+        tar_entry_t *entry = i < table->no_rows ? &archive->entries[table->entries[i]] : NULL;
+        table->sizes[i] = entry != NULL ? entry->size : 0;
+        table->mtimes[i] = entry != NULL ? entry->mtime : 0;
+        table->uids[i] = entry != NULL ? entry->uid : 0;
+        table->modes[i] = entry != NULL ? entry->mode : 0;
+        table->types[i] = entry != NULL ? table_type(entry->typeflag) : 0;
+        if (entry == NULL)
+        {
+            table->entries[i] = TAR_ROOT;
+        }
+    }
+    return table;
+}
+
+/**
+ * @brief Finds the first row whose path does not start before a prefix, or that starts after it
+ *
+ * @param table The table
+ * @param prefix The prefix
+ * @param len The length of the prefix
+ * @param after Whether the rows starting with the prefix are skipped
+ * @return size_t The row, no_rows if there is none
+ */
+size_t table_bound(tar_table_t *table, const char *prefix, size_t len, int after)
+{
+    size_t lo = 0;
+    size_t hi = table->no_rows;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strncmp(entry_name(table->archive, table->entries[mid]), prefix, len);
+        if (cmp < 0 || (after && cmp == 0))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @brief Evaluates the predicates of a query on a block of rows, one row at a time
+ *
+ * @param table The table
+ * @param first The first row of the block, a multiple of TAR_TABLE_BLOCK
+ * @param query The query
+ * @return uint64_t The mask of the matching rows of the block
+ */
+uint64_t scan_block_sw(const tar_table_t *table, size_t first, const tar_query_t *query)
+{
+    uint64_t any_uid = query->uid < 0;
+    uint64_t mask = 0;
+    for (size_t i = 0; i < TAR_TABLE_BLOCK; i++)
+    {
+        size_t row = first + i;
+        uint64_t match = (table->types[row] & query->types) != 0;
+        match &= (table->sizes[row] >= query->min_size) & (table->sizes[row] <= query->max_size);
+        match &= (table->mtimes[row] >= query->min_mtime) & (table->mtimes[row] <= query->max_mtime);
+        match &= any_uid | (table->uids[row] == (uint32_t)query->uid);
+        match &= (table->modes[row] & query->mode_mask) == query->mode_bits;
+        mask |= match << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/**
+ * @brief Evaluates the predicates of a query on a block of rows with AVX2 compares, 4 to 32 rows at a time
+ *
+ * @param table The table
+ * @param first The first row of the block, a multiple of TAR_TABLE_BLOCK
+ * @param query The query
+ * @return uint64_t The mask of the matching rows of the block
+ */
+__attribute__((target("avx2"))) uint64_t scan_block_avx2(const tar_table_t *table, size_t first,
+                                                         const tar_query_t *query)
+{
+    // Sizes are unsigned, and compared as signed numbers once their top bit is flipped
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i min_size = _mm256_set1_epi64x(query->min_size ^ (uint64_t)INT64_MIN);
+    const __m256i max_size = _mm256_set1_epi64x(query->max_size ^ (uint64_t)INT64_MIN);
+    const __m256i min_mtime = _mm256_set1_epi64x(query->min_mtime);
+    const __m256i max_mtime = _mm256_set1_epi64x(query->max_mtime);
+    uint64_t wide = 0;
+    for (size_t i = 0; i < TAR_TABLE_BLOCK; i += 4)
+    {
+        __m256i size = _mm256_xor_si256(_mm256_load_si256((const __m256i *)(table->sizes + first + i)), sign);
+        __m256i mtime = _mm256_load_si256((const __m256i *)(table->mtimes + first + i));
+        __m256i out = _mm256_or_si256(_mm256_cmpgt_epi64(min_size, size), _mm256_cmpgt_epi64(size, max_size));
+        out = _mm256_or_si256(out, _mm256_cmpgt_epi64(min_mtime, mtime));
+        out = _mm256_or_si256(out, _mm256_cmpgt_epi64(mtime, max_mtime));
+        wide |= (uint64_t)(~_mm256_movemask_pd(_mm256_castsi256_pd(out)) & 0xf) << i;
+    }
+
+    const __m256i any_uid = _mm256_set1_epi32(query->uid < 0 ? -1 : 0);
+    const __m256i uid = _mm256_set1_epi32((uint32_t)query->uid);
+    const __m256i mode_mask = _mm256_set1_epi32(query->mode_mask);
+    const __m256i mode_bits = _mm256_set1_epi32(query->mode_bits);
+    uint64_t narrow = 0;
+    for (size_t i = 0; i < TAR_TABLE_BLOCK; i += 8)
+    {
+        __m256i uids = _mm256_load_si256((const __m256i *)(table->uids + first + i));
+        __m256i modes = _mm256_and_si256(_mm256_load_si256((const __m256i *)(table->modes + first + i)), mode_mask);
+        __m256i in = _mm256_or_si256(any_uid, _mm256_cmpeq_epi32(uids, uid));
+        in = _mm256_and_si256(in, _mm256_cmpeq_epi32(modes, mode_bits));
+        narrow |= (uint64_t)(_mm256_movemask_ps(_mm256_castsi256_ps(in)) & 0xff) << i;
+    }
+
+    const __m256i types = _mm256_set1_epi8(query->types);
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < TAR_TABLE_BLOCK; i += 32)
+    {
+        __m256i type = _mm256_and_si256(_mm256_load_si256((const __m256i *)(table->types + first + i)), types);
+        __m256i none = _mm256_cmpeq_epi8(type, _mm256_setzero_si256());
+        bytes |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(none) << i;
+    }
+    return wide & narrow & bytes;
+}
+#endif
+
+/**
+ * @brief Tells whether a row comes before another one in the order of a query
+ *
+ * @param table The table
+ * @param query The query
+ * @param a The first row
+ * @param b The second row
+ * @return int Whether a comes first
+ */
+int row_before(const tar_table_t *table, const tar_query_t *query, uint32_t a, uint32_t b)
+{
+    int descending = query->descending != 0;
+    if (query->order == TAR_ORDER_SIZE && table->sizes[a] != table->sizes[b])
+    {
+        return (table->sizes[a] < table->sizes[b]) != descending;
+    }
+    if (query->order == TAR_ORDER_MTIME && table->mtimes[a] != table->mtimes[b])
+    {
+        return (table->mtimes[a] < table->mtimes[b]) != descending;
+    }
+    return query->order == TAR_ORDER_PATH && descending ? a > b : a < b; // Ties are in path order
+}
+
+/**
+ * @brief Moves a row down a heap of rows whose top is the last one in the order of a query
+ *
+ * @param table The table
+ * @param query The query
+ * @param heap The heap
+ * @param len The number of rows of the heap
+ * @param i The position of the row
+ */
+void heap_down(const tar_table_t *table, const tar_query_t *query, uint32_t *heap, size_t len, size_t i)
+{
+    uint32_t row = heap[i];
+    while (2 * i + 1 < len)
+    {
+        size_t child = 2 * i + 1;
+        if (child + 1 < len && row_before(table, query, heap[child], heap[child + 1]))
+        {
+            child++;
+        }
+        if (!row_before(table, query, row, heap[child]))
+        {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = row;
+}
+
+/**
+ * @brief Offers a matching row to a heap keeping the first rows in the order of a query
+ *
+ * @param table The table
+ * @param query The query
+ * @param heap The heap
+ * @param cap The capacity of the heap
+ * @param len The number of rows of the heap
+ * @param row The row
+ */
+void heap_offer(const tar_table_t *table, const tar_query_t *query, uint32_t *heap, size_t cap, size_t len,
+                uint32_t row)
+{
+    if (len < cap)
+    {
+        size_t i = len;
+        while (i > 0 && row_before(table, query, heap[(i - 1) / 2], row))
+        {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = row;
+    }
+    else if (cap > 0 && row_before(table, query, row, heap[0]))
+    {
+        heap[0] = row;
+        heap_down(table, query, heap, cap, 0);
+    }
+}
+
+/**
+ * Runs a query on a table, counting the matching rows and keeping the first ones in the order of the query.
+ *
+ * @param table A table returned by tar_table_build().
+ * @param query The predicates and the order.
+ * @param rows Receives the first matching rows in order, at most no_rows of them.
+ * @param no_rows The size of the rows array, the N of a top-N query.
+ *
+ * @return the number of matching rows, of which the first min(no_rows, return value) are in rows,
+ *         zero with errno set to ESTALE if the handle was changed since the table was built.
+ */
+size_t tar_query(tar_table_t *table, const tar_query_t *query, uint32_t *rows, size_t no_rows)
+{
+    if (table->generation != table->archive->generation) // The rows name entries that moved or changed
+    {
+        errno = ESTALE;
+        return 0;
+    }
+    if (query->uid < -1 || query->uid > UINT32_MAX)
+    {
+        return 0;
+    }
+    size_t lo = 0;
+    size_t hi = table->no_rows;
+    if (query->prefix != NULL)
+    {
+        size_t len = strlen(query->prefix);
+        lo = table_bound(table, query->prefix, len, 0);
+        hi = table_bound(table, query->prefix, len, 1);
+    }
+
+    uint64_t (*scan)(const tar_table_t *, size_t, const tar_query_t *) = scan_block_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scan = scan_block_avx2;
+    }
+#endif
+
+    // In path order the first matching rows are the answer, and the others are only counted
+    int in_order = query->order == TAR_ORDER_PATH && !query->descending;
+    size_t count = 0;
+    for (size_t first = lo / TAR_TABLE_BLOCK * TAR_TABLE_BLOCK; first < hi; first += TAR_TABLE_BLOCK)
+    {
+        uint64_t mask = scan(table, first, query);
+        if (first < lo)
+        {
+            mask &= ~0ULL << (lo - first);
+        }
+        if (hi - first < TAR_TABLE_BLOCK)
+        {
+            mask &= (1ULL << (hi - first)) - 1;
+        }
+        if (in_order)
+        {
+            for (; mask != 0 && count < no_rows; mask &= mask - 1)
+            {
+                rows[count++] = first + __builtin_ctzll(mask);
+            }
+            count += __builtin_popcountll(mask);
+            continue;
+        }
+        for (; mask != 0; mask &= mask - 1, count++)
+        {
+            heap_offer(table, query, rows, no_rows, count < no_rows ? count : no_rows, first + __builtin_ctzll(mask));
+        }
+    }
+
+    // Sorts the heap by moving its last row to the end, repeatedly
+    for (size_t len = in_order ? 0 : (count < no_rows ? count : no_rows); len > 1; len--)
+    {
+        uint32_t last = rows[0];
+        rows[0] = rows[len - 1];
+        rows[len - 1] = last;
+        heap_down(table, query, rows, len - 1, 0);
+    }
+    return count;
+}
+
+/**
+ * Gets the path of a row of a table.
+ *
+ * @param table A table.
+ * @param row A row returned by tar_query().
+ *
+ * @return the path, valid until the handle of the table is changed or closed,
+ *         NULL with errno set to ESTALE if the handle was changed since the table was built.
+ */
+const char *tar_table_path(tar_table_t *table, uint32_t row)
+{
+    if (table->generation != table->archive->generation || row >= table->no_rows)
+    {
+        errno = ESTALE;
+        return NULL;
+    }
+    return entry_name(table->archive, table->entries[row]);
+}
+
+/**
+ * Gets the metadata of a row of a table, like tar_lstat() on its path.
+ *
+ * @param table A table.
+ * @param row A row returned by tar_query().
+ * @param st Receives the metadata of the entry.
+ *
+ * @return zero on success, -1 with errno set to ESTALE if the handle was changed since the table was built.
+ */
+int tar_table_stat(tar_table_t *table, uint32_t row, tar_stat_t *st)
+{
+    if (table->generation != table->archive->generation || row >= table->no_rows)
+    {
+        errno = ESTALE;
+        return -1;
+    }
+    entry_stat(table->archive, table->entries[row], st);
+    return 0;
+}
+
+/**
+ * Gets the number of rows of a table.
+ *
+ * @param table A table.
+ *
+ * @return the number of entries of the archive of the table.
+ */
+size_t tar_table_rows(tar_table_t *table)
+{
+    return table->no_rows;
+}
+
+/**
+ * Releases a table.
+ *
+ * @param table A table, or NULL.
+ */
+void tar_table_free(tar_table_t *table)
+{
+    if (table != NULL)
+    {
+        free(table->memory);
+        free(table);
+    }
+}
+
+/*
+ * Disk usage
+ *
+ * With TAR_OPEN_USAGE, every entry has the totals of its subtree: the number of files, their total size and the
+ * largest of them, a file being its own subtree. Once the directory tree is linked, a single pass over the entries in
+ * the reverse of a breadth-first order adds the totals of each entry to those of its parent, the children of a
+ * directory being done before it, and fills the histogram of the sizes on the way. The totals of any subtree are then
+ * a lookup, and are kept up to date when a file changes size or entries are deleted.
+ */
+
+/**
+ * @brief Gets the bucket of a size in a size histogram
+ *
+ * @param size The size of a file
+ * @return int The bucket, 0 for an empty file and k for a size in [2^(k-1), 2^k)
+ */
+int size_bucket(uint64_t size)
+{
+    return size == 0 ? 0 : 64 - __builtin_clzll(size);
+}
+
+/**
+ * @brief Tells whether a file is larger than the largest file of a subtree
+ *
+ * @param archive The archive
+ * @param index The file
+ * @param largest The largest file of the subtree, TAR_ROOT if there is none
+ * @return int Whether the file is larger
+ */
+int rollup_larger(tar_archive_t *archive, size_t index, uint32_t largest)
+{
+    return largest == TAR_ROOT || archive->entries[index].size > archive->entries[largest].size;
+}
+
+/**
+ * @brief Computes the totals of the subtree of every entry and the size histogram, with TAR_OPEN_USAGE
+ *
+ * @param archive The archive, whose children are linked
+ * @return int 0 on success, -1 if the memory could not be allocated
+ */
+int index_rollup(tar_archive_t *archive)
+{
+    if (!(archive->flags & TAR_OPEN_USAGE))
+    {
+        return 0;
+    }
+    if (archive->rollups == NULL) // Kept when entries are deleted, there are only fewer of them
+    {
+        archive->rollups = malloc(archive->no_entries * sizeof(tar_rollup_t));
+        if (archive->rollups == NULL)
+        {
+            return -1;
+        }
+        archive->no_allocs++;
+        archive->index_bytes += archive->no_entries * sizeof(tar_rollup_t);
+    }
+    uint32_t *order = malloc(archive->no_entries * sizeof(uint32_t));
+    if (order == NULL)
+    {
+        return -1;
+    }
+
+    // Breadth-first, every directory before its children
+    size_t len = 1;
+    order[0] = TAR_ROOT;
+    for (size_t i = 0; i < len; i++)
+    {
+        tar_entry_t *entry = &archive->entries[order[i]];
+        memcpy(order + len, archive->children + entry->first_child, entry->no_children * sizeof(uint32_t));
+        len += entry->no_children;
+    }
+
+    memset(archive->rollups, 0, archive->no_entries * sizeof(tar_rollup_t));
+    memset(&archive->sizes, 0, sizeof(archive->sizes));
+    for (size_t i = len; i-- > 0;)
+    {
+        size_t index = order[i];
+        tar_entry_t *entry = &archive->entries[index];
+        tar_rollup_t *rollup = &archive->rollups[index];
+        if (type_is_file(entry->typeflag))
+        {
+            rollup->bytes += entry->size;
+            rollup->no_files++;
+            rollup->largest = rollup_larger(archive, index, rollup->largest) ? index : rollup->largest;
+            archive->sizes.no_files[size_bucket(entry->size)]++;
+            archive->sizes.bytes[size_bucket(entry->size)] += entry->size;
+        }
+        if (index != TAR_ROOT)
+        {
+            tar_rollup_t *parent = &archive->rollups[entry->parent];
+            parent->bytes += rollup->bytes;
+            parent->no_files += rollup->no_files;
+            if (rollup->largest != TAR_ROOT && rollup_larger(archive, rollup->largest, parent->largest))
+            {
+                parent->largest = rollup->largest;
+            }
+        }
+    }
+    free(order);
+    return 0;
+}
+
+/**
+ * @brief Updates the totals of the subtrees holding a file whose size changed, from the file up to the root
+ *
+ * @param archive The archive
+ * @param index The file, with its new size
+ * @param old_size The previous size of the file
+ */
+void rollup_resize(tar_archive_t *archive, size_t index, uint64_t old_size)
+{
+    if (archive->rollups == NULL || !type_is_file(archive->entries[index].typeflag))
+    {
+        return;
+    }
+    uint64_t size = archive->entries[index].size;
+    archive->sizes.no_files[size_bucket(old_size)]--;
+    archive->sizes.bytes[size_bucket(old_size)] -= old_size;
+    archive->sizes.no_files[size_bucket(size)]++;
+    archive->sizes.bytes[size_bucket(size)] += size;
+
+    for (size_t i = index;; i = archive->entries[i].parent)
+    {
+        tar_rollup_t *rollup = &archive->rollups[i];
+        rollup->bytes = rollup->bytes - old_size + size;
+        if (i != index && size > old_size && rollup_larger(archive, index, rollup->largest))
+        {
+            rollup->largest = index;
+        }
+        else if (i != index && size < old_size && rollup->largest == index)
+        {
+            // The file may no longer be the largest, the largest files of the children are up to date
+            tar_entry_t *entry = &archive->entries[i];
+            rollup->largest = type_is_file(entry->typeflag) ? i : TAR_ROOT;
+            for (uint32_t k = 0; k < entry->no_children; k++)
+            {
+                uint32_t largest = archive->rollups[archive->children[entry->first_child + k]].largest;
+                if (largest != TAR_ROOT && rollup_larger(archive, largest, rollup->largest))
+                {
+                    rollup->largest = largest;
+                }
+            }
+        }
+        if (i == TAR_ROOT)
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * Gets the totals of the files under an entry of the archive of a handle, without walking the entries.
+ *
+ * @param archive A handle returned by tar_open() with TAR_OPEN_USAGE.
+ * @param path A path to an entry in the archive, the empty string for the whole archive. If the entry is a symlink,
+ *             it is resolved to its linked-to entry. A file gives its own size.
+ * @param usage Receives the totals.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive,
+ *         -2 if the handle was not opened with TAR_OPEN_USAGE.
+ */
+int tar_usage(tar_archive_t *archive, char *path, tar_usage_t *usage)
+{
+    archive = archive_route(archive, &path);
+    if (archive == NULL)
+    {
+        return -1;
+    }
+    size_t index = index_resolve(archive, index_lookup(archive, path));
+    if (index == TAR_NO_ENTRY)
+    {
+        return -1;
+    }
+    if (archive->rollups == NULL)
+    {
+        return -2;
+    }
+    tar_rollup_t *rollup = &archive->rollups[index];
+    usage->bytes = rollup->bytes;
+    usage->no_files = rollup->no_files;
+    usage->largest_size = rollup->largest != TAR_ROOT ? archive->entries[rollup->largest].size : 0;
+    usage->largest = rollup->largest != TAR_ROOT ? entry_name(archive, rollup->largest) : NULL;
+    return 0;
+}
+
+/**
+ * Gets the histogram of the sizes of the files of the archive of a handle, filled with the totals of tar_usage().
+ *
+ * @param archive A handle returned by tar_open() with TAR_OPEN_USAGE.
+ * @param histogram Receives the histogram.
+ *
+ * @return zero on success, -1 if the handle was not opened with TAR_OPEN_USAGE.
+ */
+int tar_size_histogram(tar_archive_t *archive, tar_size_histogram_t *histogram)
+{
+    if (archive->rollups == NULL)
+    {
+        return -1;
+    }
+    *histogram = archive->sizes;
+    return 0;
+}
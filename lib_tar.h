@@ -9,6 +9,18 @@
 /* Placer nos propres includes ici */
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 
 typedef struct posix_header
 {                       /* byte offset */
@@ -42,6 +54,11 @@ typedef struct posix_header
 #define LNKTYPE '1'   /* link */
 #define SYMTYPE '2'   /* reserved */
 #define DIRTYPE '5'   /* directory */
+#define XHDTYPE 'x'   /* pax extended header of the next entry */
+#define XGLTYPE 'g'   /* pax global header of every next entry */
+#define GNUTYPE_SPARSE 'S' /* GNU sparse file */
+#define GNUTYPE_LONGNAME 'L' /* GNU long name of the next entry */
+#define GNUTYPE_LONGLINK 'K' /* GNU long link target of the next entry */
 
 /* Converts an ASCII-encoded octal-based number into a regular integer */
 #define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
@@ -151,4 +168,1260 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * An archive handle built from a single scan of the archive.
+ *
+ * The handle keeps an in-memory index of every entry (path, type, size and offsets) and of the directory tree,
+ * so that the functions taking a handle answer without rescanning the archive.
+ */
+typedef struct tar_archive tar_archive_t;
+
+/**
+ * A resumable position in a directory listing, see list_page().
+ *
+ * The fields are private to the library. A cursor must be initialised with TAR_CURSOR_INIT before its first use
+ * and only be used with the handle and path it was started with. Once tar_delete(), tar_vacuum() or tar_update()
+ * changed the handle, the cursor is stale and the next page fails with ESTALE, the listing having to start again.
+ */
+typedef struct tar_cursor
+{
+    size_t dir;          /* Index of the listed directory plus one, zero before the first page */
+    size_t next;         /* Position of the next child to return */
+    size_t listed;       /* Number of entries returned by the pages of a catalog listing */
+    uint64_t generation; /* Generation of the index of the handle when the listing started */
+} tar_cursor_t;
+
+#define TAR_CURSOR_INIT {0, 0, 0, 0}
+
+/* Access modes of a handle, telling the kernel how the archive will be read.  */
+#define TAR_ACCESS_DEFAULT 0    /* no hint */
+#define TAR_ACCESS_SEQUENTIAL 1 /* full scans and bulk reads, aggressive readahead */
+#define TAR_ACCESS_RANDOM 2     /* point reads, no readahead */
+#define TAR_ACCESS_ONESHOT 3    /* a single sequential pass, pages are dropped once read */
+#define TAR_ACCESS_MASK 3
+
+/* Flags of tar_open(), combined with an access mode.  */
+#define TAR_OPEN_DIRECT 4    /* read with O_DIRECT, bypassing the page cache */
+#define TAR_OPEN_HASH 16     /* hash the content of every file while indexing, see tar_content_hash() */
+#define TAR_OPEN_MPH 32      /* find paths with a minimal perfect hash instead of a hash table */
+#define TAR_OPEN_BLOOM 64    /* answer the lookups of unknown paths with a Bloom filter before the index */
+#define TAR_OPEN_METRICS 128 /* record the latency of the operations of the handle, see tar_metrics_quantile() */
+#define TAR_OPEN_USAGE 256   /* total the files of every directory while indexing, see tar_usage() */
+
+/* Flags of tar_catalog_open(), combined with the flags of tar_open().  */
+#define TAR_CATALOG_SHADOW 8 /* the entries of later archives hide the entries of earlier ones with the same path */
+
+/**
+ * Opens an archive handle by indexing the archive.
+ *
+ * The paths given to the functions taking the handle may go through archives stored as files of the archive, as in
+ * "layers/3.tar!/etc/passwd", see tar_nested().
+ *
+ * The path, link target, size, modification time, owner and group given by a pax extended header or a GNU long
+ * name member replace the fields of the header of their entry. An entry whose path or link target is PATH_MAX bytes
+ * or more is left out of the index rather than indexed under the cut name of its header, see tar_index_stats().
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file. The handle reads it with pread() and does
+ *               not take ownership of it, the caller must keep it open until tar_close().
+ * @param flags One of the TAR_ACCESS_* modes, see tar_set_access(), optionally combined with TAR_OPEN_* flags.
+ *              With TAR_OPEN_DIRECT, the scans and the reads of the handle bypass the page cache, through aligned
+ *              buffers. If the file system does not support O_DIRECT, the handle silently falls back to buffered I/O.
+ *              With TAR_OPEN_MPH, meant for archives that never change, the paths are found with a minimal perfect
+ *              hash built once the archive is indexed, a lookup being a single probe and a single path comparison,
+ *              or loaded by tar_open_mph().
+ *              With TAR_OPEN_BLOOM, meant for workloads looking up many paths that are not in the archive, a filter
+ *              of the paths built once the archive is indexed rejects most of them without touching the index.
+ *              With TAR_OPEN_USAGE, the totals of the files under every directory are computed once the archive is
+ *              indexed, for 16 more bytes per entry, see tar_usage().
+ *
+ * @return a new handle, or NULL if the archive could not be read or indexed (errno is set).
+ */
+tar_archive_t *tar_open(int tar_fd, int flags);
+
+/**
+ * Opens an archive handle like tar_open() with TAR_OPEN_MPH, loading the minimal perfect hash of the paths saved by
+ * tar_mph_save() instead of building it.
+ *
+ * The saved function is only a cache of its build: the archive is still scanned and indexed with the hash table of
+ * tar_open(), which the function replaces once checked against the index, so the open costs the same time and peak
+ * memory as with TAR_OPEN_MPH, less the build of the function. A function that does not map every path to its entry,
+ * as once the archive changed, or that cannot be read is ignored and a new one built.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file, see tar_open().
+ * @param flags The flags of tar_open(), TAR_OPEN_MPH being implied.
+ * @param mph_fd A file descriptor open for reading, at the position where the function was written, or -1 to build
+ *               the function.
+ *
+ * @return a new handle, or NULL if the archive could not be read or indexed (errno is set).
+ */
+tar_archive_t *tar_open_mph(int tar_fd, int flags, int mph_fd);
+
+/**
+ * Saves the minimal perfect hash of the paths of a handle, to be loaded by tar_open_mph() instead of building it.
+ *
+ * @param archive A handle returned by tar_open() or tar_open_mph() with TAR_OPEN_MPH.
+ * @param fd A file descriptor open for writing, at the position where the function is written.
+ *
+ * @return zero on success, -1 on error (errno is set, EINVAL if the handle has no minimal perfect hash).
+ */
+int tar_mph_save(tar_archive_t *archive, int fd);
+
+/**
+ * Releases an archive handle and its index. The file descriptor is left open.
+ *
+ * @param archive A handle returned by tar_open(), or NULL.
+ */
+void tar_close(tar_archive_t *archive);
+
+/**
+ * The memory usage of the index of a handle.
+ */
+typedef struct tar_index_stats
+{
+    size_t no_entries;  /* Entries in the index, including the directories without a header */
+    size_t no_allocs;   /* Allocations made to build the index */
+    size_t index_bytes; /* Size of the memory blocks of the index */
+    size_t pool_bytes;  /* Bytes used in the string pool holding the paths and the link targets */
+    size_t no_skipped;  /* Entries left out, their path or link target being PATH_MAX bytes or more */
+} tar_index_stats_t;
+
+/**
+ * Gets the memory usage of the index of a handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param stats Receives the statistics.
+ */
+void tar_index_stats(tar_archive_t *archive, tar_index_stats_t *stats);
+
+/**
+ * Sets the access mode of a handle.
+ *
+ * The mode selects the posix_fadvise() and readahead() hints given around the scans and the reads of the handle:
+ *  - TAR_ACCESS_SEQUENTIAL asks for sequential readahead,
+ *  - TAR_ACCESS_RANDOM disables readahead for point reads,
+ *  - TAR_ACCESS_ONESHOT reads sequentially and drops the pages of the archive from the page cache once read, so that
+ *    a single pass does not evict the hot pages of other files.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param mode One of the TAR_ACCESS_* modes.
+ *
+ * @return zero on success, -1 if the mode is invalid.
+ */
+int tar_set_access(tar_archive_t *archive, int mode);
+
+/**
+ * Checks whether the archive of a handle is valid, like check_archive(), using the access mode of the handle.
+ * The archive is read with pread(), leaving the offset of the file descriptor of the handle as it is.  The headers
+ * are checked as tar_open() reads them, also accepting the "ustar  " magic and version of GNU tar and a checksum
+ * summing the bytes as unsigned.
+ *
+ * @param archive A handle returned by tar_open().
+ *
+ * @return the same values as check_archive(), -1 also if the archive could not be read or is truncated before its
+ *         end blocks (errno is set then, EIO for a truncated archive).
+ */
+int tar_check_archive(tar_archive_t *archive);
+
+/**
+ * Checks whether an entry exists in the archive of a handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_exists(tar_archive_t *archive, char *path);
+
+/**
+ * Checks whether an entry exists in the archive of a handle and is a directory.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int tar_is_dir(tar_archive_t *archive, char *path);
+
+/**
+ * Checks whether an entry exists in the archive of a handle and is a file.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int tar_is_file(tar_archive_t *archive, char *path);
+
+/**
+ * Checks whether an entry exists in the archive of a handle and is a symlink.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int tar_is_symlink(tar_archive_t *archive, char *path);
+
+/**
+ * The metadata of an entry, see tar_stat().
+ */
+typedef struct tar_stat
+{
+    char type;            /* Type flag: REGTYPE, DIRTYPE, SYMTYPE, LNKTYPE..., GNUTYPE_SPARSE for a sparse file */
+    uint64_t size;        /* Size of the file, the holes of a sparse file included */
+    uint16_t mode;        /* Permission bits */
+    uint32_t uid;         /* Owner */
+    uint32_t gid;         /* Group */
+    int64_t mtime;        /* Modification time, in seconds since the epoch */
+    const char *linkname; /* Target of a link, NULL otherwise, valid until the handle is closed */
+    off_t header_offset;  /* Offset of the header in the archive of the handle, -1 for a directory without one */
+    off_t payload_offset; /* Offset of the payload, the stored data regions for a sparse file, -1 without a header */
+    uint32_t hash;        /* CRC32C of the content of a file if the handle was opened with TAR_OPEN_HASH, 0 otherwise */
+} tar_stat_t;
+
+/**
+ * Gets the metadata of an entry of the archive of a handle, with a single lookup in its index.
+ *
+ * The offsets are in the archive of the handle, for an entry of a nested archive too, and -1 when they fall in a hole
+ * of a sparse file holding a nested archive.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param st Receives the metadata of the entry.
+ *
+ * @return zero on success, -1 if no entry at the given path exists in the archive or a symlink is dangling.
+ */
+int tar_stat(tar_archive_t *archive, char *path, tar_stat_t *st);
+
+/**
+ * Gets the metadata of an entry of the archive of a handle like tar_stat(), a symlink being the entry itself.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ * @param st Receives the metadata of the entry.
+ *
+ * @return zero on success, -1 if no entry at the given path exists in the archive.
+ */
+int tar_lstat(tar_archive_t *archive, char *path, tar_stat_t *st);
+
+/**
+ * Lists one page of the entries at a given path in the archive.
+ * Like list(), list_page() does not recurse into the directories listed at the given path.
+ *
+ * Entries are returned in archive order, which is stable across calls. Each page costs O(page size) as the children
+ * of every directory are kept in the index of the handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to a directory in the archive, "" for the root. If the entry is a symlink, it is resolved to its
+ *             linked-to entry. The path is only looked up on the first call with a given cursor.
+ * @param cursor An in-out argument, initialised with TAR_CURSOR_INIT to start listing from the first entry.
+ *               The callee advances it past the entries listed.
+ * @param entries An array of char arrays, each one of PATH_MAX bytes, the longest path of an index.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`, i.e. the page size.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return -1 if no directory at the given path exists in the archive, or if the handle was changed since the first
+ *         page (errno is set to ESTALE),
+ *         zero if the listing is complete,
+ *         a positive value otherwise, representing the number of entries left to be listed.
+ */
+ssize_t list_page(tar_archive_t *archive, char *path, tar_cursor_t *cursor, char **entries, size_t *no_entries);
+
+/**
+ * Reads a file at a given path in the archive of a handle, like read_file(), without scanning the archive.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its
+ *             linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return the same values as read_file(), or -3 if the archive could not be read.
+ */
+ssize_t tar_read_file(tar_archive_t *archive, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * A data region of a file, see tar_sparse_map().
+ */
+typedef struct tar_region
+{
+    uint64_t offset; /* Offset of the data in the file */
+    uint64_t len;    /* Length of the data */
+} tar_region_t;
+
+/**
+ * Gets the data regions of a file of the archive of a handle, the rest of the file being holes that read as zeros.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param regions An array receiving the data regions, sorted by offset.
+ * @param no_regions The size of the array, the regions after it are counted but not stored.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         the number of data regions otherwise, one for a non-empty file that is not sparse.
+ */
+ssize_t tar_sparse_map(tar_archive_t *archive, char *path, tar_region_t *regions, size_t no_regions);
+
+/**
+ * Extracts a file of the archive of a handle into a file, writing only its data regions so that the holes of a
+ * sparse file stay holes in the extracted file.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param out_fd A file descriptor open for writing on a regular file, which is truncated first.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -3 if the archive could not be read or the file could not be written (errno is set).
+ */
+int tar_extract_file(tar_archive_t *archive, char *path, int out_fd);
+
+/**
+ * Reads several files of the archive of a handle, from their start.
+ *
+ * The payloads are read in the order of their offsets in the archive. Payloads separated by at most the gap
+ * threshold of the handle (see tar_set_read_gap()) are read by a single preadv(), scattering them to the buffers of
+ * the caller, so that many small files cost a few sequential reads instead of one random read each.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param paths The paths of the files to read. Symlinks are resolved to their linked-to entries.
+ * @param bufs The destination buffers, one per path.
+ * @param lens An in-out array, the sizes of the buffers then the number of bytes written to each buffer.
+ * @param results An array receiving, for each path, the value tar_read_file() would have returned.
+ * @param no_paths The number of paths.
+ *
+ * @return the number of files read successfully, i.e. with a result of zero or a positive value,
+ *         -1 if the memory could not be allocated.
+ */
+ssize_t tar_read_files(tar_archive_t *archive, char **paths, uint8_t **bufs, size_t *lens, ssize_t *results,
+                       size_t no_paths);
+
+/**
+ * Sets the gap threshold of tar_read_files() for a handle, 64 KiB by default.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param gap The largest number of bytes between two payloads for them to be read by a single request. As payloads
+ *            are separated by at least a header, a gap below 512 disables merging.
+ */
+void tar_set_read_gap(tar_archive_t *archive, size_t gap);
+
+/**
+ * Gets the content hash of a file of the archive of a handle, without reading the file.
+ *
+ * @param archive A handle returned by tar_open() with TAR_OPEN_HASH.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param hash Set to the CRC32C of the content of the file.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the handle was not opened with TAR_OPEN_HASH.
+ */
+int tar_content_hash(tar_archive_t *archive, char *path, uint32_t *hash);
+
+/**
+ * Computes the CRC32C (Castagnoli) of a buffer, the content hash of tar_content_hash().
+ *
+ * @param crc The CRC of the previous bytes, zero for the first bytes.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ *
+ * @return the CRC of the previous bytes followed by the given ones.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/**
+ * A catalog over many archives (shards), answering queries as if they were a single archive.
+ *
+ * The indexes of the shards are merged in a single table mapping every path to the shard holding it, so a lookup
+ * costs one hash probe whatever the number of shards. When several shards hold the same path, the first one wins,
+ * unless the catalog is opened with TAR_CATALOG_SHADOW, in which case the last one wins, like overlay layers.
+ */
+typedef struct tar_catalog tar_catalog_t;
+
+/**
+ * Opens a catalog over several archives.
+ *
+ * @param paths The paths of the archive files, from the lowest to the highest layer.
+ * @param no_paths The number of paths.
+ * @param flags The flags given to tar_open() for each archive, optionally combined with TAR_CATALOG_SHADOW.
+ *
+ * @return a new catalog, or NULL if an archive could not be opened or indexed (errno is set).
+ */
+tar_catalog_t *tar_catalog_open(char **paths, size_t no_paths, int flags);
+
+/**
+ * Opens a catalog over the archives matching a glob pattern, in the lexicographic order of their paths.
+ *
+ * @param pattern A glob(3) pattern, e.g. "shards/data-*.tar".
+ * @param flags See tar_catalog_open().
+ *
+ * @return a new catalog, or NULL if no archive matches or an archive could not be opened (errno is set).
+ */
+tar_catalog_t *tar_catalog_open_glob(const char *pattern, int flags);
+
+/**
+ * Opens a catalog over the archives listed in a manifest file.
+ *
+ * @param manifest The path of a text file listing an archive path per line, from the lowest to the highest layer.
+ *                 Empty lines and lines starting with '#' are ignored.
+ * @param flags See tar_catalog_open().
+ *
+ * @return a new catalog, or NULL if the manifest or an archive could not be read (errno is set).
+ */
+tar_catalog_t *tar_catalog_open_manifest(const char *manifest, int flags);
+
+/**
+ * Releases a catalog, its archive handles and their file descriptors.
+ *
+ * @param catalog A catalog returned by one of the tar_catalog_open*() functions, or NULL.
+ */
+void tar_catalog_close(tar_catalog_t *catalog);
+
+/**
+ * Checks whether an entry exists in any archive of a catalog.
+ *
+ * @param catalog A catalog.
+ * @param path A path to an entry.
+ *
+ * @return zero if no entry at the given path exists in the catalog,
+ *         any other value otherwise.
+ */
+int catalog_exists(tar_catalog_t *catalog, char *path);
+
+/**
+ * Checks whether an entry exists in a catalog and is a directory.
+ *
+ * @param catalog A catalog.
+ * @param path A path to an entry.
+ *
+ * @return zero if no entry at the given path exists in the catalog or the visible entry is not a directory,
+ *         any other value otherwise.
+ */
+int catalog_is_dir(tar_catalog_t *catalog, char *path);
+
+/**
+ * Checks whether an entry exists in a catalog and is a file.
+ *
+ * @param catalog A catalog.
+ * @param path A path to an entry.
+ *
+ * @return zero if no entry at the given path exists in the catalog or the visible entry is not a file,
+ *         any other value otherwise.
+ */
+int catalog_is_file(tar_catalog_t *catalog, char *path);
+
+/**
+ * Checks whether an entry exists in a catalog and is a symlink.
+ *
+ * @param catalog A catalog.
+ * @param path A path to an entry.
+ *
+ * @return zero if no entry at the given path exists in the catalog or the visible entry is not a symlink,
+ *         any other value otherwise.
+ */
+int catalog_is_symlink(tar_catalog_t *catalog, char *path);
+
+/**
+ * Lists one page of the entries at a given path in a catalog, see list_page().
+ *
+ * The listing is the union of the directory in every archive, each path being listed once, from the archive where
+ * it is visible. Entries are listed shard by shard, in archive order.
+ *
+ * @param catalog A catalog.
+ * @param path A path to a directory, "" for the root. If the entry is a symlink, it is resolved to its linked-to
+ *             entry. Unlike list_page(), the path must be given again on each call.
+ * @param cursor An in-out argument, initialised with TAR_CURSOR_INIT.
+ * @param entries An array of char arrays, each one of PATH_MAX bytes, the longest path of an index.
+ * @param no_entries An in-out argument, the page size then the number of entries listed.
+ *
+ * @return -1 if no directory at the given path exists in the catalog,
+ *         zero if the listing is complete,
+ *         a positive value otherwise, representing the number of entries left to be listed.
+ */
+ssize_t catalog_list_page(tar_catalog_t *catalog, char *path, tar_cursor_t *cursor, char **entries, size_t *no_entries);
+
+/**
+ * Reads a file at a given path in a catalog, see tar_read_file().
+ *
+ * @param catalog A catalog.
+ * @param path A path to a file. If the entry is a symlink, it is resolved to its linked-to entry, in any archive.
+ * @param offset An offset in the file from which to start reading from.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument, the size of dest then the number of bytes written to dest.
+ *
+ * @return the same values as tar_read_file().
+ */
+ssize_t catalog_read_file(tar_catalog_t *catalog, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * A member of a sample, e.g. "000123.jpg" in the sample "000123".
+ */
+typedef struct tar_sample_member
+{
+    const char *name;    /* Path of the entry, valid while the handle is open */
+    const char *ext;     /* Extension of the entry, after the first '.' of its base name, e.g. "jpg" */
+    const uint8_t *data; /* Payload of the entry, in the arena of the sample */
+    size_t size;         /* Size of the payload */
+} tar_sample_member_t;
+
+/**
+ * A group of regular files sharing the same key, their path up to the first '.' of their base name, that follow one
+ * another in the archive.  The payload of a sparse file is its whole content, its holes read as zeros.
+ */
+typedef struct tar_sample
+{
+    char *key;                    /* Key of the sample, e.g. "shard/000123" */
+    tar_sample_member_t *members; /* Members of the sample, in archive order */
+    size_t no_members;            /* Number of members */
+    uint8_t *arena;               /* Buffer holding the payloads of every member */
+    size_t size;                  /* Size of the arena */
+} tar_sample_t;
+
+/**
+ * A streaming iterator over the samples of an archive, in archive order (WebDataset layout).
+ */
+typedef struct tar_samples tar_samples_t;
+
+/**
+ * Starts iterating over the samples of an archive.
+ *
+ * @param archive A handle returned by tar_open(). It must stay open until tar_samples_close().
+ * @param prefetch The number of samples read ahead by a background thread, zero to read each sample on demand.
+ *
+ * @return a new iterator, or NULL on error (errno is set).
+ */
+tar_samples_t *tar_samples_open(tar_archive_t *archive, size_t prefetch);
+
+/**
+ * Gets the next sample of an archive.
+ *
+ * The payloads of the members of a sample are read into the arena of the sample, with a single read for payloads at
+ * most the read gap of the handle apart (see tar_set_read_gap()).
+ *
+ * @param samples An iterator returned by tar_samples_open().
+ * @param sample Set to the next sample, to be released with tar_sample_free().
+ *
+ * @return 1 if a sample was returned, zero at the end of the archive, -1 on error (errno is set, ESTALE if
+ *         tar_delete(), tar_vacuum() or tar_update() changed the handle since tar_samples_open()).
+ */
+int tar_samples_next(tar_samples_t *samples, tar_sample_t **sample);
+
+/**
+ * Releases a sample and its arena.
+ *
+ * @param sample A sample returned by tar_samples_next(), or NULL.
+ */
+void tar_sample_free(tar_sample_t *sample);
+
+/**
+ * Stops an iterator, waits for its prefetching thread and releases the samples it read ahead.
+ *
+ * @param samples An iterator returned by tar_samples_open(), or NULL.
+ */
+void tar_samples_close(tar_samples_t *samples);
+
+/* Digest algorithms of tar_verify().  */
+#define TAR_DIGEST_SHA256 0 /* SHA-256, as written by sha256sum */
+#define TAR_DIGEST_CRC32C 1 /* CRC32C, see crc32c(), as 8 hexadecimal digits */
+
+/* Flags of tar_verify().  */
+#define TAR_VERIFY_STOP 1 /* stop at the first failure */
+
+/* Statuses of the files given to the callback of tar_verify().  */
+#define TAR_VERIFY_OK 0       /* the content matches the digest */
+#define TAR_VERIFY_MISMATCH 1 /* the content does not match the digest, or the entry is not a file */
+#define TAR_VERIFY_MISSING 2  /* the file of the manifest is not in the archive */
+#define TAR_VERIFY_EXTRA 3    /* the file of the archive is not in the manifest */
+#define TAR_VERIFY_ERROR 4    /* the file could not be read */
+
+typedef void (*tar_verify_cb_t)(const char *path, int status, void *ctx);
+
+/**
+ * The counts of the results of tar_verify().
+ */
+typedef struct tar_verify_report
+{
+    size_t no_ok;         /* Files matching their digest */
+    size_t no_mismatched; /* Files not matching their digest */
+    size_t no_missing;    /* Files of the manifest missing from the archive */
+    size_t no_extra;      /* Files of the archive missing from the manifest */
+    size_t no_errors;     /* Files that could not be read */
+} tar_verify_report_t;
+
+/**
+ * Verifies the content of the files of the archive of a handle against a manifest of digests.
+ *
+ * The files are hashed in parallel, each worker reading its files in large chunks.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param manifest The path of a manifest, a line per file with the hexadecimal digest of the file, whitespace and
+ *                 the path of the file, as written by sha256sum. Empty lines and lines starting with '#' are ignored.
+ * @param algorithm TAR_DIGEST_SHA256 or TAR_DIGEST_CRC32C, the algorithm of the digests of the manifest.
+ * @param no_threads The number of threads hashing the files, zero for one per online processor.
+ * @param flags Zero or TAR_VERIFY_STOP to stop at the first failure.
+ * @param callback Called with the path and the status of every failure, from the worker threads but never
+ *                 concurrently, or NULL.
+ * @param ctx The context given to the callback.
+ * @param report Receives the counts of the results, or NULL.
+ *
+ * @return zero if every file of the manifest matches and the archive has no other file,
+ *         1 if there was a failure,
+ *         -1 if the manifest could not be read or is malformed (errno is set).
+ */
+int tar_verify(tar_archive_t *archive, const char *manifest, int algorithm, int no_threads, int flags,
+               tar_verify_cb_t callback, void *ctx, tar_verify_report_t *report);
+
+/* Flags of tar_diff().  */
+#define TAR_DIFF_FULL 1 /* also compare the payloads of the files whose modification time did not change */
+
+/* Changes of the entries given to the callback of tar_diff(), combined.  */
+#define TAR_DIFF_ADDED 1     /* the path is only in the new archive */
+#define TAR_DIFF_REMOVED 2   /* the path is only in the old archive */
+#define TAR_DIFF_TYPE 4      /* the type of the entry changed, nothing else is compared */
+#define TAR_DIFF_METADATA 8  /* the permissions, the owner, the group or the modification time changed */
+#define TAR_DIFF_CONTENT 16  /* the size, the payload or the link target changed */
+#define TAR_DIFF_ERROR 32    /* the payloads could not be compared */
+
+typedef void (*tar_diff_cb_t)(const char *path, int changes, void *ctx);
+
+/**
+ * The counts of the results of tar_diff().
+ */
+typedef struct tar_diff_report
+{
+    size_t no_added;            /* Entries only in the new archive */
+    size_t no_removed;          /* Entries only in the old archive */
+    size_t no_type_changed;     /* Entries whose type changed */
+    size_t no_metadata_changed; /* Entries whose metadata changed */
+    size_t no_content_changed;  /* Entries whose content changed */
+    size_t no_compared;         /* Files whose payloads were read */
+    size_t no_errors;           /* Files whose payloads could not be read */
+} tar_diff_report_t;
+
+/**
+ * Compares the archives of two handles.
+ *
+ * The paths, types, sizes, link targets and metadata of the entries are compared from the indexes; the payloads of
+ * the files are read only when their size is the same but their modification time differs, in parallel and in
+ * large chunks, up to the first difference. When both handles were opened with TAR_OPEN_HASH, files whose CRC
+ * differs are known to have changed without reading them.
+ *
+ * @param old_archive A handle returned by tar_open(), the archive compared against.
+ * @param new_archive A handle returned by tar_open(), the archive whose changes are reported.
+ * @param no_threads The number of threads comparing the payloads, zero for one per online processor.
+ * @param flags Zero or TAR_DIFF_FULL to also compare the payloads of the files whose modification time is the same.
+ * @param callback Called with the path and the TAR_DIFF_* changes of every entry that changed, once the comparison is
+ *                 over: the entries of the new archive in archive order, then the removed entries of the old one.
+ *                 May be NULL.
+ * @param ctx The context given to the callback.
+ * @param report Receives the counts of the changes, or NULL.
+ *
+ * @return zero if the archives hold the same entries,
+ *         1 if an entry changed or could not be compared,
+ *         -1 if the memory could not be allocated (errno is set).
+ */
+int tar_diff(tar_archive_t *old_archive, tar_archive_t *new_archive, int no_threads, int flags,
+             tar_diff_cb_t callback, void *ctx, tar_diff_report_t *report);
+
+/* Flags of tar_create().  */
+#define TAR_CREATE_HASH 1 /* compare the files whose mtime changed with the CRC32C of the previous archive */
+
+/**
+ * The counts of the entries of tar_create().
+ */
+typedef struct tar_create_report
+{
+    size_t no_entries;   /* Entries found in the source directory */
+    size_t no_written;   /* Entries written to the archive */
+    size_t no_unchanged; /* Entries left out, unchanged since the previous archive */
+    size_t no_hashed;    /* Files hashed to compare them with the previous archive */
+    size_t no_vanished;  /* Files that disappeared before they could be written */
+    size_t no_deleted;   /* Paths of the previous archive in the deletion manifest */
+    uint64_t bytes;      /* Size of the archive written */
+} tar_create_report_t;
+
+/**
+ * Creates an archive of a directory, or the delta of a directory against a previous archive.
+ *
+ * The directory is walked in parallel and its regular files, directories and symbolic links are written in the
+ * order of their paths, relative to the directory, so that the archive does not depend on the order of the walk. The
+ * files are read by as many threads into a bounded ring of buffers, ahead of a single writer emitting the entries in
+ * that order, and the archive is the same byte for byte whatever the number of threads.
+ * Against a previous archive, only the entries that are new or whose type, size, modification time, permissions,
+ * owner, group or link target changed are written, which is decided from the index of the previous archive without
+ * reading it, and the paths of the previous archive that are gone or changed type are written to a deletion
+ * manifest. A delta holds every change since a full archive, so the previous archive must be a full archive and
+ * not another delta, which a delta marks with a pax global header. A directory is restored by extracting the full
+ * archive, then removing the paths of the manifest of the latest delta and extracting that delta alone.
+ *
+ * @param dir The path of the source directory.
+ * @param out_fd The file the archive is written to.
+ * @param base A handle returned by tar_open() on the previous full archive, or NULL to write every entry.
+ * @param manifest_fd The file the deletion manifest is written to, a path per line, or -1.
+ * @param no_threads The number of threads walking the directory and reading the files, zero for one per online
+ *                   processor.
+ * @param flags Zero or TAR_CREATE_HASH to also leave out the files whose CRC32C is the same as in the previous
+ *              archive despite a different modification time, the previous archive having been opened with
+ *              TAR_OPEN_HASH.
+ * @param report Receives the counts of the entries, or NULL.
+ *
+ * @return zero on success,
+ *         -1 on error (errno is set, EINVAL if the previous archive is a delta, ENAMETOOLONG if a path of the
+ *         directory is PATH_MAX bytes or more).
+ */
+int tar_create(const char *dir, int out_fd, tar_archive_t *base, int manifest_fd, int no_threads, int flags,
+               tar_create_report_t *report);
+
+/**
+ * A compact, read-only copy of the index of an archive, for archives with many millions of entries.
+ *
+ * Paths are sorted and front coded in blocks, metadata is stored as arrays of variable length integers, and a lookup
+ * is a binary search on the first path of each block followed by the decoding of a single block.
+ */
+typedef struct tar_compact tar_compact_t;
+
+/**
+ * The metadata of an entry of a compact index.
+ */
+typedef struct tar_compact_entry
+{
+    char typeflag;       /* Type of the entry */
+    off_t header_offset; /* Offset of the header in the archive, -1 for a directory without a header */
+    uint64_t size;       /* Size of the payload */
+    char linkname[101];  /* Target of a link, empty otherwise */
+    uint32_t hash;       /* CRC32C of the content of a file if the handle was opened with TAR_OPEN_HASH, 0 otherwise */
+} tar_compact_entry_t;
+
+/* Flags of tar_compact_build().  */
+#define TAR_COMPACT_MPH 1   /* add a minimal perfect hash of the paths */
+#define TAR_COMPACT_BLOOM 2 /* add a Bloom filter of the paths */
+
+/**
+ * Builds a compact, read-only copy of the index of a handle.
+ * The content hashes of the entries are kept, for 4 more bytes per entry, when the handle was opened with
+ * TAR_OPEN_HASH.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param flags Zero or TAR_COMPACT_MPH to add a minimal perfect hash of the paths, making a lookup a single probe
+ *              instead of a binary search, for about 5 more bytes per entry, optionally combined with
+ *              TAR_COMPACT_BLOOM to add a filter answering most lookups of unknown paths, for 1.25 more bytes per
+ *              entry. Should two paths have the same 64 bits hash, lookups stay binary searches.
+ *
+ * @return a new compact index, or NULL if the memory could not be allocated.
+ */
+tar_compact_t *tar_compact_build(tar_archive_t *archive, int flags);
+
+/**
+ * Looks up an entry in a compact index. Like the handle functions, "dir" also matches "dir/".
+ *
+ * @param compact A compact index.
+ * @param path A path to an entry in the archive.
+ * @param entry Receives the metadata of the entry.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_compact_lookup(tar_compact_t *compact, const char *path, tar_compact_entry_t *entry);
+
+/**
+ * Gets the memory used by a compact index.
+ *
+ * @param compact A compact index.
+ *
+ * @return the number of bytes of the compact index.
+ */
+size_t tar_compact_size(tar_compact_t *compact);
+
+/**
+ * Saves a compact index to a file, to be loaded again with tar_compact_load() instead of scanning the archive.
+ *
+ * @param compact A compact index.
+ * @param fd A file descriptor open for writing, at the position where the index is written.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_compact_save(tar_compact_t *compact, int fd);
+
+/**
+ * Loads a compact index saved by tar_compact_save().
+ *
+ * @param fd A file descriptor open for reading, at the position where the index was written.
+ *
+ * @return a new compact index, or NULL if it could not be read or is invalid (errno is set).
+ */
+tar_compact_t *tar_compact_load(int fd);
+
+/**
+ * Releases a compact index.
+ *
+ * @param compact A compact index, or NULL.
+ */
+void tar_compact_free(tar_compact_t *compact);
+
+/**
+ * A Bloom filter of the paths of an archive, answering definite misses with about 1.25 bytes per entry.
+ *
+ * About 1% of the paths that are not in the archive pass the filter. Once saved, it can be loaded without opening
+ * or indexing the archive, to reject unknown paths before opening a handle or loading a compact index.
+ * A handle always holds a full index, so the filter serves the low memory configurations in two ways: the compact
+ * index loaded by tar_compact_load() checks the filter added by TAR_COMPACT_BLOOM before decoding a block, and a
+ * filter loaded alone answers the misses of a process that has neither a handle nor a compact index.
+ */
+typedef struct tar_bloom tar_bloom_t;
+
+/**
+ * Builds the filter of the paths of a handle.
+ *
+ * @param archive A handle returned by tar_open().
+ *
+ * @return a new filter, or NULL if the memory could not be allocated.
+ */
+tar_bloom_t *tar_bloom_build(tar_archive_t *archive);
+
+/**
+ * Checks whether a path may be in the archive of a filter. Like the handle functions, "dir" also matches "dir/".
+ *
+ * @param bloom A filter.
+ * @param path A path.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value if one may exist.
+ */
+int tar_bloom_check(tar_bloom_t *bloom, const char *path);
+
+/**
+ * Gets the memory used by a filter.
+ *
+ * @param bloom A filter.
+ *
+ * @return the number of bytes of the filter.
+ */
+size_t tar_bloom_size(tar_bloom_t *bloom);
+
+/**
+ * Saves a filter to a file, to be loaded again with tar_bloom_load().
+ *
+ * @param bloom A filter.
+ * @param fd A file descriptor open for writing, at the position where the filter is written.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_bloom_save(tar_bloom_t *bloom, int fd);
+
+/**
+ * Loads a filter saved by tar_bloom_save().
+ *
+ * @param fd A file descriptor open for reading, at the position where the filter was written.
+ *
+ * @return a new filter, or NULL if it could not be read or is invalid (errno is set).
+ */
+tar_bloom_t *tar_bloom_load(int fd);
+
+/**
+ * Releases a filter.
+ *
+ * @param bloom A filter, or NULL.
+ */
+void tar_bloom_free(tar_bloom_t *bloom);
+
+/* Operations whose latency is recorded, see tar_metrics_quantile().  */
+#define TAR_OP_CHECK 0      /* check_archive(), tar_check_archive() */
+#define TAR_OP_EXISTS 1     /* exists(), tar_exists() */
+#define TAR_OP_IS_DIR 2     /* is_dir(), tar_is_dir() */
+#define TAR_OP_IS_FILE 3    /* is_file(), tar_is_file() */
+#define TAR_OP_IS_SYMLINK 4 /* is_symlink(), tar_is_symlink() */
+#define TAR_OP_LIST 5       /* list(), list_page() */
+#define TAR_OP_READ_FILE 6  /* read_file(), tar_read_file() */
+#define TAR_OP_READ_FILES 7 /* tar_read_files() */
+#define TAR_OP_STAT 8       /* tar_stat(), tar_lstat() */
+#define TAR_OP_SPARSE_MAP 9 /* tar_sparse_map() */
+#define TAR_OP_EXTRACT 10   /* tar_extract_file() */
+#define TAR_OPS 11
+
+/**
+ * Enables or disables the global latency histograms, which record the operations of every handle and of the
+ * functions taking a file descriptor. They are disabled by default.
+ *
+ * @param enabled Zero to disable them, any other value to enable them.
+ */
+void tar_metrics_enable(int enabled);
+
+/**
+ * Clears latency histograms. Operations running meanwhile may be partly lost.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the global histograms.
+ */
+void tar_metrics_reset(tar_archive_t *archive);
+
+/**
+ * Counts the operations recorded in a latency histogram.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the global histograms.
+ * @param op One of the TAR_OP_* operations.
+ *
+ * @return the number of operations recorded, zero if the handle was not opened with TAR_OPEN_METRICS.
+ */
+uint64_t tar_metrics_count(tar_archive_t *archive, int op);
+
+/**
+ * Gets a quantile of the latency of an operation, e.g. 0.99 for the p99.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the global histograms.
+ * @param op One of the TAR_OP_* operations.
+ * @param quantile The fraction of the operations at most as slow as the result, between 0 and 1.
+ *
+ * @return the latency in nanoseconds, within 1/16 of the exact value, zero if no operation was recorded.
+ */
+uint64_t tar_metrics_quantile(tar_archive_t *archive, int op, double quantile);
+
+/**
+ * Writes latency histograms in the Prometheus text exposition format, as one summary with the p50, p90, p99 and
+ * p999 of every operation.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the global histograms.
+ * @param label The value of an "archive" label added to every sample, or NULL for none.
+ * @param out The stream to write to.
+ *
+ * @return zero on success, -1 if the handle has no histograms or on a write error.
+ */
+int tar_metrics_dump(tar_archive_t *archive, const char *label, FILE *out);
+
+/**
+ * A content-addressed store of the chunks of many archives, each chunk being stored once however many archives hold
+ * it. Archives are cut in chunks of about 64 KiB with content-defined chunking, every file starting a chunk.  The cut
+ * points are found with a scalar gear hash, a byte at a time and a few cycles per byte, which bounds the speed of
+ * tar_store_ingest() on one core.
+ */
+typedef struct tar_store tar_store_t;
+
+/* Flags of tar_store_open().  */
+#define TAR_STORE_CREATE 1 /* create the store if it does not exist */
+
+/**
+ * The counts of an ingest of tar_store_ingest().
+ */
+typedef struct tar_store_report
+{
+    uint64_t bytes;       /* Size of the archive */
+    uint64_t new_bytes;   /* Bytes of the chunks the store did not have */
+    size_t no_chunks;     /* Chunks of the archive */
+    size_t no_new_chunks; /* Chunks the store did not have */
+} tar_store_report_t;
+
+/**
+ * Opens a chunk store.
+ *
+ * @param dir The directory of the store.
+ * @param flags Zero or TAR_STORE_CREATE to create the store if it does not exist.
+ *
+ * @return a new store, or NULL on error (errno is set).
+ */
+tar_store_t *tar_store_open(const char *dir, int flags);
+
+/**
+ * Adds an archive to a chunk store, storing the chunks the store does not have yet.
+ *
+ * Ingests are serialized by a lock on the store, and may run while archives of the store are being read.
+ *
+ * @param store A store returned by tar_store_open().
+ * @param name The name of the archive in the store, a path component not starting with '.'. An archive of the same
+ *             name is replaced.
+ * @param tar_fd A file descriptor of the archive, read with pread().
+ * @param report Receives the counts of the chunks, or NULL.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_store_ingest(tar_store_t *store, const char *name, int tar_fd, tar_store_report_t *report);
+
+/**
+ * Opens a handle on an archive of a chunk store, its reads being served from the chunks of the store.
+ *
+ * The handle supports every function taking a handle, and must be closed before the store.
+ *
+ * @param store A store returned by tar_store_open().
+ * @param name The name given to tar_store_ingest().
+ * @param flags The flags of tar_open(), TAR_OPEN_DIRECT being ignored.
+ *
+ * @return a new handle, or NULL on error (errno is set).
+ */
+tar_archive_t *tar_store_archive(tar_store_t *store, const char *name, int flags);
+
+/**
+ * Writes an archive of a chunk store, byte for byte as it was ingested.
+ *
+ * @param store A store returned by tar_store_open().
+ * @param name The name given to tar_store_ingest().
+ * @param out_fd The file the archive is written to.
+ *
+ * @return zero on success, -1 on error (errno is set).
+ */
+int tar_store_extract(tar_store_t *store, const char *name, int out_fd);
+
+/**
+ * Closes a chunk store. Handles returned by tar_store_archive() must be closed first.
+ *
+ * @param store A store returned by tar_store_open(), or NULL.
+ */
+void tar_store_close(tar_store_t *store);
+
+/* Flags of tar_delete().  */
+#define TAR_DELETE_MARK 1 /* only mark the members as dead, leaving their space to tar_vacuum() */
+
+/**
+ * The counts of a deletion of tar_delete().
+ */
+typedef struct tar_delete_report
+{
+    size_t no_entries;  /* Entries removed from the index, those under the directories deleted included */
+    size_t no_members;  /* Members turned into dead members, the older members of the same paths included */
+    uint64_t collapsed; /* Bytes removed from the file */
+    uint64_t marked;    /* Bytes left in the file as dead members, until tar_vacuum() */
+} tar_delete_report_t;
+
+/**
+ * Deletes entries from an archive in place.
+ *
+ * Every member of the paths is turned into a dead member, the older members of the same paths included, and the
+ * blocks of the file in runs of dead members are removed with FALLOC_FL_COLLAPSE_RANGE where the filesystem supports
+ * it. The archive stays readable by any tar reader. The index of the handle is updated, and must not be used by other
+ * threads meanwhile. Hard links to the files deleted are not followed. The entries being renumbered, the list cursors,
+ * the sample iterators and the tables of the handle become stale: they then fail with ESTALE.
+ *
+ * @param archive A handle on an archive opened with O_RDWR, not a handle of a chunk store.
+ * @param paths The paths of the entries, directories being deleted with everything under them.
+ * @param no_paths The number of paths.
+ * @param flags Zero or TAR_DELETE_MARK to only mark the members as dead.
+ * @param report Receives the counts of the deletion, or NULL.
+ *
+ * @return zero on success, -1 on error (errno is set), ENOENT if a path is not in the archive, in which case nothing
+ *         is deleted. After other errors the archive is valid, but the handle must be opened again.
+ */
+int tar_delete(tar_archive_t *archive, char **paths, size_t no_paths, int flags, tar_delete_report_t *report);
+
+/**
+ * Removes the dead members of an archive, left by tar_delete(), from the file.
+ *
+ * The members after each run of dead members are moved over it in a single pass with copy_file_range(), then the
+ * file is truncated, and the index of the handle is updated. The archive is damaged if the process stops during the
+ * moves. Like after tar_delete(), the list cursors, the sample iterators and the tables of the handle become stale.
+ *
+ * @param archive A handle on an archive opened with O_RDWR, not a handle of a chunk store.
+ *
+ * @return the number of bytes removed from the file, -1 on error (errno is set).
+ */
+int64_t tar_vacuum(tar_archive_t *archive);
+
+/* Fields of tar_update_t to change.  */
+#define TAR_UPDATE_MODE 1     /* the permission bits */
+#define TAR_UPDATE_MTIME 2    /* the modification time */
+#define TAR_UPDATE_UID 4      /* the owner */
+#define TAR_UPDATE_GID 8      /* the group */
+#define TAR_UPDATE_CONTENT 16 /* the content of a regular file */
+
+/**
+ * The changes of tar_update().
+ */
+typedef struct tar_update
+{
+    int fields;       /* TAR_UPDATE_* bits of the fields to change */
+    uint16_t mode;    /* Permission bits */
+    int64_t mtime;    /* Modification time, in seconds since the epoch */
+    uint32_t uid;     /* Owner */
+    uint32_t gid;     /* Group */
+    const void *data; /* New content */
+    uint64_t size;    /* Size of the new content, taking as many 512 bytes blocks as the old one */
+} tar_update_t;
+
+/**
+ * Changes the metadata of an entry, or the content of a regular file, in place.
+ *
+ * Only the header of the entry, its payload and the extended header before it are written, the payload last but for
+ * the header. The index of the handle is updated, and must not be used by other threads meanwhile.
+ *
+ * @param archive A handle on an archive opened with O_RDWR, not a handle of a chunk store.
+ * @param path The path of the entry, a symbolic link being changed itself.
+ * @param update The fields to change and their new values.
+ *
+ * @return zero on success, -1 on error (errno is set): ENOENT if the entry has no header in the archive, EINVAL if
+ *         the new content does not take as many blocks as the old one or the entry is not a regular file, EOVERFLOW
+ *         if a record of its extended header is too short for a new value.
+ */
+int tar_update(tar_archive_t *archive, const char *path, const tar_update_t *update);
+
+
+/**
+ * Gets the handle of an archive stored as a file of the archive of a handle.
+ *
+ * The nested handle is opened with the flags of the outer one on first use, and kept by it: it must not be closed,
+ * and stays valid until the outer handle is closed, or changed by tar_delete() or by tar_update() of the file. Its
+ * reads are reads of the file in the outer archive, without copying it.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to a file of the archive holding an archive, which may itself be in nested archives, as in
+ *             "bundle.tar!/layers/3.tar". If the entry is a symlink, it is resolved to its linked-to entry.
+ *
+ * @return the nested handle, or NULL if no file at the given path exists or it does not hold an archive (errno is
+ *         set).
+ */
+tar_archive_t *tar_nested(tar_archive_t *archive, char *path);
+
+/**
+ * A columnar copy of the metadata of the index of an archive, answering queries on millions of entries by scanning
+ * arrays of types, sizes, modification times, owners and modes instead of listing and statting every entry.
+ *
+ * Its rows are the entries of the archive sorted by path, so that the entries under a path prefix are a range of
+ * rows. The table records the generation of the index it copied: once tar_delete(), tar_vacuum() or tar_update()
+ * changed the handle, its rows no longer name the same entries and the functions taking it fail with ESTALE, the
+ * table having to be built again. It must be freed before its handle is closed.
+ */
+typedef struct tar_table tar_table_t;
+
+/* Types of entries matched by a query, combined.  */
+#define TAR_QUERY_FILE 1     /* regular files, sparse or not */
+#define TAR_QUERY_DIR 2      /* directories */
+#define TAR_QUERY_SYMLINK 4  /* symlinks */
+#define TAR_QUERY_HARDLINK 8 /* hard links */
+#define TAR_QUERY_OTHER 16   /* devices, FIFOs and unknown types */
+#define TAR_QUERY_ALL 31
+
+/* Orders of the rows of a query.  */
+#define TAR_ORDER_PATH 0  /* by path */
+#define TAR_ORDER_SIZE 1  /* by size, then by path */
+#define TAR_ORDER_MTIME 2 /* by modification time, then by path */
+
+/**
+ * A query on a table, every predicate having to match. Initialize it with TAR_QUERY_INIT, matching every entry in
+ * path order, then narrow it.
+ */
+typedef struct tar_query
+{
+    const char *prefix; /* Paths starting with this string, or NULL */
+    int types;          /* Combination of TAR_QUERY_* */
+    uint64_t min_size;  /* Smallest size, inclusive */
+    uint64_t max_size;  /* Largest size, inclusive */
+    int64_t min_mtime;  /* Oldest modification time, inclusive */
+    int64_t max_mtime;  /* Newest modification time, inclusive */
+    int64_t uid;        /* Owner, or -1 for any owner */
+    uint16_t mode_mask; /* Permission bits tested */
+    uint16_t mode_bits; /* Value the tested bits must have */
+    int order;          /* TAR_ORDER_* */
+    int descending;     /* Whether the order is reversed, giving the largest or newest first */
+} tar_query_t;
+
+#define TAR_QUERY_INIT {NULL, TAR_QUERY_ALL, 0, UINT64_MAX, INT64_MIN, INT64_MAX, -1, 0, 0, TAR_ORDER_PATH, 0}
+
+/**
+ * Builds a columnar copy of the metadata of the index of a handle.
+ *
+ * @param archive A handle returned by tar_open().
+ *
+ * @return a new table, or NULL if the memory could not be allocated.
+ */
+tar_table_t *tar_table_build(tar_archive_t *archive);
+
+/**
+ * Runs a query on a table, counting the matching rows and keeping the first ones in the order of the query.
+ *
+ * @param table A table returned by tar_table_build().
+ * @param query The predicates and the order.
+ * @param rows Receives the first matching rows in order, at most no_rows of them.
+ * @param no_rows The size of the rows array, the N of a top-N query.
+ *
+ * @return the number of matching rows, of which the first min(no_rows, return value) are in rows,
+ *         zero with errno set to ESTALE if the handle was changed since the table was built.
+ */
+size_t tar_query(tar_table_t *table, const tar_query_t *query, uint32_t *rows, size_t no_rows);
+
+/**
+ * Gets the path of a row of a table.
+ *
+ * @param table A table.
+ * @param row A row returned by tar_query().
+ *
+ * @return the path, valid until the handle of the table is changed or closed,
+ *         NULL with errno set to ESTALE if the handle was changed since the table was built.
+ */
+const char *tar_table_path(tar_table_t *table, uint32_t row);
+
+/**
+ * Gets the metadata of a row of a table, like tar_lstat() on its path.
+ *
+ * @param table A table.
+ * @param row A row returned by tar_query().
+ * @param st Receives the metadata of the entry.
+ *
+ * @return zero on success, -1 with errno set to ESTALE if the handle was changed since the table was built.
+ */
+int tar_table_stat(tar_table_t *table, uint32_t row, tar_stat_t *st);
+
+/**
+ * Gets the number of rows of a table.
+ *
+ * @param table A table.
+ *
+ * @return the number of entries of the archive of the table.
+ */
+size_t tar_table_rows(tar_table_t *table);
+
+/**
+ * Releases a table.
+ *
+ * @param table A table, or NULL.
+ */
+void tar_table_free(tar_table_t *table);
+
+/**
+ * The totals of the files under an entry of an archive, see tar_usage().
+ */
+typedef struct tar_usage
+{
+    uint64_t bytes;        /* Total size of the files, the holes of sparse files included */
+    size_t no_files;       /* Number of regular and sparse files, hard links not counted */
+    uint64_t largest_size; /* Size of the largest file, zero without files */
+    const char *largest;   /* Path of the largest file, NULL without files, valid until the handle is closed */
+} tar_usage_t;
+
+/**
+ * Gets the totals of the files under an entry of the archive of a handle, without walking the entries.
+ *
+ * @param archive A handle returned by tar_open() with TAR_OPEN_USAGE.
+ * @param path A path to an entry in the archive, the empty string for the whole archive. If the entry is a symlink,
+ *             it is resolved to its linked-to entry. A file gives its own size.
+ * @param usage Receives the totals.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive,
+ *         -2 if the handle was not opened with TAR_OPEN_USAGE.
+ */
+int tar_usage(tar_archive_t *archive, char *path, tar_usage_t *usage);
+
+#define TAR_SIZE_BUCKETS 65 /* Buckets of a size histogram: empty files, then [2^(k-1), 2^k) bytes in bucket k */
+
+/**
+ * The sizes of the files of an archive, by power of two, see tar_size_histogram().
+ */
+typedef struct tar_size_histogram
+{
+    uint64_t no_files[TAR_SIZE_BUCKETS]; /* Number of files of each bucket */
+    uint64_t bytes[TAR_SIZE_BUCKETS];    /* Total size of the files of each bucket */
+} tar_size_histogram_t;
+
+/**
+ * Gets the histogram of the sizes of the files of the archive of a handle, filled with the totals of tar_usage().
+ *
+ * @param archive A handle returned by tar_open() with TAR_OPEN_USAGE.
+ * @param histogram Receives the histogram.
+ *
+ * @return zero on success, -1 if the handle was not opened with TAR_OPEN_USAGE.
+ */
+int tar_size_histogram(tar_archive_t *archive, tar_size_histogram_t *histogram);
+
 #endif
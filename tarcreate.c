@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "lib_tar.h"
+
+/**
+ * Creates an archive of a directory, or with -b the delta of the directory against a previous archive
+ */
+
+int main(int argc, char **argv)
+{
+    int no_threads = 0;
+    int flags = 0;
+    const char *base_path = NULL;
+    const char *manifest_path = NULL;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:b:d:hv")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            no_threads = atoi(optarg);
+            break;
+        case 'b':
+            base_path = optarg;
+            break;
+        case 'd':
+            manifest_path = optarg;
+            break;
+        case 'h':
+            flags |= TAR_CREATE_HASH;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            optind = argc; // Print the usage
+            break;
+        }
+    }
+    if (argc - optind != 2 || (base_path == NULL && (manifest_path != NULL || flags)))
+    {
+        printf("Usage: %s [-j threads] [-b base_tar_file [-d deleted_file] [-h]] [-v] dir tar_file\n", argv[0]);
+        printf("  -b  only write what changed since a previous full archive, not a delta\n");
+        printf("  -d  write the paths removed since the previous archive to a file\n");
+        printf("  -h  compare the files whose mtime changed with the previous archive by CRC32C\n");
+        printf("  -v  print the counts of the entries\n");
+        return 2;
+    }
+
+    tar_archive_t *base = NULL;
+    if (base_path != NULL)
+    {
+        int base_fd = open(base_path, O_RDONLY);
+        int open_flags = TAR_ACCESS_DEFAULT | (flags & TAR_CREATE_HASH ? TAR_OPEN_HASH : 0);
+        base = base_fd < 0 ? NULL : tar_open(base_fd, open_flags);
+        if (base == NULL)
+        {
+            perror(base_path);
+            return 2;
+        }
+    }
+
+    int manifest_fd = -1;
+    if (manifest_path != NULL && (manifest_fd = open(manifest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        perror(manifest_path);
+        return 2;
+    }
+    const char *out_path = argv[optind + 1];
+    int out_fd = strcmp(out_path, "-") == 0 ? STDOUT_FILENO : open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0)
+    {
+        perror(out_path);
+        return 2;
+    }
+
+    tar_create_report_t report;
+    if (tar_create(argv[optind], out_fd, base, manifest_fd, no_threads, flags, &report) < 0)
+    {
+        perror("tar_create");
+        return 2;
+    }
+    if (verbose)
+    {
+        fprintf(stderr, "%zu entries, %zu written, %zu unchanged, %zu hashed, %zu vanished, %zu deleted, %llu bytes\n",
+                report.no_entries, report.no_written, report.no_unchanged, report.no_hashed, report.no_vanished,
+                report.no_deleted, (unsigned long long)report.bytes);
+    }
+
+    tar_close(base);
+    if (fsync(out_fd) < 0 && errno != EINVAL) // Pipes cannot be synced
+    {
+        perror(out_path);
+        return 2;
+    }
+    return 0;
+}
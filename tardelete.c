@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "lib_tar.h"
+
+/**
+ * Deletes entries from an archive in place, and removes the space of the entries deleted from the file with -c
+ */
+
+int main(int argc, char **argv)
+{
+    int flags = 0;
+    int vacuum = 0;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "mcv")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            flags |= TAR_DELETE_MARK;
+            break;
+        case 'c':
+            vacuum = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            optind = argc; // Print the usage
+            break;
+        }
+    }
+    if (argc - optind < 1 || (argc - optind == 1 && !vacuum))
+    {
+        printf("Usage: %s [-m] [-c] [-v] tar_file [path...]\n", argv[0]);
+        printf("  -m  only mark the entries as deleted, without removing blocks from the file\n");
+        printf("  -c  then move the entries over the space of every entry deleted so far\n");
+        printf("  -v  print the counts of the deletion\n");
+        return 2;
+    }
+
+    const char *path = argv[optind];
+    int fd = open(path, O_RDWR);
+    tar_archive_t *archive = fd < 0 ? NULL : tar_open(fd, TAR_ACCESS_DEFAULT);
+    if (archive == NULL)
+    {
+        perror(path);
+        return 2;
+    }
+
+    int ret = 0;
+    tar_delete_report_t report;
+    if (argc - optind > 1 && tar_delete(archive, argv + optind + 1, argc - optind - 1, flags, &report) < 0)
+    {
+        perror("tar_delete");
+        ret = 2;
+    }
+    else if (argc - optind > 1 && verbose)
+    {
+        fprintf(stderr, "%zu entries, %zu members deleted, %llu bytes collapsed, %llu bytes marked\n",
+                report.no_entries, report.no_members, (unsigned long long)report.collapsed,
+                (unsigned long long)report.marked);
+    }
+
+    int64_t reclaimed = ret == 0 && vacuum ? tar_vacuum(archive) : 0;
+    if (reclaimed < 0)
+    {
+        perror("tar_vacuum");
+        ret = 2;
+    }
+    else if (vacuum && verbose)
+    {
+        fprintf(stderr, "%lld bytes reclaimed\n", (long long)reclaimed);
+    }
+
+    tar_close(archive);
+    if (fsync(fd) < 0)
+    {
+        perror(path);
+        ret = 2;
+    }
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "lib_tar.h"
+
+/**
+ * Lists the entries that changed between two archives, a line per entry with letters for its changes:
+ * A added, D removed, T type changed, M metadata changed, C content changed, E could not be compared
+ *
+ * As diff(1), exits with 0 if the archives are the same, 1 if they differ and 2 on trouble, a file that could not be
+ * compared included.
+ */
+
+void print_change(const char *path, int changes, void *ctx)
+{
+    static const struct
+    {
+        int change;
+        char letter;
+    } letters[] = {{TAR_DIFF_ADDED, 'A'},    {TAR_DIFF_REMOVED, 'D'}, {TAR_DIFF_TYPE, 'T'},
+                   {TAR_DIFF_METADATA, 'M'}, {TAR_DIFF_CONTENT, 'C'}, {TAR_DIFF_ERROR, 'E'}};
+
+    char code[8];
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(letters) / sizeof(letters[0]); i++)
+    {
+        if (changes & letters[i].change)
+        {
+            code[len++] = letters[i].letter;
+        }
+    }
+    code[len] = '\0';
+    printf("%-3s %s\n", code, path);
+}
+
+/**
+ * @brief Opens an archive and indexes it
+ *
+ * @param path The path of the archive
+ * @param flags The flags of tar_open()
+ * @return tar_archive_t* The handle, NULL on error
+ */
+tar_archive_t *open_archive(const char *path, int flags)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        perror(path);
+        return NULL;
+    }
+    tar_archive_t *archive = tar_open(fd, flags);
+    if (archive == NULL)
+    {
+        perror(path);
+        close(fd);
+    }
+    return archive;
+}
+
+int main(int argc, char **argv)
+{
+    int no_threads = 0;
+    int diff_flags = 0;
+    int open_flags = TAR_ACCESS_DEFAULT;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:fhv")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            no_threads = atoi(optarg);
+            break;
+        case 'f':
+            diff_flags |= TAR_DIFF_FULL;
+            break;
+        case 'h':
+            open_flags |= TAR_OPEN_HASH;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            optind = argc; // Print the usage
+            break;
+        }
+    }
+    if (argc - optind != 2)
+    {
+        printf("Usage: %s [-j threads] [-f] [-h] [-v] old_tar_file new_tar_file\n", argv[0]);
+        printf("  -f  compare the content of the files whose modification time did not change\n");
+        printf("  -h  hash the files while indexing, to find most content changes without comparing\n");
+        printf("  -v  print the counts of the changes\n");
+        return 2;
+    }
+
+    tar_archive_t *old_archive = open_archive(argv[optind], open_flags);
+    tar_archive_t *new_archive = old_archive == NULL ? NULL : open_archive(argv[optind + 1], open_flags);
+    if (new_archive == NULL)
+    {
+        tar_close(old_archive);
+        return 2;
+    }
+
+    tar_diff_report_t report;
+    int ret = tar_diff(old_archive, new_archive, no_threads, diff_flags, print_change, NULL, &report);
+    if (ret < 0)
+    {
+        perror("tar_diff");
+    }
+    else if (verbose)
+    {
+        fprintf(stderr, "%zu added, %zu removed, %zu type changed, %zu metadata changed, %zu content changed, "
+                        "%zu compared, %zu errors\n",
+                report.no_added, report.no_removed, report.no_type_changed, report.no_metadata_changed,
+                report.no_content_changed, report.no_compared, report.no_errors);
+    }
+
+    tar_close(old_archive);
+    tar_close(new_archive);
+    return ret < 0 || report.no_errors > 0 ? 2 : ret;
+}
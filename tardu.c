@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "lib_tar.h"
+
+/**
+ * Prints the totals of the files under every directory of an archive like du, and with -H the histogram of the sizes
+ * of its files
+ */
+
+#define TARDU_PAGE 64       // Names listed at a time
+#define TARDU_NAME PATH_MAX // Size of a name of the listing
+
+/**
+ * @brief Prints the totals of a directory after those of its subdirectories, down to a given depth
+ *
+ * @param archive The handle, opened with TAR_OPEN_USAGE
+ * @param path The path of the directory
+ * @param depth The number of levels of subdirectories left to print, negative for all of them
+ * @return int 0 on success, 1 on error
+ */
+int print_usage(tar_archive_t *archive, char *path, int depth)
+{
+    // A page of names per level of the recursion, on the heap so that deep trees do not exhaust the stack
+    char *names = depth != 0 ? malloc(TARDU_PAGE * TARDU_NAME) : NULL;
+    char *entries[TARDU_PAGE];
+    if (depth != 0 && names == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    for (int i = 0; names != NULL && i < TARDU_PAGE; i++)
+    {
+        entries[i] = names + i * TARDU_NAME;
+    }
+    tar_cursor_t cursor = TAR_CURSOR_INIT;
+    for (ssize_t left = depth != 0; left > 0;)
+    {
+        size_t no_entries = TARDU_PAGE;
+        left = list_page(archive, path, &cursor, entries, &no_entries); // -1 for a file, which has no children
+        for (size_t i = 0; i < no_entries; i++)
+        {
+            tar_stat_t st;
+            if (tar_lstat(archive, entries[i], &st) == 0 && st.type == DIRTYPE &&
+                print_usage(archive, entries[i], depth - 1) != 0)
+            {
+                free(names);
+                return 1;
+            }
+        }
+    }
+    free(names);
+
+    tar_usage_t usage;
+    if (tar_usage(archive, path, &usage) < 0)
+    {
+        fprintf(stderr, "%s: no such entry\n", path);
+        return 1;
+    }
+    printf("%14llu %10zu %14llu  %s\n", (unsigned long long)usage.bytes, usage.no_files,
+           (unsigned long long)usage.largest_size, path[0] != '\0' ? path : ".");
+    return 0;
+}
+
+/**
+ * @brief Prints the histogram of the sizes of the files of an archive, a line per non-empty bucket
+ */
+void print_histogram(tar_archive_t *archive)
+{
+    tar_size_histogram_t histogram;
+    tar_size_histogram(archive, &histogram);
+    uint64_t no_files = 0;
+    uint64_t bytes = 0;
+    for (int k = 0; k < TAR_SIZE_BUCKETS; k++)
+    {
+        no_files += histogram.no_files[k];
+        bytes += histogram.bytes[k];
+    }
+
+    printf("%-42s %10s %7s %16s %7s\n", "size", "files", "", "bytes", "");
+    for (int k = 0; k < TAR_SIZE_BUCKETS; k++)
+    {
+        if (histogram.no_files[k] == 0)
+        {
+            continue;
+        }
+        char range[48];
+        if (k == 0)
+        {
+            snprintf(range, sizeof(range), "0");
+        }
+        else
+        {
+            snprintf(range, sizeof(range), "%llu - %llu", 1ULL << (k - 1),
+                     k == 64 ? UINT64_MAX : (1ULL << k) - 1);
+        }
+        printf("%-42s %10llu %6.1f%% %16llu %6.1f%%\n", range, (unsigned long long)histogram.no_files[k],
+               100.0 * histogram.no_files[k] / no_files, (unsigned long long)histogram.bytes[k],
+               bytes ? 100.0 * histogram.bytes[k] / bytes : 0.0);
+    }
+    printf("%-42s %10llu %7s %16llu\n", "total", (unsigned long long)no_files, "", (unsigned long long)bytes);
+}
+
+int main(int argc, char **argv)
+{
+    int depth = -1;
+    int histogram = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:sH")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 's':
+            depth = 0;
+            break;
+        case 'H':
+            histogram = 1;
+            break;
+        default:
+            optind = argc; // Print the usage
+            break;
+        }
+    }
+    if (argc - optind < 1)
+    {
+        printf("Usage: %s [-d depth | -s] [-H] tar_file [path...]\n", argv[0]);
+        printf("  -d  print the directories at most depth levels below the paths\n");
+        printf("  -s  only print the totals of the paths\n");
+        printf("  -H  print the histogram of the sizes of the files instead\n");
+        return 2;
+    }
+
+    const char *tar_path = argv[optind];
+    int fd = open(tar_path, O_RDONLY);
+    tar_archive_t *archive = fd < 0 ? NULL : tar_open(fd, TAR_ACCESS_DEFAULT | TAR_OPEN_USAGE);
+    if (archive == NULL)
+    {
+        perror(tar_path);
+        return 2;
+    }
+
+    int ret = 0;
+    if (histogram)
+    {
+        print_histogram(archive);
+    }
+    else
+    {
+        printf("%14s %10s %14s  %s\n", "bytes", "files", "largest", "path");
+        char root[] = "";
+        ret = argc - optind == 1 ? print_usage(archive, root, depth) : 0;
+        for (int i = optind + 1; i < argc; i++)
+        {
+            ret |= print_usage(archive, argv[i], depth);
+        }
+    }
+
+    tar_close(archive);
+    return ret;
+}
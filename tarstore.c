@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "lib_tar.h"
+
+/**
+ * Adds archives to a chunk store, and reads them back whole or file by file
+ */
+
+int usage(const char *name)
+{
+    printf("Usage: %s store_dir ingest name tar_file...\n", name);
+    printf("       %s store_dir extract name tar_file\n", name);
+    printf("       %s store_dir cat name path\n", name);
+    return 2;
+}
+
+/**
+ * @brief Ingests archives, named by the name given and their position when there are several
+ */
+int ingest(tar_store_t *store, const char *name, char **paths, int no_paths)
+{
+    for (int i = 0; i < no_paths; i++)
+    {
+        char archive_name[256];
+        snprintf(archive_name, sizeof(archive_name), no_paths > 1 ? "%s.%d" : "%s", name, i);
+        int fd = open(paths[i], O_RDONLY);
+        tar_store_report_t report;
+        if (fd < 0 || tar_store_ingest(store, archive_name, fd, &report) < 0)
+        {
+            perror(paths[i]);
+            return 1;
+        }
+        close(fd);
+        printf("%s: %llu bytes, %zu chunks, %zu new chunks, %llu new bytes (%.1f%%)\n", archive_name,
+               (unsigned long long)report.bytes, report.no_chunks, report.no_new_chunks,
+               (unsigned long long)report.new_bytes, report.bytes ? 100.0 * report.new_bytes / report.bytes : 0.0);
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a file of an archive of the store to the standard output, through the normal read API
+ */
+int cat(tar_store_t *store, const char *name, char *path)
+{
+    tar_archive_t *archive = tar_store_archive(store, name, TAR_ACCESS_DEFAULT);
+    if (archive == NULL)
+    {
+        perror(name);
+        return 1;
+    }
+    uint8_t buf[1 << 16];
+    ssize_t ret;
+    size_t offset = 0;
+    do
+    {
+        size_t len = sizeof(buf);
+        ret = tar_read_file(archive, path, offset, buf, &len);
+        if (ret < 0 || fwrite(buf, 1, len, stdout) != len)
+        {
+            fprintf(stderr, "%s: cannot read %s (%zd)\n", name, path, ret);
+            tar_close(archive);
+            return 1;
+        }
+        offset += len;
+    } while (ret > 0);
+    tar_close(archive);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 5)
+    {
+        return usage(argv[0]);
+    }
+    int is_ingest = strcmp(argv[2], "ingest") == 0;
+    if (!is_ingest && argc != 5)
+    {
+        return usage(argv[0]);
+    }
+
+    tar_store_t *store = tar_store_open(argv[1], is_ingest ? TAR_STORE_CREATE : 0);
+    if (store == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    int ret;
+    if (is_ingest)
+    {
+        ret = ingest(store, argv[3], argv + 4, argc - 4);
+    }
+    else if (strcmp(argv[2], "extract") == 0)
+    {
+        int fd = strcmp(argv[4], "-") == 0 ? STDOUT_FILENO : open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ret = fd < 0 || tar_store_extract(store, argv[3], fd) < 0;
+        if (ret)
+        {
+            perror(argv[3]);
+        }
+    }
+    else if (strcmp(argv[2], "cat") == 0)
+    {
+        ret = cat(store, argv[3], argv[4]);
+    }
+    else
+    {
+        ret = usage(argv[0]);
+    }
+
+    tar_store_close(store);
+    return ret;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "lib_tar.h"
+
+/**
+ * Changes the metadata of an entry of an archive in place, or replaces the content of a file by a file of the same
+ * number of blocks
+ */
+
+int main(int argc, char **argv)
+{
+    tar_update_t update = {.fields = 0};
+    const char *content_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:t:u:g:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            update.fields |= TAR_UPDATE_MODE;
+            update.mode = strtoul(optarg, NULL, 8);
+            break;
+        case 't':
+            update.fields |= TAR_UPDATE_MTIME;
+            update.mtime = strtoll(optarg, NULL, 10);
+            break;
+        case 'u':
+            update.fields |= TAR_UPDATE_UID;
+            update.uid = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            update.fields |= TAR_UPDATE_GID;
+            update.gid = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            update.fields |= TAR_UPDATE_CONTENT;
+            content_path = optarg;
+            break;
+        default:
+            optind = argc; // Print the usage
+            break;
+        }
+    }
+    if (argc - optind != 2 || update.fields == 0)
+    {
+        printf("Usage: %s [-m octal_mode] [-t mtime] [-u uid] [-g gid] [-f content_file] tar_file path\n", argv[0]);
+        printf("  -f  replace the content of a file, the new one taking as many 512 bytes blocks\n");
+        return 2;
+    }
+
+    void *data = NULL;
+    if (content_path != NULL)
+    {
+        int content_fd = open(content_path, O_RDONLY);
+        struct stat st;
+        ssize_t len = 0;
+        if (content_fd >= 0 && fstat(content_fd, &st) == 0 && (data = malloc(st.st_size ? st.st_size : 1)) != NULL)
+        {
+            for (ssize_t ret = 1; len < st.st_size && ret > 0; len += ret > 0 ? ret : 0)
+            {
+                ret = read(content_fd, (char *)data + len, st.st_size - len);
+            }
+        }
+        int err = errno;
+        if (content_fd >= 0)
+        {
+            close(content_fd);
+        }
+        if (data == NULL || len != st.st_size)
+        {
+            errno = err;
+            perror(content_path);
+            free(data);
+            return 2;
+        }
+        update.data = data;
+        update.size = st.st_size;
+    }
+
+    const char *path = argv[optind];
+    int fd = open(path, O_RDWR);
+    tar_archive_t *archive = fd < 0 ? NULL : tar_open(fd, TAR_ACCESS_RANDOM);
+    if (archive == NULL)
+    {
+        perror(path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        free(data);
+        return 2;
+    }
+
+    int ret = 0;
+    if (tar_update(archive, argv[optind + 1], &update) < 0 || fsync(fd) < 0)
+    {
+        perror(argv[optind + 1]);
+        ret = 2;
+    }
+    tar_close(archive);
+    close(fd);
+    free(data);
+    return ret;
+}
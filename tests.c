@@ -1,7 +1,13 @@
+#define _XOPEN_SOURCE 700
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include "lib_tar.h"
 
@@ -28,6 +34,1656 @@ void debug_dump(const uint8_t *bytes, size_t len)
     }
 }
 
+/**
+ * @brief Writes a file of a test directory
+ *
+ * @param dir The directory
+ * @param name The name of the file
+ * @param content The content of the file
+ * @return int 0 on success, -1 on error
+ */
+int write_file(const char *dir, const char *name, const char *content)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    ssize_t len = write(fd, content, strlen(content));
+    close(fd);
+    return len == (ssize_t)strlen(content) ? 0 : -1;
+}
+
+/**
+ * @brief Appends a header to an archive being written by hand
+ *
+ * @param fd The archive
+ * @param name The name field, cut to 100 bytes
+ * @param typeflag The type of the member
+ * @param linkname The link target field, cut to 100 bytes, or NULL
+ * @param size The size field
+ * @param gnu Whether to write the GNU magic instead of the ustar one
+ * @return int 0 on success, -1 on error
+ */
+int write_header(int fd, const char *name, char typeflag, const char *linkname, uint64_t size, int gnu)
+{
+    tar_header_t header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.name, name, sizeof(header.name));
+    strcpy(header.mode, "0000644");
+    strcpy(header.uid, "0000000");
+    strcpy(header.gid, "0000000");
+    snprintf(header.size, sizeof(header.size), "%011llo", (unsigned long long)size);
+    strcpy(header.mtime, "00000000000");
+    header.typeflag = typeflag;
+    if (linkname != NULL)
+    {
+        strncpy(header.linkname, linkname, sizeof(header.linkname));
+    }
+    memcpy(header.magic, gnu ? "ustar  " : TMAGIC, gnu ? 8 : TMAGLEN);
+    if (!gnu)
+    {
+        memcpy(header.version, TVERSION, TVERSLEN);
+    }
+
+    unsigned int checksum = 8 * ' ';
+    for (size_t i = 0; i < sizeof(header); i++)
+    {
+        checksum += i < 148 || i >= 156 ? ((unsigned char *)&header)[i] : 0;
+    }
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", checksum);
+    return write(fd, &header, sizeof(header)) == sizeof(header) ? 0 : -1;
+}
+
+/**
+ * @brief Appends a payload to an archive being written by hand, padded to a whole block
+ *
+ * @param fd The archive
+ * @param data The payload, NULL for zeros
+ * @param len The length of the payload
+ * @return int 0 on success, -1 on error
+ */
+int write_payload(int fd, const void *data, size_t len)
+{
+    char block[512];
+    for (size_t done = 0; done < len; done += 512)
+    {
+        size_t chunk = len - done < 512 ? len - done : 512;
+        memset(block, 0, sizeof(block));
+        if (data != NULL)
+        {
+            memcpy(block, (const char *)data + done, chunk);
+        }
+        if (write(fd, block, sizeof(block)) != sizeof(block))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Creates a test archive, "a.txt" and "c.txt" around a file whose name needs a pax extended header
+ *
+ * @param tmp The directory of the test
+ * @param long_name Receives the long name, of 150 characters
+ * @return int The archive, opened with O_RDWR, -1 on error
+ */
+int make_archive(const char *tmp, char *long_name)
+{
+    memset(long_name, 'b', 146);
+    strcpy(long_name + 146, ".txt");
+
+    char dir[512];
+    char tar_path[512];
+    snprintf(dir, sizeof(dir), "%s/src", tmp);
+    snprintf(tar_path, sizeof(tar_path), "%s/test.tar", tmp);
+    if (mkdir(dir, 0755) == -1 || write_file(dir, "a.txt", "first\n") == -1 ||
+        write_file(dir, long_name, "long\n") == -1 || write_file(dir, "c.txt", "last\n") == -1)
+    {
+        return -1;
+    }
+
+    int fd = open(tar_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1 && tar_create(dir, fd, NULL, -1, 1, 0, NULL) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Opens an archive, checks it with tar_check_archive() and reads a file of it
+ *
+ * @param fd The archive
+ * @param path The path of the file
+ * @param content The expected content of the file
+ * @return ssize_t The number of entries at the root of the archive, -1 if a check failed
+ */
+ssize_t check_file(int fd, char *path, const char *content)
+{
+    tar_archive_t *archive = tar_open(fd, TAR_ACCESS_DEFAULT);
+    if (archive == NULL || tar_check_archive(archive) < 0)
+    {
+        tar_close(archive);
+        return -1;
+    }
+    uint8_t buf[64];
+    size_t len = sizeof(buf);
+    ssize_t ret = tar_read_file(archive, path, 0, buf, &len);
+    if (ret != 0 || len != strlen(content) || memcmp(buf, content, len) != 0)
+    {
+        tar_close(archive);
+        return -1;
+    }
+
+    char names[4][PATH_MAX];
+    char *entries[4] = {names[0], names[1], names[2], names[3]};
+    tar_cursor_t cursor = TAR_CURSOR_INIT;
+    ssize_t no_listed = 0;
+    ssize_t left;
+    do
+    {
+        size_t no_entries = 4;
+        left = list_page(archive, "", &cursor, entries, &no_entries);
+        no_listed += no_entries;
+    } while (left > 0);
+    tar_close(archive);
+    return left < 0 ? -1 : no_listed;
+}
+
+/**
+ * @brief Removes a file of a test directory, called by nftw()
+ */
+int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/**
+ * @brief Lists a directory of five files two entries at a time, before and after a deletion renumbered the entries
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_list_page(const char *tmp)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/list.tar", tmp);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ret = fd == -1 || write_header(fd, "a/", DIRTYPE, NULL, 0, 0) == -1 ||
+                      write_header(fd, "a/x", REGTYPE, NULL, 1, 0) == -1 || write_payload(fd, "x", 1) == -1 ||
+                      write_header(fd, "d/", DIRTYPE, NULL, 0, 0) == -1
+                  ? -1
+                  : 0;
+    for (int i = 0; i < 5 && ret == 0; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "d/%d", i);
+        ret = write_header(fd, name, REGTYPE, NULL, 1, 0) == -1 || write_payload(fd, name + 2, 1) == -1 ? -1 : 0;
+    }
+    tar_archive_t *archive = ret == 0 && write_payload(fd, NULL, 1024) == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+
+    char names[2][PATH_MAX];
+    char *entries[2] = {names[0], names[1]};
+    size_t no_entries = 2;
+    tar_cursor_t cursor = TAR_CURSOR_INIT;
+    char *deleted[] = {"a/"};
+    ret = -1;
+    if (archive != NULL && list_page(archive, "d/", &cursor, entries, &no_entries) == 3 && no_entries == 2 &&
+        strcmp(names[0], "d/0") == 0 && strcmp(names[1], "d/1") == 0 && tar_delete(archive, deleted, 1, 0, NULL) == 0)
+    {
+        // The cursor holds an entry index from before the deletion
+        no_entries = 2;
+        if (list_page(archive, "d/", &cursor, entries, &no_entries) == -1 && errno == ESTALE && no_entries == 0)
+        {
+            tar_cursor_t again = TAR_CURSOR_INIT;
+            ssize_t left;
+            int no_listed = 0;
+            do
+            {
+                no_entries = 2;
+                left = list_page(archive, "d/", &again, entries, &no_entries);
+                no_listed += no_entries;
+            } while (left > 0);
+            ret = left == 0 && no_listed == 5 && strcmp(names[0], "d/4") == 0 && !tar_exists(archive, "a/x") ? 0 : -1;
+        }
+    }
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Scans and reads a handle in each access mode, then checks a truncated archive without moving its offset
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_access(const char *tmp)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/access.tar", tmp);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ret = fd == -1 || write_header(fd, "a.txt", REGTYPE, NULL, 6, 0) == -1 ||
+                      write_payload(fd, "first\n", 6) == -1 || write_header(fd, "b.txt", REGTYPE, NULL, 5, 0) == -1 ||
+                      write_payload(fd, "last\n", 5) == -1 || write_payload(fd, NULL, 1024) == -1
+                  ? -1
+                  : 0;
+    int modes[] = {TAR_ACCESS_DEFAULT, TAR_ACCESS_SEQUENTIAL, TAR_ACCESS_RANDOM, TAR_ACCESS_ONESHOT};
+    tar_archive_t *shared = ret == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+    ret = shared != NULL ? 0 : -1;
+    for (int i = 0; i < 4 && ret == 0; i++)
+    {
+        // A handle opened in the mode and one switched to it give the same results
+        tar_archive_t *archive = tar_open(fd, modes[i]);
+        tar_archive_t *handles[] = {archive, shared};
+        ret = archive != NULL && tar_set_access(shared, modes[i]) == 0 ? 0 : -1;
+        for (int j = 0; j < 2 && ret == 0; j++)
+        {
+            uint8_t buf[16];
+            size_t len = sizeof(buf);
+            ret = tar_check_archive(handles[j]) == 2 && tar_read_file(handles[j], "b.txt", 0, buf, &len) == 0 &&
+                          len == 5 && memcmp(buf, "last\n", 5) == 0
+                      ? 0
+                      : -1;
+            len = sizeof(buf);
+            ret = ret == 0 && tar_read_file(handles[j], "a.txt", 1, buf, &len) == 0 && len == 5 &&
+                          memcmp(buf, "irst\n", 5) == 0
+                      ? 0
+                      : -1;
+        }
+        tar_close(archive);
+    }
+    tar_close(shared);
+
+    // Drop the end blocks and part of the last payload, the check reads through pread() only
+    tar_archive_t *archive = ret == 0 && ftruncate(fd, 3 * 512 + 256) == 0 ? tar_open(fd, TAR_ACCESS_ONESHOT) : NULL;
+    ret = -1;
+    if (archive != NULL && lseek(fd, 7, SEEK_SET) == 7)
+    {
+        errno = 0;
+        ret = tar_check_archive(archive) == -1 && errno == EIO && lseek(fd, 0, SEEK_CUR) == 7 ? 0 : -1;
+    }
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Deletes the neighbour before the pax long name in place, then marks the one after it and vacuums it
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_delete(const char *tmp)
+{
+    char long_name[151];
+    int fd = make_archive(tmp, long_name);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    int ret = -1;
+    char *first[] = {"a.txt"};
+    char *last[] = {"c.txt"};
+    tar_archive_t *archive = tar_open(fd, TAR_ACCESS_DEFAULT);
+    if (archive != NULL && tar_delete(archive, first, 1, 0, NULL) == 0 && !tar_exists(archive, "a.txt"))
+    {
+        tar_close(archive);
+        archive = check_file(fd, long_name, "long\n") == 2 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+        if (archive != NULL && tar_delete(archive, last, 1, TAR_DELETE_MARK, NULL) == 0 && tar_vacuum(archive) > 0)
+        {
+            tar_close(archive);
+            archive = NULL;
+            ret = check_file(fd, long_name, "long\n") == 1 ? 0 : -1;
+        }
+    }
+    tar_close(archive);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Ingests the test archive into a chunk store twice, then extracts it and reads it through the store
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_store(const char *tmp)
+{
+    char long_name[151];
+    int fd = make_archive(tmp, long_name);
+    char store_path[512];
+    char out_path[512];
+    snprintf(store_path, sizeof(store_path), "%s/store", tmp);
+    snprintf(out_path, sizeof(out_path), "%s/out.tar", tmp);
+    tar_store_t *store = fd == -1 ? NULL : tar_store_open(store_path, TAR_STORE_CREATE);
+    int out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ret = -1;
+    tar_store_report_t report;
+    if (store != NULL && out_fd != -1 && tar_store_ingest(store, "test", fd, NULL) == 0 &&
+        lseek(fd, 0, SEEK_SET) == 0 && tar_store_ingest(store, "again", fd, &report) == 0 &&
+        tar_store_extract(store, "test", out_fd) == 0 && check_file(out_fd, long_name, "long\n") == 3)
+    {
+        // The second ingest finds every chunk in the store, and the extracted archive is the same
+        struct stat st;
+        struct stat out_st;
+        tar_archive_t *archive = tar_store_archive(store, "again", TAR_ACCESS_DEFAULT);
+        ret = archive != NULL && tar_exists(archive, "c.txt") && report.new_bytes == 0 && fstat(fd, &st) == 0 &&
+                      fstat(out_fd, &out_st) == 0 && st.st_size == out_st.st_size
+                  ? 0
+                  : -1;
+        tar_close(archive);
+    }
+    tar_store_close(store);
+    if (out_fd != -1)
+    {
+        close(out_fd);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Changes the metadata and the content of the file with the pax long name in place
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_update(const char *tmp)
+{
+    char long_name[151];
+    int fd = make_archive(tmp, long_name);
+    tar_archive_t *archive = fd == -1 ? NULL : tar_open(fd, TAR_ACCESS_DEFAULT);
+    tar_update_t update = {.fields = TAR_UPDATE_MODE | TAR_UPDATE_MTIME | TAR_UPDATE_CONTENT,
+                           .mode = 0600,
+                           .mtime = 1234567890,
+                           .data = "changed\n",
+                           .size = 8};
+    int ret = -1;
+    if (archive != NULL && tar_update(archive, long_name, &update) == 0)
+    {
+        tar_close(archive);
+        archive = check_file(fd, long_name, "changed\n") == 3 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+        tar_stat_t st;
+        if (archive != NULL && tar_stat(archive, long_name, &st) == 0 && st.mode == 0600 && st.mtime == 1234567890)
+        {
+            ret = 0;
+        }
+    }
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Reads an archive of GNU format whose long name and long link target are in 'L' and 'K' members
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_gnu_long_name(const char *tmp)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/gnu.tar", tmp);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char long_name[151];
+    char long_link[151];
+    memset(long_name, 'n', 150);
+    long_name[150] = '\0';
+    memcpy(long_link, long_name, sizeof(long_name));
+    long_link[0] = 'l';
+    if (fd == -1 || write_header(fd, "././@LongLink", GNUTYPE_LONGNAME, NULL, 151, 1) == -1 ||
+        write_payload(fd, long_name, 151) == -1 ||
+        write_header(fd, long_name, REGTYPE, NULL, 5, 1) == -1 ||
+        write_payload(fd, "long\n", 5) == -1 ||
+        write_header(fd, "././@LongLink", GNUTYPE_LONGNAME, NULL, 151, 1) == -1 ||
+        write_payload(fd, long_link, 151) == -1 ||
+        write_header(fd, "././@LongLink", GNUTYPE_LONGLINK, NULL, 151, 1) == -1 ||
+        write_payload(fd, long_name, 151) == -1 ||
+        write_header(fd, long_link, SYMTYPE, long_name, 0, 1) == -1 ||
+        write_payload(fd, NULL, 1024) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // The link and the file at the root, no "././" directory, and the link read through its long target, while
+    // check_archive() keeps rejecting the GNU version
+    tar_stat_t st;
+    int ret =
+        check_file(fd, long_link, "long\n") == 2 && lseek(fd, 0, SEEK_SET) == 0 && check_archive(fd) == -2 ? 0 : -1;
+    tar_archive_t *archive = ret == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+    if (archive == NULL || tar_lstat(archive, long_link, &st) != 0 || st.type != SYMTYPE ||
+        strcmp(st.linkname, long_name) != 0 || tar_exists(archive, "././"))
+    {
+        ret = -1;
+    }
+    tar_close(archive);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Reads an archive of GNU format with a name of 310 bytes, and one longer than PATH_MAX that is left out
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_gnu_longer_name(const char *tmp)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/gnu.tar", tmp);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char long_name[311];
+    memset(long_name, 'n', 310);
+    memcpy(long_name, "deep/", 5);
+    long_name[310] = '\0';
+    char *too_long = malloc(PATH_MAX + 1);
+    if (too_long != NULL)
+    {
+        memset(too_long, 't', PATH_MAX);
+        too_long[PATH_MAX] = '\0';
+    }
+    if (fd == -1 || too_long == NULL ||
+        write_header(fd, "././@LongLink", GNUTYPE_LONGNAME, NULL, PATH_MAX + 1, 1) == -1 ||
+        write_payload(fd, too_long, PATH_MAX + 1) == -1 ||
+        write_header(fd, too_long, REGTYPE, NULL, 5, 1) == -1 ||
+        write_payload(fd, "skip\n", 5) == -1 ||
+        write_header(fd, "././@LongLink", GNUTYPE_LONGNAME, NULL, 311, 1) == -1 ||
+        write_payload(fd, long_name, 311) == -1 ||
+        write_header(fd, long_name, REGTYPE, NULL, 5, 1) == -1 ||
+        write_payload(fd, "deep\n", 5) == -1 ||
+        write_payload(fd, NULL, 1024) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        free(too_long);
+        return -1;
+    }
+    free(too_long);
+
+    // The file under its own directory, and the first file neither indexed nor found under its cut name
+    tar_index_stats_t stats;
+    int ret = check_file(fd, long_name, "deep\n") == 1 ? 0 : -1;
+    tar_archive_t *archive = ret == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+    if (archive != NULL)
+    {
+        tar_index_stats(archive, &stats);
+    }
+    if (archive == NULL || !tar_is_dir(archive, "deep") || stats.no_skipped != 1 || stats.no_entries != 2)
+    {
+        ret = -1;
+    }
+    tar_close(archive);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Reads a file through two levels of nested archives, and checks that a file of a block that is not an archive
+ *        stays so
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_nested(const char *tmp)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/nested.tar", tmp);
+    char payload[8192];
+    memset(payload, 'x', 512);
+    memcpy(payload, "deep\n", 5);
+    size_t len = 512; // A whole block, not a valid header, rather than a short file read as an empty archive
+    char *names[] = {"x.txt", "deep.tar", "inner.tar"};
+    int fd = -1;
+    int ret = 0;
+    for (int i = 0; i < 3 && ret == 0; i++)
+    {
+        // Each archive is the payload of the next one
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ret = fd == -1 || write_header(fd, names[i], REGTYPE, NULL, len, 0) == -1 ||
+                      write_payload(fd, payload, len) == -1 || write_payload(fd, NULL, 1024) == -1
+                  ? -1
+                  : 0;
+        len = ret == 0 ? (size_t)lseek(fd, 0, SEEK_CUR) : 0;
+        ret = ret == 0 && pread(fd, payload, len, 0) == (ssize_t)len ? 0 : -1;
+    }
+
+    tar_archive_t *archive = ret == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+    uint8_t buf[16];
+    len = sizeof(buf);
+    ret = archive != NULL && tar_read_file(archive, "inner.tar!/deep.tar!/x.txt", 0, buf, &len) == 512 - 16 &&
+                  memcmp(buf, "deep\nxxx", 8) == 0 && tar_nested(archive, "inner.tar!/deep.tar") != NULL &&
+                  tar_exists(archive, "inner.tar!/deep.tar!/x.txt") && !tar_exists(archive, "inner.tar!/x.txt")
+              ? 0
+              : -1;
+    for (int i = 0; i < 2 && ret == 0; i++)
+    {
+        errno = 0;
+        ret = tar_nested(archive, "inner.tar!/deep.tar!/x.txt") == NULL && errno == EINVAL ? 0 : -1;
+    }
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Records known operations in the histograms of a handle and in the global ones, and dumps them with a label
+ *        that needs escaping
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_metrics(const char *tmp)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/metrics.tar", tmp);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ret = fd == -1 || write_header(fd, "a.txt", REGTYPE, NULL, 6, 0) == -1 ||
+                      write_payload(fd, "first\n", 6) == -1 || write_payload(fd, NULL, 1024) == -1
+                  ? -1
+                  : 0;
+    tar_metrics_enable(1);
+    tar_metrics_reset(NULL);
+    tar_archive_t *archive = ret == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT | TAR_OPEN_METRICS) : NULL;
+    tar_archive_t *plain = ret == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+    ret = archive != NULL && plain != NULL ? 0 : -1;
+    for (int i = 0; i < 3 && ret == 0; i++)
+    {
+        uint8_t buf[16];
+        size_t len = sizeof(buf);
+        ret = tar_exists(archive, "a.txt") && !tar_exists(archive, "b.txt") &&
+                      tar_read_file(archive, "a.txt", 0, buf, &len) == 0
+                  ? 0
+                  : -1;
+    }
+    ret = ret == 0 && tar_exists(plain, "a.txt") ? 0 : -1;
+
+    // The handle holds its own operations, the global histograms those of both handles
+    ret = ret == 0 && tar_metrics_count(archive, TAR_OP_EXISTS) == 6 &&
+                  tar_metrics_count(archive, TAR_OP_READ_FILE) == 3 && tar_metrics_count(archive, TAR_OP_IS_DIR) == 0 &&
+                  tar_metrics_count(NULL, TAR_OP_EXISTS) == 7 && tar_metrics_count(plain, TAR_OP_EXISTS) == 0 &&
+                  tar_metrics_quantile(archive, TAR_OP_IS_DIR, 0.5) == 0 &&
+                  tar_metrics_quantile(archive, TAR_OP_EXISTS, 0.5) > 0 &&
+                  tar_metrics_quantile(archive, TAR_OP_EXISTS, 0.5) <= tar_metrics_quantile(archive, TAR_OP_EXISTS, 1)
+              ? 0
+              : -1;
+
+    char *dump = NULL;
+    size_t dump_len = 0;
+    FILE *out = ret == 0 ? open_memstream(&dump, &dump_len) : NULL;
+    ret = out != NULL && tar_metrics_dump(archive, "a\"b\\c\nd", out) == 0 && tar_metrics_dump(plain, NULL, out) == -1
+              ? 0
+              : -1;
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+    ret = ret == 0 &&
+                  strstr(dump, "tar_operation_duration_seconds_count{archive=\"a\\\"b\\\\c\\nd\",op=\"exists\"} 6\n") !=
+                      NULL &&
+                  strstr(dump, "{archive=\"a\\\"b\\\\c\\nd\",op=\"read_file\",quantile=\"0.99\"} ") != NULL
+              ? 0
+              : -1;
+    free(dump);
+    tar_metrics_enable(0);
+    tar_close(archive);
+    tar_close(plain);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Appends a pax extended header with a path record and a few numeric records to an archive being written
+ *
+ * @param fd The archive
+ * @param path The value of the path record
+ * @param records The other records, already encoded
+ * @return int 0 on success, -1 on error
+ */
+int write_pax(int fd, const char *path, const char *records)
+{
+    size_t len = strlen(path) + strlen(records) + 64;
+    char *buf = malloc(len);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+    size_t record_len = strlen(path) + sizeof(" path=\n") - 1;
+    size_t digits = snprintf(NULL, 0, "%zu", record_len);
+    digits = snprintf(NULL, 0, "%zu", record_len + digits);
+    len = sprintf(buf, "%zu path=%s\n%s", record_len + digits, path, records);
+    int ret = write_header(fd, "PaxHeaders/long", XHDTYPE, NULL, len, 0) == -1 || write_payload(fd, buf, len) == -1
+                  ? -1
+                  : 0;
+    free(buf);
+    return ret;
+}
+
+/**
+ * @brief Gets the metadata of symlinks with tar_stat() and tar_lstat(), one to a file and one dangling
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_stat_symlink(const char *tmp)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/stat.tar", tmp);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ret = fd == -1 || write_header(fd, "dir/", DIRTYPE, NULL, 0, 0) == -1 ||
+                      write_header(fd, "dir/a.txt", REGTYPE, NULL, 6, 0) == -1 ||
+                      write_payload(fd, "first\n", 6) == -1 ||
+                      write_header(fd, "link", SYMTYPE, "dir/a.txt", 0, 0) == -1 ||
+                      write_header(fd, "dangling", SYMTYPE, "none", 0, 0) == -1 ||
+                      write_pax(fd, "dir/p.txt", "") == -1 || write_header(fd, "cut", REGTYPE, NULL, 4, 0) == -1 ||
+                      write_payload(fd, "pax\n", 4) == -1 ||
+                      write_header(fd, "plink", SYMTYPE, "dir/p.txt", 0, 0) == -1 ||
+                      write_payload(fd, NULL, 1024) == -1
+                  ? -1
+                  : 0;
+    tar_archive_t *archive = ret == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+
+    // The symlink itself, then its target, whose payload is at the offset given
+    tar_stat_t st;
+    char buf[8];
+    ret = archive != NULL && tar_lstat(archive, "link", &st) == 0 && st.type == SYMTYPE && st.linkname != NULL &&
+                  strcmp(st.linkname, "dir/a.txt") == 0 && st.header_offset == 3 * 512 &&
+                  st.payload_offset == 4 * 512 && tar_stat(archive, "link", &st) == 0 && st.type == REGTYPE &&
+                  st.linkname == NULL && st.size == 6 && st.header_offset == 512 && st.payload_offset == 2 * 512 &&
+                  pread(fd, buf, 6, st.payload_offset) == 6 && memcmp(buf, "first\n", 6) == 0
+              ? 0
+              : -1;
+
+    // The offsets of a member with a pax extended header are those of its own header
+    ret = ret == 0 && tar_lstat(archive, "plink", &st) == 0 && strcmp(st.linkname, "dir/p.txt") == 0 &&
+                  tar_stat(archive, "plink", &st) == 0 && st.header_offset == 7 * 512 &&
+                  st.payload_offset == 8 * 512 && pread(fd, buf, 4, st.payload_offset) == 4 &&
+                  memcmp(buf, "pax\n", 4) == 0
+              ? 0
+              : -1;
+    ret = ret == 0 && tar_lstat(archive, "dangling", &st) == 0 && strcmp(st.linkname, "none") == 0 &&
+                  st.header_offset == 4 * 512 && tar_stat(archive, "dangling", &st) == -1
+              ? 0
+              : -1;
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Reads an archive whose paths are in pax extended headers, one of 300 bytes with an owner and a modification
+ *        time that its header cannot hold, and one longer than PATH_MAX that is left out
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_pax_long_name(const char *tmp)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/pax.tar", tmp);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char long_name[301];
+    memset(long_name, 'p', 300);
+    memcpy(long_name, "deep/", 5);
+    long_name[300] = '\0';
+    char *too_long = malloc(PATH_MAX + 1);
+    if (too_long != NULL)
+    {
+        memset(too_long, 't', PATH_MAX);
+        too_long[PATH_MAX] = '\0';
+    }
+    if (fd == -1 || too_long == NULL || write_pax(fd, too_long, "") == -1 ||
+        write_header(fd, "cut", REGTYPE, NULL, 5, 0) == -1 || write_payload(fd, "skip\n", 5) == -1 ||
+        write_pax(fd, long_name, "10 size=5\n15 uid=3000000\n20 mtime=9876543210\n") == -1 ||
+        write_header(fd, "deep/cut", REGTYPE, NULL, 5, 0) == -1 || write_payload(fd, "deep\n", 5) == -1 ||
+        write_payload(fd, NULL, 1024) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        free(too_long);
+        return -1;
+    }
+    free(too_long);
+
+    tar_index_stats_t stats;
+    tar_stat_t st;
+    int ret = check_file(fd, long_name, "deep\n") == 1 ? 0 : -1;
+    tar_archive_t *archive = ret == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+    if (archive != NULL)
+    {
+        tar_index_stats(archive, &stats);
+    }
+    if (archive == NULL || tar_stat(archive, long_name, &st) != 0 || st.size != 5 || st.uid != 3000000 ||
+        st.mtime != 9876543210LL || tar_exists(archive, "cut") || stats.no_skipped != 1)
+    {
+        ret = -1;
+    }
+    tar_close(archive);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Appends the header of a GNU sparse member with two regions, its map being in the header itself
+ *
+ * @param fd The archive
+ * @param name The name of the member
+ * @param regions The offset and the length of each region
+ * @param realsize The size of the file
+ * @return int 0 on success, -1 on error
+ */
+int write_gnu_sparse(int fd, const char *name, const uint64_t regions[4], uint64_t realsize)
+{
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    char buf[512];
+    if (offset == -1 || write_header(fd, name, GNUTYPE_SPARSE, NULL, regions[1] + regions[3], 1) == -1 ||
+        pread(fd, buf, sizeof(buf), offset) != sizeof(buf))
+    {
+        return -1;
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        snprintf(buf + 386 + 12 * i, 12, "%011llo", (unsigned long long)regions[i]);
+    }
+    snprintf(buf + 483, 12, "%011llo", (unsigned long long)realsize);
+
+    // Checksum again over the map
+    unsigned int checksum = 8 * ' ';
+    for (int i = 0; i < 512; i++)
+    {
+        checksum += i < 148 || i >= 156 ? (unsigned char)buf[i] : 0;
+    }
+    snprintf(buf + 148, 8, "%06o", checksum);
+    return pwrite(fd, buf, sizeof(buf), offset) == sizeof(buf) ? 0 : -1;
+}
+
+/**
+ * @brief Reads a GNU sparse member and a pax sparse member (version 1.0) of a 1 MiB file with a word at each end, and
+ *        extracts them keeping the hole
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_sparse(const char *tmp)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/sparse.tar", tmp);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    const uint64_t regions[4] = {0, 4, 1 << 20, 4};
+    const uint64_t realsize = (1 << 20) + 4;
+    char payload[520] = "2\n0\n4\n1048576\n4\n";
+    memcpy(payload + 512, "headtail", 8); // The data of the pax member follows its map, padded to a block
+    int ret = fd == -1 || write_gnu_sparse(fd, "g.bin", regions, realsize) == -1 ||
+                      write_payload(fd, "headtail", 8) == -1 ||
+                      write_pax(fd, "p.bin", "22 GNU.sparse.major=1\n22 GNU.sparse.minor=0\n"
+                                             "31 GNU.sparse.realsize=1048580\n") == -1 ||
+                      write_header(fd, "GNUSparseFile.0/p.bin", REGTYPE, NULL, sizeof(payload), 0) == -1 ||
+                      write_payload(fd, payload, sizeof(payload)) == -1 || write_payload(fd, NULL, 1024) == -1
+                  ? -1
+                  : 0;
+    tar_archive_t *archive = ret == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+    uint8_t *buf = malloc(realsize);
+    char *names[] = {"g.bin", "p.bin"};
+    ret = archive != NULL && buf != NULL && tar_check_archive(archive) == 3 ? 0 : -1;
+    for (int i = 0; i < 2 && ret == 0; i++)
+    {
+        // The data regions around a hole read as zeros
+        tar_region_t map_read[4];
+        size_t len = realsize;
+        ret = tar_sparse_map(archive, names[i], map_read, 4) == 2 && map_read[1].offset == 1 << 20 &&
+                      map_read[1].len == 4 && tar_read_file(archive, names[i], 0, buf, &len) == 0 && len == realsize &&
+                      memcmp(buf, "head", 4) == 0 && memcmp(buf + (1 << 20), "tail", 4) == 0
+                  ? 0
+                  : -1;
+        for (size_t j = 4; j < 1 << 20 && ret == 0; j++)
+        {
+            ret = buf[j] == 0 ? 0 : -1;
+        }
+        len = 6;
+        ret = ret == 0 && tar_read_file(archive, names[i], (1 << 20) - 2, buf, &len) == 0 && len == 6 &&
+                      memcmp(buf, "\0\0tail", 6) == 0
+                  ? 0
+                  : -1;
+
+        // The hole stays a hole once extracted
+        char out_path[512];
+        struct stat st;
+        snprintf(out_path, sizeof(out_path), "%s/%s", tmp, names[i]);
+        int out_fd = ret == 0 ? open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+        ret = out_fd != -1 && tar_extract_file(archive, names[i], out_fd) == 0 && fstat(out_fd, &st) == 0 &&
+                      st.st_size == (off_t)realsize && st.st_blocks * 512 < 1 << 20 &&
+                      pread(out_fd, buf, 4, 1 << 20) == 4 && memcmp(buf, "tail", 4) == 0
+                  ? 0
+                  : -1;
+        if (out_fd != -1)
+        {
+            close(out_fd);
+        }
+    }
+    free(buf);
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Iterates over the samples of an archive with a sparse member, on demand then prefetched, and checks that a
+ *        deletion makes the iterator stale
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_samples(const char *tmp)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/samples.tar", tmp);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    const uint64_t regions[4] = {0, 4, 8192, 4};
+    int ret = fd == -1 || write_header(fd, "s/0001.jpg", REGTYPE, NULL, 4, 0) == -1 ||
+                      write_payload(fd, "jpg1", 4) == -1 ||
+                      write_header(fd, "s/0001.json", REGTYPE, NULL, 2, 0) == -1 || write_payload(fd, "{}", 2) == -1 ||
+                      write_gnu_sparse(fd, "s/0002.bin", regions, 8196) == -1 ||
+                      write_payload(fd, "headtail", 8) == -1 ||
+                      write_header(fd, "s/0002.cls", REGTYPE, NULL, 1, 0) == -1 || write_payload(fd, "7", 1) == -1 ||
+                      write_header(fd, "s/0003.txt", REGTYPE, NULL, 3, 0) == -1 || write_payload(fd, "end", 3) == -1 ||
+                      write_payload(fd, NULL, 1024) == -1
+                  ? -1
+                  : 0;
+    tar_archive_t *archive = ret == 0 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+    ret = archive != NULL ? 0 : -1;
+    for (size_t prefetch = 0; prefetch < 3 && ret == 0; prefetch += 2)
+    {
+        tar_samples_t *samples = tar_samples_open(archive, prefetch);
+        tar_sample_t *sample[3] = {NULL, NULL, NULL};
+        tar_sample_t *last = NULL;
+        ret = samples != NULL && tar_samples_next(samples, &sample[0]) == 1 &&
+                      tar_samples_next(samples, &sample[1]) == 1 && tar_samples_next(samples, &sample[2]) == 1 &&
+                      tar_samples_next(samples, &last) == 0
+                  ? 0
+                  : -1;
+
+        // The sparse file is read whole, its hole as zeros, next to the member read from its own header
+        static const uint8_t zeros[8188];
+        ret = ret == 0 && strcmp(sample[0]->key, "s/0001") == 0 && sample[0]->no_members == 2 &&
+                      strcmp(sample[0]->members[1].ext, "json") == 0 &&
+                      memcmp(sample[0]->members[0].data, "jpg1", 4) == 0 &&
+                      strcmp(sample[1]->key, "s/0002") == 0 && sample[1]->no_members == 2 &&
+                      sample[1]->members[0].size == 8196 && memcmp(sample[1]->members[0].data, "head", 4) == 0 &&
+                      memcmp(sample[1]->members[0].data + 4, zeros, sizeof(zeros)) == 0 &&
+                      memcmp(sample[1]->members[0].data + 8192, "tail", 4) == 0 &&
+                      sample[1]->members[1].size == 1 && sample[1]->members[1].data[0] == '7' &&
+                      sample[2]->no_members == 1 && memcmp(sample[2]->members[0].data, "end", 3) == 0
+                  ? 0
+                  : -1;
+        for (int i = 0; i < 3; i++)
+        {
+            tar_sample_free(sample[i]);
+        }
+        tar_samples_close(samples);
+    }
+
+    // The files of the iterator are entry indexes from before the deletion
+    tar_samples_t *samples = ret == 0 ? tar_samples_open(archive, 0) : NULL;
+    tar_sample_t *sample = NULL;
+    char *deleted[] = {"s/0001.json"};
+    ret = samples != NULL && tar_samples_next(samples, &sample) == 1 && tar_delete(archive, deleted, 1, 0, NULL) == 0
+              ? 0
+              : -1;
+    tar_sample_free(sample);
+    sample = NULL;
+    ret = ret == 0 && tar_samples_next(samples, &sample) == -1 && errno == ESTALE ? 0 : -1;
+    tar_samples_close(samples);
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Creates an archive of a directory holding a path of 310 bytes, then a delta of it once changed
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_create(const char *tmp)
+{
+    char dir[512];
+    char deep[512];
+    char path[1024];
+    snprintf(dir, sizeof(dir), "%s/src", tmp);
+    int len = snprintf(deep, sizeof(deep), "%s/", dir);
+    memset(deep + len, 'd', 150);
+    deep[len + 150] = '\0';
+    if (mkdir(dir, 0755) == -1 || mkdir(deep, 0755) == -1)
+    {
+        return -1;
+    }
+    strcat(deep, "/");
+    memset(deep + len + 151, 'e', 150);
+    deep[len + 301] = '\0';
+    if (mkdir(deep, 0755) == -1 || write_file(deep, "deep.txt", "deep\n") == -1 ||
+        write_file(dir, "keep.txt", "keep\n") == -1 || write_file(dir, "gone.txt", "gone\n") == -1 ||
+        write_file(dir, "edit.txt", "edit\n") == -1)
+    {
+        return -1;
+    }
+    char *deep_path = deep + strlen(dir) + 1; // Relative to the source directory
+    strcat(deep_path, "/deep.txt");
+
+    snprintf(path, sizeof(path), "%s/full.tar", tmp);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    snprintf(path, sizeof(path), "%s/delta.tar", tmp);
+    int delta_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    snprintf(path, sizeof(path), "%s/deleted.txt", tmp);
+    int manifest_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_archive_t *base = NULL;
+    tar_archive_t *delta = NULL;
+    tar_create_report_t report;
+    char manifest[64] = "";
+    int ret = -1;
+    if (fd != -1 && delta_fd != -1 && manifest_fd != -1 && tar_create(dir, fd, NULL, -1, 2, 0, &report) == 0 &&
+        report.no_written == 6 && check_file(fd, deep_path, "deep\n") == 4)
+    {
+        // Remove a file, change another one at another time, add a third one
+        struct timespec times[2] = {{0, UTIME_OMIT}, {1000000000, 0}};
+        char edit_path[1024];
+        snprintf(path, sizeof(path), "%s/gone.txt", dir);
+        snprintf(edit_path, sizeof(edit_path), "%s/edit.txt", dir);
+        base = tar_open(fd, TAR_ACCESS_DEFAULT);
+        if (base != NULL && unlink(path) == 0 && write_file(dir, "edit.txt", "edited\n") == 0 &&
+            utimensat(AT_FDCWD, edit_path, times, 0) == 0 && write_file(dir, "new.txt", "new\n") == 0)
+        {
+            if (tar_create(dir, delta_fd, base, manifest_fd, 2, 0, &report) == 0 && report.no_written == 2 &&
+                report.no_unchanged == 4 && report.no_deleted == 1 &&
+                pread(manifest_fd, manifest, sizeof(manifest) - 1, 0) > 0 && strcmp(manifest, "gone.txt\n") == 0 &&
+                check_file(delta_fd, "edit.txt", "edited\n") == 2)
+            {
+                // A delta is never the base of another one
+                delta = tar_open(delta_fd, TAR_ACCESS_DEFAULT);
+                ret = delta != NULL && tar_exists(delta, "new.txt") && !tar_exists(delta, "keep.txt") &&
+                              tar_create(dir, manifest_fd, delta, -1, 1, 0, NULL) == -1 && errno == EINVAL
+                          ? 0
+                          : -1;
+            }
+        }
+    }
+    tar_close(delta);
+    tar_close(base);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (delta_fd != -1)
+    {
+        close(delta_fd);
+    }
+    if (manifest_fd != -1)
+    {
+        close(manifest_fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Creates the same tree with one thread and with eight, which must give the same archive byte for byte, and
+ *        checks it with check_archive()
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_create_threads(const char *tmp)
+{
+    char dir[512];
+    char sub[1024];
+    char path[1024];
+    snprintf(dir, sizeof(dir), "%s/tree", tmp);
+    snprintf(sub, sizeof(sub), "%s/d", dir);
+    char long_name[151];
+    memset(long_name, 'n', 146);
+    strcpy(long_name + 146, ".txt");
+    if (mkdir(dir, 0755) == -1 || mkdir(sub, 0755) == -1 || write_file(dir, "a.txt", "first\n") == -1 ||
+        write_file(sub, "b.txt", "second\n") == -1 || write_file(sub, long_name, "long\n") == -1 ||
+        snprintf(path, sizeof(path), "%s/d/link", dir) < 0 || symlink("b.txt", path) == -1)
+    {
+        return -1;
+    }
+
+    // A file over several buffers of the ring, so that its parts are read by different threads
+    size_t big_len = (3 << 20) + 123;
+    uint8_t *big = malloc(big_len);
+    snprintf(path, sizeof(path), "%s/d/big.bin", dir);
+    int big_fd = big == NULL ? -1 : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (size_t i = 0; big != NULL && i < big_len; i++)
+    {
+        big[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+    int ret = big_fd != -1 && write(big_fd, big, big_len) == (ssize_t)big_len ? 0 : -1;
+    if (big_fd != -1)
+    {
+        close(big_fd);
+    }
+    free(big);
+
+    int fds[2] = {-1, -1};
+    int threads[2] = {1, 8};
+    for (int i = 0; i < 2 && ret == 0; i++)
+    {
+        snprintf(path, sizeof(path), "%s/threads%d.tar", tmp, threads[i]);
+        fds[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ret = fds[i] != -1 && tar_create(dir, fds[i], NULL, -1, threads[i], 0, NULL) == 0 ? 0 : -1;
+    }
+
+    off_t len = ret == 0 ? lseek(fds[0], 0, SEEK_END) : -1;
+    uint8_t *archives[2] = {len > 0 ? malloc(len) : NULL, len > 0 ? malloc(len) : NULL};
+    ret = archives[0] != NULL && archives[1] != NULL && lseek(fds[1], 0, SEEK_END) == len &&
+                  pread(fds[0], archives[0], len, 0) == len && pread(fds[1], archives[1], len, 0) == len &&
+                  memcmp(archives[0], archives[1], len) == 0
+              ? 0
+              : -1;
+    free(archives[0]);
+    free(archives[1]);
+
+    // "a.txt", "d/" and its four entries, and the pax extended header of the long name
+    ret = ret == 0 && lseek(fds[0], 0, SEEK_SET) == 0 && check_archive(fds[0]) == 7 ? 0 : -1;
+    for (int i = 0; i < 2; i++)
+    {
+        if (fds[i] != -1)
+        {
+            close(fds[i]);
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Saves the compact index of a hashed handle, then loads it and looks up its entries and an unknown path
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_compact(const char *tmp)
+{
+    char long_name[151];
+    int fd = make_archive(tmp, long_name);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/test.idx", tmp);
+    int idx_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_archive_t *archive = fd != -1 ? tar_open(fd, TAR_ACCESS_DEFAULT | TAR_OPEN_HASH) : NULL;
+    tar_compact_t *compact = archive != NULL ? tar_compact_build(archive, TAR_COMPACT_MPH | TAR_COMPACT_BLOOM) : NULL;
+    tar_compact_t *loaded = NULL;
+    tar_compact_entry_t entry;
+    tar_stat_t st;
+    int ret = -1;
+    if (idx_fd != -1 && compact != NULL && tar_compact_save(compact, idx_fd) == 0 &&
+        lseek(idx_fd, 0, SEEK_SET) == 0 && (loaded = tar_compact_load(idx_fd)) != NULL &&
+        tar_stat(archive, "a.txt", &st) == 0 && st.hash == crc32c(0, "first\n", 6) &&
+        tar_compact_lookup(loaded, "a.txt", &entry) && entry.size == 6 && entry.hash == st.hash &&
+        entry.header_offset == st.header_offset && tar_compact_lookup(loaded, long_name, &entry) &&
+        entry.hash == crc32c(0, "long\n", 5) && !tar_compact_lookup(loaded, "b.txt", &entry))
+    {
+        ret = 0;
+    }
+    tar_compact_free(loaded);
+    tar_compact_free(compact);
+    tar_close(archive);
+    if (idx_fd != -1)
+    {
+        close(idx_fd);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Saves the minimal perfect hash of a handle, then opens the archive with it, before and after a deletion
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_mph(const char *tmp)
+{
+    char long_name[151];
+    int fd = make_archive(tmp, long_name);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/test.mph", tmp);
+    int mph_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_archive_t *archive = fd != -1 ? tar_open(fd, TAR_ACCESS_DEFAULT | TAR_OPEN_MPH) : NULL;
+    char *first[] = {"a.txt"};
+    int ret = -1;
+    if (mph_fd != -1 && archive != NULL && tar_mph_save(archive, mph_fd) == 0)
+    {
+        tar_close(archive);
+        archive = lseek(mph_fd, 0, SEEK_SET) == 0 ? tar_open_mph(fd, TAR_ACCESS_DEFAULT, mph_fd) : NULL;
+        if (archive != NULL && tar_exists(archive, "a.txt") && tar_exists(archive, long_name) &&
+            tar_exists(archive, "c.txt") && !tar_exists(archive, "b.txt") && !tar_exists(archive, "src") &&
+            tar_delete(archive, first, 1, 0, NULL) == 0)
+        {
+            // The saved function no longer matches the archive, a new one is built
+            tar_close(archive);
+            archive = lseek(mph_fd, 0, SEEK_SET) == 0 ? tar_open_mph(fd, TAR_ACCESS_DEFAULT, mph_fd) : NULL;
+            ret = archive != NULL && !tar_exists(archive, "a.txt") && tar_exists(archive, long_name) &&
+                          tar_exists(archive, "c.txt")
+                      ? 0
+                      : -1;
+        }
+    }
+    tar_close(archive);
+    if (mph_fd != -1)
+    {
+        close(mph_fd);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Saves the filter of a handle, then loads it and checks the paths of the archive and unknown paths
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_bloom(const char *tmp)
+{
+    char long_name[151];
+    int fd = make_archive(tmp, long_name);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/test.bloom", tmp);
+    int bloom_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_archive_t *archive = fd != -1 ? tar_open(fd, TAR_ACCESS_DEFAULT | TAR_OPEN_BLOOM) : NULL;
+    tar_bloom_t *bloom = archive != NULL ? tar_bloom_build(archive) : NULL;
+    tar_bloom_t *loaded = NULL;
+    int ret = -1;
+    if (bloom_fd != -1 && bloom != NULL && tar_bloom_save(bloom, bloom_fd) == 0 &&
+        lseek(bloom_fd, 0, SEEK_SET) == 0 && (loaded = tar_bloom_load(bloom_fd)) != NULL &&
+        tar_bloom_check(loaded, "a.txt") && tar_bloom_check(loaded, long_name) && tar_bloom_check(loaded, "c.txt") &&
+        tar_exists(archive, "a.txt") && !tar_exists(archive, "b.txt"))
+    {
+        // About 1% of the unknown paths pass the filter, and the handle finds none of them
+        int no_passed = 0;
+        ret = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            snprintf(path, sizeof(path), "missing/%d.txt", i);
+            no_passed += tar_bloom_check(loaded, path) != 0;
+            ret = tar_exists(archive, path) ? -1 : ret;
+        }
+        ret = no_passed > 50 ? -1 : ret;
+    }
+    tar_bloom_free(loaded);
+    tar_bloom_free(bloom);
+    tar_close(archive);
+    if (bloom_fd != -1)
+    {
+        close(bloom_fd);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Reads files in another order than the archive, one of them through a nested archive and one cut short
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_read_files(const char *tmp)
+{
+    char long_name[151];
+    int fd = make_archive(tmp, long_name);
+    char path[512];
+    char inner_path[512];
+    snprintf(path, sizeof(path), "%s/test.tar", tmp);
+    snprintf(inner_path, sizeof(inner_path), "%s/src/inner.tar", tmp);
+    if (fd == -1 || rename(path, inner_path) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+
+    snprintf(path, sizeof(path), "%s/src", tmp);
+    snprintf(inner_path, sizeof(inner_path), "%s/outer.tar", tmp);
+    fd = open(inner_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_archive_t *archive = NULL;
+    if (fd != -1 && tar_create(path, fd, NULL, -1, 1, 0, NULL) == 0)
+    {
+        archive = tar_open(fd, TAR_ACCESS_DEFAULT);
+    }
+
+    char *paths[] = {"inner.tar!/c.txt", "c.txt", "missing", long_name, "a.txt"};
+    uint8_t bufs[5][16];
+    uint8_t *buf_ptrs[] = {bufs[0], bufs[1], bufs[2], bufs[3], bufs[4]};
+    size_t lens[] = {16, 16, 16, 2, 16};
+    ssize_t results[5];
+    int ret = -1;
+    if (archive != NULL && tar_read_files(archive, paths, buf_ptrs, lens, results, 5) == 4 && results[0] == 0 &&
+        lens[0] == 5 && memcmp(bufs[0], "last\n", 5) == 0 && results[1] == 0 && lens[1] == 5 &&
+        memcmp(bufs[1], "last\n", 5) == 0 && results[2] == -1 && lens[2] == 0 && results[3] == 3 && lens[3] == 2 &&
+        memcmp(bufs[3], "lo", 2) == 0 && results[4] == 0 && lens[4] == 6 && memcmp(bufs[4], "first\n", 6) == 0)
+    {
+        ret = 0;
+    }
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Reads the unaligned files of the test archive twice through a handle opened with TAR_OPEN_DIRECT
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_direct(const char *tmp)
+{
+    char long_name[151];
+    int fd = make_archive(tmp, long_name);
+    tar_archive_t *archive = fd != -1 ? tar_open(fd, TAR_ACCESS_RANDOM | TAR_OPEN_DIRECT) : NULL;
+    char *paths[] = {"c.txt", long_name, "a.txt"};
+    const char *contents[] = {"last\n", "long\n", "first\n"};
+    int ret = archive != NULL ? 0 : -1;
+    for (int i = 0; i < 6 && ret == 0; i++)
+    {
+        uint8_t buf[16];
+        size_t len = sizeof(buf);
+        if (tar_read_file(archive, paths[i % 3], 1, buf, &len) != 0 || len != strlen(contents[i % 3]) - 1 ||
+            memcmp(buf, contents[i % 3] + 1, len) != 0)
+        {
+            ret = -1;
+        }
+    }
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Runs top-N and prefix queries on the table of the test archive, then again once an update made it stale
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_query(const char *tmp)
+{
+    char long_name[151];
+    int fd = make_archive(tmp, long_name);
+    tar_archive_t *archive = fd != -1 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+    tar_table_t *table = archive != NULL ? tar_table_build(archive) : NULL;
+    tar_query_t largest = TAR_QUERY_INIT;
+    largest.order = TAR_ORDER_SIZE;
+    largest.descending = 1;
+    tar_query_t prefix = TAR_QUERY_INIT;
+    prefix.prefix = "c";
+    tar_query_t newest = TAR_QUERY_INIT;
+    newest.min_mtime = 2000000000;
+    tar_update_t update = {.fields = TAR_UPDATE_MTIME, .mtime = 2000000000};
+    uint32_t rows[2];
+    tar_stat_t st;
+    int ret = -1;
+    if (table != NULL && tar_table_rows(table) == 3 && tar_query(table, &largest, rows, 2) == 3 &&
+        strcmp(tar_table_path(table, rows[0]), "a.txt") == 0 && tar_query(table, &prefix, rows, 2) == 1 &&
+        strcmp(tar_table_path(table, rows[0]), "c.txt") == 0 && tar_query(table, &newest, rows, 2) == 0 &&
+        tar_update(archive, "c.txt", &update) == 0)
+    {
+        // The table copied the index before the update
+        if (tar_query(table, &newest, rows, 2) == 0 && errno == ESTALE && tar_table_stat(table, 0, &st) == -1 &&
+            tar_table_path(table, 0) == NULL)
+        {
+            tar_table_free(table);
+            table = tar_table_build(archive);
+            ret = table != NULL && tar_query(table, &newest, rows, 2) == 1 &&
+                          tar_table_stat(table, rows[0], &st) == 0 && st.mtime == 2000000000 && st.size == 5
+                      ? 0
+                      : -1;
+        }
+    }
+    tar_table_free(table);
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Looks up paths in a catalog over two shards holding "a.txt", the first shard winning then the last one, and
+ *        lists its root as "" and as "/"
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_catalog(const char *tmp)
+{
+    char first[512];
+    char second[512];
+    snprintf(first, sizeof(first), "%s/first.tar", tmp);
+    snprintf(second, sizeof(second), "%s/second.tar", tmp);
+    int fd = open(first, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int second_fd = open(second, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ret = fd == -1 || second_fd == -1 || write_header(fd, "a.txt", REGTYPE, NULL, 6, 0) == -1 ||
+                      write_payload(fd, "first\n", 6) == -1 || write_header(fd, "dir/", DIRTYPE, NULL, 0, 0) == -1 ||
+                      write_header(fd, "dir/x", REGTYPE, NULL, 1, 0) == -1 || write_payload(fd, "x", 1) == -1 ||
+                      write_payload(fd, NULL, 1024) == -1 ||
+                      write_header(second_fd, "a.txt", REGTYPE, NULL, 7, 0) == -1 ||
+                      write_payload(second_fd, "second\n", 7) == -1 ||
+                      write_header(second_fd, "d.txt", REGTYPE, NULL, 7, 0) == -1 ||
+                      write_payload(second_fd, "fourth\n", 7) == -1 || write_payload(second_fd, NULL, 1024) == -1
+                  ? -1
+                  : 0;
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (second_fd != -1)
+    {
+        close(second_fd);
+    }
+
+    char *paths[] = {first, second};
+    char *roots[] = {"", "/"};
+    for (int shadow = 0; shadow <= 1 && ret == 0; shadow++)
+    {
+        tar_catalog_t *catalog = tar_catalog_open(paths, 2, TAR_ACCESS_DEFAULT | (shadow ? TAR_CATALOG_SHADOW : 0));
+        uint8_t buf[16];
+        size_t len = sizeof(buf);
+        const char *content = shadow ? "second\n" : "first\n";
+        if (catalog == NULL || catalog_read_file(catalog, "a.txt", 0, buf, &len) != 0 || len != strlen(content) ||
+            memcmp(buf, content, len) != 0 || !catalog_is_file(catalog, "d.txt") || !catalog_is_dir(catalog, "dir") ||
+            !catalog_exists(catalog, "dir/x") || catalog_exists(catalog, "b.txt"))
+        {
+            ret = -1;
+        }
+        for (int i = 0; i < 2 && ret == 0; i++)
+        {
+            // "a.txt" once, from the shard where it is visible
+            char names[8][PATH_MAX];
+            char *entries[8] = {names[0], names[1], names[2], names[3], names[4], names[5], names[6], names[7]};
+            size_t no_entries = 8;
+            tar_cursor_t cursor = TAR_CURSOR_INIT;
+            ret = catalog_is_dir(catalog, roots[i]) &&
+                          catalog_list_page(catalog, roots[i], &cursor, entries, &no_entries) == 0 && no_entries == 3
+                      ? 0
+                      : -1;
+        }
+        tar_catalog_close(catalog);
+    }
+    return ret;
+}
+
+/**
+ * @brief Writes an archive by hand, a member per path, a name of 100 bytes or more going in a pax extended header
+ *
+ * @param path The path of the archive
+ * @param names The paths of the members, a path ending with '/' being a directory
+ * @param contents The content of each file, ignored for a directory
+ * @param no_members The number of members
+ * @return int The archive, opened with O_RDWR, -1 on error
+ */
+int write_archive(const char *path, char **names, char **contents, size_t no_members)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ret = fd == -1 ? -1 : 0;
+    for (size_t i = 0; i < no_members && ret == 0; i++)
+    {
+        size_t len = strlen(names[i]);
+        int dir = names[i][len - 1] == '/';
+        size_t size = dir ? 0 : strlen(contents[i]);
+        ret = (len >= 100 && write_pax(fd, names[i], "") == -1) ||
+                      write_header(fd, names[i], dir ? DIRTYPE : REGTYPE, NULL, size, 0) == -1 ||
+                      write_payload(fd, contents[i], size) == -1
+                  ? -1
+                  : 0;
+    }
+    if (ret == -1 || write_payload(fd, NULL, 1024) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Records the paths given to the callback of tar_verify()
+ */
+void verify_failure(const char *path, int status, void *ctx)
+{
+    snprintf(ctx, 64, "%s %d", path, status);
+}
+
+/**
+ * @brief Verifies an archive against a manifest of CRC32C digests, once a payload was corrupted in place
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_verify(const char *tmp)
+{
+    char long_name[151];
+    memset(long_name, 'b', 146);
+    strcpy(long_name + 146, ".txt");
+    char *names[] = {"a.txt", long_name, "c.txt"};
+    char *contents[] = {"first\n", "long\n", "last\n"};
+    char path[512];
+    char manifest[512];
+    snprintf(path, sizeof(path), "%s/verify.tar", tmp);
+    int fd = write_archive(path, names, contents, 3);
+    snprintf(manifest, sizeof(manifest), "%s/manifest.crc", tmp);
+    FILE *out = fopen(manifest, "w");
+    if (fd == -1 || out == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        if (out != NULL)
+        {
+            fclose(out);
+        }
+        return -1;
+    }
+    fprintf(out, "# digests\n%08x  a.txt\n%08x  %s\n%08x  c.txt\n", crc32c(0, "first\n", 6),
+            crc32c(0, "long\n", 5), long_name, crc32c(0, "last\n", 5));
+    fclose(out);
+
+    tar_archive_t *archive = tar_open(fd, TAR_ACCESS_DEFAULT);
+    tar_verify_report_t report;
+    tar_stat_t st;
+    char failure[64] = "";
+    int ret = -1;
+    if (archive != NULL &&
+        tar_verify(archive, manifest, TAR_DIGEST_CRC32C, 2, 0, verify_failure, failure, &report) == 0 &&
+        report.no_ok == 3 && tar_stat(archive, "c.txt", &st) == 0 && pwrite(fd, "L", 1, st.payload_offset) == 1 &&
+        tar_verify(archive, manifest, TAR_DIGEST_CRC32C, 2, 0, verify_failure, failure, &report) == 1 &&
+        report.no_ok == 2 && report.no_mismatched == 1 && report.no_missing == 0 && report.no_extra == 0 &&
+        strcmp(failure, "c.txt 1") == 0)
+    {
+        ret = 0;
+    }
+    tar_close(archive);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Counts the changes given to the callback of tar_diff()
+ */
+void diff_change(const char *path, int changes, void *ctx)
+{
+    (*(int *)ctx)++;
+}
+
+/**
+ * @brief Compares two archives where a file was removed, one was added and one has new content of the same size and
+ *        modification time, compared only with TAR_DIFF_FULL
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_diff(const char *tmp)
+{
+    char long_name[151];
+    memset(long_name, 'b', 146);
+    strcpy(long_name + 146, ".txt");
+    char *old_names[] = {"a.txt", long_name, "c.txt"};
+    char *old_contents[] = {"first\n", "long\n", "last\n"};
+    char *new_names[] = {long_name, "c.txt", "d.txt"};
+    char *new_contents[] = {"long\n", "LAST\n", "fourth\n"};
+    char path[512];
+    snprintf(path, sizeof(path), "%s/old.tar", tmp);
+    int fd = write_archive(path, old_names, old_contents, 3);
+    snprintf(path, sizeof(path), "%s/new.tar", tmp);
+    int new_fd = write_archive(path, new_names, new_contents, 3);
+    tar_archive_t *old_archive = fd != -1 ? tar_open(fd, TAR_ACCESS_DEFAULT) : NULL;
+    tar_archive_t *new_archive = new_fd != -1 ? tar_open(new_fd, TAR_ACCESS_DEFAULT) : NULL;
+
+    tar_diff_report_t report;
+    int no_changes = 0;
+    int ret = -1;
+    if (old_archive != NULL && new_archive != NULL && tar_diff(old_archive, old_archive, 2, 0, NULL, NULL, NULL) == 0 &&
+        tar_diff(old_archive, new_archive, 2, 0, diff_change, &no_changes, &report) == 1 && no_changes == 2 &&
+        report.no_added == 1 && report.no_removed == 1 && report.no_content_changed == 0 && report.no_compared == 0)
+    {
+        // The payloads of the files of the same size are read
+        no_changes = 0;
+        ret = tar_diff(old_archive, new_archive, 2, TAR_DIFF_FULL, diff_change, &no_changes, &report) == 1 &&
+                      no_changes == 3 && report.no_added == 1 && report.no_removed == 1 &&
+                      report.no_content_changed == 1 && report.no_compared == 2
+                  ? 0
+                  : -1;
+    }
+    tar_close(old_archive);
+    tar_close(new_archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (new_fd != -1)
+    {
+        close(new_fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Gets the totals of the files under the directories of an archive and its histogram of sizes
+ *
+ * @param tmp The directory of the test
+ * @return int 0 if the test passed, -1 otherwise
+ */
+int test_usage(const char *tmp)
+{
+    char big[101];
+    memset(big, 'x', 100);
+    big[100] = '\0';
+    char *names[] = {"x/", "x/y.bin", "x/z", "w"};
+    char *contents[] = {NULL, big, "0123456789", "w"};
+    char path[512];
+    snprintf(path, sizeof(path), "%s/usage.tar", tmp);
+    int fd = write_archive(path, names, contents, 4);
+    tar_archive_t *archive = fd != -1 ? tar_open(fd, TAR_ACCESS_DEFAULT | TAR_OPEN_USAGE) : NULL;
+
+    tar_usage_t usage;
+    tar_usage_t total;
+    tar_size_histogram_t histogram;
+    int ret = -1;
+    if (archive != NULL && tar_usage(archive, "x", &usage) == 0 && usage.bytes == 110 && usage.no_files == 2 &&
+        usage.largest_size == 100 && strcmp(usage.largest, "x/y.bin") == 0 && tar_usage(archive, "", &total) == 0 &&
+        total.bytes == 111 && total.no_files == 3 && tar_usage(archive, "v", &usage) == -1 &&
+        tar_size_histogram(archive, &histogram) == 0 && histogram.no_files[1] == 1 && histogram.no_files[4] == 1 &&
+        histogram.no_files[7] == 1 && histogram.bytes[7] == 100)
+    {
+        ret = 0;
+    }
+    tar_close(archive);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * @brief Runs a test in a directory of its own
+ *
+ * @param name The name of the test
+ * @param test The test
+ * @return int 0 if the test passed, 1 otherwise
+ */
+int run_test(const char *name, int (*test)(const char *tmp))
+{
+    char tmp[] = "/tmp/lib_tar_tests.XXXXXX";
+    int ret = mkdtemp(tmp) == NULL ? -1 : test(tmp);
+    nftw(tmp, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%s: %s\n", name, ret == 0 ? "ok" : "failed");
+    return ret == 0 ? 0 : 1;
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2)
@@ -46,5 +1702,54 @@ int main(int argc, char **argv)
     int ret = check_archive(fd);
     printf("check_archive returned %d\n", ret);
 
-    return 0;
+    tar_archive_t *archive = tar_open(fd, TAR_ACCESS_DEFAULT);
+    if (archive == NULL)
+    {
+        perror("tar_open(tar_file)");
+        return -1;
+    }
+
+    // List the root of the archive, a few entries at a time
+    char names[4][PATH_MAX];
+    char *entries[4] = {names[0], names[1], names[2], names[3]};
+    tar_cursor_t cursor = TAR_CURSOR_INIT;
+    ssize_t left;
+    do
+    {
+        size_t no_entries = 4;
+        left = list_page(archive, "", &cursor, entries, &no_entries);
+        for (size_t i = 0; i < no_entries; i++)
+        {
+            printf("list_page: %s\n", entries[i]);
+        }
+    } while (left > 0);
+
+    tar_close(archive);
+
+    int failed = run_test("test_delete", test_delete);
+    failed += run_test("test_store", test_store);
+    failed += run_test("test_update", test_update);
+    failed += run_test("test_gnu_long_name", test_gnu_long_name);
+    failed += run_test("test_gnu_longer_name", test_gnu_longer_name);
+    failed += run_test("test_pax_long_name", test_pax_long_name);
+    failed += run_test("test_create", test_create);
+    failed += run_test("test_compact", test_compact);
+    failed += run_test("test_mph", test_mph);
+    failed += run_test("test_bloom", test_bloom);
+    failed += run_test("test_read_files", test_read_files);
+    failed += run_test("test_direct", test_direct);
+    failed += run_test("test_query", test_query);
+    failed += run_test("test_catalog", test_catalog);
+    failed += run_test("test_verify", test_verify);
+    failed += run_test("test_diff", test_diff);
+    failed += run_test("test_usage", test_usage);
+    failed += run_test("test_list_page", test_list_page);
+    failed += run_test("test_access", test_access);
+    failed += run_test("test_sparse", test_sparse);
+    failed += run_test("test_samples", test_samples);
+    failed += run_test("test_nested", test_nested);
+    failed += run_test("test_metrics", test_metrics);
+    failed += run_test("test_stat_symlink", test_stat_symlink);
+    failed += run_test("test_create_threads", test_create_threads);
+    return failed;
 }
\ No newline at end of file